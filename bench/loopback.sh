@@ -0,0 +1,176 @@
+#!/bin/bash
+#
+# End-to-end loopback benchmark: send -> fill_ringbuffer -> ringbuffer -> draining reader
+#
+# usage: loopback.sh <directory with fill_ringbuffer and send> [results file]
+#
+# For every combination of science mode, rate, recvmmsg batch size and socket buffer size a
+# local ringbuffer is created, fill_ringbuffer and a reader are started, and send offers
+# FRAMES frames at the given rate. One CSV line per run is appended to the results file
+# (and printed):
+#
+#   case,mode,rate_gbps,batch,sockbuf,pages,packets_sent,packets_received,packets_per_s,gbytes_per_s,loss_pct,cycles_per_packet,ring_max_full,ring_mean_full,nbufs
+#
+# The sweep is set with environment variables, defaults in brackets:
+#   CASE [4]  MODES [0]  RATES (Gb/s) [4 8 16]  BATCHES [64 256]  SOCKBUFS [8388608 67108864]
+#   FRAMES [10]  NBUFS [4]  PADDED_SIZE [25000]  KEY [b0b0]  PORT [7469]  SEND_OPTS [-t 2 -g]
+#   READER [dada_dbnull -z -k $KEY, or ring_db -z -k $KEY for a native ring buffer]
+#
+# A KEY of the form shm:<name> uses the native ring buffer backend, created with ring_db
+# instead of dada_db, so psrdada is not needed.
+#
+# cycles_per_packet is measured with 'perf stat' when available, otherwise estimated from the
+# CPU time of fill_ringbuffer and the nominal clock frequency.
+
+BINDIR=${1:?usage: loopback.sh <directory with fill_ringbuffer and send> [results file]}
+RESULTS=${2:-bench_results.csv}
+
+CASE=${CASE:-4}
+MODES=${MODES:-0}
+RATES=${RATES:-4 8 16}
+BATCHES=${BATCHES:-64 256}
+SOCKBUFS=${SOCKBUFS:-8388608 67108864}
+FRAMES=${FRAMES:-10}
+NBUFS=${NBUFS:-4}
+PADDED_SIZE=${PADDED_SIZE:-25000}
+KEY=${KEY:-b0b0}
+PORT=${PORT:-7469}
+SEND_OPTS=${SEND_OPTS:--t 2 -g}
+if [ "${KEY#shm:}" != "$KEY" ]; then
+  READER=${READER:-$BINDIR/ring_db -z -k $KEY}
+  RING_DB="$BINDIR/ring_db"
+else
+  READER=${READER:-dada_dbnull -z -k $KEY}
+  RING_DB=dada_db
+fi
+
+STARTPACKET=800000            # second frame, the first one is used to get going
+DURATION=$(awk -v frames="$FRAMES" 'BEGIN {printf "%.3f", frames * 1.024}')
+WORKDIR=$(mktemp -d)
+
+for tool in "$BINDIR/fill_ringbuffer" "$BINDIR/send" $RING_DB ${READER%% *}; do
+  if ! command -v "$tool" > /dev/null; then
+    echo "ERROR: $tool not found" >&2
+    exit 1
+  fi
+done
+
+cleanup() {
+  [ -n "$READER_PID" ] && kill "$READER_PID" 2> /dev/null
+  [ -n "$FILL_PID" ] && kill "$FILL_PID" 2> /dev/null
+  $RING_DB -d -k "$KEY" > /dev/null 2>&1
+  rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# CPU time (user + system) of a process in clock ticks
+cputicks() {
+  awk '{print $14 + $15}' "/proc/$1/stat" 2> /dev/null
+}
+
+MHZ=$(awk -F: '/cpu MHz/ {print $2; exit}' /proc/cpuinfo)
+TICKS=$(getconf CLK_TCK)
+
+if [ ! -s "$RESULTS" ]; then
+  echo "case,mode,rate_gbps,batch,sockbuf,pages,packets_sent,packets_received,packets_per_s,gbytes_per_s,loss_pct,cycles_per_packet,ring_max_full,ring_mean_full,nbufs" > "$RESULTS"
+fi
+
+for MODE in $MODES; do
+  # page size as used by fill_ringbuffer
+  if [ "$CASE" = 3 ]; then NTIMES=12500; else NTIMES=25000; fi
+  if [ $((MODE & 2)) = 0 ]; then NTABS=12; else NTABS=1; fi
+  if [ $((MODE & 1)) = 0 ]; then
+    BUFSZ=$((NTABS * 1536 * PADDED_SIZE))
+  else
+    BUFSZ=$((NTABS * 1536 * NTIMES * 4))
+  fi
+
+  cat > "$WORKDIR/header" << EOF
+HDR_VERSION 1.0
+HDR_SIZE 4096
+SCIENCE_CASE $CASE
+SCIENCE_MODE $MODE
+PADDED_SIZE $PADDED_SIZE
+EOF
+
+  for RATE in $RATES; do
+    for BATCH in $BATCHES; do
+      for SOCKBUF in $SOCKBUFS; do
+        $RING_DB -d -k "$KEY" > /dev/null 2>&1
+        if ! $RING_DB -k "$KEY" -b "$BUFSZ" -n "$NBUFS" > /dev/null; then
+          echo "ERROR: cannot create ringbuffer $KEY of $NBUFS x $BUFSZ bytes" >&2
+          exit 1
+        fi
+
+        $READER > "$WORKDIR/reader.log" 2>&1 &
+        READER_PID=$!
+
+        "$BINDIR/fill_ringbuffer" -h "$WORKDIR/header" -k "$KEY" -s $STARTPACKET -d "$DURATION" \
+          -p "$PORT" -l "$WORKDIR/fill.log" -b "$BATCH" -B "$SOCKBUF" > /dev/null 2>&1 &
+        FILL_PID=$!
+        sleep 1
+
+        # measure CPU cycles of fill_ringbuffer while it runs
+        PERF_PID=
+        rm -f "$WORKDIR/perf.csv"
+        if command -v perf > /dev/null; then
+          perf stat -x, -e cycles -p "$FILL_PID" -o "$WORKDIR/perf.csv" 2> /dev/null &
+          PERF_PID=$!
+        fi
+        TICKS0=$(cputicks "$FILL_PID")
+        echo "$TICKS0" > "$WORKDIR/ticks"
+        ( while kill -0 "$FILL_PID" 2> /dev/null; do cputicks "$FILL_PID" > "$WORKDIR/ticks.new" && mv "$WORKDIR/ticks.new" "$WORKDIR/ticks"; sleep 0.05; done ) &
+        SAMPLER_PID=$!
+
+        # send two extra frames: the first is skipped before the start packet, the last ends the run
+        "$BINDIR/send" -c "$CASE" -m "$MODE" -p "$PORT" -s 0 -n $((FRAMES + 2)) -r "$RATE" $SEND_OPTS > "$WORKDIR/send.log" 2>&1
+
+        # fill_ringbuffer stops at the end packet; don't wait forever if the last packets were lost
+        for i in $(seq 50); do
+          kill -0 "$FILL_PID" 2> /dev/null || break
+          sleep 0.1
+        done
+        kill "$FILL_PID" 2> /dev/null
+        wait "$FILL_PID" 2> /dev/null
+        FILL_PID=
+        wait "$SAMPLER_PID" 2> /dev/null
+        TICKS1=$(cat "$WORKDIR/ticks")
+        [ -n "$PERF_PID" ] && wait "$PERF_PID" 2> /dev/null
+        kill "$READER_PID" 2> /dev/null
+        wait "$READER_PID" 2> /dev/null
+        READER_PID=
+
+        CYCLES=
+        if [ -s "$WORKDIR/perf.csv" ]; then
+          CYCLES=$(awk -F, '/cycles/ {print $1}' "$WORKDIR/perf.csv")
+        fi
+        if ! [[ "$CYCLES" =~ ^[0-9]+$ ]]; then
+          CYCLES=$(awk -v t0="$TICKS0" -v t1="$TICKS1" -v hz="$TICKS" -v mhz="$MHZ" 'BEGIN {printf "%.0f", (t1 - t0) / hz * mhz * 1e6}')
+        fi
+
+        # sender: "Sent <packets> packets, <bytes> bytes in <seconds> s: ..."
+        read -r SENT SEND_SECONDS < <(awk '/^Sent/ {print $2, $7}' "$WORKDIR/send.log")
+        PACKETS_PER_SAMPLE=$(awk -F'= ' '/Packets per sample/ {print $2}' "$WORKDIR/fill.log")
+
+        # fill_ringbuffer: one line per page with the missing packets and ring fill level
+        awk -v sc="$CASE" -v mode="$MODE" -v rate="$RATE" -v batch="$BATCH" -v sockbuf="$SOCKBUF" \
+            -v sent="${SENT:-0}" -v seconds="${SEND_SECONDS:-1}" -v pps="${PACKETS_PER_SAMPLE:-0}" \
+            -v cycles="$CYCLES" -v bufsz="$BUFSZ" -v nbufs="$NBUFS" '
+          /missing:/ {
+            pages++
+            m = $0; sub(/.*missing:[^(]*\(/, "", m); sub(/\).*/, "", m); missing += m
+            r = $0; sub(/.*ring: /, "", r); split(r, f, "/"); sum += f[1]; if (f[1] + 0 > max) max = f[1] + 0
+          }
+          END {
+            expected = pages * pps
+            received = expected - missing
+            loss = expected ? 100.0 * missing / expected : 100
+            printf "%s,%s,%s,%s,%s,%d,%d,%d,%.0f,%.3f,%.3f,%.0f,%d,%.2f,%d\n",
+              sc, mode, rate, batch, sockbuf, pages, sent, received,
+              received / seconds, pages * bufsz * (1 - loss / 100) / seconds * 1e-9, loss,
+              received ? cycles / received : 0, max, pages ? sum / pages : 0, nbufs
+          }' "$WORKDIR/fill.log" | tee -a "$RESULTS"
+      done
+    done
+  done
+done
@@ -8,6 +8,8 @@ find_path(PSRDADA_INCLUDE_DIR "dada_hdu.h" HINTS ENV PSRDADA_INCLUDE_DIR)
 find_package_handle_standard_args(psrdada DEFAULT_MSG PSRDADA_LIBRARY PSRDADA_INCLUDE_DIR)
 
 mark_as_advanced(PSRDADA_LIBRARY)
-include_directories(${PSRDADA_INCLUDE_DIR})
 
-set(PSRDADA_LIBRARIES ${PSRDADA_LIBRARY} )
+if (PSRDADA_FOUND)
+  include_directories(${PSRDADA_INCLUDE_DIR})
+  set(PSRDADA_LIBRARIES ${PSRDADA_LIBRARY} )
+endif()
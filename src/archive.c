@@ -0,0 +1,1043 @@
+/**
+ * Archive the pages of a ring buffer to disk: a SIGPROC filterbank file or a compressed container per tab
+ * Author: Jisk Attema
+ *
+ * Every page is cut into a job per tab. A pool of worker threads turns the jobs into file contents: transposed
+ * to time-major for filterbank files, bitshuffled and compressed in blocks for containers (see archive.h and codec.h).
+ * The ring buffer page is released as soon as the workers are done with it. A separate I/O thread writes the results
+ * in order with direct I/O, so the archive does not go through (and evict) the page cache, while the workers
+ * continue with the next page.
+ *
+ * Direct I/O needs aligned offsets and sizes: container chunks are padded to ARCHIVE_ALIGN; for filterbank files
+ * the unaligned end of every write is kept, and written in front of the next one.
+ */
+// needed for O_DIRECT
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "ringbuffer.h"
+#include "archive.h"
+#include "codec.h"
+#include "transpose.h"
+#include "log.h"
+
+#define NCHANNELS 1536
+#define MAXWORKERS 64                    // Maximum number of worker threads
+#define SOURCE_SIZE 64                   // Longest source name in a filterbank header
+
+enum format {
+  FORMAT_FILTERBANK,
+  FORMAT_CONTAINER
+};
+
+char *format_names[] = {"filterbank", "container"};
+char *format_extensions[] = {"fil", "rbc"};
+char *science_modes[] = {"I+TAB", "IQUV+TAB", "I+IAB", "IQUV+IAB"};
+
+enum job_state {
+  JOB_FREE,
+  JOB_QUEUED,                // waiting for a worker
+  JOB_BUSY,                  // a worker is on it
+  JOB_DONE                   // waiting for the I/O thread
+};
+
+/*
+ * The file contents for a tab of a page
+ */
+typedef struct {
+  int state;
+  int tab;
+  uint64_t page;             // page number in the transfer
+  const uint8_t *src;        // the tab in the ring buffer page
+  uint8_t *buf;              // aligned; the contents start lead bytes in
+  size_t lead;               // unaligned bytes of the file before the contents, the I/O thread copies them in
+  size_t size;               // bytes of contents
+} job_t;
+
+/*
+ * A file per tab
+ */
+typedef struct {
+  int fd;
+  int direct;                // opened with O_DIRECT
+  char *name;
+  uint64_t written;          // bytes written, a multiple of ARCHIVE_ALIGN
+  uint64_t queued;           // file size when the submitted jobs are written, for the lead of the next job
+  uint8_t *tail;             // [ARCHIVE_ALIGN], the unaligned end of the file, not written yet
+  size_t tail_size;
+} output_t;
+
+typedef struct {
+  // settings
+  char *prefix;              // of the file names
+  int format;
+  int codec;
+  int level;                 // compression level, for zstd
+  int nworkers;
+  int depth;                 // pages of file contents that can wait for the I/O thread
+  int direct;                // use direct I/O
+
+  // page layout of the transfer
+  int science_case;
+  int science_mode;
+  int ntabs;
+  int nchannels;
+  int ntimes;                // samples per channel per page
+  int padded_size;
+  int time_major;            // Stokes I pages with ORDER TF
+  int split;                 // Stokes IQUV page of a single Stokes parameter, see STOKES
+  uint64_t slice;            // bytes per tab in the page
+  uint64_t capacity;         // bytes per job buffer
+
+  output_t *outputs;
+
+  // jobs, a ring of njobs; the positions only go up
+  job_t *jobs;
+  int njobs;
+  uint8_t *buffers;
+  uint64_t submitted;        // by the main thread
+  uint64_t started;          // by the workers
+  uint64_t written;          // by the I/O thread
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t workers[MAXWORKERS];
+  pthread_t writer;
+
+  // statistics of the transfer
+  uint64_t pages;
+  uint64_t raw;              // bytes of the tabs
+  uint64_t stored;           // bytes written to disk
+  uint64_t busy_ns;          // time spent by the workers
+  uint64_t io_ns;            // time spent writing
+} archiver_t;
+
+/**
+ * Nanoseconds between two points in time
+ */
+static inline long elapsed_ns(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+static inline uint64_t align_up(uint64_t size) {
+  return (size + ARCHIVE_ALIGN - 1) & ~((uint64_t) ARCHIVE_ALIGN - 1);
+}
+
+/**
+ * Compress the tab of a job into a container chunk
+ *
+ * @param {uint8_t *} scratch ARCHIVE_BLOCK bytes for the bitshuffled block
+ */
+static void compress_chunk(archiver_t *a, job_t *job, uint8_t *scratch) {
+  archive_chunk_t *chunk = (archive_chunk_t *) &job->buf[job->lead];
+  archive_block_t block;
+  uint8_t *out = (uint8_t *) (chunk + 1);
+  uint8_t *header;
+  const uint8_t *src = job->src;
+  uint64_t offset;
+  size_t size, stored;
+
+  memset(chunk, 0, sizeof(archive_chunk_t));
+  for (offset = 0; offset < a->slice; offset += size) {
+    size = a->slice - offset < ARCHIVE_BLOCK ? a->slice - offset : ARCHIVE_BLOCK;
+    header = out;
+    out += sizeof(archive_block_t);
+
+    // compressed straight into the chunk; a block that does not shrink does not fit, and is stored as is
+    memset(&block, 0, sizeof(archive_block_t));
+    stored = 0;
+    if (a->codec != CODEC_NONE) {
+      block.reference = codec_reference(&src[offset], size);
+      bitshuffle(&src[offset], scratch, size, block.reference);
+      stored = codec_compress(a->codec, a->level, scratch, size, out, size - 1);
+    }
+    if (!stored) {
+      memcpy(out, &src[offset], size);
+      stored = size;
+    }
+
+    // block headers are not aligned
+    block.raw_size = size;
+    block.stored_size = stored;
+    memcpy(header, &block, sizeof(archive_block_t));
+    out += stored;
+    chunk->nblocks++;
+  }
+
+  chunk->magic = ARCHIVE_CHUNK_MAGIC;
+  chunk->page = job->page;
+  chunk->raw_size = a->slice;
+  chunk->size = align_up(out - (uint8_t *) chunk);
+  memset(out, 0, chunk->size - (out - (uint8_t *) chunk));
+  job->size = chunk->size;
+}
+
+/**
+ * Turn the tab of a page into file contents
+ */
+static void process_job(archiver_t *a, job_t *job, uint8_t *scratch) {
+  uint8_t *dest = &job->buf[job->lead];
+
+  if (a->format == FORMAT_CONTAINER) {
+    compress_chunk(a, job, scratch);
+  } else if (a->time_major) {
+    // already [time][channel], without the padding
+    memcpy(dest, job->src, (size_t) a->ntimes * a->nchannels);
+    job->size = (size_t) a->ntimes * a->nchannels;
+  } else {
+    transpose_matrix(job->src, a->padded_size, (char *) dest, a->nchannels, a->nchannels, a->ntimes);
+    job->size = (size_t) a->ntimes * a->nchannels;
+  }
+}
+
+/**
+ * Worker thread: process the jobs in order of submission
+ */
+static void *worker_thread(void *arg) {
+  archiver_t *a = arg;
+  struct timespec start, end;
+  uint8_t *scratch;
+  job_t *job;
+
+  scratch = malloc(ARCHIVE_BLOCK);
+  if (!scratch) {
+    LOG_ERR("ERROR: cannot allocate worker memory\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&a->lock);
+  while (1) {
+    while (a->started == a->submitted && !a->stop) {
+      pthread_cond_wait(&a->cond, &a->lock);
+    }
+    if (a->started == a->submitted) {
+      break;
+    }
+    job = &a->jobs[a->started++ % a->njobs];
+    job->state = JOB_BUSY;
+    pthread_mutex_unlock(&a->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    process_job(a, job, scratch);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&a->lock);
+    job->state = JOB_DONE;
+    a->busy_ns += elapsed_ns(&start, &end);
+    pthread_cond_broadcast(&a->cond);
+  }
+  pthread_mutex_unlock(&a->lock);
+
+  free(scratch);
+  return NULL;
+}
+
+/**
+ * Write all bytes at an offset; when the file system refuses direct I/O, continue without
+ *
+ * @returns {int} 0 on success, -1 on error
+ */
+static int write_all(output_t *o, const uint8_t *buf, size_t size, uint64_t offset) {
+  ssize_t n;
+
+  while (size) {
+    n = pwrite(o->fd, buf, size, offset);
+    if (n < 0 && errno == EINVAL && o->direct) {
+      LOG_WARN("WARNING: direct I/O refused for %s, continuing through the page cache\n", o->name);
+      fcntl(o->fd, F_SETFL, fcntl(o->fd, F_GETFL) & ~O_DIRECT);
+      o->direct = 0;
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG_ERR("ERROR: cannot write to %s: %s\n", o->name, strerror(errno));
+      return -1;
+    }
+    buf += n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+/**
+ * Write the contents of a job, all but the unaligned end that is kept for the next job
+ */
+static void write_job(archiver_t *a, job_t *job) {
+  output_t *o = &a->outputs[job->tab];
+  size_t total, aligned;
+
+  // the lead of the job is the tail of the previous write
+  if (job->lead != o->tail_size) {
+    LOG_ERR("ERROR: file offset of %s out of sync\n", o->name);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(job->buf, o->tail, o->tail_size);
+
+  total = job->lead + job->size;
+  aligned = total & ~((size_t) ARCHIVE_ALIGN - 1);
+  if (write_all(o, job->buf, aligned, o->written)) {
+    exit(EXIT_FAILURE);
+  }
+  o->written += aligned;
+  o->tail_size = total - aligned;
+  memcpy(o->tail, &job->buf[aligned], o->tail_size);
+}
+
+/**
+ * I/O thread: write the jobs in order of submission
+ */
+static void *writer_thread(void *arg) {
+  archiver_t *a = arg;
+  struct timespec start, end;
+  job_t *job;
+
+  pthread_mutex_lock(&a->lock);
+  while (1) {
+    while (a->written == a->submitted || a->jobs[a->written % a->njobs].state != JOB_DONE) {
+      if (a->stop && a->written == a->submitted) {
+        pthread_mutex_unlock(&a->lock);
+        return NULL;
+      }
+      pthread_cond_wait(&a->cond, &a->lock);
+    }
+    job = &a->jobs[a->written % a->njobs];
+    pthread_mutex_unlock(&a->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    write_job(a, job);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_lock(&a->lock);
+    a->stored += job->size;
+    a->io_ns += elapsed_ns(&start, &end);
+    job->state = JOB_FREE;
+    a->written++;
+    pthread_cond_broadcast(&a->cond);
+  }
+}
+
+/**
+ * Start the workers and the I/O thread
+ */
+void start_archiver(archiver_t *a) {
+  int w;
+
+  pthread_mutex_init(&a->lock, NULL);
+  pthread_cond_init(&a->cond, NULL);
+  for (w = 0; w < a->nworkers; w++) {
+    if (pthread_create(&a->workers[w], NULL, worker_thread, a)) {
+      LOG_ERR("ERROR: cannot start worker thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (pthread_create(&a->writer, NULL, writer_thread, a)) {
+    LOG_ERR("ERROR: cannot start I/O thread\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Stop the threads, after the last transfer
+ */
+void stop_archiver(archiver_t *a) {
+  int w;
+
+  pthread_mutex_lock(&a->lock);
+  a->stop = 1;
+  pthread_cond_broadcast(&a->cond);
+  pthread_mutex_unlock(&a->lock);
+
+  for (w = 0; w < a->nworkers; w++) {
+    pthread_join(a->workers[w], NULL);
+  }
+  pthread_join(a->writer, NULL);
+}
+
+/**
+ * Hand the tabs of a page to the workers, and wait till they are done with the page
+ *
+ * @param {uint64_t} page Page number in the transfer
+ * @param {char *} data The ring buffer page
+ */
+void archive_page(archiver_t *a, uint64_t page, const char *data) {
+  output_t *o;
+  job_t *job;
+  uint64_t first, position;
+  int tab;
+
+  pthread_mutex_lock(&a->lock);
+
+  // room for the page: the I/O thread may be behind
+  while (a->submitted + a->ntabs > a->written + a->njobs) {
+    pthread_cond_wait(&a->cond, &a->lock);
+  }
+
+  first = a->submitted;
+  for (tab = 0; tab < a->ntabs; tab++) {
+    job = &a->jobs[(first + tab) % a->njobs];
+    o = &a->outputs[tab];
+    job->tab = tab;
+    job->page = page;
+    job->src = (const uint8_t *) &data[tab * a->slice];
+    job->lead = o->queued % ARCHIVE_ALIGN;
+    job->state = JOB_QUEUED;
+
+    // the size of a filterbank write is known beforehand, a container chunk is padded
+    if (a->format == FORMAT_FILTERBANK) {
+      o->queued += (uint64_t) a->ntimes * a->nchannels;
+    }
+  }
+  a->submitted += a->ntabs;
+  pthread_cond_broadcast(&a->cond);
+
+  for (position = first; position < first + a->ntabs; position++) {
+    while (position >= a->written && a->jobs[position % a->njobs].state != JOB_DONE) {
+      pthread_cond_wait(&a->cond, &a->lock);
+    }
+  }
+  pthread_mutex_unlock(&a->lock);
+
+  a->pages++;
+  a->raw += a->ntabs * (a->format == FORMAT_FILTERBANK ? (uint64_t) a->ntimes * a->nchannels : a->slice);
+}
+
+/**
+ * Wait till the I/O thread has written all jobs
+ */
+void flush_archiver(archiver_t *a) {
+  pthread_mutex_lock(&a->lock);
+  while (a->written < a->submitted) {
+    pthread_cond_wait(&a->cond, &a->lock);
+  }
+  pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Append a SIGPROC header keyword, a length prefixed string
+ */
+static size_t sigproc_string(uint8_t *buf, size_t pos, const char *string) {
+  int32_t length = strlen(string);
+
+  memcpy(&buf[pos], &length, sizeof(length));
+  memcpy(&buf[pos + sizeof(length)], string, length);
+  return pos + sizeof(length) + length;
+}
+
+static size_t sigproc_int(uint8_t *buf, size_t pos, const char *keyword, int32_t value) {
+  pos = sigproc_string(buf, pos, keyword);
+  memcpy(&buf[pos], &value, sizeof(value));
+  return pos + sizeof(value);
+}
+
+static size_t sigproc_double(uint8_t *buf, size_t pos, const char *keyword, double value) {
+  pos = sigproc_string(buf, pos, keyword);
+  memcpy(&buf[pos], &value, sizeof(value));
+  return pos + sizeof(value);
+}
+
+/**
+ * Put the SIGPROC header of a tab in the tail of the file, to be written in front of the first page
+ *
+ * @param {char *} header Ring buffer header, for the frequencies, start time, and source name
+ */
+static void filterbank_header(archiver_t *a, output_t *o, int tab, const char *header) {
+  char source[SOURCE_SIZE] = "unknown";
+  float min_frequency = 1220.0;
+  float channel_bandwidth = 300.0 / NCHANNELS;
+  double mjd_start = 0;
+  size_t pos = 0;
+
+  if ((ringbuffer_header_get(header, "MIN_FREQUENCY", "%f", &min_frequency) != 1 ||
+      ringbuffer_header_get(header, "CHANNEL_BANDWIDTH", "%f", &channel_bandwidth) != 1) && tab == 0) {
+    LOG_WARN("WARNING: MIN_FREQUENCY or CHANNEL_BANDWIDTH not set in header, using %f + n * %f MHz\n", min_frequency, channel_bandwidth);
+  }
+  ringbuffer_header_get(header, "MJD_START", "%lf", &mjd_start);
+  ringbuffer_header_get(header, "SOURCE", "%63s", source);
+
+  pos = sigproc_string(o->tail, pos, "HEADER_START");
+  pos = sigproc_string(o->tail, pos, "source_name");
+  pos = sigproc_string(o->tail, pos, source);
+  pos = sigproc_int(o->tail, pos, "telescope_id", 0);
+  pos = sigproc_int(o->tail, pos, "machine_id", 0);
+  pos = sigproc_int(o->tail, pos, "data_type", 1);
+  pos = sigproc_double(o->tail, pos, "fch1", min_frequency);
+  pos = sigproc_double(o->tail, pos, "foff", channel_bandwidth);
+  pos = sigproc_int(o->tail, pos, "nchans", a->nchannels);
+  pos = sigproc_int(o->tail, pos, "nbits", 8);
+  pos = sigproc_int(o->tail, pos, "nifs", 1);
+  pos = sigproc_double(o->tail, pos, "tstart", mjd_start);
+  pos = sigproc_double(o->tail, pos, "tsamp", 1.024 / a->ntimes);
+  pos = sigproc_int(o->tail, pos, "ibeam", tab);
+  pos = sigproc_int(o->tail, pos, "nbeams", a->ntabs);
+  pos = sigproc_string(o->tail, pos, "HEADER_END");
+
+  o->tail_size = pos;
+  o->queued = pos;
+}
+
+/**
+ * Write the container header of a tab, with a copy of the ring buffer header
+ *
+ * @returns {int} 0 on success, -1 on error
+ */
+static int container_header(archiver_t *a, output_t *o, int tab, const char *header, size_t header_length) {
+  archive_header_t *h;
+  uint64_t size = align_up(sizeof(archive_header_t) + header_length + 1);
+  uint8_t *buf;
+  int status;
+
+  buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    return -1;
+  }
+  h = (archive_header_t *) buf;
+  h->magic = ARCHIVE_MAGIC;
+  h->version = ARCHIVE_VERSION;
+  h->codec = a->codec;
+  h->shuffle = a->codec != CODEC_NONE;
+  h->block_size = ARCHIVE_BLOCK;
+  h->header_size = size;
+  h->chunk_size = a->slice;
+  h->tab = tab;
+  h->ntabs = a->ntabs;
+  h->science_case = a->science_case;
+  h->science_mode = a->science_mode;
+  h->nchannels = a->nchannels;
+  h->time_major = a->time_major;
+  h->padded_size = a->padded_size;
+  memcpy(&buf[sizeof(archive_header_t)], header, header_length);
+
+  status = write_all(o, buf, size, 0);
+  munmap(buf, size);
+  o->written = size;
+  o->queued = size;
+  return status;
+}
+
+/**
+ * Read the page layout from the ring buffer header
+ *
+ * @returns {int} 0 on success, -1 when the header is incomplete or the layout cannot be archived in the format
+ */
+int parse_layout(archiver_t *a, const char *header) {
+  char order[8] = "FT";
+  char stokes[8] = "";
+  int header_incomplete = 0;
+
+  if (ringbuffer_header_get(header, "SCIENCE_CASE", "%i", &a->science_case) == -1) {
+    LOG_ERR("ERROR. SCIENCE_CASE not set in header\n");
+    header_incomplete = 1;
+  }
+  if (ringbuffer_header_get(header, "SCIENCE_MODE", "%i", &a->science_mode) == -1) {
+    LOG_ERR("ERROR. SCIENCE_MODE not set in header\n");
+    header_incomplete = 1;
+  }
+  if (ringbuffer_header_get(header, "PADDED_SIZE", "%i", &a->padded_size) == -1) {
+    LOG_ERR("ERROR. PADDED_SIZE not set in header\n");
+    header_incomplete = 1;
+  }
+  if (header_incomplete) {
+    return -1;
+  }
+
+  if ((a->science_case != 3 && a->science_case != 4) || a->science_mode < 0 || a->science_mode > 3) {
+    LOG_ERR("ERROR: science case %i mode %i not supported\n", a->science_case, a->science_mode);
+    return -1;
+  }
+  a->ntimes = a->science_case == 3 ? 12500 : 25000;
+  a->ntabs = a->science_mode < 2 ? 12 : 1;
+  a->nchannels = NCHANNELS;
+
+  // a selection, see fill_ringbuffer -t and -C
+  ringbuffer_header_get(header, "NTABS", "%i", &a->ntabs);
+  ringbuffer_header_get(header, "NCHANNELS", "%i", &a->nchannels);
+  ringbuffer_header_get(header, "ORDER", "%7s", order);
+  ringbuffer_header_get(header, "STOKES", "%7s", stokes);
+
+  if (a->science_mode & 1) {
+    a->time_major = 0;
+    a->split = stokes[0] != '\0';
+    a->slice = (uint64_t) a->nchannels * a->ntimes * (a->split ? 1 : 4);
+  } else {
+    a->time_major = !strcmp(order, "TF");
+    a->split = 0;
+    a->slice = (uint64_t) a->nchannels * a->padded_size;
+  }
+
+  if (a->ntabs < 1 || a->nchannels < 1 || a->padded_size < a->ntimes) {
+    LOG_ERR("ERROR: page layout of %i tabs, %i channels, padded size %i not supported\n", a->ntabs, a->nchannels, a->padded_size);
+    return -1;
+  }
+  if (a->format == FORMAT_FILTERBANK && (a->science_mode & 1)) {
+    LOG_ERR("ERROR: filterbank files hold Stokes I only, use the container format for Stokes IQUV\n");
+    return -1;
+  }
+
+  LOG("Science case = %i\n", a->science_case);
+  LOG("Science mode = %i [ %s ]\n", a->science_mode, science_modes[a->science_mode]);
+  LOG("Page layout: %i tabs, %i channels, %i samples%s%s%s, %lu bytes per tab\n", a->ntabs, a->nchannels, a->ntimes,
+      a->time_major ? ", time-major" : "", a->split ? ", Stokes " : "", a->split ? stokes : "", a->slice);
+  return 0;
+}
+
+/**
+ * Open the files of a transfer, and allocate the job buffers for its page layout
+ *
+ * @param {int} transfer Transfer number, for the file names
+ * @param {char *} header Ring buffer header
+ * @param {uint64_t} header_size Size of the header page
+ * @returns {int} 0 on success, -1 on error
+ */
+int open_transfer(archiver_t *a, int transfer, const char *header, uint64_t header_size) {
+  size_t header_length = strnlen(header, header_size);
+  uint64_t nblocks;
+  output_t *o;
+  char *name;
+  int tab, j;
+
+  if (a->format == FORMAT_CONTAINER) {
+    nblocks = (a->slice + ARCHIVE_BLOCK - 1) / ARCHIVE_BLOCK;
+    a->capacity = align_up(sizeof(archive_chunk_t) + nblocks * sizeof(archive_block_t) + a->slice);
+  } else {
+    a->capacity = align_up(ARCHIVE_ALIGN + (uint64_t) a->ntimes * a->nchannels);
+  }
+  a->njobs = a->ntabs * a->depth;
+  a->jobs = calloc(a->njobs, sizeof(job_t));
+  a->outputs = calloc(a->ntabs, sizeof(output_t));
+  a->buffers = mmap(NULL, a->njobs * a->capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (!a->jobs || !a->outputs || a->buffers == MAP_FAILED) {
+    LOG_ERR("ERROR: cannot allocate %lu bytes for the job buffers\n", a->njobs * a->capacity);
+    return -1;
+  }
+  for (j = 0; j < a->njobs; j++) {
+    a->jobs[j].buf = &a->buffers[j * a->capacity];
+  }
+
+  for (tab = 0; tab < a->ntabs; tab++) {
+    o = &a->outputs[tab];
+    if (asprintf(&name, "%s_%03i_tab%02i.%s", a->prefix, transfer, tab, format_extensions[a->format]) < 0) {
+      return -1;
+    }
+    o->name = name;
+    o->tail = aligned_alloc(ARCHIVE_ALIGN, ARCHIVE_ALIGN);
+    o->direct = a->direct;
+    o->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | (o->direct ? O_DIRECT : 0), 0666);
+    if (o->fd < 0 && o->direct && errno == EINVAL) {
+      LOG_WARN("WARNING: no direct I/O for %s, writing through the page cache\n", name);
+      o->direct = 0;
+      o->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (o->fd < 0 || !o->tail) {
+      LOG_ERR("ERROR: cannot open %s: %s\n", name, strerror(errno));
+      return -1;
+    }
+
+    if (a->format == FORMAT_CONTAINER) {
+      if (container_header(a, o, tab, header, header_length)) {
+        return -1;
+      }
+    } else {
+      filterbank_header(a, o, tab, header);
+    }
+  }
+  LOG("Writing %i %s files %s_%03i_tab*.%s (%s I/O)\n", a->ntabs, format_names[a->format], a->prefix, transfer,
+      format_extensions[a->format], a->outputs[0].direct ? "direct" : "buffered");
+
+  a->pages = 0;
+  a->raw = 0;
+  a->stored = 0;
+  a->busy_ns = 0;
+  a->io_ns = 0;
+  return 0;
+}
+
+/**
+ * Write the tails, close the files, and free the job buffers; call after flush_archiver
+ */
+void close_transfer(archiver_t *a) {
+  output_t *o;
+  int tab;
+
+  for (tab = 0; a->outputs && tab < a->ntabs; tab++) {
+    o = &a->outputs[tab];
+    if (o->fd >= 0 && o->tail_size) {
+      // the last, partial block: without direct I/O
+      if (o->direct) {
+        fcntl(o->fd, F_SETFL, fcntl(o->fd, F_GETFL) & ~O_DIRECT);
+        o->direct = 0;
+      }
+      write_all(o, o->tail, o->tail_size, o->written);
+    }
+    if (o->fd > 0) {
+      close(o->fd);
+    }
+    free(o->name);
+    free(o->tail);
+  }
+  free(a->outputs);
+  free(a->jobs);
+  if (a->buffers && a->buffers != MAP_FAILED) {
+    munmap(a->buffers, a->njobs * a->capacity);
+  }
+  a->outputs = NULL;
+  a->jobs = NULL;
+  a->buffers = NULL;
+}
+
+/**
+ * Expand a container to the raw tab of every page, the reverse of archiving
+ *
+ * @param {char *} name Container file
+ * @param {char *} output Raw output file
+ * @returns {int} 0 on success, -1 on error
+ */
+int extract(const char *name, const char *output) {
+  archive_header_t header;
+  archive_chunk_t chunk;
+  archive_block_t block;
+  uint8_t *data = NULL, *raw = NULL, *plain = NULL;
+  uint64_t chunks = 0, bytes = 0;
+  char *text;
+  size_t pos;
+  uint32_t b;
+  FILE *in, *out;
+  int status = -1;
+
+  in = fopen(name, "rb");
+  if (!in) {
+    LOG_ERR("ERROR: cannot open %s\n", name);
+    return -1;
+  }
+  out = fopen(output, "wb");
+  if (!out) {
+    LOG_ERR("ERROR: cannot open %s\n", output);
+    fclose(in);
+    return -1;
+  }
+  if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != ARCHIVE_MAGIC || header.version != ARCHIVE_VERSION ||
+      header.header_size < sizeof(header) || header.block_size == 0) {
+    LOG_ERR("ERROR: not a container, or a different version: %s\n", name);
+    goto done;
+  }
+  text = calloc(header.header_size - sizeof(header) + 1, 1);
+  if (!text || fread(text, header.header_size - sizeof(header), 1, in) != 1) {
+    LOG_ERR("ERROR: cannot read the header of %s\n", name);
+    free(text);
+    goto done;
+  }
+  LOG("Container %s: tab %i of %i, codec %s%s, %lu bytes per page\n%s", name, header.tab, header.ntabs,
+      codec_name(header.codec), header.shuffle ? " with bitshuffle" : "", header.chunk_size, text);
+  free(text);
+
+  raw = malloc(header.block_size);
+  plain = malloc(header.block_size);
+  if (!raw || !plain) {
+    goto done;
+  }
+
+  while (fread(&chunk, sizeof(chunk), 1, in) == 1 && chunk.magic == ARCHIVE_CHUNK_MAGIC) {
+    data = realloc(data, chunk.size);
+    if (!data || chunk.size < sizeof(chunk) || fread(data, chunk.size - sizeof(chunk), 1, in) != 1) {
+      LOG_ERR("ERROR: truncated chunk for page %lu\n", chunk.page);
+      goto done;
+    }
+    pos = 0;
+    for (b = 0; b < chunk.nblocks; b++) {
+      memcpy(&block, &data[pos], sizeof(block));
+      pos += sizeof(block);
+      if (block.raw_size > header.block_size || pos + block.stored_size > chunk.size - sizeof(chunk)) {
+        LOG_ERR("ERROR: corrupt block %u of page %lu\n", b, chunk.page);
+        goto done;
+      }
+      if (block.stored_size == block.raw_size) {
+        fwrite(&data[pos], 1, block.raw_size, out);
+      } else {
+        if (codec_decompress(header.codec, &data[pos], block.stored_size, raw, block.raw_size)) {
+          LOG_ERR("ERROR: cannot decompress block %u of page %lu with %s\n", b, chunk.page, codec_name(header.codec));
+          goto done;
+        }
+        if (header.shuffle) {
+          bitunshuffle(raw, plain, block.raw_size, block.reference);
+          fwrite(plain, 1, block.raw_size, out);
+        } else {
+          fwrite(raw, 1, block.raw_size, out);
+        }
+      }
+      pos += block.stored_size;
+      bytes += block.raw_size;
+    }
+    chunks++;
+  }
+  log_printf(LOG_NOTICE, "Extracted %lu pages, %lu bytes to %s\n", chunks, bytes, output);
+  status = 0;
+
+done:
+  free(data);
+  free(raw);
+  free(plain);
+  fclose(in);
+  if (fclose(out)) {
+    status = -1;
+  }
+  return status;
+}
+
+/**
+ * Print commandline options
+ */
+void printOptions() {
+  printf("usage: archive -k <key> -o <file prefix>\n");
+  printf("e.g. archive -k shm:dada -o /data/obs1 -f container -j 4\n");
+  printf("Optional: -f <format: filterbank, container (default)> -z <codec: none, rle, lz4, zstd> -L <zstd level, default 1>\n");
+  printf("          -j <worker threads, default 4> -q <pages waiting for I/O, default 2> -b buffered I/O instead of direct I/O\n");
+  printf("          -n <stop after this many transfers> -l <logfile>\n");
+  printf("          -v <minimum log level: debug, info, notice, warning, error> -F <log format: plain, kv>\n");
+  printf("Extract a container: archive -x <container file> -o <raw output file>\n");
+  printf("Codecs in this build: none, rle%s%s, default %s\n",
+      codec_parse("lz4") < 0 ? "" : ", lz4", codec_parse("zstd") < 0 ? "" : ", zstd", codec_name(codec_default()));
+  return;
+}
+
+/**
+ * Parse commandline
+ */
+void parseOptions(int argc, char*argv[], char **key, char **logfile, char **extract_file, int *transfers, archiver_t *a, int *loglevel, int *logformat) {
+  int c;
+
+  int setk=0, seto=0;
+  while((c=getopt(argc,argv,"k:o:f:z:L:j:q:bn:x:l:v:F:"))!=-1) {
+    switch(c) {
+      // -v minimum log level
+      case('v'):
+        *loglevel = log_parse_level(optarg);
+        if (*loglevel < 0) {
+          fprintf(stderr, "Log level should be one of debug, info, notice, warning, error\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -F log format
+      case('F'):
+        *logformat = log_parse_format(optarg);
+        if (*logformat < 0) {
+          fprintf(stderr, "Log format should be plain or kv\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -k <key>
+      case('k'):
+        *key = strdup(optarg);
+        setk=1;
+        break;
+
+      // -o file prefix, or the output file when extracting
+      case('o'):
+        a->prefix = strdup(optarg);
+        seto=1;
+        break;
+
+      // -f file format
+      case('f'):
+        if (!strcmp(optarg, "filterbank")) {
+          a->format = FORMAT_FILTERBANK;
+        } else if (!strcmp(optarg, "container")) {
+          a->format = FORMAT_CONTAINER;
+        } else {
+          fprintf(stderr, "Format should be filterbank or container\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -z codec
+      case('z'):
+        a->codec = codec_parse(optarg);
+        if (a->codec < 0) {
+          fprintf(stderr, "Codec should be none, rle, lz4, or zstd; lz4 and zstd when built with the libraries\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -L compression level
+      case('L'):
+        a->level = atoi(optarg);
+        break;
+
+      // -j number of worker threads
+      case('j'):
+        a->nworkers = atoi(optarg);
+        if (a->nworkers < 1 || a->nworkers > MAXWORKERS) {
+          fprintf(stderr, "Number of workers should be between 1 and %i\n", MAXWORKERS);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -q pages waiting for I/O
+      case('q'):
+        a->depth = atoi(optarg);
+        if (a->depth < 1) {
+          fprintf(stderr, "Pages waiting for I/O should be at least 1\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -b buffered I/O
+      case('b'):
+        a->direct = 0;
+        break;
+
+      // -n number of transfers
+      case('n'):
+        *transfers = atoi(optarg);
+        break;
+
+      // -x extract a container
+      case('x'):
+        *extract_file = strdup(optarg);
+        break;
+
+      // -l log file
+      case('l'):
+        *logfile = strdup(optarg);
+        break;
+
+      default:
+        printOptions();
+        exit(0);
+    }
+  }
+
+  if ((!setk && !*extract_file) || !seto) {
+    if (!setk && !*extract_file) fprintf(stderr, "Ringbuffer key not set\n");
+    if (!seto) fprintf(stderr, "Output not set\n");
+    printOptions();
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char** argv) {
+  archiver_t archiver;
+  archiver_t *a = &archiver;
+  ringbuffer_t *rb;
+  char *key = NULL;
+  char *logfile = NULL;
+  char *extract_file = NULL;
+  char *header;
+  char *page;
+  uint64_t size;
+  uint64_t page_number;
+  int loglevel = LOG_INFO;
+  int logformat = LOG_PLAIN;
+  int transfers = 0;        // stop after this many, 0 to keep going
+  int transfer;
+  int usable;
+  struct timespec start, end, before, after;
+  double seconds;
+
+  memset(a, 0, sizeof(archiver_t));
+  a->format = FORMAT_CONTAINER;
+  a->codec = codec_default();
+  a->level = 1;
+  a->nworkers = 4;
+  a->depth = 2;
+  a->direct = 1;
+  parseOptions(argc, argv, &key, &logfile, &extract_file, &transfers, a, &loglevel, &logformat);
+
+  // set up logging
+  if (log_init(logfile, loglevel, logformat)) {
+    fprintf(stderr, "ERROR opening logfile: %s\n", logfile);
+    exit(EXIT_FAILURE);
+  }
+  if (logfile) {
+    LOG("Logging to logfile: %s\n", logfile);
+    free(logfile);
+  }
+  LOG("archive version: " VERSION "\n");
+
+  if (extract_file) {
+    exit(extract(extract_file, a->prefix) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  rb = ringbuffer_open(key, RING_READER);
+  if (!rb) {
+    LOG_ERR("ERROR. Cannot connect to ringbuffer %s\n", key);
+    exit(EXIT_FAILURE);
+  }
+  LOG("Ringbuffer KEY: %s (%s backend%s)\n", key, rb->backend->name, rb->hugepages ? ", huge pages" : "");
+  LOG("Format: %s, codec %s, %i workers\n", format_names[a->format],
+      a->format == FORMAT_CONTAINER ? codec_name(a->codec) : "none", a->nworkers);
+  free(key);
+
+  start_archiver(a);
+
+  for (transfer = 0; transfers == 0 || transfer < transfers; transfer++) {
+    // the header of the next transfer
+    header = ringbuffer_next_read(rb, RING_HEADER, &size);
+    if (!header) {
+      break;
+    }
+    usable = parse_layout(a, header) == 0 && open_transfer(a, transfer, header, size) == 0;
+    ringbuffer_mark_cleared(rb, RING_HEADER);
+    if (!usable) {
+      LOG_ERR("ERROR: cannot archive transfer %i, skipping its pages\n", transfer);
+      close_transfer(a);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    page_number = 0;
+    while ((page = ringbuffer_next_read(rb, RING_DATA, &size))) {
+      clock_gettime(CLOCK_MONOTONIC, &before);
+      if (usable && size >= a->ntabs * a->slice) {
+        archive_page(a, page_number, page);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        LOG("Page %lu: %.3f s, ring %lu/%lu full\n", page_number, 1e-9 * elapsed_ns(&before, &after),
+            ringbuffer_nfull(rb, RING_DATA), rb->nbufs[RING_DATA]);
+        page_number++;
+      } else if (usable && size > 0) {
+        LOG_WARN("WARNING: page of %lu bytes too small for the layout, skipped\n", size);
+      }
+
+      ringbuffer_mark_cleared(rb, RING_DATA);
+      if (ringbuffer_eod(rb, RING_DATA)) {
+        break;
+      }
+    }
+    if (!usable) {
+      continue;
+    }
+
+    flush_archiver(a);
+    close_transfer(a);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = 1e-9 * elapsed_ns(&start, &end);
+    log_printf(LOG_NOTICE, "Transfer %i: %lu pages, %.3f GB to %.3f GB (%.1f%%) in %.3f s, %.3f GB/s; workers %.1f%% busy, I/O %.1f%% busy\n",
+        transfer, a->pages, 1e-9 * a->raw, 1e-9 * a->stored, a->raw ? 100.0 * a->stored / a->raw : 0, seconds,
+        seconds > 0 ? 1e-9 * a->raw / seconds : 0, seconds > 0 ? 1e-7 * a->busy_ns / seconds / a->nworkers : 0,
+        seconds > 0 ? 1e-7 * a->io_ns / seconds : 0);
+  }
+
+  stop_archiver(a);
+  ringbuffer_close(rb);
+  free(a->prefix);
+
+  log_close();
+  fflush(stdout);
+  fflush(stderr);
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,67 @@
+/**
+ * Archive of ring buffer pages: the chunked container written by archive
+ * Author: Jisk Attema
+ *
+ * A container holds a single tab of a transfer: per page, a chunk with the bytes of that tab in the page,
+ * in the page layout (see assemble.h), compressed in blocks of ARCHIVE_BLOCK bytes. Every block is
+ * bitshuffled against its mean and compressed on its own (see codec.h); a block that does not shrink is stored as is.
+ * All parts start at a multiple of ARCHIVE_ALIGN, so the container can be written with direct I/O.
+ *
+ *   archive_header_t                         64 bytes
+ *   ring buffer header                       ASCII, NUL terminated, padded to header_size
+ *   per page:
+ *     archive_chunk_t                        64 bytes
+ *     nblocks times:
+ *       archive_block_t                      12 bytes
+ *       data                                 stored bytes
+ *     padding                                to a multiple of ARCHIVE_ALIGN
+ *
+ * Readers walk the chunks using archive_chunk_t.size; a chunk with a different magic ends the container
+ * (a container that is still being written, or was cut short).
+ */
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+
+#define ARCHIVE_MAGIC 0x4b434252            // 'RBCK'
+#define ARCHIVE_CHUNK_MAGIC 0x4b4e4843      // 'CHNK'
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_ALIGN 4096                  // alignment for direct I/O: file offsets, sizes, and buffers
+#define ARCHIVE_BLOCK 262144                // bytes per compressed block, bitshuffled while in cache
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t codec;                           // one of codec, see codec.h
+  uint32_t shuffle;                         // 1 when the blocks are bitshuffled before compression, see codec.h
+  uint32_t block_size;                      // ARCHIVE_BLOCK
+  uint64_t header_size;                     // bytes of this header and the ring buffer header, to the first chunk
+  uint64_t chunk_size;                      // bytes of the tab per page, uncompressed
+  uint16_t tab;                             // tab in the page
+  uint16_t ntabs;                           // tabs in the page
+  uint16_t science_case;
+  uint16_t science_mode;
+  uint16_t nchannels;                       // channels in the page
+  uint16_t time_major;                      // 1 for Stokes I pages with ORDER TF
+  uint32_t padded_size;
+  uint8_t padding[16];
+} archive_header_t;
+
+typedef struct {
+  uint32_t magic;                           // ARCHIVE_CHUNK_MAGIC
+  uint32_t nblocks;
+  uint64_t page;                            // page number in the transfer
+  uint64_t size;                            // bytes of the chunk, including this header and the padding
+  uint64_t raw_size;                        // bytes of the tab in the page
+  uint8_t padding[32];
+} archive_chunk_t;
+
+typedef struct {
+  uint32_t raw_size;                        // bytes of the block, ARCHIVE_BLOCK except for the last block
+  uint32_t stored_size;                     // bytes of the block in the container; equal to raw_size when stored as is
+  uint8_t reference;                        // of the bitshuffle, see codec_reference
+  uint8_t padding[3];
+} archive_block_t;
+
+#endif
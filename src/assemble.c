@@ -0,0 +1,561 @@
+/**
+ * Packet assembly: validate packets and copy their payload to the right place in a ringbuffer page
+ * Author: Jisk Attema, based on code by Roy Smits
+ *
+ */
+// needed for bswap
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <byteswap.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "assemble.h"
+
+char *copy_strategies[] = {"memcpy", "stream", "repmovsb"};
+
+// Due to issues with the FPGAs upstream from us, the packet headers are wrong.
+// Work around it for now by using this table with correct frequencies. (search for FREQISSUE below)
+extern const unsigned short remap_frequency_sc4[1536];
+
+/**
+ * Page geometry for the tabs and channels in the page
+ */
+static void set_geometry(assembler_t *assembler) {
+  if ((assembler->science_mode & 1) == 0) {
+    // Stokes I: a packet holds PAYLOADSIZE_STOKESI samples of a single channel
+    assembler->channel_slots = assembler->nchannels;
+    assembler->required_size = (size_t) assembler->ntabs * assembler->nchannels * assembler->padded_size;
+  } else {
+    // Stokes IQUV: a packet holds 500 samples of 4 channels and 4 components, a split page 1 component
+    assembler->channel_slots = assembler->nchannels / 4;
+    assembler->required_size = (size_t) assembler->ntabs * assembler->nchannels * assembler->ntimes * (assembler->split ? 1 : ASSEMBLE_STOKES);
+  }
+  assembler->packets_per_sample = assembler->ntabs * assembler->channel_slots * assembler->sequence_length;
+}
+
+/**
+ * Set up the expected packet layout and page geometry
+ *
+ * @param {assembler_t *} assembler To initialize
+ * @param {int} science_case 3 or 4
+ * @param {int} science_mode 0: I+TAB, 1: IQUV+TAB, 2: I+IAB, 3: IQUV+IAB
+ * @param {int} padded_size Size of the time dimension of a Stokes I page
+ * @returns {int} 0 on success, -1 for an unsupported science case or mode
+ */
+int assemble_init(assembler_t *assembler, int science_case, int science_mode, int padded_size) {
+  int ntimes;
+
+  memset(assembler, 0, sizeof(assembler_t));
+  assembler->science_case = science_case;
+  assembler->science_mode = science_mode;
+  assembler->padded_size = padded_size;
+  assembler->copy = COPY_MEMCPY;
+
+  if (science_case == 3) {
+    ntimes = 12500;
+    switch (science_mode) {
+      case 0: assembler->expected_marker_byte = 0xD0; break; // I with TAB
+      case 1: assembler->expected_marker_byte = 0xD1; break; // IQUV with TAB
+      case 2: assembler->expected_marker_byte = 0xD2; break; // I with IAB
+      case 3: assembler->expected_marker_byte = 0xD3; break; // IQUV with IAB
+      default: return -1;
+    }
+  } else if (science_case == 4) {
+    ntimes = 25000;
+    switch (science_mode) {
+      case 0: assembler->expected_marker_byte = 0xE0; break; // I with TAB
+      case 1: assembler->expected_marker_byte = 0xE1; break; // IQUV with TAB
+      case 2: assembler->expected_marker_byte = 0xE2; break; // I with IAB
+      case 3: assembler->expected_marker_byte = 0xE3; break; // IQUV with IAB
+      default: return -1;
+    }
+  } else {
+    return -1;
+  }
+
+  assembler->beam_tabs = (science_mode & 2) ? 1 : ASSEMBLE_MAX_TABS;
+  assembler->ntimes = ntimes;
+  if ((science_mode & 1) == 0) {
+    assembler->sequence_length = ntimes / PAYLOADSIZE_STOKESI;
+    assembler->expected_payload = PAYLOADSIZE_STOKESI;
+  } else {
+    assembler->sequence_length = ntimes / 500;
+    assembler->expected_payload = PAYLOADSIZE_STOKESIQUV;
+  }
+
+  // all tabs and channels
+  return assemble_select(assembler, NULL, NULL);
+}
+
+/**
+ * Parse a comma separated list of indices and ranges, e.g. "0,3-5"
+ *
+ * @param {char *} list The list
+ * @param {int} max Indices are below max
+ * @param {char *} selected Set to 1 for the indices in the list
+ * @returns {int} 0 on success, -1 on error
+ */
+static int parse_selection(const char *list, int max, char *selected) {
+  const char *item = list;
+  char *end;
+  long first, last;
+
+  memset(selected, 0, max);
+  while (*item) {
+    first = strtol(item, &end, 10);
+    last = first;
+    if (end == item) {
+      return -1;
+    }
+    if (*end == '-') {
+      item = end + 1;
+      last = strtol(item, &end, 10);
+      if (end == item) {
+        return -1;
+      }
+    }
+    if (first < 0 || first > last || last >= max || (*end != ',' && *end != '\0')) {
+      return -1;
+    }
+    memset(&selected[first], 1, last - first + 1);
+    item = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
+/**
+ * Write the selected indices as a comma separated list of indices and ranges
+ *
+ * @returns {int} Number of characters written, as snprintf
+ */
+static int format_selection(const char *selected, int max, char *buf, size_t size) {
+  int first, last;
+  int n = 0;
+
+  buf[0] = '\0';
+  for (first = 0; first < max; first = last + 1) {
+    if (!selected[first]) {
+      last = first;
+      continue;
+    }
+    for (last = first; last + 1 < max && selected[last + 1]; last++);
+    if (first == last) {
+      n += snprintf(&buf[n], n < (int) size ? size - n : 0, "%s%i", n ? "," : "", first);
+    } else {
+      n += snprintf(&buf[n], n < (int) size ? size - n : 0, "%s%i-%i", n ? "," : "", first, last);
+    }
+  }
+  return n;
+}
+
+/**
+ * Select the tabs and channels to keep, the page is compacted to hold only those, in order
+ * Stokes IQUV packets hold 4 channels, so its channels are selected in groups of 4.
+ * The channel selection cannot be combined with the FREQISSUE workaround.
+ *
+ * @param {assembler_t *} assembler Initialized assembler
+ * @param {char *} tabs Tab indices and ranges, e.g. "0,3-5", or NULL for all tabs
+ * @param {char *} channels Channel indices and ranges, e.g. "0-767,1024-1279", or NULL for all channels
+ * @returns {int} 0 on success, -1 for an invalid selection
+ */
+int assemble_select(assembler_t *assembler, const char *tabs, const char *channels) {
+  char selected_tabs[ASSEMBLE_MAX_TABS];
+  char selected_channels[NCHANNELS];
+  int i;
+
+  memset(selected_tabs, 1, assembler->beam_tabs);
+  memset(selected_channels, 1, NCHANNELS);
+  if (tabs && parse_selection(tabs, assembler->beam_tabs, selected_tabs)) {
+    return -1;
+  }
+  if (channels) {
+    if (assembler->freqissue_workaround || parse_selection(channels, NCHANNELS, selected_channels)) {
+      return -1;
+    }
+    for (i = 0; (assembler->science_mode & 1) && i < NCHANNELS; i += 4) {
+      if (memchr(&selected_channels[i], !selected_channels[i], 4)) {
+        return -1;
+      }
+    }
+  }
+
+  assembler->ntabs = 0;
+  for (i = 0; i < ASSEMBLE_MAX_TABS; i++) {
+    assembler->tab_slot[i] = i < assembler->beam_tabs && selected_tabs[i] ? assembler->ntabs++ : -1;
+  }
+  assembler->nchannels = 0;
+  for (i = 0; i < NCHANNELS; i++) {
+    assembler->channel_slot[i] = selected_channels[i] ? assembler->nchannels++ : -1;
+  }
+  if (assembler->ntabs == 0 || assembler->nchannels == 0) {
+    return -1;
+  }
+
+  set_geometry(assembler);
+  return 0;
+}
+
+/**
+ * Describe the selected tabs and channels as lists of indices and ranges, see assemble_select
+ *
+ * @returns {int} 1 when a subset of the tabs or channels is selected, 0 for all tabs and channels
+ */
+int assemble_selection(const assembler_t *assembler, char *tabs, size_t tabs_size, char *channels, size_t channels_size) {
+  char selected[NCHANNELS];
+  int i;
+
+  for (i = 0; i < assembler->beam_tabs; i++) {
+    selected[i] = assembler->tab_slot[i] >= 0;
+  }
+  format_selection(selected, assembler->beam_tabs, tabs, tabs_size);
+  for (i = 0; i < NCHANNELS; i++) {
+    selected[i] = assembler->channel_slot[i] >= 0;
+  }
+  format_selection(selected, NCHANNELS, channels, channels_size);
+
+  return assembler->ntabs < assembler->beam_tabs || assembler->nchannels < NCHANNELS;
+}
+
+/**
+ * Split Stokes IQUV pages over a page per Stokes parameter, see assemble_copy_stokes
+ * The pages keep the layout, with a quarter of the bytes per packet: required_size is the size of each of them.
+ *
+ * @param {assembler_t *} assembler Initialized assembler
+ * @param {int} split 1 to split, 0 for interleaved pages
+ * @returns {int} 0 on success, -1 when splitting Stokes I
+ */
+int assemble_split_stokes(assembler_t *assembler, int split) {
+  if (split && (assembler->science_mode & 1) == 0) {
+    return -1;
+  }
+  assembler->split = split;
+  set_geometry(assembler);
+  return 0;
+}
+
+/**
+ * Check the packet header
+ *
+ * @returns {int} ASSEMBLE_OK, ASSEMBLE_SKIP for packets that should be counted but not copied,
+ *                ASSEMBLE_UNSELECTED for packets outside the selection, or an error code
+ */
+int assemble_validate(const assembler_t *assembler, const packet_t *packet) {
+  unsigned short curr_channel;
+
+  // check marker byte
+  if (packet->marker_byte != assembler->expected_marker_byte) {
+    return ASSEMBLE_WRONG_MARKER;
+  }
+
+  // check version
+  if (packet->format_version != 1) {
+    return ASSEMBLE_WRONG_VERSION;
+  }
+
+  // check compound beam index
+  if (packet->cb_index != assembler->cb_index) {
+    return ASSEMBLE_WRONG_BEAM;
+  }
+
+  // check tab index
+  if (packet->tab_index >= assembler->beam_tabs) {
+    return ASSEMBLE_WRONG_TAB;
+  }
+
+  // check channel and sequence number, so the copy stays within the page
+  curr_channel = bswap_16(packet->channel_index);
+  if (curr_channel >= NCHANNELS || packet->sequence_number >= assembler->sequence_length) {
+    return ASSEMBLE_WRONG_CHANNEL;
+  }
+
+  // check payload size
+  if (packet->payload_size != bswap_16(assembler->expected_payload)) {
+    return ASSEMBLE_WRONG_PAYLOAD;
+  }
+
+  // not in the selection
+  if (assembler->tab_slot[packet->tab_index] < 0 || assembler->channel_slot[curr_channel] < 0) {
+    return ASSEMBLE_UNSELECTED;
+  }
+
+  // Work around the FREQISSUE: some channels have to be dropped
+  if (assembler->freqissue_workaround && (assembler->science_mode & 1) == 0 && remap_frequency_sc4[curr_channel] == 9999) {
+    return ASSEMBLE_SKIP;
+  }
+
+  return ASSEMBLE_OK;
+}
+
+/**
+ * Index of a validated packet within the page, between 0 and packets_per_sample, to detect duplicates
+ */
+size_t assemble_slot(const assembler_t *assembler, const packet_t *packet) {
+  size_t tab = assembler->tab_slot[packet->tab_index];
+  size_t channel = assembler->channel_slot[bswap_16(packet->channel_index)];
+
+  if ((assembler->science_mode & 1) == 0) {
+    return (tab * assembler->channel_slots + channel) * assembler->sequence_length + packet->sequence_number;
+  } else {
+    return (tab * assembler->channel_slots + channel / 4) * assembler->sequence_length + packet->sequence_number;
+  }
+}
+
+/**
+ * Copy using non-temporal stores, the page is not read again by us so don't pollute the cache with it
+ */
+static inline void copy_stream(char *dest, const unsigned char *src, size_t n) {
+#ifdef __SSE2__
+  // align the destination to 16 bytes
+  size_t head = (16 - ((uintptr_t) dest & 15)) & 15;
+  if (head > n) {
+    head = n;
+  }
+  memcpy(dest, src, head);
+  dest += head;
+  src += head;
+  n -= head;
+
+  while (n >= 64) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (src +  0));
+    __m128i b = _mm_loadu_si128((const __m128i *) (src + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *) (src + 32));
+    __m128i d = _mm_loadu_si128((const __m128i *) (src + 48));
+    _mm_stream_si128((__m128i *) (dest +  0), a);
+    _mm_stream_si128((__m128i *) (dest + 16), b);
+    _mm_stream_si128((__m128i *) (dest + 32), c);
+    _mm_stream_si128((__m128i *) (dest + 48), d);
+    dest += 64;
+    src += 64;
+    n -= 64;
+  }
+  while (n >= 16) {
+    _mm_stream_si128((__m128i *) dest, _mm_loadu_si128((const __m128i *) src));
+    dest += 16;
+    src += 16;
+    n -= 16;
+  }
+#endif
+  memcpy(dest, src, n);
+}
+
+/**
+ * Copy using rep movsb, microcoded to use full cache lines on CPUs with ERMS
+ */
+static inline void copy_repmovsb(char *dest, const unsigned char *src, size_t n) {
+#ifdef __x86_64__
+  __asm__ __volatile__("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+#else
+  memcpy(dest, src, n);
+#endif
+}
+
+/**
+ * Offset of a validated Stokes IQUV packet in the page
+ */
+static inline size_t iquv_offset(const assembler_t *assembler, const packet_t *packet) {
+  unsigned short curr_channel = bswap_16(packet->channel_index);
+  int tab = assembler->tab_slot[packet->tab_index];
+
+  // stokes IQUV
+  // packets contains matrix: [t0 .. t499][c0 .. c3][the 4 components IQUV] total of 500*4*4=8000 bytes
+  // t0, .., t499 = sequence_number * 500 + tx
+  // c0, c1, c2, c3 = curr_channel + 0, 1, 2, 3
+  //
+  // ring buffer contains matrix:
+  // tab             := tab_slot[tab_index]       : ranges from 0 to ntabs
+  // channel_offset  := channel_slot[channel]/4   : ranges from 0 to channel_slots
+  // sequence_number := packet->sequence_number : ranges from 0 to sequence_length
+  //
+  // [tab][channel_offset][sequence_number][PAYLOADSIZE_STOKESIQUV]
+  return (((size_t) (tab * assembler->channel_slots) + assembler->channel_slot[curr_channel] / 4) * assembler->sequence_length + packet->sequence_number) * PAYLOADSIZE_STOKESIQUV;
+}
+
+/**
+ * Copy the payload of a validated packet to its place in the page
+ */
+void assemble_copy(const assembler_t *assembler, const packet_t *packet, char *page) {
+  unsigned short curr_channel = bswap_16(packet->channel_index);
+  int tab = assembler->tab_slot[packet->tab_index];
+  char *dest;
+
+  if ((assembler->science_mode & 1) == 0) {
+    // stokes I
+    // packets contains: timeseries of PAYLOADSIZE_STOKESI elements [t0 .. tn]
+    //
+    // ring buffer contains matrix, for the selected tabs and channels:
+    // [ntabs][nchannels][padded_size]
+
+    if (assembler->freqissue_workaround) {
+      // Work around the FREQISSUE described above
+      curr_channel = remap_frequency_sc4[curr_channel];
+    }
+    curr_channel = assembler->channel_slot[curr_channel];
+
+    if (assembler->transposer) {
+      // time-major: [ntabs][padded_size][nchannels], through a tile
+      transpose_add(assembler->transposer, tab, curr_channel, packet->sequence_number, packet->record, page);
+      return;
+    }
+
+    dest = &page[((size_t) (tab * assembler->nchannels) + curr_channel) * assembler->padded_size + packet->sequence_number * PAYLOADSIZE_STOKESI];
+  } else {
+    dest = &page[iquv_offset(assembler, packet)];
+  }
+
+  switch (assembler->copy) {
+    case COPY_STREAM:
+      copy_stream(dest, packet->record, assembler->expected_payload);
+      break;
+    case COPY_REPMOVSB:
+      copy_repmovsb(dest, packet->record, assembler->expected_payload);
+      break;
+    default:
+      memcpy(dest, packet->record, assembler->expected_payload);
+      break;
+  }
+}
+
+#ifdef __SSSE3__
+/**
+ * De-interleave 16 samples of 4 channels: 64 bytes [sample][c0 .. c3][IQUV] to a register [sample][c0 .. c3] per Stokes parameter
+ */
+static inline void deinterleave_stokes(const unsigned char *src, __m128i *out) {
+  // gather the bytes of every parameter of a sample: [c0 .. c3][IQUV] to [IQUV][c0 .. c3]
+  const __m128i gather = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+  __m128i v[4], t[4];
+  int k;
+
+  for (k = 0; k < 4; k++) {
+    v[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &src[16 * k]), gather);
+  }
+
+  // then transpose the 4 x 4 dwords of 4 samples, giving 4 samples of a parameter per register
+  t[0] = _mm_unpacklo_epi32(v[0], v[1]);
+  t[1] = _mm_unpacklo_epi32(v[2], v[3]);
+  t[2] = _mm_unpackhi_epi32(v[0], v[1]);
+  t[3] = _mm_unpackhi_epi32(v[2], v[3]);
+  out[0] = _mm_unpacklo_epi64(t[0], t[1]);
+  out[1] = _mm_unpackhi_epi64(t[0], t[1]);
+  out[2] = _mm_unpacklo_epi64(t[2], t[3]);
+  out[3] = _mm_unpackhi_epi64(t[2], t[3]);
+}
+#endif
+
+/**
+ * Copy the payload of a validated Stokes IQUV packet to the pages of the Stokes parameters, de-interleaving it
+ * The packet holds [500 samples][4 channels][IQUV]; the page of a parameter gets [500 samples][4 channels]
+ * at a quarter of the offset of the packet in an interleaved page.
+ *
+ * @param {char *} pages Page per Stokes parameter I, Q, U, V; NULL for a parameter that is not kept
+ */
+void assemble_copy_stokes(const assembler_t *assembler, const packet_t *packet, char *const pages[ASSEMBLE_STOKES]) {
+  size_t offset = iquv_offset(assembler, packet) / ASSEMBLE_STOKES;
+  const unsigned char *src = packet->record;
+  char *dest[ASSEMBLE_STOKES];
+  int i, k;
+
+  for (k = 0; k < ASSEMBLE_STOKES; k++) {
+    dest[k] = pages[k] ? &pages[k][offset] : NULL;
+  }
+
+#ifdef __SSSE3__
+  __m128i out[ASSEMBLE_STOKES];
+  int stream = assembler->copy == COPY_STREAM;
+
+  // 2000 bytes per parameter: 125 registers
+  for (i = 0; i < PAYLOADSIZE_STOKESIQUV / ASSEMBLE_STOKES; i += 16) {
+    deinterleave_stokes(&src[ASSEMBLE_STOKES * i], out);
+    for (k = 0; k < ASSEMBLE_STOKES; k++) {
+      if (!dest[k]) {
+        continue;
+      }
+      if (stream && ((uintptr_t) dest[k] & 15) == 0) {
+        _mm_stream_si128((__m128i *) &dest[k][i], out[k]);
+      } else {
+        _mm_storeu_si128((__m128i *) &dest[k][i], out[k]);
+      }
+    }
+  }
+#else
+  for (i = 0; i < PAYLOADSIZE_STOKESIQUV / ASSEMBLE_STOKES; i++) {
+    for (k = 0; k < ASSEMBLE_STOKES; k++) {
+      if (dest[k]) {
+        dest[k][i] = src[ASSEMBLE_STOKES * i + k];
+      }
+    }
+  }
+#endif
+}
+
+/**
+ * Copy the flags of a validated packet to its place in the flag mask of the page, bit-packed in host byte order
+ * Flag k of the packet is bit k % 64 of word k / 64, the byte swapped words of packet_t.flags.
+ *
+ * @param {uint8_t *} mask Flag mask of the page, ASSEMBLE_FLAG_WORDS words per slot, see assemble_slot
+ */
+void assemble_flags(const assembler_t *assembler, const packet_t *packet, uint8_t *mask) {
+  uint64_t *dest = (uint64_t *) &mask[assemble_slot(assembler, packet) * ASSEMBLE_FLAG_WORDS * sizeof(uint64_t)];
+  int w;
+
+  for (w = 0; w < ASSEMBLE_FLAG_WORDS; w++) {
+    dest[w] = bswap_64(packet->flags[w]);
+  }
+}
+
+/**
+ * Write out the data held back for the page, for time-major pages
+ * Call from a single thread when all packets of the page are copied, before assemble_flush.
+ */
+void assemble_finish(const assembler_t *assembler) {
+  if (assembler->transposer) {
+    transpose_finish(assembler->transposer);
+  }
+}
+
+/**
+ * Make all copies to the page globally visible, call before handing the page to readers
+ */
+void assemble_flush(const assembler_t *assembler) {
+#ifdef __SSE2__
+  if (assembler->copy == COPY_STREAM || assembler->transposer) {
+    _mm_sfence();
+  }
+#endif
+}
+
+/**
+ * Describe why a packet was rejected
+ *
+ * @returns {int} Number of characters written, as snprintf
+ */
+int assemble_describe(const assembler_t *assembler, const packet_t *packet, int status, char *buf, size_t size) {
+  switch (status) {
+    case ASSEMBLE_OK:
+    case ASSEMBLE_SKIP:
+      return snprintf(buf, size, "OK\n");
+    case ASSEMBLE_UNSELECTED:
+      return snprintf(buf, size, "OK, not selected: tab %d channel %d\n", packet->tab_index, bswap_16(packet->channel_index));
+    case ASSEMBLE_WRONG_MARKER:
+      return snprintf(buf, size, "ERROR: wrong marker byte: %x instead of %x\n", packet->marker_byte, assembler->expected_marker_byte);
+    case ASSEMBLE_WRONG_VERSION:
+      return snprintf(buf, size, "ERROR: wrong format version: %d instead of %d\n", packet->format_version, 1);
+    case ASSEMBLE_WRONG_BEAM:
+      return snprintf(buf, size, "ERROR: unexpected compound beam index %d\n", packet->cb_index);
+    case ASSEMBLE_WRONG_TAB:
+      return snprintf(buf, size, "ERROR: unexpected tab index %d\n", packet->tab_index);
+    case ASSEMBLE_WRONG_CHANNEL:
+      return snprintf(buf, size, "ERROR: unexpected channel index %d or sequence number %d\n", bswap_16(packet->channel_index), packet->sequence_number);
+    case ASSEMBLE_WRONG_PAYLOAD:
+      return snprintf(buf, size, "Warning: unexpected payload size %d\n", bswap_16(packet->payload_size));
+  }
+  return snprintf(buf, size, "ERROR: unknown status %d\n", status);
+}
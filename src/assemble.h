@@ -0,0 +1,93 @@
+/**
+ * Packet assembly: validate packets and copy their payload to the right place in a ringbuffer page
+ * Author: Jisk Attema, based on code by Roy Smits
+ *
+ */
+#ifndef ASSEMBLE_H
+#define ASSEMBLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet.h"
+#include "transpose.h"
+
+/* Send on to ringbuffer a single second of data as a three dimensional array:
+ * [tab_index][channel][record] of sizes [0..11][0..1535][0..paddedsize-1] = 18432 * paddedsize for a ringbuffer page
+ * or, for time-major Stokes I pages, [tab_index][record][channel]
+ * and with a selection only the selected tabs and channels, see assemble_select
+ * Stokes IQUV pages can be split into a page per Stokes parameter, see assemble_split_stokes
+ *
+ * SC3: records per 1.024s 12500
+ * SC4: records per 1.024s 25000
+ */
+
+// Result of validating a packet
+enum {
+  ASSEMBLE_OK = 0,
+  ASSEMBLE_SKIP,             // valid, but the data is not used (see FREQISSUE)
+  ASSEMBLE_UNSELECTED,       // valid, but not in the selected tabs and channels
+  ASSEMBLE_WRONG_MARKER,
+  ASSEMBLE_WRONG_VERSION,
+  ASSEMBLE_WRONG_BEAM,
+  ASSEMBLE_WRONG_TAB,
+  ASSEMBLE_WRONG_CHANNEL,
+  ASSEMBLE_WRONG_PAYLOAD
+};
+
+#define ASSEMBLE_FLAG_BITS 192      // Flag bits per packet, see packet_t.flags
+#define ASSEMBLE_FLAG_WORDS 3       // 64 bit words of flags per packet, in the flag mask of a page
+#define ASSEMBLE_MAX_TABS 12        // Tabs per compound beam
+#define ASSEMBLE_STOKES 4           // Stokes parameters in an IQUV packet: I, Q, U, V
+
+// How to copy the payload to the page
+enum {
+  COPY_MEMCPY = 0,           // libc memcpy
+  COPY_STREAM,               // non-temporal (streaming) SIMD stores, bypassing the cache
+  COPY_REPMOVSB,             // rep movsb, fast on CPUs with ERMS
+  COPY_STRATEGIES
+};
+extern char *copy_strategies[];
+
+/*
+ * Packet layout and page geometry for a science case and mode
+ * With a selection of tabs and channels, the page only holds those, in order, see assemble_select.
+ */
+typedef struct {
+  int science_case;                  // 3 or 4
+  int science_mode;                  // 0: I+TAB, 1: IQUV+TAB, 2: I+IAB, 3: IQUV+IAB
+  unsigned char expected_marker_byte;
+  unsigned short expected_payload;   // payload size in bytes
+  int ntabs;                         // tabs in the page
+  int beam_tabs;                     // tabs in the packets: 12 for TAB modes, 1 for IAB modes
+  int nchannels;                     // channels in the page, NCHANNELS without a selection
+  int channel_slots;                 // packet slots per tab and sequence number: nchannels for Stokes I, nchannels / 4 for IQUV
+  int sequence_length;               // number of packages belonging to a sequence
+  int packets_per_sample;            // number of packets per page
+  int ntimes;                        // samples per page
+  int padded_size;                   // size of the time dimension of a Stokes I page
+  size_t required_size;              // minimum size of a page in bytes
+  signed char tab_slot[ASSEMBLE_MAX_TABS];  // tab in the page per tab index, -1 when not selected
+  short channel_slot[NCHANNELS];     // channel in the page per channel index, -1 when not selected
+
+  unsigned char cb_index;            // Compound beam to accept
+  int freqissue_workaround;          // Do we need to work around the FREQISSUE bug?
+  int copy;                          // copy strategy
+  transposer_t *transposer;          // Stokes I pages time-major: [tab][padded_size][nchannels], see transpose.h; NULL otherwise
+  int split;                         // Stokes IQUV split over a page per Stokes parameter, see assemble_copy_stokes
+} assembler_t;
+
+int assemble_init(assembler_t *assembler, int science_case, int science_mode, int padded_size);
+int assemble_select(assembler_t *assembler, const char *tabs, const char *channels);
+int assemble_selection(const assembler_t *assembler, char *tabs, size_t tabs_size, char *channels, size_t channels_size);
+int assemble_split_stokes(assembler_t *assembler, int split);
+int assemble_validate(const assembler_t *assembler, const packet_t *packet);
+size_t assemble_slot(const assembler_t *assembler, const packet_t *packet);
+void assemble_copy(const assembler_t *assembler, const packet_t *packet, char *page);
+void assemble_copy_stokes(const assembler_t *assembler, const packet_t *packet, char *const pages[ASSEMBLE_STOKES]);
+void assemble_flags(const assembler_t *assembler, const packet_t *packet, uint8_t *mask);
+void assemble_finish(const assembler_t *assembler);
+void assemble_flush(const assembler_t *assembler);
+int assemble_describe(const assembler_t *assembler, const packet_t *packet, int status, char *buf, size_t size);
+
+#endif
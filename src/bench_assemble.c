@@ -0,0 +1,259 @@
+/**
+ * Microbenchmark for the packet assembly kernel
+ * Author: Jisk Attema
+ *
+ * Validates and copies synthetic in-memory packets into a plain page buffer, without network or ringbuffer,
+ * for every science case and mode, packet order and copy strategy.
+ * Stokes I is also measured with time-major pages, see transpose.h, and Stokes IQUV split over a page per Stokes parameter.
+ */
+// needed for bswap
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <byteswap.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "packet.h"
+#include "assemble.h"
+
+#define MMSG_VLEN  256            // Packets per batch, as received by fill_ringbuffer in a single recvmmsg call
+
+// Order in which the packets of a frame arrive
+enum {
+  ORDER_SEQUENTIAL,               // as sent by the beamformer (and send): channel fastest, then sequence number, then tab
+  ORDER_SHUFFLED,                 // random permutation of the whole frame
+  ORDER_LOSSY,                    // sequential, with a fraction of the packets missing
+  ORDERS
+};
+char *orders[] = {"in order", "shuffled", "lossy"};
+
+/**
+ * Print commandline optinos
+ */
+void printOptions() {
+  printf("usage: bench_assemble [-c <science case>] [-m <science mode>] [-n <frames>] [-l <loss fraction>]\n");
+  printf("Without -c or -m, all science cases and modes are measured.\n");
+  return;
+}
+
+/**
+ * Parse commandline
+ */
+void parseOptions(int argc, char*argv[], int *science_case, int *science_mode, int *nframes, double *loss) {
+  int c;
+
+  while((c=getopt(argc,argv,"c:m:n:l:"))!=-1) {
+    switch(c) {
+      // -c science case
+      case('c'):
+        *science_case = atoi(optarg);
+        break;
+
+      // -m science mode
+      case('m'):
+        *science_mode = atoi(optarg);
+        break;
+
+      // -n frames per measurement
+      case('n'):
+        *nframes = atoi(optarg);
+        break;
+
+      // -l fraction of lost packets for the lossy order
+      case('l'):
+        *loss = atof(optarg);
+        break;
+
+      default:
+        printOptions();
+        exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/**
+ * Nanoseconds between two points in time
+ */
+static inline double elapsed_ns(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e9 + (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * Build the list of packet slots of a frame, encoded as (tab << 24) | (sequence << 16) | channel
+ *
+ * @returns {int} Number of slots in the list
+ */
+int make_slots(assembler_t *assembler, int order, double loss, unsigned int *slots) {
+  int channel_delta = (assembler->science_mode & 1) ? 4 : 1;
+  int tab, sequence, channel;
+  int nslots = 0;
+  int i, j;
+
+  for (tab = 0; tab < assembler->ntabs; tab++) {
+    for (sequence = 0; sequence < assembler->sequence_length; sequence++) {
+      for (channel = 0; channel < NCHANNELS; channel += channel_delta) {
+        if (order == ORDER_LOSSY && drand48() < loss) {
+          continue;
+        }
+        slots[nslots++] = (tab << 24) | (sequence << 16) | channel;
+      }
+    }
+  }
+
+  if (order == ORDER_SHUFFLED) {
+    for (i = nslots - 1; i > 0; i--) {
+      j = lrand48() % (i + 1);
+      unsigned int tmp = slots[i];
+      slots[i] = slots[j];
+      slots[j] = tmp;
+    }
+  }
+
+  return nslots;
+}
+
+int main(int argc, char** argv) {
+  int only_case = 0;
+  int only_mode = -1;
+  int nframes = 3;
+  double loss = 0.05;
+
+  int science_case, science_mode, order, copy;
+  int frame, i, n, k;
+  unsigned int *slots;
+  int nslots;
+  packet_t *packet_buffer;
+  char *page;
+  char *pages[ASSEMBLE_STOKES];
+  assembler_t assembler;
+  transposer_t transposer;
+  struct timespec start, end;
+
+  parseOptions(argc, argv, &only_case, &only_mode, &nframes, &loss);
+
+  // the packets of one recvmmsg batch, with a payload that is not all zeros
+  packet_buffer = malloc(MMSG_VLEN * sizeof(packet_t));
+  for (i = 0; i < MMSG_VLEN; i++) {
+    for (n = 0; n < PAYLOADSIZE_MAX; n++) {
+      packet_buffer[i].record[n] = (i + n) & 0xff;
+    }
+  }
+
+  // room for the largest frame: 12 tabs, 50 sequences, 1536 channels
+  slots = malloc(12 * 50 * NCHANNELS * sizeof(unsigned int));
+
+  printf("%-4s %-4s %-9s %-9s %10s %10s %8s\n", "case", "mode", "order", "copy", "packets", "ns/packet", "GB/s");
+
+  for (science_case = 3; science_case <= 4; science_case++) {
+    if (only_case && science_case != only_case) {
+      continue;
+    }
+    for (science_mode = 0; science_mode < 4; science_mode++) {
+      if (only_mode >= 0 && science_mode != only_mode) {
+        continue;
+      }
+
+      assemble_init(&assembler, science_case, science_mode, science_case == 3 ? 12500 : 25000);
+      assembler.cb_index = 1;
+
+      // a prefaulted page, so page faults are not measured
+      page = mmap(NULL, assembler.required_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+      if (page == MAP_FAILED) {
+        perror("ERROR: cannot allocate page");
+        exit(EXIT_FAILURE);
+      }
+
+      for (i = 0; i < MMSG_VLEN; i++) {
+        packet_buffer[i].marker_byte = assembler.expected_marker_byte;
+        packet_buffer[i].format_version = 1;
+        packet_buffer[i].cb_index = assembler.cb_index;
+        packet_buffer[i].payload_size = bswap_16(assembler.expected_payload);
+      }
+
+      for (order = 0; order < ORDERS; order++) {
+        srand48(42);
+        nslots = make_slots(&assembler, order, loss, slots);
+
+        // the copy strategies, and the time-major transpose for Stokes I or the split over four pages for Stokes IQUV
+        for (copy = 0; copy <= COPY_STRATEGIES; copy++) {
+          double ns = 0;
+          long packets = 0;
+
+          if (copy == COPY_STRATEGIES && (science_mode & 1)) {
+            // quarters of the page
+            assembler.copy = COPY_MEMCPY;
+            assemble_split_stokes(&assembler, 1);
+            for (k = 0; k < ASSEMBLE_STOKES; k++) {
+              pages[k] = &page[k * assembler.required_size];
+            }
+          } else if (copy == COPY_STRATEGIES) {
+            if (transpose_init(&transposer, assembler.ntabs, assembler.nchannels, assembler.sequence_length, assembler.padded_size)) {
+              perror("ERROR: cannot allocate tiles");
+              exit(EXIT_FAILURE);
+            }
+            assembler.transposer = &transposer;
+          } else {
+            assembler.copy = copy;
+          }
+
+          for (frame = 0; frame < nframes; frame++) {
+            for (i = 0; i < nslots; i += MMSG_VLEN) {
+              int count = nslots - i < MMSG_VLEN ? nslots - i : MMSG_VLEN;
+
+              // 'receive' the next batch: only the headers change
+              for (n = 0; n < count; n++) {
+                unsigned int slot = slots[i + n];
+                packet_buffer[n].tab_index = slot >> 24;
+                packet_buffer[n].sequence_number = (slot >> 16) & 0xff;
+                packet_buffer[n].channel_index = bswap_16(slot & 0xffff);
+                packet_buffer[n].timestamp = bswap_64((unsigned long) frame * FRAMETIME);
+              }
+
+              clock_gettime(CLOCK_MONOTONIC, &start);
+              for (n = 0; n < count; n++) {
+                if (assemble_validate(&assembler, &packet_buffer[n]) != ASSEMBLE_OK) {
+                  continue;
+                }
+                if (assembler.split) {
+                  assemble_copy_stokes(&assembler, &packet_buffer[n], pages);
+                } else {
+                  assemble_copy(&assembler, &packet_buffer[n], page);
+                }
+              }
+              if (i + count == nslots) {
+                assemble_finish(&assembler);
+                assemble_flush(&assembler);
+              }
+              clock_gettime(CLOCK_MONOTONIC, &end);
+
+              ns += elapsed_ns(&start, &end);
+              packets += count;
+            }
+          }
+
+          printf("%-4i %-4i %-9s %-9s %10li %10.1f %8.3f\n", science_case, science_mode, orders[order],
+              copy < COPY_STRATEGIES ? copy_strategies[copy] : assembler.split ? "split" : "transpose", packets, ns / packets, packets * assembler.expected_payload / ns);
+          if (assembler.transposer) {
+            if (transposer.partial) {
+              printf("     %lu partial tiles\n", transposer.partial);
+            }
+            transpose_close(&transposer);
+            assembler.transposer = NULL;
+          }
+          assemble_split_stokes(&assembler, 0);
+        }
+      }
+
+      munmap(page, assembler.required_size);
+    }
+  }
+
+  free(slots);
+  free(packet_buffer);
+  return 0;
+}
@@ -0,0 +1,362 @@
+/**
+ * Compression of archived pages: bitshuffle and a byte codec
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "codec.h"
+
+#define RLE_MAX_LITERAL 128       // longest literal: control bytes 0 to 127
+#define RLE_MIN_RUN 3             // shorter runs are cheaper as literals
+#define RLE_MAX_RUN 130           // longest run: control bytes 128 to 255
+
+static const char *codec_names[] = {"none", "rle", "lz4", "zstd"};
+
+/**
+ * Find a codec by name
+ *
+ * @returns {int} One of codec, or -1 when unknown or not available in this build
+ */
+int codec_parse(const char *name) {
+  int codec;
+
+  for (codec = 0; codec < CODECS; codec++) {
+    if (!strcmp(name, codec_names[codec])) {
+#ifndef HAVE_LZ4
+      if (codec == CODEC_LZ4) return -1;
+#endif
+#ifndef HAVE_ZSTD
+      if (codec == CODEC_ZSTD) return -1;
+#endif
+      return codec;
+    }
+  }
+  return -1;
+}
+
+const char *codec_name(int codec) {
+  return codec >= 0 && codec < CODECS ? codec_names[codec] : "unknown";
+}
+
+/**
+ * The best codec of this build: zstd, lz4, or else the built-in rle
+ */
+int codec_default(void) {
+#if defined(HAVE_ZSTD)
+  return CODEC_ZSTD;
+#elif defined(HAVE_LZ4)
+  return CODEC_LZ4;
+#else
+  return CODEC_RLE;
+#endif
+}
+
+/**
+ * Largest compressed size of a block
+ */
+size_t codec_bound(int codec, size_t size) {
+  switch (codec) {
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: return LZ4_compressBound(size);
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: return ZSTD_compressBound(size);
+#endif
+    case CODEC_RLE: return size + size / RLE_MAX_LITERAL + 1;
+    default: return size;
+  }
+}
+
+/**
+ * Append literals, at most RLE_MAX_LITERAL per control byte
+ *
+ * @returns {size_t} Position after the literals, or 0 when they do not fit
+ */
+static size_t rle_literals(const uint8_t *src, size_t count, uint8_t *dest, size_t out, size_t capacity) {
+  size_t n;
+
+  while (count) {
+    n = count < RLE_MAX_LITERAL ? count : RLE_MAX_LITERAL;
+    if (out + 1 + n > capacity) {
+      return 0;
+    }
+    dest[out++] = n - 1;
+    memcpy(&dest[out], src, n);
+    out += n;
+    src += n;
+    count -= n;
+  }
+  return out;
+}
+
+/**
+ * Run length encoding: a control byte c < 128 is followed by c + 1 literal bytes,
+ * a control byte c >= 128 by a byte that is repeated c - 125 times
+ */
+static size_t rle_compress(const uint8_t *src, size_t size, uint8_t *dest, size_t capacity) {
+  const uint64_t ones = 0x0101010101010101UL;
+  size_t start = 0;              // first literal not written yet
+  size_t out = 0;
+  size_t i = 0;
+  size_t run;
+  uint64_t word;
+
+  while (i < size) {
+#ifdef __SSE2__
+    // skip the literals 16 bytes at a time, to the first position where 3 equal bytes start: the noisy low bit planes
+    __m128i x, y, z;
+    int starts;
+
+    for (; i + 18 <= size; i += 16) {
+      x = _mm_loadu_si128((const __m128i *) &src[i]);
+      y = _mm_loadu_si128((const __m128i *) &src[i + 1]);
+      z = _mm_loadu_si128((const __m128i *) &src[i + 2]);
+      starts = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, y), _mm_cmpeq_epi8(y, z)));
+      if (starts) {
+        i += __builtin_ctz(starts);
+        break;
+      }
+    }
+#endif
+
+    // the length of the run at i, 8 bytes at a time in the long runs of the high bit planes
+    run = 1;
+    while (run + 8 <= RLE_MAX_RUN && i + run + 8 <= size) {
+      memcpy(&word, &src[i + run], sizeof(word));
+      if (word != src[i] * ones) {
+        break;
+      }
+      run += 8;
+    }
+    while (run < RLE_MAX_RUN && i + run < size && src[i + run] == src[i]) {
+      run++;
+    }
+
+    if (run < RLE_MIN_RUN) {
+      i += run;
+      continue;
+    }
+
+    if (i > start) {
+      out = rle_literals(&src[start], i - start, dest, out, capacity);
+      if (!out) {
+        return 0;
+      }
+    }
+    if (out + 2 > capacity) {
+      return 0;
+    }
+    dest[out++] = run + 125;
+    dest[out++] = src[i];
+    i += run;
+    start = i;
+  }
+
+  if (size > start) {
+    out = rle_literals(&src[start], size - start, dest, out, capacity);
+  }
+  return out;
+}
+
+static int rle_decompress(const uint8_t *src, size_t size, uint8_t *dest, size_t raw_size) {
+  size_t in = 0, out = 0, n;
+
+  while (in < size) {
+    if (src[in] < RLE_MAX_LITERAL) {
+      n = src[in] + 1;
+      if (in + 1 + n > size || out + n > raw_size) {
+        return -1;
+      }
+      memcpy(&dest[out], &src[in + 1], n);
+      in += 1 + n;
+    } else {
+      n = src[in] - 125;
+      if (in + 2 > size || out + n > raw_size) {
+        return -1;
+      }
+      memset(&dest[out], src[in + 1], n);
+      in += 2;
+    }
+    out += n;
+  }
+  return out == raw_size ? 0 : -1;
+}
+
+/**
+ * Compress a block
+ *
+ * @param {int} codec One of codec
+ * @param {int} level Compression level, for zstd
+ * @returns {size_t} Compressed size, or 0 when it does not fit or the codec failed
+ */
+size_t codec_compress(int codec, int level, const uint8_t *src, size_t size, uint8_t *dest, size_t capacity) {
+  switch (codec) {
+    case CODEC_RLE:
+      return rle_compress(src, size, dest, capacity);
+#ifdef HAVE_LZ4
+    case CODEC_LZ4: {
+      int n = LZ4_compress_default((const char *) src, (char *) dest, size, capacity);
+      return n > 0 ? (size_t) n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+      // a context per thread, created once: allocating one per block costs more than compressing it
+      static __thread ZSTD_CCtx *context = NULL;
+      size_t n;
+
+      if (!context && !(context = ZSTD_createCCtx())) {
+        return 0;
+      }
+      n = ZSTD_compressCCtx(context, dest, capacity, src, size, level);
+      return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Decompress a block
+ *
+ * @param {size_t} raw_size Size of the block before compression
+ * @returns {int} 0 on success, -1 on corrupt data or an unknown codec
+ */
+int codec_decompress(int codec, const uint8_t *src, size_t size, uint8_t *dest, size_t raw_size) {
+  switch (codec) {
+    case CODEC_RLE:
+      return rle_decompress(src, size, dest, raw_size);
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+      return LZ4_decompress_safe((const char *) src, (char *) dest, size, raw_size) == (int) raw_size ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+      return ZSTD_decompress(dest, raw_size, src, size) == raw_size ? 0 : -1;
+#endif
+    default:
+      return -1;
+  }
+}
+
+/**
+ * The reference of a block for bitshuffle: its mean, rounded
+ */
+uint8_t codec_reference(const uint8_t *src, size_t size) {
+  uint64_t sum = 0;
+  size_t i = 0;
+
+  if (size == 0) {
+    return 0;
+  }
+#ifdef __SSE2__
+  // sums of absolute differences with zero: the sum of every 8 bytes, in two 64 bit lanes
+  __m128i total = _mm_setzero_si128();
+
+  for (; i + 16 <= size; i += 16) {
+    total = _mm_add_epi64(total, _mm_sad_epu8(_mm_loadu_si128((const __m128i *) &src[i]), _mm_setzero_si128()));
+  }
+  sum = _mm_cvtsi128_si64(total) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total));
+#endif
+  for (; i < size; i++) {
+    sum += src[i];
+  }
+  return (sum + size / 2) / size;
+}
+
+/**
+ * Distance of a byte to the reference, zigzag encoded: 0, -1, 1, -2, 2, ... become 0, 1, 2, 3, 4, ...
+ */
+static inline uint8_t zigzag(uint8_t byte, uint8_t reference) {
+  uint8_t distance = byte - reference;
+
+  return (uint8_t) (distance << 1) ^ ((distance & 0x80) ? 0xff : 0);
+}
+
+static inline uint8_t unzigzag(uint8_t code, uint8_t reference) {
+  return ((code >> 1) ^ -(code & 1)) + reference;
+}
+
+/**
+ * Gather bit 7 - p of 8 bytes, after zigzag
+ */
+static inline uint8_t gather_bits(const uint8_t *src, int p, uint8_t reference) {
+  uint8_t bits = 0;
+  int j;
+
+  for (j = 0; j < 8; j++) {
+    bits |= ((zigzag(src[j], reference) >> (7 - p)) & 1) << j;
+  }
+  return bits;
+}
+
+/**
+ * Regroup a block into 8 bit planes of size / 8 bytes, the most significant bit first;
+ * the last size % 8 bytes are copied as they are
+ * The bytes are first replaced by their zigzag encoded distance to the reference, see codec_reference,
+ * so noise around any level leaves the high bit planes empty.
+ */
+void bitshuffle(const uint8_t *src, uint8_t *dest, size_t size, uint8_t reference) {
+  size_t nplane = size / 8;
+  size_t k = 0;
+  int p;
+
+#ifdef __SSE2__
+  // movemask collects the top bit of 16 bytes: two bytes of a plane. Adding the vector to itself moves up the next bit
+  const __m128i ref = _mm_set1_epi8(reference);
+  __m128i x;
+  uint16_t bits;
+
+  for (k = 0; k + 2 <= nplane; k += 2) {
+    x = _mm_sub_epi8(_mm_loadu_si128((const __m128i *) &src[8 * k]), ref);
+    x = _mm_xor_si128(_mm_add_epi8(x, x), _mm_cmpgt_epi8(_mm_setzero_si128(), x));
+    for (p = 0; p < 8; p++) {
+      bits = _mm_movemask_epi8(x);
+      memcpy(&dest[p * nplane + k], &bits, sizeof(bits));
+      x = _mm_add_epi8(x, x);
+    }
+  }
+#endif
+  for (; k < nplane; k++) {
+    for (p = 0; p < 8; p++) {
+      dest[p * nplane + k] = gather_bits(&src[8 * k], p, reference);
+    }
+  }
+  memcpy(&dest[8 * nplane], &src[8 * nplane], size % 8);
+}
+
+/**
+ * Undo bitshuffle
+ */
+void bitunshuffle(const uint8_t *src, uint8_t *dest, size_t size, uint8_t reference) {
+  size_t nplane = size / 8;
+  size_t k;
+  uint8_t code;
+  int j, p;
+
+  for (k = 0; k < nplane; k++) {
+    for (j = 0; j < 8; j++) {
+      code = 0;
+      for (p = 0; p < 8; p++) {
+        code |= ((src[p * nplane + k] >> j) & 1) << (7 - p);
+      }
+      dest[8 * k + j] = unzigzag(code, reference);
+    }
+  }
+  memcpy(&dest[8 * nplane], &src[8 * nplane], size % 8);
+}
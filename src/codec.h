@@ -0,0 +1,41 @@
+/**
+ * Compression of archived pages: bitshuffle and a byte codec
+ * Author: Jisk Attema
+ *
+ * The samples are 8 bit, mostly noise around a slowly varying level. Every byte of a block is replaced by its distance
+ * to a reference, the mean of the block, zigzag encoded (0, -1, 1, -2, ... become 0, 1, 2, 3, ...), so only the low bits are noisy.
+ * A bitshuffle then regroups the block into 8 bit planes, most significant bit first: plane p holds bit 7 - p of every byte,
+ * so bit j of byte k of plane p is bit 7 - p of byte 8 * k + j. The planes of the high bits are long runs
+ * of zeros that any codec compresses well, while the planes of the noisy low bits are left as they are.
+ *
+ * Codecs:
+ *  - none, the block is stored as is
+ *  - rle, built in: runs of equal bytes, and literals
+ *  - lz4 and zstd, when the libraries were found at build time
+ */
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum codec {
+  CODEC_NONE,
+  CODEC_RLE,
+  CODEC_LZ4,
+  CODEC_ZSTD,
+  CODECS
+};
+
+int codec_parse(const char *name);
+const char *codec_name(int codec);
+int codec_default(void);
+size_t codec_bound(int codec, size_t size);
+size_t codec_compress(int codec, int level, const uint8_t *src, size_t size, uint8_t *dest, size_t capacity);
+int codec_decompress(int codec, const uint8_t *src, size_t size, uint8_t *dest, size_t raw_size);
+
+uint8_t codec_reference(const uint8_t *src, size_t size);
+void bitshuffle(const uint8_t *src, uint8_t *dest, size_t size, uint8_t reference);
+void bitunshuffle(const uint8_t *src, uint8_t *dest, size_t size, uint8_t reference);
+
+#endif
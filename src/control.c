@@ -0,0 +1,304 @@
+/**
+ * Control socket for the daemon mode of fill_ringbuffer
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "control.h"
+
+#define CONTROL_POLL_MS 100        // How often the control thread checks for the stop flag
+#define CONTROL_IDLE_MS 10000      // Disconnect clients that are silent this long
+
+static const char *state_names[] = {"idle", "waiting", "observing"};
+
+/**
+ * Handle a single command, and format the reply
+ */
+static void handle_command(control_t *c, char *line, char *reply, size_t size) {
+  char *command, *argument;
+  char *end;
+  unsigned long startpacket;
+  float duration;
+  int queued;
+
+  command = strtok_r(line, " \t\r", &end);
+  argument = strtok_r(NULL, "\r", &end);
+  while (argument && (*argument == ' ' || *argument == '\t')) {
+    argument++;
+  }
+
+  if (!command) {
+    snprintf(reply, size, "ERROR empty command\n");
+    return;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  queued = c->tail - c->head;
+
+  if (strcmp(command, "header") == 0 && argument) {
+    if (access(argument, R_OK)) {
+      snprintf(reply, size, "ERROR cannot read header file %s\n", argument);
+    } else {
+      snprintf(c->next.header, sizeof(c->next.header), "%s", argument);
+      c->have_header = 1;
+      snprintf(reply, size, "OK\n");
+    }
+
+  } else if (strcmp(command, "key") == 0 && argument) {
+    if (strlen(argument) >= sizeof(c->next.key)) {
+      snprintf(reply, size, "ERROR key too long\n");
+    } else {
+      snprintf(c->next.key, sizeof(c->next.key), "%s", argument);
+      c->have_key = 1;
+      snprintf(reply, size, "OK\n");
+    }
+
+  } else if (strcmp(command, "duration") == 0 && argument) {
+    duration = strtof(argument, &end);
+    if (*end != '\0' || duration <= 0) {
+      snprintf(reply, size, "ERROR invalid duration %s\n", argument);
+    } else {
+      c->next.duration = duration;
+      c->have_duration = 1;
+      snprintf(reply, size, "OK\n");
+    }
+
+  } else if (strcmp(command, "start") == 0 && argument) {
+    startpacket = strtoul(argument, &end, 10);
+    if (*end != '\0') {
+      snprintf(reply, size, "ERROR invalid start packet %s\n", argument);
+    } else if (!c->have_header || !c->have_key || !c->have_duration) {
+      snprintf(reply, size, "ERROR header, key, and duration should be set before the start\n");
+    } else if (queued == CONTROL_QUEUE) {
+      snprintf(reply, size, "ERROR queue full, %i observations queued\n", queued);
+    } else {
+      c->next.startpacket = startpacket;
+      c->queue[c->tail % CONTROL_QUEUE] = c->next;
+      c->tail++;
+      snprintf(reply, size, "OK queued=%i\n", queued + 1);
+    }
+
+  } else if (strcmp(command, "stop") == 0) {
+    if (c->request == CONTROL_CONTINUE) {
+      c->request = CONTROL_STOP;
+    }
+    snprintf(reply, size, "OK\n");
+
+  } else if (strcmp(command, "quit") == 0) {
+    c->request = CONTROL_QUIT;
+    snprintf(reply, size, "OK\n");
+
+  } else if (strcmp(command, "status") == 0) {
+    if (c->state == CONTROL_IDLE) {
+      snprintf(reply, size, "OK state=%s queued=%i\n", state_names[c->state], queued);
+    } else {
+      snprintf(reply, size, "OK state=%s key=%s header=%s start=%lu duration=%g packet=%lu pages=%lu queued=%i\n",
+          state_names[c->state], c->current.key, c->current.header, c->current.startpacket, c->current.duration,
+          c->packet, c->pages, queued);
+    }
+
+  } else {
+    snprintf(reply, size, "ERROR unknown command %s\n", command);
+  }
+
+  pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Answer the commands of a client, one line at a time, till it disconnects or stays silent
+ */
+static void serve_client(control_t *c, int client) {
+  char line[CONTROL_LINE];
+  char reply[2 * CONTROL_LINE];
+  struct pollfd pfd;
+  size_t used = 0;
+  ssize_t n;
+  char *newline;
+  int idle = 0;
+
+  pfd.fd = client;
+  pfd.events = POLLIN;
+
+  while (!__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE) && idle < CONTROL_IDLE_MS) {
+    if (poll(&pfd, 1, CONTROL_POLL_MS) <= 0) {
+      idle += CONTROL_POLL_MS;
+      continue;
+    }
+    idle = 0;
+
+    n = read(client, line + used, sizeof(line) - 1 - used);
+    if (n <= 0) {
+      break;
+    }
+    used += n;
+    line[used] = '\0';
+
+    while ((newline = strchr(line, '\n'))) {
+      *newline = '\0';
+      handle_command(c, line, reply, sizeof(reply));
+      if (write(client, reply, strlen(reply)) < 0) {
+        return;
+      }
+      used -= newline + 1 - line;
+      memmove(line, newline + 1, used + 1);
+    }
+
+    if (used == sizeof(line) - 1) {
+      snprintf(reply, sizeof(reply), "ERROR command too long\n");
+      if (write(client, reply, strlen(reply)) < 0) {
+        // client went away, nothing to do
+      }
+      return;
+    }
+  }
+}
+
+/**
+ * Control thread: accept clients on the UNIX socket, one at a time
+ */
+static void *control_thread(void *arg) {
+  control_t *c = arg;
+  struct pollfd pfd;
+  sigset_t all;
+  int client;
+
+  // leave signals to the receiving thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  pfd.fd = c->sockfd;
+  pfd.events = POLLIN;
+
+  while (!__atomic_load_n(&c->stop, __ATOMIC_ACQUIRE)) {
+    if (poll(&pfd, 1, CONTROL_POLL_MS) > 0) {
+      client = accept(c->sockfd, NULL, NULL);
+      if (client >= 0) {
+        serve_client(c, client);
+        close(client);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Open the control socket and start answering commands
+ *
+ * @param {control_t *} c To initialize
+ * @param {char *} socketpath Path of the UNIX socket
+ * @returns {int} 0 on success, -1 on error
+ */
+int control_init(control_t *c, const char *socketpath) {
+  struct sockaddr_un addr;
+
+  memset(c, 0, sizeof(control_t));
+  pthread_mutex_init(&c->lock, NULL);
+  c->state = CONTROL_IDLE;
+  c->request = CONTROL_CONTINUE;
+
+  if (strlen(socketpath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "ERROR. Socket path too long: %s\n", socketpath);
+    return -1;
+  }
+  c->socketpath = strdup(socketpath);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socketpath);
+
+  c->sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socketpath);
+  if (c->sockfd < 0 || bind(c->sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(c->sockfd, 4) < 0) {
+    perror("ERROR. Cannot open control socket");
+    return -1;
+  }
+
+  if (pthread_create(&c->thread, NULL, control_thread, c)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Take the next queued observation
+ *
+ * @param {observation_t *} obs Set to the next observation
+ * @returns {int} 1 when an observation was queued, 0 otherwise
+ */
+int control_next(control_t *c, observation_t *obs) {
+  int found = 0;
+
+  pthread_mutex_lock(&c->lock);
+  if (c->head != c->tail) {
+    *obs = c->queue[c->head % CONTROL_QUEUE];
+    c->head++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return found;
+}
+
+/**
+ * Check for a stop or quit command; a stop is only returned once
+ *
+ * @returns {int} One of control_request
+ */
+int control_request(control_t *c) {
+  int request;
+
+  pthread_mutex_lock(&c->lock);
+  request = c->request;
+  if (request == CONTROL_STOP) {
+    c->request = CONTROL_CONTINUE;
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return request;
+}
+
+/**
+ * Update the state answered to status commands
+ *
+ * @param {int} state One of control_state
+ * @param {observation_t *} obs Current observation, or NULL when idle
+ * @param {unsigned long} packet Timestamp of the last page
+ * @param {uint64_t} pages Pages written in the current observation
+ */
+void control_status(control_t *c, int state, const observation_t *obs, unsigned long packet, uint64_t pages) {
+  pthread_mutex_lock(&c->lock);
+  c->state = state;
+  if (obs && obs != &c->current) {
+    c->current = *obs;
+  }
+  c->packet = packet;
+  c->pages = pages;
+  pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Stop the control thread, and remove the socket
+ */
+void control_close(control_t *c) {
+  if (!c->socketpath) {
+    return;
+  }
+
+  __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(c->thread, NULL);
+
+  close(c->sockfd);
+  unlink(c->socketpath);
+  free(c->socketpath);
+  c->socketpath = NULL;
+}
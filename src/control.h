@@ -0,0 +1,78 @@
+/**
+ * Control socket for the daemon mode of fill_ringbuffer
+ * Author: Jisk Attema
+ *
+ * Commands are single lines on a UNIX stream socket, each answered with a single line starting with OK or ERROR:
+ *
+ *   header <file>          header file for the next observation
+ *   key <key>              ring buffer key for the next observation
+ *   duration <seconds>     duration of the next observation
+ *   start <packet>         queue an observation starting at this packet number, with the header, key and duration set before
+ *   stop                   end the current observation at the next page
+ *   status                 state, current observation, and number of queued observations
+ *   quit                   end the current observation at the next page, and exit
+ *
+ * e.g. printf "header obs.txt\nkey shm:ring\nduration 300\nstart 1400265281306250\n" | socat - UNIX-CONNECT:/run/fill.sock
+ */
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define CONTROL_QUEUE 8            // Maximum number of queued observations
+#define CONTROL_LINE 4096          // Maximum length of a command
+#define CONTROL_KEY 256            // Maximum length of a ring buffer key
+
+typedef struct {
+  char header[CONTROL_LINE];       // header file
+  char key[CONTROL_KEY];           // ring buffer key
+  unsigned long startpacket;       // packet number to start at
+  float duration;                  // in seconds
+} observation_t;
+
+enum control_state {
+  CONTROL_IDLE,                    // no observation
+  CONTROL_WAITING,                 // waiting for the start packet
+  CONTROL_OBSERVING
+};
+
+enum control_request {
+  CONTROL_CONTINUE,
+  CONTROL_STOP,                    // end the current observation
+  CONTROL_QUIT                     // end the current observation, and exit
+};
+
+typedef struct {
+  pthread_mutex_t lock;
+
+  // the next observation, set by commands
+  observation_t next;
+  int have_header, have_key, have_duration;
+
+  // queued observations
+  observation_t queue[CONTROL_QUEUE];
+  int head;
+  int tail;
+  int request;                     // one of control_request
+
+  // status, set by the receiving thread
+  int state;
+  observation_t current;
+  unsigned long packet;            // timestamp of the last page
+  uint64_t pages;                  // pages in the current observation
+
+  // socket
+  char *socketpath;
+  int sockfd;
+  int stop;
+  pthread_t thread;
+} control_t;
+
+int control_init(control_t *c, const char *socketpath);
+int control_next(control_t *c, observation_t *obs);
+int control_request(control_t *c);
+void control_status(control_t *c, int state, const observation_t *obs, unsigned long packet, uint64_t pages);
+void control_close(control_t *c);
+
+#endif
@@ -0,0 +1,142 @@
+/**
+ * Network endpoints to receive on, and the CPUs close to their network interface
+ * Author: Jisk Attema
+ *
+ */
+// needed for pthread_setaffinity_np and the CPU_SET macros
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+
+#include "endpoint.h"
+
+/**
+ * Parse a comma separated list of endpoints: [address:]port
+ *
+ * @param {char *} list Endpoints, e.g. "4000" or "10.0.1.2:4000,10.0.2.2:4000"
+ * @param {endpoint_t *} endpoints Array to fill
+ * @param {int} max Size of the array
+ * @returns {int} Number of endpoints, -1 on error
+ */
+int endpoint_parse(const char *list, endpoint_t *endpoints, int max) {
+  char *copy, *item, *save, *colon, *end;
+  struct in_addr addr;
+  int n = 0;
+
+  copy = strdup(list);
+  for (item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+    if (n == max) {
+      fprintf(stderr, "At most %i endpoints are supported\n", max);
+      n = -1;
+      break;
+    }
+
+    memset(&endpoints[n], 0, sizeof(endpoint_t));
+    colon = strrchr(item, ':');
+    if (colon) {
+      *colon = '\0';
+      if (inet_pton(AF_INET, item, &addr) != 1) {
+        fprintf(stderr, "Not an IPv4 address: %s\n", item);
+        n = -1;
+        break;
+      }
+      snprintf(endpoints[n].address, sizeof(endpoints[n].address), "%s", item);
+      item = colon + 1;
+    }
+
+    endpoints[n].port = strtol(item, &end, 10);
+    if (*end != '\0' || endpoints[n].port <= 0 || endpoints[n].port > 65535) {
+      fprintf(stderr, "Not a port number: %s\n", item);
+      n = -1;
+      break;
+    }
+    endpoints[n].numa_node = endpoint_numa_node(endpoints[n].address);
+    n++;
+  }
+  free(copy);
+
+  return n;
+}
+
+/**
+ * NUMA node of the network interface with the given address, from sysfs
+ *
+ * @param {char *} address IPv4 address of the interface
+ * @returns {int} NUMA node, -1 when unknown, e.g. for all interfaces or a virtual device
+ */
+int endpoint_numa_node(const char *address) {
+  struct ifaddrs *ifaddrs, *ifa;
+  struct in_addr addr;
+  char path[256];
+  FILE *file;
+  int node = -1;
+
+  if (!*address || inet_pton(AF_INET, address, &addr) != 1 || getifaddrs(&ifaddrs)) {
+    return -1;
+  }
+
+  for (ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET &&
+        ((struct sockaddr_in *) ifa->ifa_addr)->sin_addr.s_addr == addr.s_addr) {
+      snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", ifa->ifa_name);
+      file = fopen(path, "r");
+      if (file) {
+        if (fscanf(file, "%i", &node) != 1) {
+          node = -1;
+        }
+        fclose(file);
+      }
+      break;
+    }
+  }
+  freeifaddrs(ifaddrs);
+
+  return node;
+}
+
+/**
+ * Pin the calling thread to the CPUs of a NUMA node
+ *
+ * @param {int} numa_node Node, see endpoint_numa_node
+ * @returns {int} 0 on success, -1 on error
+ */
+int endpoint_pin(int numa_node) {
+  char path[256];
+  char cpulist[1024];
+  char *range, *save, *end;
+  cpu_set_t cpus;
+  FILE *file;
+  long first, last, cpu;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%i/cpulist", numa_node);
+  file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  if (!fgets(cpulist, sizeof(cpulist), file)) {
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+
+  // e.g. 0-7,16-23
+  CPU_ZERO(&cpus);
+  for (range = strtok_r(cpulist, ",\n", &save); range; range = strtok_r(NULL, ",\n", &save)) {
+    first = strtol(range, &end, 10);
+    last = *end == '-' ? strtol(end + 1, NULL, 10) : first;
+    for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+  if (CPU_COUNT(&cpus) == 0) {
+    return -1;
+  }
+
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) ? -1 : 0;
+}
@@ -0,0 +1,26 @@
+/**
+ * Network endpoints to receive on, and the CPUs close to their network interface
+ * Author: Jisk Attema
+ *
+ * The data of a beam can arrive over several links. Every endpoint is an (interface address, port) pair,
+ * given as a comma separated list: [address:]port[,[address:]port...], e.g. 10.0.1.2:4000,10.0.2.2:4000
+ * Without an address the port is opened on all interfaces.
+ */
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include <netinet/in.h>
+
+#define ENDPOINT_MAX 8             // Maximum number of endpoints
+
+typedef struct {
+  char address[INET_ADDRSTRLEN];   // IPv4 address of the interface, empty for all interfaces
+  int port;
+  int numa_node;                   // of the network interface, -1 when unknown
+} endpoint_t;
+
+int endpoint_parse(const char *list, endpoint_t *endpoints, int max);
+int endpoint_numa_node(const char *address);
+int endpoint_pin(int numa_node);
+
+#endif
@@ -16,112 +16,409 @@
 #include <getopt.h>
 #include <netinet/in.h>
 #include <byteswap.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
 
-#include "ascii_header.h"
-#include "dada_hdu.h"
-#include "futils.h"
 #include "config.h"
+#include "ringbuffer.h"
+#include "histogram.h"
+#include "log.h"
+#include "pattern.h"
 
 #define NCHANNELS 1536
+#define PAYLOADSIZE_STOKESI 6250         // Size of a Stokes I record: 6250 samples of a channel
+#define PAYLOADSIZE_STOKESIQUV 8000      // Size of an IQUV record: [500 samples][4 channels][IQUV]
+#define FRAMETIME 800000                 // Timestamps per page (batch), in units of 1.28 microseconds
 
-#define UMSBATCH (1000000.0)       // sleep time in microseconds between sending batches
+#define NLANES 8                         // Number of interleaved noise generators, 8 x 64 bit fills an AVX-512 register
+#define MAXTHREADS 64                    // Maximum number of generator threads
 
-FILE *runlog = NULL;
+#define PAGETIME_NS 1024000000L    // real time duration of a page (batch) in nanoseconds
 
 char *science_modes[] = {"I+TAB", "IQUV+TAB", "I+IAB", "IQUV+IAB"};
 
-// #define LOG(...) {fprintf(logio, __VA_ARGS__)}; 
-#define LOG(...) {fprintf(stdout, __VA_ARGS__); fprintf(runlog, __VA_ARGS__); fflush(stdout);}
-
-void generatePulsar(
-    // pulsar properties
-    const float DM,
-    const unsigned int period,      // period of the pulse in number of samples
-    const unsigned int width,       // width of the pules in number of samples
-    const int random,               // if true, randomize peak height and noise level
-
-    // signal properties
-    const float minFreq,
-    const float maxFreq,
-    const float bandwidth,
-    const int ntabs,                 // size of the tab dimension of the data array
-    const int nchannels,             // size of the channel dimension of data array
-    const int nsamples,              // the number of samples per channel in a batch (ie. time dimension)
-    const unsigned int paddedSize,   // actual size of the time dimension of data array, ie nsamples + padding
-    const unsigned int batch,        // batch number
-    unsigned char *data              // Byte array of size [ntabs][nchannels][paddedSize]
-) {
-
-  unsigned int channel;
-  unsigned int sample;
-  unsigned int internalSample;
-
-  // Set random number generator seed
-  srand(batch + 42);
- 
-  // Set background signal, either constant or random (ie. approximation of white noise
-  int tab;
-  for (tab = 0; tab < ntabs; tab++) {
-    for (channel = 0; channel < nchannels; channel++) {
-      for (sample = 0; sample < nsamples; sample++) {
-        data[tab * nchannels * paddedSize + channel * paddedSize + sample] = random ? rand() % 25 : 8;
+/*
+ * Generator settings and per page job, shared by the generator threads
+ */
+typedef struct {
+  // pulsar properties
+  float DM;                      // dispersion measure in pc/cm^3
+  unsigned int period;           // period of the pulse in number of samples
+  unsigned int width;            // width of the pulse in number of samples
+  int random;                    // if true, randomize peak height and add noise
+  int pattern;                   // if true, write the test pattern instead, see pattern.h
+  int pulse_tab;                 // the tab containing the pulsar
+
+  // signal properties
+  float minFreq;                 // frequency of the first channel in MHz
+  float bandwidth;               // channel width in MHz
+  int iquv;                      // 0: Stokes I, 1: Stokes IQUV
+  int ntabs;                     // size of the tab dimension of the data array
+  int nchannels;                 // size of the channel dimension of data array
+  int nsamples;                  // the number of samples per channel in a batch (ie. time dimension)
+  unsigned int paddedSize;       // actual size of the time dimension for Stokes I, ie nsamples + padding
+  int *delay;                    // per channel dispersion delay in samples
+
+  // current job
+  unsigned int batch;            // batch number
+  unsigned char *data;           // page to fill
+} generator_t;
+
+/*
+ * Generator thread
+ */
+typedef struct {
+  int id;
+  int nthreads;
+  pthread_t thread;
+  generator_t *generator;
+} worker_t;
+
+pthread_barrier_t batch_start;   // released when there is a new page to fill
+pthread_barrier_t batch_done;    // released when all threads finished the page
+volatile int generator_stop = 0;
+
+/**
+ * splitmix64, used to seed the noise generator per row, and for the pulse heights
+ */
+static inline uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15UL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Fill nbytes of data with noise
+ *
+ * NLANES independent xorshift64 generators are advanced in lock step, so the compiler turns the
+ * inner loop into SIMD instructions. Every output byte is the sum of the two nibbles of a random
+ * byte: a triangular distribution on [0, 30] with mean 15, a cheap approximation of white noise.
+ * The generators are seeded from (seed, lane), making the noise independent of the thread layout.
+ */
+void generateNoise(uint64_t seed, unsigned char *data, size_t nbytes) {
+  uint64_t state[NLANES];
+  uint64_t out[NLANES];
+  size_t i, n;
+  int l;
+
+  for (l = 0; l < NLANES; l++) {
+    state[l] = splitmix64(&seed) | 1; // xorshift state must be non-zero
+  }
+
+  for (i = 0; i < nbytes; i += sizeof(out)) {
+    for (l = 0; l < NLANES; l++) {
+      uint64_t x = state[l];
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      state[l] = x;
+      out[l] = (x & 0x0F0F0F0F0F0F0F0FUL) + ((x >> 4) & 0x0F0F0F0F0F0F0F0FUL);
+    }
+
+    n = nbytes - i < sizeof(out) ? nbytes - i : sizeof(out);
+    memcpy(&data[i], out, n);
+  }
+}
+
+/**
+ * Offset of a sample in the page
+ *
+ * Stokes I:    [tab][channel][paddedSize]
+ * Stokes IQUV: [tab][channel/4][sequence][500 samples][4 channels][IQUV], stokes selects the component
+ */
+static inline size_t sampleOffset(generator_t *g, int tab, int channel, unsigned int sample, int stokes) {
+  if (g->iquv) {
+    return ((size_t) (tab * g->nchannels + (channel & ~3)) * g->nsamples * 4) +
+           (sample / 500) * PAYLOADSIZE_STOKESIQUV + (sample % 500) * 16 + (channel & 3) * 4 + stokes;
+  } else {
+    return ((size_t) tab * g->nchannels + channel) * g->paddedSize + sample;
+  }
+}
+
+/**
+ * Write the dispersed pulses of one channel that fall (partly) in this batch
+ *
+ * Pulses are placed on the absolute sample number, and their random height depends on the pulse number,
+ * so a pulse that crosses the end of a batch continues at the start of the next one.
+ */
+void generatePulses(generator_t *g, int tab, int channel) {
+  const long first = (long) g->batch * g->nsamples;      // first absolute sample in this batch
+  const long last = first + g->nsamples;                  // first absolute sample of the next batch
+  const long delay = g->delay[channel];
+  long pulse, sample;
+  uint64_t state;
+  unsigned char value;
+
+  // pulse k covers [k * period + delay, k * period + delay + width)
+  long firstPulse = (first - delay - (long) g->width) / (long) g->period;
+  long lastPulse = (last - delay) / (long) g->period;
+  if (firstPulse < 0) {
+    firstPulse = 0;
+  }
+
+  for (pulse = firstPulse; pulse <= lastPulse; pulse++) {
+    state = ((uint64_t) pulse << 32) ^ ((uint64_t) tab << 16) ^ channel;
+    value = g->random ? 30 + (splitmix64(&state) % 98) : 42;
+
+    for (sample = pulse * g->period + delay; sample < pulse * g->period + delay + g->width; sample++) {
+      if (sample < first || sample >= last) {
+        continue;
+      }
+      g->data[sampleOffset(g, tab, channel, sample - first, 0)] = value;
+      if (g->iquv) {
+        // linearly polarized: half of the intensity in Q
+        g->data[sampleOffset(g, tab, channel, sample - first, 1)] = value / 2;
       }
     }
   }
+}
 
-  // Generate the pulsar
-  float inverseHighFreq = 1.0f / (maxFreq * maxFreq);
-  float kDM = 4148.808f * DM;
-
-  for (channel = 0; channel < nchannels; channel++) {
-    float inverseFreq = 1.0f / ((minFreq + channel * bandwidth) * (minFreq + channel * bandwidth));
-    float delta = kDM * (inverseFreq - inverseHighFreq);
-
-    // Find the first pulse in this batch: first N batches contain floor(N x samples per batch / pulse period) pulses
-    int firstPulse = ((batch * nsamples) / period) + 1;
-    int lastPulse = ((batch+1) * nsamples / period);
-  
-    // Loop over the pulses in this batch
-    int pulse;
-    for (pulse = firstPulse; pulse <= lastPulse; pulse++) {
-      // fill in a pulse of specified width in tab 3
-      unsigned int i;
-      for (i = 0; i < width; i++) {
-        sample = pulse * period + delta; // TODO: check math for delta
-
-        if (sample + i >= (batch + 1)*nsamples) {
-          // dont write outside this batch
-          // NOTE: the part of the pulse that overlaps with the next batch is dropped, and lost completely.
-          //       It is *not* inserted at the beginning of the next batch
-          break;
-        } else {
-          // Write a pulse in tab 3
-          internalSample = (sample + i) % nsamples;
-          data[3 * nchannels * paddedSize + channel * paddedSize + internalSample] = random? rand() % 128 : 42;
-        }
+/**
+ * Write the test pattern of a row, as if it was sent with send -x verify: per packet of the row,
+ * with the batch number times FRAMETIME as timestamp
+ */
+void generatePattern(generator_t *g, int tab, int channel, unsigned char *data) {
+  const size_t packetSize = g->iquv ? PAYLOADSIZE_STOKESIQUV : PAYLOADSIZE_STOKESI;
+  const int sequenceLength = g->iquv ? g->nsamples / 500 : g->nsamples / PAYLOADSIZE_STOKESI;
+  uint8_t first, step;
+  int sequence;
+
+  for (sequence = 0; sequence < sequenceLength; sequence++) {
+    pattern_key(tab, channel, sequence, (uint64_t) g->batch * FRAMETIME, &first, &step);
+    pattern_fill(&data[sequence * packetSize], packetSize, first, step);
+  }
+}
+
+/**
+ * Fill a range of rows of the page; a row is a tab and channel (Stokes I),
+ * or a tab and group of 4 channels (Stokes IQUV)
+ */
+void generateRows(generator_t *g, int firstRow, int lastRow) {
+  const int channelsPerRow = g->iquv ? 4 : 1;
+  const int rowsPerTab = g->nchannels / channelsPerRow;
+  const size_t rowSize = g->iquv ? (size_t) g->nsamples * 16 : g->paddedSize;
+  int row, c;
+
+  for (row = firstRow; row < lastRow; row++) {
+    int tab = row / rowsPerTab;
+    int channel = (row % rowsPerTab) * channelsPerRow;
+    unsigned char *data = &g->data[row * rowSize];
+    uint64_t rng = ((uint64_t) g->batch << 32) ^ ((uint64_t) tab << 16) ^ channel;
+
+    if (g->pattern) {
+      generatePattern(g, tab, channel, data);
+      if (!g->iquv && g->paddedSize > g->nsamples) {
+        memset(&data[g->nsamples], 0, g->paddedSize - g->nsamples);
+      }
+      continue;
+    }
+
+    // Set background signal, either constant or random (ie. approximation of white noise)
+    if (g->random) {
+      generateNoise(rng, data, g->iquv ? rowSize : g->nsamples);
+    } else {
+      memset(data, 8, g->iquv ? rowSize : g->nsamples);
+    }
+
+    // keep the padding clean
+    if (!g->iquv && g->paddedSize > g->nsamples) {
+      memset(&data[g->nsamples], 0, g->paddedSize - g->nsamples);
+    }
+
+    // Generate the pulsar
+    if (tab == g->pulse_tab) {
+      for (c = channel; c < channel + channelsPerRow; c++) {
+        generatePulses(g, tab, c);
       }
     }
   }
 }
 
+/**
+ * Generator thread: fill its share of the rows for every page
+ */
+void *generatorThread(void *arg) {
+  worker_t *worker = (worker_t *) arg;
+  generator_t *g = worker->generator;
+  int nrows = g->ntabs * g->nchannels / (g->iquv ? 4 : 1);
+
+  while (1) {
+    pthread_barrier_wait(&batch_start);
+    if (generator_stop) {
+      break;
+    }
+
+    generateRows(g, nrows * worker->id / worker->nthreads, nrows * (worker->id + 1) / worker->nthreads);
+
+    pthread_barrier_wait(&batch_done);
+  }
+
+  return NULL;
+}
+
+/**
+ * Fill a page with noise and a dispersed pulsar, using all generator threads
+ *
+ * @param {generator_t *} g Generator settings
+ * @param {worker_t *} workers Generator threads, worker 0 is the calling thread
+ * @param {unsigned int} batch Batch (page) number
+ * @param {unsigned char *} data Byte array of size [ntabs][nchannels][paddedSize], or [ntabs][nchannels][nsamples][4] for IQUV
+ */
+void generatePulsar(generator_t *g, worker_t *workers, unsigned int batch, unsigned char *data) {
+  g->batch = batch;
+  g->data = data;
+
+  pthread_barrier_wait(&batch_start);
+  generateRows(g, 0, g->ntabs * g->nchannels / (g->iquv ? 4 : 1) / workers[0].nthreads);
+  pthread_barrier_wait(&batch_done);
+}
+
+/**
+ * Set up the generator threads, and precompute the dispersion delays
+ */
+worker_t *initGenerator(generator_t *g, int nthreads) {
+  float maxFreq = g->minFreq + (g->nchannels - 1) * g->bandwidth;
+  float inverseHighFreq = 1.0f / (maxFreq * maxFreq);
+  float kDM = 4148.808f * g->DM;                        // dispersion delay in seconds, with frequencies in MHz
+  float samplesPerSecond = g->nsamples / 1.024f;
+  int channel, t;
+
+  g->delay = malloc(g->nchannels * sizeof(int));
+  for (channel = 0; channel < g->nchannels; channel++) {
+    float freq = g->minFreq + channel * g->bandwidth;
+    float inverseFreq = 1.0f / (freq * freq);
+    g->delay[channel] = lroundf(kDM * (inverseFreq - inverseHighFreq) * samplesPerSecond);
+  }
+
+  generator_stop = 0;
+  pthread_barrier_init(&batch_start, NULL, nthreads);
+  pthread_barrier_init(&batch_done, NULL, nthreads);
+
+  worker_t *workers = calloc(nthreads, sizeof(worker_t));
+  for (t = 0; t < nthreads; t++) {
+    workers[t].id = t;
+    workers[t].nthreads = nthreads;
+    workers[t].generator = g;
+    if (t > 0 && pthread_create(&workers[t].thread, NULL, generatorThread, &workers[t])) {
+      LOG_ERR("ERROR: cannot start generator thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return workers;
+}
+
+/**
+ * Stop the generator threads
+ */
+void stopGenerator(generator_t *g, worker_t *workers) {
+  int t;
+
+  generator_stop = 1;
+  pthread_barrier_wait(&batch_start);
+  for (t = 1; t < workers[0].nthreads; t++) {
+    pthread_join(workers[t].thread, NULL);
+  }
+  free(workers);
+  free(g->delay);
+
+  pthread_barrier_destroy(&batch_start);
+  pthread_barrier_destroy(&batch_done);
+}
+
 /**
  * Print commandline optinos
  */
 void printOptions() {
   printf("usage: fill_fake -h <header file> -k <hexadecimal key> -d <duration (s)> -l <logfile>\n");
   printf("e.g. fill_fake -h \"header1.txt\" -k dada -d 60 -l log.txt\n");
+  printf("Optional: -t <generator threads> -D <DM> -P <pulse period (samples)> -W <pulse width (samples)> -T <pulsar tab> -r (add noise)\n");
+  printf("          -p write the test pattern of send -x verify instead of a pulsar, with timestamp batch * %i, see verify\n", FRAMETIME);
+  printf("          -a write pages as fast as the readers allow, instead of one per 1.024s\n");
+  printf("          -q do not generate data, only mark pages filled (with -a: benchmark the readers)\n");
+  printf("          -v <minimum log level: debug, info, notice, warning, error> -F <log format: plain, kv>\n");
   return;
 }
 
 /**
  * Parse commandline
  */
-void parseOptions(int argc, char*argv[], char **header, char **key, int *duration, char **logfile) {
+void parseOptions(int argc, char*argv[], char **header, char **key, int *duration, char **logfile, int *nthreads, generator_t *g, int *fast, int *quiet, int *loglevel, int *logformat) {
   int c;
 
   int seth=0, setk=0, setd=0, setl=0;
-  while((c=getopt(argc,argv,"h:k:d:l:"))!=-1) {
+  while((c=getopt(argc,argv,"h:k:d:l:t:D:P:W:T:rpaqv:F:"))!=-1) {
     switch(c) {
+      // -v minimum log level
+      case('v'):
+        *loglevel = log_parse_level(optarg);
+        if (*loglevel < 0) {
+          fprintf(stderr, "Log level should be one of debug, info, notice, warning, error\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -F log format
+      case('F'):
+        *logformat = log_parse_format(optarg);
+        if (*logformat < 0) {
+          fprintf(stderr, "Log format should be plain or kv\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -a as fast as possible
+      case('a'):
+        *fast = 1;
+        break;
+
+      // -q do not generate data
+      case('q'):
+        *quiet = 1;
+        break;
+
+      // -t number of generator threads
+      case('t'):
+        *nthreads = atoi(optarg);
+        if (*nthreads < 1 || *nthreads > MAXTHREADS) {
+          fprintf(stderr, "Number of threads should be between 1 and %i\n", MAXTHREADS);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -D dispersion measure
+      case('D'):
+        g->DM = atof(optarg);
+        break;
+
+      // -P pulse period in samples
+      case('P'):
+        g->period = atoi(optarg);
+        break;
+
+      // -W pulse width in samples
+      case('W'):
+        g->width = atoi(optarg);
+        break;
+
+      // -T tab containing the pulsar
+      case('T'):
+        g->pulse_tab = atoi(optarg);
+        break;
+
+      // -r randomize: noise and random pulse heights
+      case('r'):
+        g->random = 1;
+        break;
+
+      // -p test pattern
+      case('p'):
+        g->pattern = 1;
+        break;
+
       // -h <heaer_file>
       case('h'):
         *header = strdup(optarg);
@@ -169,89 +466,77 @@ void parseOptions(int argc, char*argv[], char **header, char **key, int *duratio
  * The required_size field is updated with the actual buffer size
  *
  * @param {char *} filename String containing the header file names to read
- * @param {char *} key String containing the shared memeory keys as hexadecimal numbers
+ * @param {char *} key String containing the ringbuffer key, see ringbuffer.h
  * @param {size_t *} required_size Minimum required ring buffer page size
  * @param {int *} science_case read from header, and value stored here
  * @param {int *} science_mode read from header, and value stored here
  * @param {int *} padded_size read from header, and value stored here
- * @returns {hdu *} A connected HDU
+ * @param {float *} min_frequency read from header if present, and value stored here
+ * @param {float *} channel_bandwidth read from header if present, and value stored here
+ * @returns {ringbuffer_t *} A connected ringbuffer
  */
-dada_hdu_t *init_ringbuffer(char *filename, char *key, size_t *required_size, int *science_case, int *science_mode, int *padded_size) {
+ringbuffer_t *init_ringbuffer(char *filename, char *key, size_t *required_size, int *science_case, int *science_mode, int *padded_size, float *min_frequency, float *channel_bandwidth) {
   char *buf;
   int incomplete_header = 0;
   uint64_t bufsz;
-  uint64_t nbufs;
-  dada_hdu_t *hdu;
-
-  key_t shmkey;
-
-  multilog_t* multilog = NULL; // TODO: See if this is used in anyway by dada
-  char writemode='W';     // needs to be a capital
-
-  // create hdu
-  hdu = dada_hdu_create (multilog);
-
-  // init key
-  sscanf(key, "%x", &shmkey);
-  dada_hdu_set_key(hdu, shmkey);
-  LOG("psrdada SHMKEY: %s\n", key);
+  ringbuffer_t *rb;
 
   // connect
-  if (dada_hdu_connect (hdu) < 0) {
-    LOG("ERROR in dada_hdu_connect\n");
+  rb = ringbuffer_open(key, RING_WRITER);
+  if (! rb) {
+    LOG_ERR("ERROR. Cannot connect to ringbuffer %s\n", key);
     exit(EXIT_FAILURE);
   }
+  LOG("Ringbuffer KEY: %s (%s backend%s)\n", key, rb->backend->name, rb->hugepages ? ", huge pages" : "");
 
-  // Make data buffers readable
-  if (dada_hdu_lock_write_spec (hdu, writemode) < 0) {
-    LOG("ERROR in dada_hdu_lock_write_spec\n");
-    exit(EXIT_FAILURE);
-  }
-
-  // get dada buffer size
-  bufsz = ipcbuf_get_bufsz (hdu->header_block);
+  // get header buffer size
+  bufsz = rb->bufsz[RING_HEADER];
 
   // get write address
-  buf = ipcbuf_get_next_write (hdu->header_block);
+  buf = ringbuffer_next_write (rb, RING_HEADER);
   if (! buf) {
-    LOG("ERROR. Get next header block error\n");
+    LOG_ERR("ERROR. Get next header block error\n");
     exit(EXIT_FAILURE);
   }
 
   // read header from file
-  if (fileread (filename, buf, bufsz) < 0) {
-    LOG("ERROR. Cannot read header from %s\n", filename);
+  if (ringbuffer_header_read (filename, buf, bufsz) < 0) {
+    LOG_ERR("ERROR. Cannot read header from %s\n", filename);
     exit(EXIT_FAILURE);
   }
 
   // parse relevant metadata for ourselves
-  if (ascii_header_get(buf, "SCIENCE_CASE", "%i", science_case) == -1) {
-    LOG("ERROR. SCIENCE_CASE not set in dada header\n");
+  if (ringbuffer_header_get(buf, "SCIENCE_CASE", "%i", science_case) == -1) {
+    LOG_ERR("ERROR. SCIENCE_CASE not set in header\n");
     incomplete_header = 1;
   }
-  if (ascii_header_get(buf, "SCIENCE_MODE", "%i", science_mode) == -1) {
-    LOG("ERROR. SCIENCE_MODE not set in dada header\n");
+  if (ringbuffer_header_get(buf, "SCIENCE_MODE", "%i", science_mode) == -1) {
+    LOG_ERR("ERROR. SCIENCE_MODE not set in header\n");
     incomplete_header = 1;
   }
-  if (ascii_header_get(buf, "PADDED_SIZE", "%i", padded_size) == -1) {
-    LOG("ERROR. PADDED_SIZE not set in dada header\n");
+  if (ringbuffer_header_get(buf, "PADDED_SIZE", "%i", padded_size) == -1) {
+    LOG_ERR("ERROR. PADDED_SIZE not set in header\n");
     incomplete_header = 1;
   }
   if (incomplete_header) {
     exit(EXIT_FAILURE);
   }
 
+  // optional, only used for the dispersion of the generated pulsar
+  ringbuffer_header_get(buf, "MIN_FREQUENCY", "%f", min_frequency);
+  ringbuffer_header_get(buf, "CHANNEL_BANDWIDTH", "%f", channel_bandwidth);
+
   // tell the ringbuffer the header is filled
-  if (ipcbuf_mark_filled (hdu->header_block, bufsz) < 0) {
-    LOG("ERROR. Could not mark filled header block\n");
+  if (ringbuffer_mark_filled (rb, RING_HEADER, bufsz) < 0) {
+    LOG_ERR("ERROR. Could not mark filled header block\n");
     exit(EXIT_FAILURE);
   }
-  LOG("psrdada HEADER: %s\n", filename);
+  LOG("Ringbuffer HEADER: %s\n", filename);
 
-  dada_hdu_db_addresses(hdu, &nbufs, &bufsz);
+  bufsz = rb->bufsz[RING_DATA];
 
   if (bufsz < *required_size) {
-    LOG("ERROR. ring buffer data block too small, should be at least %lu\n", *required_size);
+    LOG_ERR("ERROR. ring buffer data block too small, should be at least %lu\n", *required_size);
     exit(EXIT_FAILURE);
   }
 
@@ -260,12 +545,19 @@ dada_hdu_t *init_ringbuffer(char *filename, char *key, size_t *required_size, in
   // If we need to use the actual buffer size to prevent the stream from closing (too small) or reading outside of the array bounds (too big)
   *required_size = bufsz;
 
-  return hdu;
+  return rb;
+}
+
+/**
+ * Nanoseconds between two points in time
+ */
+static inline long elapsed_ns(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
 }
 
 int main(int argc, char** argv) {
   // ringbuffer state
-  dada_hdu_t *hdu;
+  ringbuffer_t *rb;
   char *buf; // pointer to current buffer
 
   // run parameters
@@ -275,32 +567,51 @@ int main(int argc, char** argv) {
   int ntabs;
   int ntimes;
   int padded_size;
+  int nthreads = 1;
+  float min_frequency;
+  float channel_bandwidth;
+  generator_t generator;
+  worker_t *workers;
+  int fast = 0;             // do not pace, write pages as fast as the readers allow
+  int quiet = 0;            // do not generate data
+
+  // timing
+  struct timespec start, deadline, before, after;
+  long blocked;             // time spent waiting for a free page in nanoseconds
+  long overruns = 0;        // pages finished after their deadline
+  histogram_t lag;          // histogram of blocked time
+  char report[4096];
 
   // local vars
   char *header;
   char *key;
   char *logfile;
-  const char mode = 'w';
+  int loglevel = LOG_INFO;
+  int logformat = LOG_PLAIN;
   size_t required_size = 0;
 
   // parse commandline
-  parseOptions(argc, argv, &header, &key, &duration, &logfile);
+  memset(&generator, 0, sizeof(generator_t));
+  generator.DM = 2;
+  generator.period = 2500;
+  generator.width = 5;
+  generator.pulse_tab = -1;
+  parseOptions(argc, argv, &header, &key, &duration, &logfile, &nthreads, &generator, &fast, &quiet, &loglevel, &logformat);
 
   // set up logging
-  if (logfile) {
-    runlog = fopen(logfile, &mode);
-    if (! runlog) {
-      LOG("ERROR opening logfile: %s\n", logfile);
-      exit(EXIT_FAILURE);
-    }
-    LOG("Logging to logfile: %s\n", logfile);
-    free (logfile);
+  if (log_init(logfile, loglevel, logformat)) {
+    fprintf(stderr, "ERROR opening logfile: %s\n", logfile);
+    exit(EXIT_FAILURE);
   }
+  LOG("Logging to logfile: %s\n", logfile);
+  free (logfile);
   LOG("fill_fake version: " VERSION "\n");
 
   // ring buffer
   LOG("Connecting to ringbuffer\n");
-  hdu = init_ringbuffer(header, key, &required_size, &science_case, &science_mode, &padded_size);
+  min_frequency = 1220.0;
+  channel_bandwidth = 300.0 / NCHANNELS;
+  rb = init_ringbuffer(header, key, &required_size, &science_case, &science_mode, &padded_size, &min_frequency, &channel_bandwidth);
 
   free(header); header = NULL;
   free(key); key = NULL;
@@ -317,7 +628,7 @@ int main(int argc, char** argv) {
       case 2: ntabs = 1; break;
       case 3: ntabs = 1; break;
       default:
-        LOG("Science mode not supported");
+        LOG_ERR("Science mode not supported");
         break;
     }
   } else if (science_case == 4) {
@@ -328,75 +639,120 @@ int main(int argc, char** argv) {
       case 2: ntabs = 1; break;
       case 3: ntabs = 1; break;
       default:
-        LOG("Science mode not supported");
+        LOG_ERR("Science mode not supported");
         break;
     }
   } else {
     ntabs = 1;
-    LOG("Science case not supported");
+    LOG_ERR("Science case not supported");
+    goto exit;
+  }
+
+  generator.iquv = science_mode & 1;
+  generator.ntabs = ntabs;
+  generator.nchannels = NCHANNELS;
+  generator.nsamples = ntimes;
+  generator.paddedSize = padded_size;
+  generator.minFreq = min_frequency;
+  generator.bandwidth = channel_bandwidth;
+  if (generator.pulse_tab < 0) {
+    generator.pulse_tab = ntabs > 3 ? 3 : 0;
+  }
+
+  if (!generator.iquv && padded_size < ntimes) {
+    LOG_ERR("ERROR: padded size %i smaller than the number of samples %i\n", padded_size, ntimes);
+    goto exit;
+  }
+  if (required_size < (size_t) ntabs * NCHANNELS * (generator.iquv ? ntimes * 4 : padded_size)) {
+    LOG_ERR("ERROR: ring buffer page too small, should be at least %lu\n", (size_t) ntabs * NCHANNELS * (generator.iquv ? ntimes * 4 : padded_size));
+    goto exit;
+  }
+  if (generator.period == 0 || generator.pulse_tab >= ntabs) {
+    LOG_ERR("ERROR: illegal pulse period or tab\n");
     goto exit;
   }
 
+  if (generator.pattern) {
+    LOG("Generator: %i threads, test pattern\n", nthreads);
+  } else {
+    LOG("Generator: %i threads, DM %f, period %u, width %u, tab %i, noise %i, frequency %f + n * %f MHz\n",
+        nthreads, generator.DM, generator.period, generator.width, generator.pulse_tab, generator.random,
+        generator.minFreq, generator.bandwidth);
+  }
+  workers = initGenerator(&generator, nthreads);
+
   // ============================================================
   // run till end time
   // ============================================================
 
+  // Pages are due at absolute times start + n * 1.024s on the monotonic clock,
+  // so time spent generating or waiting for the readers does not add up
+  histogram_clear(&lag);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  deadline = start;
+
   int batch;
   for (batch = 0; batch < duration; batch++) {
-    // get a new buffer
-    buf = ipcbuf_get_next_write ((ipcbuf_t *)hdu->data_block);
+    // get a new buffer, and measure how long the readers kept us waiting
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    buf = ringbuffer_next_write (rb, RING_DATA);
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    blocked = elapsed_ns(&before, &after);
+    histogram_add(&lag, blocked);
+
+    // fill it with a pulsar
+    if (!quiet) {
+      generatePulsar(&generator, workers, batch, (unsigned char *) buf);
+    }
 
     if (batch == duration-1) {
-      ipcbuf_enable_eod((ipcbuf_t *)hdu->data_block);
+      ringbuffer_enable_eod(rb, RING_DATA);
     }
 
-    if (ipcbuf_mark_filled ((ipcbuf_t *) hdu->data_block, required_size) < 0) {
-      LOG("ERROR: cannot mark buffer as filled\n");
+    if (ringbuffer_mark_filled (rb, RING_DATA, required_size) < 0) {
+      LOG_ERR("ERROR: cannot mark buffer as filled\n");
       goto exit;
     }
 
-    // slow down sending a bit
-    usleep(UMSBATCH);
-
-    /*
-    // copy to ringbuffer
-    if ((science_mode & 1) == 0) {
-      // ring buffer contains matrix:
-      // [tab][channel][time]
-      // memcpy(
-      //   &buf[((packet->tab_index * NCHANNELS) + curr_channel) * padded_size + packet->sequence_number * expected_payload],
-      //   packet->record, expected_payload);
-      generatePulsar(
-        // pulsar properties
-        2,  // DM
-        50, // period of the pulse in number of samples
-        5,  // width of the pules in number of samples
-        0,  // if true, randomize peak height and noise level
- 
-        // signal properties
-        52.5,          // minFreq
-        7732.5,        // maxFreq
-        5,             // bandwidth
-        ntabs,         // size of the tab dimension of the data array
-        NCHANNELS,     // size of the channel dimension of data array
-        ntimes,        // the number of samples per channel in a batch (ie. time dimension)
-        padded_size,   // actual size of the time dimension of data array, ie nsamples + padding
-        batch,         // batch number
-        (unsigned char *) buf            // Byte array of size [ntabs][nchannels][paddedSize]
-      );
+    LOG("Batch %i: blocked %.3f ms\n", batch, 1e-6 * blocked);
+
+    if (fast) {
+      continue;
+    }
+
+    // wait for the next deadline; when running late, don't try to catch up
+    deadline.tv_nsec += PAGETIME_NS % 1000000000L;
+    deadline.tv_sec += PAGETIME_NS / 1000000000L + deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    if (elapsed_ns(&deadline, &after) > 0) {
+      overruns++;
+      deadline = after;
     } else {
-      // stokes IQUV
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
     }
-    */
+  }
+  clock_gettime(CLOCK_MONOTONIC, &after);
+
+  // report
+  histogram_format(&lag, report, sizeof(report), "Consumer lag (blocked waiting for a free page)");
+  log_printf(LOG_NOTICE, "%s", report);
+  if (fast) {
+    double seconds = 1e-9 * elapsed_ns(&start, &after);
+    log_printf(LOG_NOTICE, "Sustained consumer throughput: %i pages in %.3f s, %.3f pages/s, %.3f GB/s\n",
+        duration, seconds, duration / seconds, 1e-9 * duration * required_size / seconds);
+  } else {
+    log_printf(LOG_NOTICE, "Pages written after their deadline: %li\n", overruns);
   }
 
+  stopGenerator(&generator, workers);
+
   // clean up and exit
 exit:
+  log_close();
   fflush(stdout);
   fflush(stderr);
-  fflush(runlog);
-
-  fclose(runlog);
   exit(EXIT_SUCCESS);
 }
 
@@ -1,5 +1,5 @@
 /**
- * Program to read from the port and write to the ringbuffer 
+ * Program to read from the port and write to the ringbuffer
  * Author: Jisk Attema, based on code by Roy Smits
  *
  */
@@ -18,77 +18,194 @@
 #include <byteswap.h>
 #include <math.h>
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <linux/filter.h>
 
-#include "dada_hdu.h"
-#include "ascii_header.h"
-#include "futils.h"
 #include "config.h"
-
-#define PACKHEADER 114                   // Size of the packet header = PACKETSIZE-PAYLOADSIZE in bytes
-
-#define PACKETSIZE_STOKESI  6364         // Size of the packet, including the header in bytes
-#define PAYLOADSIZE_STOKESI 6250         // Size of the record = packet - header in bytes
-
-#define PACKETSIZE_STOKESIQUV  8114      // Size of the packet, including the header in bytes
-#define PAYLOADSIZE_STOKESIQUV 8000      // Size of the record = packet - header in bytes
-#define PAYLOADSIZE_MAX        8000      // Maximum of payload size of I, IQUV
-
-#define TIMEUNIT 781250           // Conversion factor of timestamp from seconds to (1.28 us) packets
-
-#define MMSG_VLEN  256            // Batch message into single syscal using recvmmsg()
+#include "ringbuffer.h"
+#include "packet.h"
+#include "assemble.h"
+#include "warmup.h"
+#include "metrics.h"
+#include "loss.h"
+#include "histogram.h"
+#include "log.h"
+#include "pagewriter.h"
+#include "control.h"
+#include "pagemeta.h"
+#include "flagmask.h"
+#include "endpoint.h"
+#include "profile.h"
+
+#define MMSG_VLEN  256            // Batch message into single syscal using recvmmsg(), maximum and default
 
 /* We currently use
  *  - one compound beam per instance
  *  - one instance of fill_ringbuffer connected to
- *  - one HDU
+ *  - one ring buffer (psrdada HDU, or native, see ringbuffer.h)
+ *
+ * The page layout is described in assemble.h
  *
- * Send on to ringbuffer a single second of data as a three dimensional array:
- * [tab_index][channel][record] of sizes [0..11][0..1535][0..paddedsize-1] = 18432 * paddedsize for a ringbuffer page
+ * The packets can arrive on several endpoints, see endpoint.h. The main thread receives on the first one,
+ * and decides when to hand over a page. Every other endpoint has a stream thread that copies its packets into the same page,
+ * holding the page lock for reading; the main thread takes it for writing to switch pages.
  *
- * SC3: records per 1.024s 12500
- * SC4: records per 1.024s 25000
+ * In daemon mode (-D) the socket, packet buffer, ring buffer, and page writer are kept over observations,
+ * and observations are queued on a control socket, see control.h.
+ * Every observation is a transfer on the ring buffer: a header page, then data pages till end of data.
  */
 
-#define NCHANNELS 1536
-
-#define SOCKBUFSIZE 67108864      // Buffer size of socket
-
-FILE *runlog = NULL;
+#define SOCKBUFSIZE 67108864      // Default buffer size of socket
+#define NS_PER_PACKET (1000000000UL / TIMEUNIT)  // 1280 ns per unit of the packet timestamp
+#define UDPHEADER 8               // The socket filter sees the UDP header before the packet
+#define DRAIN_INTERVAL_NS 10000000L  // How often the socket is drained while waiting for the start
+#define START_MARGIN_NS 100000000L   // Start parsing packets this long before the wall clock time of the start packet
+#define CONTROL_INTERVAL_NS 100000000L  // How often commands are checked for while idle or waiting, in daemon mode
+#define MAX_GAP_FRAMES 1024       // Longer jumps forward in time are not a gap in the data, but a timestamp reset
+#define RESET_PACKETS 1000        // Consecutive packets far from the current page that make a timestamp reset
+#define STREAM_TIMEOUT_US 20000   // With more endpoints, wait this long for packets on one before looking at the others
+#define FILTER_MAX_RANGES 32      // Channel ranges checked by the socket filter, more are checked in user space only
+#define FILTER_REJECT 0xff        // Jump offset in the socket filter that is replaced by the one to the reject statement
+#define CONTROLLEN (CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct timespec)))  // control messages of a packet
 
 char *science_modes[] = {"I+TAB", "IQUV+TAB", "I+IAB", "IQUV+IAB"};
+char stokes_names[] = "IQUV";
 
-// Due to issues with the FPGAs upstream from us, the packet headers are wrong.
-// Work around it for now by using this table with correct frequencies. (search for FREQISSUE below)
-extern const unsigned short remap_frequency_sc4[1536];
-
-// global state needed for SIGTERM shutdown
-dada_hdu_t *signal_hdu = NULL;
-size_t signal_required_size = 0;
-int signal_sockfd = -1;
+/*
+ * Warm-up of the ring buffer pages, done in a thread while idling till the start packet
+ */
+typedef struct {
+  ringbuffer_t *rb[ASSEMBLE_STOKES];  // the ring buffer, and those of the other Stokes parameters; NULL when not used
+  warmup_t result;
+} ring_warmup_t;
 
 /*
- * Header description based on:
- * ARTS Interface Specification from BF to SC3+4
- * ASTRON_SP_066_InterfaceSpecificationSC34.pdf
- * revision 2.0
+ * Receiving thread of one of the other endpoints
  */
 typedef struct {
-  unsigned char marker_byte;         // See table 3 in PDF, page 6
-  unsigned char format_version;      // Version: 1
-  unsigned char cb_index;            // [0,39] one compound beam per fill_ringbuffer instance:: ignore
-  unsigned char tab_index;           // [0,ntabs-1] all tabs per fill_ringbuffer instance
-  unsigned short channel_index;      // [0,1535] all channels per fill_ringbuffer instance
-  unsigned short payload_size;       // Stokes I: 6250, IQUV: 8000
-  unsigned long timestamp;           // units of 1.28 us, since 1970-01-01 00:00.000 
-  unsigned char sequence_number;     // SC3: Stokes I: 0-1, Stokes IQUV: 0-24
-                                     // SC4: Stokes I: 0-3, Stokes IQUV: 0-49
-  unsigned char reserved[7];
-  unsigned long flags[3];
-  unsigned char record[PAYLOADSIZE_MAX];
-} packet_t;
-
-// #define LOG(...) {fprintf(logio, __VA_ARGS__)}; 
-#define LOG(...) {fprintf(stdout, __VA_ARGS__); fprintf(runlog, __VA_ARGS__); fflush(stdout);}
+  struct receiver *r;
+  endpoint_t endpoint;
+  pthread_t thread;
+  int sockfd;
+  packet_t *packet_buffer;
+  int npackets;                    // packets in the packet buffer
+  int packet_idx;                  // next packet to process
+  struct iovec iov[MMSG_VLEN];
+  struct mmsghdr msgs[MMSG_VLEN];
+  char control[MMSG_VLEN][CONTROLLEN];
+  uint64_t arrival[MMSG_VLEN];
+  uint32_t kernel_drops;
+  unsigned long ahead;             // timestamp of the packet held for a later page, ULONG_MAX when none
+  metrics_counters_t counters;     // added to the totals after every batch
+  uint64_t previous_arrival;
+
+  // the current page, collected by the main thread while it holds the page lock for writing
+  uint64_t *received;              // bitmap of the packets copied, loss.nwords words, see loss_mark_bitmap
+  uint32_t packets;                // copied
+  uint32_t invalid;                // dropped
+  uint64_t last_arrival;
+  histogram_t latency;
+  histogram_t jitter;
+} stream_t;
+
+/*
+ * State kept over observations
+ */
+typedef struct receiver {
+  // network
+  int sockfd;                      // socket file descriptor, of the first endpoint
+  int vlen;                        // packets per recvmmsg call
+  int kernel_filter;               // drop invalid packets in the kernel
+  packet_t *packet_buffer;         // Buffer for batch requesting packets via recvmmsg
+  int npackets;                    // Packets in the packet buffer
+  int packet_idx;                  // Next packet to process in the packet buffer, npackets when all are processed
+  struct iovec iov[MMSG_VLEN];     // IO vec structure for recvmmsg
+  struct mmsghdr msgs[MMSG_VLEN];  // multimessage hearders for recvmmsg
+  char control[MMSG_VLEN][CONTROLLEN];  // control messages, for the kernel drop counter and arrival time
+  uint64_t arrival[MMSG_VLEN];     // kernel receive time of the packets in the buffer, ns since the unix epoch
+  uint32_t kernel_drops;           // kernel drop counter of the socket
+  unsigned char cb_index;          // compound beam of the last packet
+  packet_t *held;                  // consecutive packets far from the current page, replayed after a timestamp reset
+  int nheld;                       // packets to replay
+  int held_idx;                    // next packet to replay, nheld when all are replayed
+
+  // ring buffer
+  char key[CONTROL_KEY];
+  ringbuffer_t *rb;
+  char *header;                    // header page of the next transfer
+  int in_transfer;                 // the header page was handed over, but the end of data not yet
+  pagewriter_t writer;             // hands pages to the ring buffer
+  int have_writer;
+  int overload;                    // what to do when the ring buffer is full
+  int spill_pages;                 // size of the spill pool
+  int warm;                        // prefault and lock buffers before the start packet
+  int warming;                     // the ring buffer warm-up thread is running
+  pthread_t warmup_thread;
+  ring_warmup_t ring_warmup;
+  struct timespec idle_end;        // end of the wait for the start packet
+  char *metafile;                  // page metadata sidecar
+  pagemeta_t meta;
+  char *flagsfile;                 // flag mask sidecar
+  flagmask_t flags;
+
+  // Stokes IQUV split over a ring buffer per Stokes parameter: I goes to the ring buffer above, Q, U, and V to these
+  int split_stokes;                // requested
+  int split;                       // the current transfer is split
+  char *stokes_keys[ASSEMBLE_STOKES];  // NULL for a parameter that is dropped
+  ringbuffer_t *stokes_rb[ASSEMBLE_STOKES];
+  pagewriter_t stokes_writer[ASSEMBLE_STOKES];
+  int have_stokes_writer[ASSEMBLE_STOKES];
+  char *pages[ASSEMBLE_STOKES];    // current page per Stokes parameter, NULL when dropped
+
+  // observation
+  assembler_t assembler;           // packet layout, validation and copy to the page
+  int freqissue_workaround;        // Do we need to work around the FREQISSUE bug?
+  int time_major;                  // Stokes I pages as [tab][padded_size][nchannels]
+  char *tabs;                      // selected tabs, e.g. "0,3-5", or NULL for all
+  char *channels;                  // selected channel ranges, e.g. "0-767", or NULL for all
+  transposer_t transposer;         // tiles for the time-major pages
+  int have_transposer;
+  unsigned long startpacket;       // Packet number to start (in units of TIMEUNIT since unix epoch)
+  unsigned long endpacket;         // Packet number to stop (excluded) (in units of TIMEUNIT since unix epoch)
+  char *lossfile;                  // binary loss summary
+  loss_t loss;                     // packets received per slot of the current page
+  int have_loss;
+
+  // metrics
+  metrics_t metrics;               // totals, exported
+  metrics_counters_t counters;     // counted by the receive loop, added to the totals every page
+  struct timespec busy_start;      // for the time spent receiving, processing, and blocked
+  histogram_t latency;             // network latency of the packets in the page: arrival - end of their data
+  histogram_t jitter;              // time between arrivals of consecutive packets in the page
+  histogram_t publication;         // last packet of a page to handing it to the ring buffer, over the run
+  uint64_t previous_arrival;       // of the previous packet, for the jitter
+  int profiling;                   // requested
+  profile_t profile;               // cycles per stage of the receive loop, of this thread only, see profile.h
+
+  // other endpoints, copying to the same page
+  int nstreams;
+  stream_t *streams;
+  int stop_streams;
+  pthread_rwlock_t page_lock;      // read locked by the streams while copying, write locked by the main thread to switch pages
+  pthread_mutex_t page_mutex;      // for streams waiting for the next page
+  pthread_cond_t page_changed;
+  uint64_t page_generation;        // bumped on every switch
+  char *page;                      // current page, NULL when not observing or while switching pages
+  uint8_t *page_mask;              // flag mask of the current page, NULL without flag masks
+  unsigned long page_time;         // timestamp of the current page
+  unsigned long keep_from;         // without a page, packets from this timestamp on are kept for the next page
+} receiver_t;
+
+// global state needed for a shutdown on a fatal error
+receiver_t *signal_receiver = NULL;
+control_t *signal_control = NULL;
+
+// set by SIGTERM, the receive loop then ends the observation and exits
+volatile sig_atomic_t shutdown_requested = 0;
 
 /**
  * Print commandline optinos
@@ -96,19 +213,168 @@ typedef struct {
 void printOptions() {
   printf("usage: fill_ringbuffer -h <header file> -k <hexadecimal key> -c <science case> -m <science mode> -s <start packet number> -d <duration (s)> -p <port> -l <logfile>\n");
   printf("e.g. fill_ringbuffer -h \"header1.txt\" -k 10 -s 11565158400000 -c 3 -m 0 -d 3600 -p 4000 -l log.txt\n");
+  printf("The key is a hexadecimal psrdada key, or 'shm:<name>' for a native ring buffer created with ring_db\n");
   printf("\n\nA workaround for the incorrect frequencies in the packets headers for science case 4, stokesI, can be enabled with '-f'\n");
+  printf("Time-major Stokes I pages [tab][time][channel] instead of [tab][channel][time] with '-T', the header gets 'ORDER TF'\n");
+  printf("Split Stokes IQUV: -K <Q key>,<U key>,<V key>, the -k ring buffer gets Stokes I and these the others; '-' drops one, e.g. -K -,-,shm:v\n");
+  printf("Selection: -t <tabs, e.g. 0,3-5> -C <channel ranges, e.g. 0-767,1024-1279>, the pages only hold those, the header is updated\n");
+  printf("Endpoints: -p <[address:]port[,[address:]port...]>, e.g. -p 10.0.1.2:4000,10.0.2.2:4000 receives on two interfaces into the same pages\n");
+  printf("Daemon mode: -D <control socket>, observations are queued on the control socket; -h, -k, -s, and -d are optional and give the first observation\n");
+  printf("Tuning: -b <packets per recvmmsg call, max %i> -B <socket receive buffer size in bytes>\n", MMSG_VLEN);
+  printf("Buffers are prefaulted and locked in memory before the start packet, disable with -w\n");
+  printf("Invalid packets are dropped by a socket filter in the kernel, disable with -X\n");
+  printf("When the ring buffer is full: -O block (default), skip (the page), or spill:<pages> (to a pool of pages, skip when that is full too)\n");
+  printf("Metrics: -M <Prometheus text file> -U <UNIX socket to serve them on>\n");
+  printf("Loss per tab, channel group and sequence number: -S <binary summary file>\n");
+  printf("Page metadata: -P <sidecar file, e.g. /dev/shm/ring.meta> with a record per page: timestamp, packets received, flags\n");
+  printf("Flag masks: -G <sidecar file, e.g. /dev/shm/ring.flags> with the beamformer flags of every page\n");
+  printf("Logging: -v <minimum level: debug, info, notice, warning, error> -F <format: plain, kv>\n");
+  printf("Profiling: -Q logs the cycles per packet of every stage of the receive loop, and hardware counters, per page (built with ENABLE_PROFILE)\n");
   return;
 }
 
+/**
+ * Parse the keys of the ring buffers for Stokes Q, U, and V: a comma separated list, with '-' for a parameter to drop
+ *
+ * @param {char *} list The list, missing keys at the end are dropped too
+ * @param {char **} keys Set for Q, U, and V: keys[1] to keys[3]
+ * @returns {int} 0 on success, -1 for more than 3 keys
+ */
+int parse_stokes_keys(const char *list, char **keys) {
+  char *copy = strdup(list);
+  char *key, *save;
+  int k = 1;
+
+  for (key = strtok_r(copy, ",", &save); key; key = strtok_r(NULL, ",", &save)) {
+    if (k == ASSEMBLE_STOKES) {
+      free(copy);
+      return -1;
+    }
+    keys[k++] = strcmp(key, "-") ? strdup(key) : NULL;
+  }
+  free(copy);
+  return 0;
+}
+
 /**
  * Parse commandline
  */
-void parseOptions(int argc, char*argv[], char **header, char **key, unsigned long *startpacket, float *duration, int *port, char **logfile, int *freqissue_workaround) {
+void parseOptions(int argc, char*argv[], char **header, char **key, unsigned long *startpacket, float *duration, char **endpoints, char **logfile, int *freqissue_workaround, int *time_major, int *split_stokes, char **stokes_keys, char **tabs, char **channels, int *vlen, int *sockbufsize, int *warm, int *kernel_filter, int *overload, int *spill_pages, char **metricsfile, char **metricssocket, char **lossfile, char **metafile, char **flagsfile, int *loglevel, int *logformat, char **controlsocket, int *profiling) {
   int c;
 
   int seth=0, setk=0, sets=0, setd=0, setp=0, setl=0;
-  while((c=getopt(argc,argv,"h:k:s:d:p:l:f"))!=-1) {
+  while((c=getopt(argc,argv,"h:k:s:d:p:l:fTK:t:C:b:B:wXO:M:U:S:P:G:v:F:D:Q"))!=-1) {
     switch(c) {
+      // -b packets per recvmmsg call
+      case('b'):
+        *vlen = atoi(optarg);
+        if (*vlen < 1 || *vlen > MMSG_VLEN) {
+          fprintf(stderr, "Packets per call should be between 1 and %i\n", MMSG_VLEN);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -B socket buffer size
+      case('B'):
+        *sockbufsize = atoi(optarg);
+        break;
+
+      // -D control socket, daemon mode
+      case('D'):
+        *controlsocket = strdup(optarg);
+        break;
+
+      // -M metrics text file
+      case('M'):
+        *metricsfile = strdup(optarg);
+        break;
+
+      // -U metrics UNIX socket
+      case('U'):
+        *metricssocket = strdup(optarg);
+        break;
+
+      // -S loss summary file
+      case('S'):
+        *lossfile = strdup(optarg);
+        break;
+
+      // -P page metadata sidecar
+      case('P'):
+        *metafile = strdup(optarg);
+        break;
+
+      // -G flag mask sidecar
+      case('G'):
+        *flagsfile = strdup(optarg);
+        break;
+
+      // -Q profile the receive loop
+      case('Q'):
+        *profiling = 1;
+        break;
+
+      // -v minimum log level
+      case('v'):
+        *loglevel = log_parse_level(optarg);
+        if (*loglevel < 0) {
+          fprintf(stderr, "Log level should be one of debug, info, notice, warning, error\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -F log format
+      case('F'):
+        *logformat = log_parse_format(optarg);
+        if (*logformat < 0) {
+          fprintf(stderr, "Log format should be plain or kv\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -w no warm-up
+      case('w'):
+        *warm = 0;
+        break;
+
+      // -O overload policy
+      case('O'):
+        *overload = pagewriter_parse(optarg, spill_pages);
+        if (*overload < 0) {
+          fprintf(stderr, "Overload policy should be block, skip, or spill:<pages>\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -X no socket filter
+      case('X'):
+        *kernel_filter = 0;
+        break;
+
+      // -T time-major Stokes I pages
+      case('T'):
+        *time_major = 1;
+        break;
+
+      // -K rings for Stokes Q, U, and V
+      case('K'):
+        *split_stokes = 1;
+        if (parse_stokes_keys(optarg, stokes_keys)) {
+          fprintf(stderr, "Split Stokes IQUV: give at most 3 keys, for Q, U, and V\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -t selected tabs
+      case('t'):
+        *tabs = strdup(optarg);
+        break;
+
+      // -C selected channel ranges
+      case('C'):
+        *channels = strdup(optarg);
+        break;
+
       // -f work around for the FREQISSUE
       case('f'):
         *freqissue_workaround = 1;
@@ -129,7 +395,7 @@ void parseOptions(int argc, char*argv[], char **header, char **key, unsigned lon
       // -s start packet number
       case('s'):
         *startpacket = atol(optarg);
-        sets=1; 
+        sets=1;
         break;
 
       // -d duration in seconds
@@ -138,9 +404,9 @@ void parseOptions(int argc, char*argv[], char **header, char **key, unsigned lon
         setd=1;
         break;
 
-      // -p port number
+      // -p port number, or list of endpoints
       case('p'):
-        *port=atoi(optarg);
+        *endpoints = strdup(optarg);
         setp=1;
         break;
 
@@ -156,8 +422,8 @@ void parseOptions(int argc, char*argv[], char **header, char **key, unsigned lon
     }
   }
 
-  // All arguments are required
-  if (!seth || !setk || !sets || !setd || !setp || !setl) {
+  // All arguments are required, except in daemon mode where the observation is optional
+  if (!setp || !setl || (seth + setk + sets + setd < 4 && (!*controlsocket || seth + setk + sets + setd > 0))) {
     if (!seth) fprintf(stderr, "DADA header not set\n");
     if (!setk) fprintf(stderr, "DADA key not set\n");
     if (!sets) fprintf(stderr, "Start packet not set\n");
@@ -171,21 +437,24 @@ void parseOptions(int argc, char*argv[], char **header, char **key, unsigned lon
 /**
  * Open a socket to read from a network port
  *
- * @param {int} port Network port to connect to
+ * @param {endpoint_t *} endpoint Interface address and network port to connect to
+ * @param {int} sockbufsize Requested socket receive buffer size in bytes
+ * @param {int} timeout_us Receive timeout in microseconds, 0 to block
  * @returns {int} socket file descriptor
  */
-int init_network(int port) {
+int init_network(const endpoint_t *endpoint, int sockbufsize, int timeout_us) {
   int sock;
   struct addrinfo hints, *servinfo, *p;
   char service[256];
+  int one = 1;
 
   memset(&hints, 0, sizeof hints);
   hints.ai_family = AF_INET; // set to AF_INET to force IPv4
   hints.ai_socktype = SOCK_DGRAM;
   hints.ai_flags = AI_PASSIVE; // use my IP
 
-  snprintf(service, 255, "%i", port);
-  if (getaddrinfo(NULL, service, &hints, &servinfo) != 0) {
+  snprintf(service, 255, "%i", endpoint->port);
+  if (getaddrinfo(endpoint->address[0] ? endpoint->address : NULL, service, &hints, &servinfo) != 0) {
     perror(NULL);
     exit(EXIT_FAILURE);
   }
@@ -198,9 +467,20 @@ int init_network(int port) {
     }
 
     // set socket buffer size
-    int sockbufsize = SOCKBUFSIZE;
     setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &sockbufsize, (socklen_t)sizeof(int));
 
+    // report the number of packets dropped by the kernel with every message
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &one, (socklen_t)sizeof(int));
+
+    // and the time the packet arrived, for the latency histograms
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, (socklen_t)sizeof(int));
+
+    // with more endpoints, do not wait for one that is silent
+    if (timeout_us) {
+      struct timeval timeout = {timeout_us / 1000000, timeout_us % 1000000};
+      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, (socklen_t)sizeof(timeout));
+    }
+
     if(bind(sock, p->ai_addr, p->ai_addrlen) == -1) {
       perror(NULL);
       close(sock);
@@ -222,529 +502,1989 @@ int init_network(int port) {
 }
 
 /**
- * Open a connection to the ringbuffer
- * The metadata (header block) is read from file
- * The miminum_size field is updated with the actual buffer size
+ * Attach a classic BPF filter to the socket, to drop packets with the wrong size, marker byte, version, or beam in the kernel
+ * and packets outside the selected tabs and channels. Replaces a previously attached filter.
  *
- * @param {dada_hdu_t **} hdu pointer to a pointer of HDU
- * @param {char *} header String containing the header file name to read
- * @param {char *} key String containing the shared memeory keys as hexadecimal numbers
- * @param {size_t *} minimum_size Minimum required ring buffer page size
- * @param {int *} science_case read from the header file, and stored here
- * @param {int *} science_mode read from the header file, and stored here
- * @param {int *} padded_size read from the header file, and stored here
- * @returns {hdu *} A connected HDU
- */
-dada_hdu_t *init_ringbuffer(char *header, char *key, size_t *minimum_size, int *science_case, int *science_mode, int *padded_size) {
-  char *buf;
-  uint64_t bufsz;
-  uint64_t nbufs;
-  dada_hdu_t *hdu;
-  int header_incomplete = 0;
-
-  key_t shmkey;
-
-  multilog_t* multilog = NULL; // TODO: See if this is used in anyway by dada
-  char writemode='W';     // needs to be a capital
-
-  // create hdu
-  hdu = dada_hdu_create (multilog);
-
-  // init key
-  sscanf(key, "%x", &shmkey);
-  dada_hdu_set_key(hdu, shmkey);
-  LOG("psrdada SHMKEY: %s\n", key);
+ * @param {int} sockfd Socket
+ * @param {assembler_t *} assembler Expected packet layout
+ * @param {int} cb_index Compound beam to accept, or -1 for any beam
+ * @returns {int} 0 on success, -1 on error
+ */
+int attach_filter(int sockfd, const assembler_t *assembler, int cb_index) {
+  struct sock_filter code[16 + 6 + 2 * FILTER_MAX_RANGES];
+  struct sock_fprog program;
+  int first[FILTER_MAX_RANGES], last[FILTER_MAX_RANGES];
+  uint32_t tabs = 0;
+  int nranges = 0;
+  int n = 0, i, c;
+
+  // checks load a value and jump to the reject statement when it is not the expected one, the jump offsets are filled in below
+#define CHECK(load, offset, value) \
+  code[n++] = (struct sock_filter) BPF_STMT(load, offset); \
+  code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, 0, FILTER_REJECT);
+
+  CHECK(BPF_LD | BPF_W | BPF_LEN, 0, UDPHEADER + PACKHEADER + assembler->expected_payload);
+  CHECK(BPF_LD | BPF_B | BPF_ABS, UDPHEADER + offsetof(packet_t, marker_byte), assembler->expected_marker_byte);
+  CHECK(BPF_LD | BPF_B | BPF_ABS, UDPHEADER + offsetof(packet_t, format_version), 1);
+  CHECK(BPF_LD | BPF_H | BPF_ABS, UDPHEADER + offsetof(packet_t, payload_size), assembler->expected_payload); // loads in network order
+  if (cb_index >= 0) {
+    CHECK(BPF_LD | BPF_B | BPF_ABS, UDPHEADER + offsetof(packet_t, cb_index), cb_index);
+  }
+#undef CHECK
 
-  // connect
-  if (dada_hdu_connect (hdu) < 0) {
-    LOG("ERROR in dada_hdu_connect\n");
-    exit(EXIT_FAILURE);
+  // selected tabs: bit tab_index of the tab bitmap must be set
+  if (assembler->ntabs < assembler->beam_tabs) {
+    for (i = 0; i < assembler->beam_tabs; i++) {
+      tabs |= (assembler->tab_slot[i] >= 0) << i;
+    }
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, UDPHEADER + offsetof(packet_t, tab_index));
+    code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, assembler->beam_tabs, FILTER_REJECT, 0);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_MISC | BPF_TAX, 0);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_IMM, tabs);
+    code[n++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_RSH | BPF_X, 0);
+    code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 1, 0, FILTER_REJECT);
   }
 
-  // Make data buffers readable
-  if (dada_hdu_lock_write_spec (hdu, writemode) < 0) {
-    LOG("ERROR in dada_hdu_lock_write_spec\n");
-    exit(EXIT_FAILURE);
+  // selected channels: the channel index must be in one of the ranges; too many ranges are left to user space
+  if (assembler->nchannels < NCHANNELS) {
+    for (c = 0; c < NCHANNELS; c++) {
+      if (assembler->channel_slot[c] < 0) {
+        continue;
+      }
+      if (c > 0 && assembler->channel_slot[c - 1] >= 0) {
+        last[nranges - 1] = c;
+        continue;
+      }
+      if (nranges == FILTER_MAX_RANGES) {
+        nranges++;
+        break;
+      }
+      first[nranges] = c;
+      last[nranges] = c;
+      nranges++;
+    }
+    if (nranges <= FILTER_MAX_RANGES) {
+      code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, UDPHEADER + offsetof(packet_t, channel_index));
+      for (i = 0; i < nranges; i++) {
+        // below the range: try the next one, above it: try the next one, in it: skip the other ranges
+        code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, first[i], 0, i == nranges - 1 ? FILTER_REJECT : 1);
+        code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, last[i], i == nranges - 1 ? FILTER_REJECT : 0, 2 * (nranges - 1 - i));
+      }
+    }
   }
 
-  // get dada buffer size
-  bufsz = ipcbuf_get_bufsz (hdu->header_block);
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF); // accept the whole packet
+  code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);          // reject
 
-  // get write address
-  buf = ipcbuf_get_next_write (hdu->header_block);
-  if (! buf) {
-    LOG("ERROR. Get next header block error\n");
-    exit(EXIT_FAILURE);
+  for (i = 0; i < n - 2; i++) {
+    if (BPF_CLASS(code[i].code) == BPF_JMP) {
+      if (code[i].jt == FILTER_REJECT) {
+        code[i].jt = n - 1 - (i + 1);
+      }
+      if (code[i].jf == FILTER_REJECT) {
+        code[i].jf = n - 1 - (i + 1);
+      }
+    }
   }
 
-  // read header from file
-  if (fileread (header, buf, bufsz) < 0) { 
-    LOG("ERROR. Cannot read header from %s\n", header);
-    header_incomplete = 1;
-    exit(EXIT_FAILURE);
-  }
+  program.len = n;
+  program.filter = code;
+  return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program));
+}
 
-  if (ascii_header_get(buf, "SCIENCE_CASE", "%i", science_case) == -1) {
-    LOG("ERROR. SCIENCE_CASE not set in header\n");
-    header_incomplete = 1;
-  }
-  if (ascii_header_get(buf, "SCIENCE_MODE", "%i", science_mode) == -1) {
-    LOG("ERROR. SCIENCE_CASE not set in header\n");
-    header_incomplete = 1;
-  }
-  if (ascii_header_get(buf, "PADDED_SIZE", "%i", padded_size) == -1) {
-    LOG("ERROR. PADDED_SIZE not set in header\n");
-    header_incomplete = 1;
-  }
+/**
+ * Wall clock time in nanoseconds since the unix epoch
+ */
+static inline long realtime_ns() {
+  struct timespec now;
 
-  LOG("psrdada HEADER: %s\n", header);
-  if (header_incomplete) {
-    exit(EXIT_FAILURE);
-  }
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
 
-  // tell the ringbuffer the header is filled
-  if (ipcbuf_mark_filled (hdu->header_block, bufsz) < 0) {
-    LOG("ERROR. Could not mark filled header block\n");
-    exit(EXIT_FAILURE);
+/**
+ * Sleep till a wall clock time, regularly draining the socket
+ * Only the packet headers are read, to keep track of the compound beam.
+ * Stops early when a packet of the frame before the start packet arrives, in case the packet timestamps run ahead of our clock.
+ *
+ * @param {int} sockfd Socket
+ * @param {packet_t *} packet_buffer Buffer for vlen packet headers
+ * @param {int} vlen Packets per recvmmsg call
+ * @param {long} wake_ns Wall clock time to sleep till, in ns since the unix epoch
+ * @param {unsigned long} startpacket Start packet number, or ULONG_MAX when not waiting for a start
+ * @param {unsigned char *} cb_index Compound beam of the last packet, updated
+ * @param {unsigned long *} drained Number of packets drained, increased
+ * @returns {int} 1 when stopped early, 0 otherwise
+ */
+int drain_until(int sockfd, packet_t *packet_buffer, int vlen, long wake_ns, unsigned long startpacket, unsigned char *cb_index, unsigned long *drained) {
+  struct iovec iov[MMSG_VLEN];
+  struct mmsghdr msgs[MMSG_VLEN];
+  struct timespec next;
+  long now_ns, next_ns;
+  unsigned long timestamp;
+  int close_to_start = 0;   // a packet of the frame before the start packet arrived
+  int lost = 0;             // packets at or after the start packet, drained before we noticed
+  int i, n;
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < vlen; i++) {
+    iov[i].iov_base = (char *) &packet_buffer[i];
+    iov[i].iov_len = PACKHEADER; // the rest of the packet is discarded by the kernel
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
   }
 
-  dada_hdu_db_addresses(hdu, &nbufs, &bufsz);
+  now_ns = realtime_ns();
+  while (now_ns < wake_ns && !shutdown_requested) {
+    next_ns = now_ns + DRAIN_INTERVAL_NS < wake_ns ? now_ns + DRAIN_INTERVAL_NS : wake_ns;
+    next.tv_sec = next_ns / 1000000000L;
+    next.tv_nsec = next_ns % 1000000000L;
+    clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL);
+
+    while ((n = recvmmsg(sockfd, msgs, vlen, MSG_DONTWAIT, NULL)) > 0) {
+      *drained += n;
+      for (i = 0; i < n; i++) {
+        *cb_index = packet_buffer[i].cb_index;
+        timestamp = bswap_64(packet_buffer[i].timestamp);
+        if (startpacket != ULONG_MAX && timestamp + FRAMETIME >= startpacket) {
+          close_to_start = 1;
+        }
+        if (timestamp >= startpacket) {
+          lost++;
+        }
+      }
+      if (close_to_start) {
+        if (lost) {
+          LOG_WARN("WARNING: Drained %i packets at or after the start packet\n", lost);
+        }
+        return 1;
+      }
+    }
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && !shutdown_requested) {
+      LOG_ERR("ERROR Could not drain socket\n");
+      return 0;
+    }
 
-  if (bufsz < *minimum_size) {
-    LOG("ERROR. ring buffer data block too small, should be at least %lui\n", *minimum_size);
-    exit(EXIT_FAILURE);
+    now_ns = realtime_ns();
   }
 
-  // set the required size to the actual size
-  // this is needed when marking a page full.
-  // If we need to use the actual buffer size to prevent the stream from closing (too small) or reading outside of the array bounds (too big)
-  *minimum_size = bufsz;
-
-  return hdu;
+  return 0;
 }
 
 /**
- * Try to cleanly shut down, and singal end-of-data on the ring buffer, if possible
+ * Prefault, lock, and ask huge pages for all data pages of the ring buffer, and of the Stokes ring buffers
  */
-void clean_exit(int signum) {
-  if (signum == SIGTERM) {
-    LOG("Received SIGTERM, shutting down");
+void *warmup_ringbuffer(void *arg) {
+  ring_warmup_t *warmup = arg;
+  ringbuffer_t *rb;
+  sigset_t all;
+  uint64_t i;
+  int k;
+
+  // leave signals to the main thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  warmup_clear(&warmup->result);
+  for (k = 0; k < ASSEMBLE_STOKES; k++) {
+    rb = warmup->rb[k];
+    for (i = 0; rb && i < rb->nbufs[RING_DATA]; i++) {
+      warmup_region(&warmup->result, ringbuffer_page(rb, RING_DATA, i), rb->bufsz[RING_DATA]);
+    }
   }
+  return NULL;
+}
 
-  if (signal_hdu) {
-    ipcbuf_enable_eod((ipcbuf_t *)signal_hdu->data_block);
-    ipcbuf_mark_filled ((ipcbuf_t *)signal_hdu->data_block, signal_required_size);
+/**
+ * Wait for the ring buffer warm-up, and log the result
+ */
+void join_warmup(receiver_t *r) {
+  struct timespec joined;
+  char message[256];
+  double delay;
+  int status;
+
+  if (!r->warming) {
+    return;
   }
 
-  // clean up and exit
-  fflush(stdout);
-  fflush(stderr);
-  fflush(runlog);
+  pthread_join(r->warmup_thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &joined);
+  r->warming = 0;
 
-  close(signal_sockfd);
-  fclose(runlog);
+  status = warmup_describe(&r->ring_warmup.result, "ring buffer", message, sizeof(message));
+  log_printf(status ? LOG_WARNING : LOG_INFO, "%s", message);
 
-  if (signum == SIGTERM) {
-    exit(EXIT_SUCCESS);
+  delay = joined.tv_sec - r->idle_end.tv_sec + 1e-9 * (joined.tv_nsec - r->idle_end.tv_nsec);
+  if (delay > 1e-3) {
+    LOG_WARN("WARNING: Warm-up not finished at the start packet, it delayed the start by %.3f s\n", delay);
   }
-
-  exit(EXIT_FAILURE);
 }
 
-int main(int argc, char** argv) {
-  // network state
-  int port;                 // port number
-  int sockfd = -1;          // socket file descriptor
-
-  // ringbuffer state
-  dada_hdu_t *hdu;
-  char *buf; // pointer to current buffer
-
-  // run parameters
-  float duration;          // run time in seconds
-  int science_case;        // 3 or 4
-  int science_mode;        // 0: I+TAB, 1: IQUV+TAB, 2: I+IAB, 3: IQUV+IAB
-  float missing_pct;       // Number of packets missed in percentage of expected number
-  int missing;             // Number of packets missed
-  unsigned long startpacket;           // Packet number to start (in units of TIMEUNIT since unix epoch)
-  unsigned long endpacket;             // Packet number to stop (excluded) (in units of TIMEUNIT since unix epoch)
-  int padded_size;
-  int freqissue_workaround = 0; // Do we need to work around the FREQISSUE bug?
-
-  // local vars
-  char *header;
-  char *key;
-  char *logfile;
-  const char mode = 'w';
-  size_t required_size = 0;
-  int ntabs = 0;
-  float done_pct;
-  int sequence_length; // number of packages belonging to a sequence
-
-  packet_t packet_buffer[MMSG_VLEN];   // Buffer for batch requesting packets via recvmmsg
-  unsigned int packet_idx;             // Current packet index in MMSG buffer
-  struct iovec iov[MMSG_VLEN];         // IO vec structure for recvmmsg
-  struct mmsghdr msgs[MMSG_VLEN];      // multimessage hearders for recvmmsg
-
-  packet_t *packet;                 // Pointer to current packet
-  unsigned char cb_index = 255;     // Current compound beam index (fixed per run)
-  unsigned short curr_channel;      // Current channel index
-  unsigned long curr_packet = 0;    // Current packet number (is number of packets after unix epoch)
-  unsigned long sequence_time;      // Timestamp for current sequnce
-  unsigned long packets_in_buffer;  // number of records processed per time segment
+/**
+ * Open a connection to the ringbuffer, and start warming it up
+ *
+ * @param {receiver_t *} r Receiver
+ * @param {char *} key String containing the ringbuffer key, see ringbuffer.h
+ * @returns {int} 0 on success, -1 on error
+ */
+int open_ringbuffer(receiver_t *r, const char *key) {
+  int k;
 
-  // parse commandline
-  if (argc == 1) {
-    printOptions();
-    exit(EXIT_FAILURE);
+  LOG("Connecting to ringbuffer\n");
+  r->rb = ringbuffer_open(key, RING_WRITER);
+  if (! r->rb) {
+    LOG_ERR("ERROR. Cannot connect to ringbuffer %s\n", key);
+    return -1;
   }
-  parseOptions(argc, argv, &header, &key, &startpacket, &duration, &port, &logfile, &freqissue_workaround);
+  LOG("Ringbuffer KEY: %s (%s backend%s)\n", key, r->rb->backend->name, r->rb->hugepages ? ", huge pages" : "");
+  snprintf(r->key, sizeof(r->key), "%s", key);
 
-  // set up logging
-  if (logfile) {
-    runlog = fopen(logfile, &mode);
-    if (! runlog) {
-      LOG("ERROR opening logfile: %s\n", logfile);
-      exit(EXIT_FAILURE);
+  // the ring buffers of the other Stokes parameters
+  for (k = 1; k < ASSEMBLE_STOKES; k++) {
+    if (!r->stokes_keys[k]) {
+      continue;
     }
-    LOG("Logging to logfile: %s\n", logfile);
-    free (logfile);
+    r->stokes_rb[k] = ringbuffer_open(r->stokes_keys[k], RING_WRITER);
+    if (! r->stokes_rb[k]) {
+      LOG_ERR("ERROR. Cannot connect to ringbuffer %s\n", r->stokes_keys[k]);
+      return -1;
+    }
+    LOG("Ringbuffer KEY for Stokes %c: %s (%s backend%s)\n", stokes_names[k], r->stokes_keys[k], r->stokes_rb[k]->backend->name,
+        r->stokes_rb[k]->hugepages ? ", huge pages" : "");
   }
-  LOG("fill ringbuffer version: " VERSION "\n");
-
-  // ring buffer
-  LOG("Connecting to ringbuffer\n");
-  hdu = init_ringbuffer(header, key, &required_size, &science_case, &science_mode, &padded_size); // sets required_size to actual size
-
-  free(header); header = NULL;
-  free(key); key = NULL;
-
-  // calculate run length
-  endpacket = startpacket + lroundf(duration * TIMEUNIT);
-  LOG("Science case = %i\n", science_case);
-  LOG("Science mode = %i [ %s ]\n", science_mode, science_modes[science_mode]);
-  LOG("Start time (unix time) = %lu\n", startpacket / TIMEUNIT);
-  LOG("End time (unix time) = %lu\n", endpacket / TIMEUNIT);
-  LOG("Duration (s) = %f\n", duration);
-  LOG("Start packet = %lu\n", startpacket);
-  LOG("End packet = %lu\n", endpacket);
-
-  unsigned char expected_marker_byte = 0;
-  int packets_per_sample = 0;
-  unsigned short expected_payload = 0;
-  if (science_case == 3) {
-    switch (science_mode) {
-      case 0:
-        expected_marker_byte = 0xD0; // I with TAB
-        ntabs = 12;
-        sequence_length = 2;
-        packets_per_sample = ntabs * NCHANNELS * 12500 * 1 / 6250;
-        expected_payload = PAYLOADSIZE_STOKESI;
-        required_size = ntabs * NCHANNELS * padded_size;
-        break;
-
-      case 1:
-        expected_marker_byte = 0xD1; // IQUV with TAB
-        ntabs = 12;
-        sequence_length = 25;
-        packets_per_sample = ntabs * NCHANNELS * 12500 * 4 / 8000;
-        expected_payload = PAYLOADSIZE_STOKESIQUV;
-        required_size = ntabs * NCHANNELS * 12500 * 4;
-        break;
-
-      case 2:
-        expected_marker_byte = 0xD2; // I with IAB
-        ntabs = 1;
-        sequence_length = 2;
-        packets_per_sample = ntabs * NCHANNELS * 12500 * 1 / 6250;
-        expected_payload = PAYLOADSIZE_STOKESI;
-        required_size = ntabs * NCHANNELS * padded_size;
-        break;
-
-      case 3:
-        expected_marker_byte = 0xD3; // IQUV with IAB
-        ntabs = 1;
-        sequence_length = 25;
-        packets_per_sample = ntabs * NCHANNELS * 12500 * 4 / 8000;
-        expected_payload = PAYLOADSIZE_STOKESIQUV;
-        required_size = ntabs * NCHANNELS * 12500 * 4;
-        break;
 
-      default:
-        fprintf(stderr, "Illegal science mode: '%i'\n", science_mode);
-        exit(EXIT_FAILURE);
-        break;
+  // page metadata, with room for all pages of the ring buffer
+  if (r->metafile) {
+    if (pagemeta_create(&r->meta, r->metafile, 2 * r->rb->nbufs[RING_DATA])) {
+      LOG_ERR("ERROR. Cannot create page metadata file %s\n", r->metafile);
+      return -1;
     }
-  } else if (science_case == 4) {
-    switch (science_mode) {
-      case 0:
-        expected_marker_byte = 0xE0; // I with TAB
-        ntabs = 12;
-        sequence_length = 4;
-        packets_per_sample = ntabs * NCHANNELS * 25000 * 1 / 6250;
-        expected_payload = PAYLOADSIZE_STOKESI;
-        required_size = ntabs * NCHANNELS * padded_size;
-        break;
-
-      case 1:
-        expected_marker_byte = 0xE1; // IQUV with TAB
-        ntabs = 12;
-        sequence_length = 50;
-        packets_per_sample = ntabs * NCHANNELS * 25000 * 4 / 8000;
-        expected_payload = PAYLOADSIZE_STOKESIQUV;
-        required_size = ntabs * NCHANNELS * 25000 * 4;
-        break;
-
-      case 2:
-        expected_marker_byte = 0xE2; // I with IAB
-        ntabs = 1;
-        sequence_length = 4;
-        packets_per_sample = ntabs * NCHANNELS * 25000 * 1 / 6250;
-        expected_payload = PAYLOADSIZE_STOKESI;
-        required_size = ntabs * NCHANNELS * padded_size;
-        break;
+    LOG("Page metadata file: %s\n", r->metafile);
+  }
 
-      case 3:
-        expected_marker_byte = 0xE3; // IQUV with IAB
-        ntabs = 1;
-        sequence_length = 50;
-        packets_per_sample = ntabs * NCHANNELS * 25000 * 4 / 8000;
-        expected_payload = PAYLOADSIZE_STOKESIQUV;
-        required_size = ntabs * NCHANNELS * 25000 * 4;
-        break;
+  r->header = malloc(r->rb->bufsz[RING_HEADER]);
+  if (! r->header) {
+    LOG_ERR("ERROR. Cannot allocate header page\n");
+    return -1;
+  }
 
-      default:
-        fprintf(stderr, "Illegal science mode: '%i'\n", science_mode);
-        exit(EXIT_FAILURE);
-        break;
+  // warm up the ring buffer in the background while idling
+  if (r->warm) {
+    r->ring_warmup.rb[0] = r->rb;
+    for (k = 1; k < ASSEMBLE_STOKES; k++) {
+      r->ring_warmup.rb[k] = r->stokes_rb[k];
+    }
+    if (pthread_create(&r->warmup_thread, NULL, warmup_ringbuffer, &r->ring_warmup)) {
+      LOG_WARN("WARNING: Cannot start warm-up thread\n");
+    } else {
+      r->warming = 1;
     }
-  } else {
-    LOG("Science case not supported");
-    exit(EXIT_FAILURE);
   }
 
-  LOG("Expected marker byte= 0x%X\n", expected_marker_byte);
-  LOG("Expected payload = %i B\n", expected_payload);
-  LOG("Packets per sample = %i\n", packets_per_sample);
+  return 0;
+}
 
-  // sockets
-  LOG("Opening network port %i\n", port);
-  sockfd = init_network(port);
+/**
+ * Take the page lock for writing, waiting for the streams to finish copying their current batch
+ */
+static inline void lock_streams(receiver_t *r) {
+  if (r->nstreams) {
+    pthread_rwlock_wrlock(&r->page_lock);
+  }
+}
 
-  // multi message setup
-  memset(msgs, 0, sizeof(msgs));
-  for(packet_idx=0; packet_idx < MMSG_VLEN; packet_idx++) {
-    iov[packet_idx].iov_base = (char *) &packet_buffer[packet_idx];
-    iov[packet_idx].iov_len = expected_payload + PACKHEADER;
+static inline void unlock_streams(receiver_t *r) {
+  if (r->nstreams) {
+    pthread_rwlock_unlock(&r->page_lock);
+  }
+}
 
-    msgs[packet_idx].msg_hdr.msg_name    = NULL; // we don't need to know who sent the data
-    msgs[packet_idx].msg_hdr.msg_iov     = &iov[packet_idx];
-    msgs[packet_idx].msg_hdr.msg_iovlen  = 1;
-    msgs[packet_idx].msg_hdr.msg_control = NULL; // we're not interested in OoB data
+/**
+ * Switch the page the streams copy to, and wake the ones waiting for it; call while holding the page lock for writing
+ *
+ * @param {receiver_t *} r Receiver
+ * @param {char *} page The new page, NULL when not observing
+ * @param {uint8_t *} mask Flag mask of the new page, or NULL
+ * @param {unsigned long} page_time Timestamp of the new page
+ * @param {unsigned long} keep_from While not observing, keep packets from this timestamp on for the next page; ULONG_MAX to drop all
+ */
+void share_page(receiver_t *r, char *page, uint8_t *mask, unsigned long page_time, unsigned long keep_from) {
+  if (!r->nstreams) {
+    return;
   }
 
-  // clear packet counters
-  packets_in_buffer = 0;
+  r->page = page;
+  r->page_mask = mask;
+  r->page_time = page_time;
+  r->keep_from = keep_from;
 
-  // start at the end of the packet buffer, so the main loop starts with a recvmmsg call
-  packet_idx = MMSG_VLEN - 1;
-  packet = &packet_buffer[packet_idx];
+  pthread_mutex_lock(&r->page_mutex);
+  r->page_generation++;
+  pthread_cond_broadcast(&r->page_changed);
+  pthread_mutex_unlock(&r->page_mutex);
+}
 
-  //  get a new buffer
-  buf = ipcbuf_get_next_write ((ipcbuf_t *)hdu->data_block);
-  packets_in_buffer = 0;
-  sequence_time = curr_packet;
+/**
+ * Get the next page to fill, and those of the other Stokes parameters when split
+ *
+ * @returns {char *} The page, of Stokes I when split
+ */
+char *next_page(receiver_t *r) {
+  int k;
 
-  // ============================================================
-  // idle till start time, but keep track of which bands there are
-  // ============================================================
- 
-  curr_packet = 0;
-  packet_idx = MMSG_VLEN - 1;
-  while (curr_packet < startpacket) {
-    // go to next packet in the packet buffer
-    packet_idx++;
+  r->pages[0] = pagewriter_next(&r->writer);
+  for (k = 1; r->split && k < ASSEMBLE_STOKES; k++) {
+    r->pages[k] = r->have_stokes_writer[k] ? pagewriter_next(&r->stokes_writer[k]) : NULL;
+  }
+  return r->pages[0];
+}
 
-    // did we reach the end of the packet buffer?
-    if (packet_idx == MMSG_VLEN) {
-      // read new packets from the network into the buffer
-      if(recvmmsg(sockfd, msgs, MMSG_VLEN, 0, NULL) != MMSG_VLEN) {
-        LOG("ERROR Could not read packets\n");
-        clean_exit(0);
-      }
-      // go to start of buffer
-      packet_idx = 0;
+/**
+ * Hand over the current page, and those of the other Stokes parameters when split
+ *
+ * @param {int} eod Set End-Of-Data after the page
+ * @returns {int} 0 on success, -1 on error
+ */
+int filled_page(receiver_t *r, int eod) {
+  int status;
+  int k;
+
+  status = pagewriter_filled(&r->writer, eod);
+  for (k = 1; r->split && k < ASSEMBLE_STOKES; k++) {
+    if (r->have_stokes_writer[k] && pagewriter_filled(&r->stokes_writer[k], eod) < 0) {
+      status = -1;
     }
-    packet = &packet_buffer[packet_idx];
+  }
+  return status < 0 ? -1 : 0;
+}
 
-    // keep track of compound beams
-    cb_index = packet->cb_index;
+/**
+ * Hand over the end of data of the current transfer, if any
+ * An observation that ends before its start packet gets an empty page, so the readers still see a complete transfer.
+ */
+void end_transfer(receiver_t *r) {
+  int k;
 
-    // keep track of timestamps
-    curr_packet = bswap_64(packet->timestamp);
+  if (!r->in_transfer) {
+    return;
+  }
 
-    if (curr_packet != sequence_time) {
-      printf( "Current packet is %li\n", curr_packet);
-      sequence_time = curr_packet;
+  if (r->writer.target != PAGE_NONE) {
+    filled_page(r, 1);
+  } else {
+    pagewriter_empty(&r->writer);
+    for (k = 1; r->split && k < ASSEMBLE_STOKES; k++) {
+      if (r->have_stokes_writer[k]) {
+        pagewriter_empty(&r->stokes_writer[k]);
+      }
     }
   }
+  r->in_transfer = 0;
+}
 
-  // process the first (already-read) package by moving the packet_idx one back
-  // this to compensate for the packet_idx++ statement in the first pass of the mainloop
-  packet_idx--;
-
-  // Try to do a clean exit on SIGTERM
-  signal_hdu = hdu;
-  signal_sockfd = sockfd;
-  signal_required_size = required_size;
-  signal(SIGTERM, clean_exit);
-
-  LOG("STARTING WITH CB_INDEX=%i\n", cb_index);
-
-  // ============================================================
-  // run till end time
-  // ============================================================
+/**
+ * End the current transfer, wait for the page writer, and disconnect from the ring buffer
+ */
+void close_ringbuffer(receiver_t *r) {
+  int k;
 
-  while (1) { // loop is terminated by break statement below
-    // go to next packet in the packet buffer
-    packet_idx++;
+  end_transfer(r);
 
-    // did we reach the end of the packet buffer?
-    if (packet_idx == MMSG_VLEN) {
-      // read new packets from the network into the buffer
-      if(recvmmsg(sockfd, msgs, MMSG_VLEN, 0, NULL) != MMSG_VLEN) {
-        LOG("ERROR Could not read packets\n");
-        clean_exit(0);
-      }
-      // go to start of buffer
-      packet_idx = 0;
+  if (r->have_writer) {
+    pagewriter_close(&r->writer);
+    r->have_writer = 0;
+  }
+  for (k = 1; k < ASSEMBLE_STOKES; k++) {
+    if (r->have_stokes_writer[k]) {
+      pagewriter_close(&r->stokes_writer[k]);
+      r->have_stokes_writer[k] = 0;
     }
-    packet = &packet_buffer[packet_idx];
+  }
 
-    // check marker byte
-    if (packet->marker_byte != expected_marker_byte) {
-      LOG("ERROR: wrong marker byte: %x instead of %x\n", packet->marker_byte, expected_marker_byte);
-      clean_exit(0);
-    }
+  if (r->warming) {
+    pthread_join(r->warmup_thread, NULL);
+    r->warming = 0;
+  }
 
-    // check version
-    if (packet->format_version != 1) {
-      LOG("ERROR: wrong format version: %d instead of %d\n", packet->format_version, 1);
-      clean_exit(0);
+  pagemeta_close(&r->meta);
+  flagmask_close(&r->flags);
+  free(r->header);
+  r->header = NULL;
+  ringbuffer_close(r->rb);
+  r->rb = NULL;
+  for (k = 1; k < ASSEMBLE_STOKES; k++) {
+    if (r->stokes_rb[k]) {
+      ringbuffer_close(r->stokes_rb[k]);
+      r->stokes_rb[k] = NULL;
     }
+  }
+}
 
-    // check compound beam index 
-    if (packet->cb_index != cb_index) {
-      LOG("ERROR: unexpected compound beam index %d\n", packet->cb_index);
-      clean_exit(0);
-    }
+/**
+ * Describe the selected tabs and channels in the header, when not all of them are selected
+ * Sets NTABS and NCHANNELS, TABS and CHANNELS as lists of indices and ranges, and moves MIN_FREQUENCY to the first selected channel.
+ *
+ * @param {receiver_t *} r Receiver, with the header and the assembler set up
+ * @param {uint64_t} bufsz Size of the header page
+ * @returns {int} 0 on success, -1 when the header page is too small
+ */
+int update_selection(receiver_t *r, uint64_t bufsz) {
+  const assembler_t *assembler = &r->assembler;
+  char tabs[64];
+  char channels[8192];
+  float min_frequency, channel_bandwidth;
+  int first;
+  int status = 0;
+
+  if (!assemble_selection(assembler, tabs, sizeof(tabs), channels, sizeof(channels))) {
+    return 0;
+  }
 
-    // check tab index 
-    if (packet->tab_index >= ntabs) {
-      LOG("ERROR: unexpected tab index %d\n", packet->tab_index);
-      clean_exit(0);
-    }
+  status |= ringbuffer_header_set(r->header, bufsz, "NTABS", "%i", assembler->ntabs);
+  status |= ringbuffer_header_set(r->header, bufsz, "TABS", "%s", tabs);
+  status |= ringbuffer_header_set(r->header, bufsz, "NCHANNELS", "%i", assembler->nchannels);
+  status |= ringbuffer_header_set(r->header, bufsz, "CHANNELS", "%s", channels);
+  if (ringbuffer_header_get(r->header, "MIN_FREQUENCY", "%f", &min_frequency) == 1 &&
+      ringbuffer_header_get(r->header, "CHANNEL_BANDWIDTH", "%f", &channel_bandwidth) == 1) {
+    for (first = 0; assembler->channel_slot[first] < 0; first++);
+    status |= ringbuffer_header_set(r->header, bufsz, "MIN_FREQUENCY", "%f", min_frequency + first * channel_bandwidth);
+  }
+  if (status) {
+    LOG_ERR("ERROR. Header page too small\n");
+    return -1;
+  }
 
-    // check channel
-    curr_channel = bswap_16(packet->channel_index);
-    if (curr_channel >= NCHANNELS) {
-      LOG("ERROR: unexpected channel index %d\n", curr_channel);
-      clean_exit(0);
-    }
+  LOG("Selection: tabs %s, channels %s (%i tabs, %i channels)\n", tabs, channels, assembler->ntabs, assembler->nchannels);
+  return 0;
+}
 
-    // check payload size
-    if (packet->payload_size != bswap_16(expected_payload)) {
-      LOG("Warning: unexpected payload size %d\n", bswap_16(packet->payload_size));
-      clean_exit(0);
-    }
+/**
+ * Set up the next observation: connect to its ring buffer if needed, read the header, and hand it over
+ * The metadata (header block) is read from file.
+ *
+ * @param {receiver_t *} r Receiver
+ * @param {observation_t *} obs The observation
+ * @returns {int} 0 on success, -1 on error
+ */
+int setup_observation(receiver_t *r, const observation_t *obs) {
+  char *buf;
+  char message[256];
+  uint64_t bufsz;
+  int science_case;        // 3 or 4
+  int science_mode;        // 0: I+TAB, 1: IQUV+TAB, 2: I+IAB, 3: IQUV+IAB
+  int padded_size;
+  size_t required_size;
+  int header_incomplete = 0;
+  int status, i;
+
+  // a different ring buffer, disconnect from the current one
+  if (r->rb && strcmp(r->key, obs->key)) {
+    close_ringbuffer(r);
+  }
+  if (!r->rb && open_ringbuffer(r, obs->key)) {
+    return -1;
+  }
+
+  // read header from file
+  bufsz = r->rb->bufsz[RING_HEADER];
+  if (ringbuffer_header_read (obs->header, r->header, bufsz) < 0) {
+    LOG_ERR("ERROR. Cannot read header from %s\n", obs->header);
+    return -1;
+  }
+
+  if (ringbuffer_header_get(r->header, "SCIENCE_CASE", "%i", &science_case) == -1) {
+    LOG_ERR("ERROR. SCIENCE_CASE not set in header\n");
+    header_incomplete = 1;
+  }
+  if (ringbuffer_header_get(r->header, "SCIENCE_MODE", "%i", &science_mode) == -1) {
+    LOG_ERR("ERROR. SCIENCE_CASE not set in header\n");
+    header_incomplete = 1;
+  }
+  if (ringbuffer_header_get(r->header, "PADDED_SIZE", "%i", &padded_size) == -1) {
+    LOG_ERR("ERROR. PADDED_SIZE not set in header\n");
+    header_incomplete = 1;
+  }
+
+  LOG("Ringbuffer HEADER: %s\n", obs->header);
+  if (header_incomplete) {
+    return -1;
+  }
+
+  // calculate run length
+  r->startpacket = obs->startpacket;
+  r->endpacket = obs->startpacket + lroundf(obs->duration * TIMEUNIT);
+  LOG("Science case = %i\n", science_case);
+  LOG("Science mode = %i [ %s ]\n", science_mode, science_mode >= 0 && science_mode < 4 ? science_modes[science_mode] : "unknown");
+  LOG("Start time (unix time) = %lu\n", r->startpacket / TIMEUNIT);
+  LOG("End time (unix time) = %lu\n", r->endpacket / TIMEUNIT);
+  LOG("Duration (s) = %f\n", obs->duration);
+  LOG("Start packet = %lu\n", r->startpacket);
+  LOG("End packet = %lu\n", r->endpacket);
+
+  if (assemble_init(&r->assembler, science_case, science_mode, padded_size)) {
+    if (science_case == 3 || science_case == 4) {
+      LOG_ERR("Illegal science mode: '%i'\n", science_mode);
+    } else {
+      LOG_ERR("Science case not supported");
+    }
+    return -1;
+  }
+  r->assembler.freqissue_workaround = r->freqissue_workaround;
+
+  // only the selected tabs and channels go to the page
+  if (assemble_select(&r->assembler, r->tabs, r->channels)) {
+    LOG_ERR("ERROR. Invalid selection of tabs '%s' or channels '%s'%s\n", r->tabs ? r->tabs : "all", r->channels ? r->channels : "all",
+        (science_mode & 1) ? ", Stokes IQUV channels are selected in groups of 4" : r->freqissue_workaround ? ", cannot select channels with the FREQISSUE workaround" : "");
+    return -1;
+  }
+  if (update_selection(r, bufsz)) {
+    return -1;
+  }
+
+  // Stokes IQUV split over the ring buffers of the Stokes parameters, every page a quarter of the size
+  r->split = 0;
+  if (r->split_stokes) {
+    if (assemble_split_stokes(&r->assembler, 1)) {
+      LOG_WARN("WARNING: Only Stokes IQUV is split, the ring buffers of Q, U, and V get no data\n");
+    } else if (ringbuffer_header_set(r->header, bufsz, "STOKES", "I")) {
+      LOG_ERR("ERROR. Header page too small\n");
+      return -1;
+    } else {
+      r->split = 1;
+      LOG("Page layout: Stokes IQUV split, Stokes I to %s\n", r->key);
+    }
+  }
+  required_size = r->assembler.required_size;
+
+  // time-major Stokes I pages, transposed through the tiles
+  if (r->have_transposer) {
+    transpose_close(&r->transposer);
+    r->have_transposer = 0;
+  }
+  if (r->time_major) {
+    if (science_mode & 1) {
+      LOG_WARN("WARNING: Time-major pages are only supported for Stokes I, keeping the Stokes IQUV layout\n");
+    } else {
+      if (transpose_init(&r->transposer, r->assembler.ntabs, r->assembler.nchannels, r->assembler.sequence_length, padded_size)) {
+        LOG_ERR("ERROR. Cannot allocate tiles for the time-major pages\n");
+        return -1;
+      }
+      r->have_transposer = 1;
+      r->assembler.transposer = &r->transposer;
+      if (ringbuffer_header_set(r->header, bufsz, "ORDER", "TF")) {
+        LOG_ERR("ERROR. Header page too small\n");
+        return -1;
+      }
+      LOG("Page layout: time-major [tab][time][channel]\n");
+    }
+  }
+
+  if (r->rb->bufsz[RING_DATA] < required_size) {
+    LOG_ERR("ERROR. ring buffer data block too small, should be at least %lu\n", required_size);
+    return -1;
+  }
+  for (i = 1; r->split && i < ASSEMBLE_STOKES; i++) {
+    if (r->stokes_rb[i] && r->stokes_rb[i]->bufsz[RING_DATA] < required_size) {
+      LOG_ERR("ERROR. ring buffer data block of Stokes %c too small, should be at least %lu\n", stokes_names[i], required_size);
+      return -1;
+    }
+  }
+
+  LOG("Expected marker byte= 0x%X\n", r->assembler.expected_marker_byte);
+  LOG("Expected payload = %i B\n", r->assembler.expected_payload);
+  LOG("Packets per sample = %i\n", r->assembler.packets_per_sample);
+  if (r->metafile && r->assembler.packets_per_sample > PAGEMETA_SLOTS) {
+    LOG_ERR("ERROR. Page metadata has room for %i packets per page, not %i\n", PAGEMETA_SLOTS, r->assembler.packets_per_sample);
+    return -1;
+  }
+
+  // packets in the buffer, and the ones left over from the previous observation, are not affected
+  for (i = 0; i < MMSG_VLEN; i++) {
+    r->iov[i].iov_len = r->assembler.expected_payload + PACKHEADER;
+  }
+  if (r->kernel_filter) {
+    status = attach_filter(r->sockfd, &r->assembler, -1);
+    for (i = 0; i < r->nstreams; i++) {
+      status |= attach_filter(r->streams[i].sockfd, &r->assembler, -1);
+    }
+    if (status) {
+      LOG_WARN("WARNING: Cannot attach socket filter, all packets are checked in user space\n");
+      r->kernel_filter = 0;
+    } else {
+      LOG("Socket filter: packets with the wrong size, marker byte, or version%s are dropped by the kernel\n",
+          r->assembler.ntabs < r->assembler.beam_tabs || r->assembler.nchannels < NCHANNELS ? ", or outside the selection," : "");
+    }
+  }
+
+  // the other endpoints keep the packets from the start on
+  lock_streams(r);
+  share_page(r, NULL, NULL, 0, r->startpacket);
+  unlock_streams(r);
+
+  // loss
+  if (r->have_loss) {
+    loss_close(&r->loss);
+    r->have_loss = 0;
+  }
+  if (loss_init(&r->loss, &r->assembler, r->lossfile)) {
+    LOG_ERR("ERROR. Cannot set up loss summary %s\n", r->lossfile ? r->lossfile : "");
+    return -1;
+  }
+  r->have_loss = 1;
+  if (r->lossfile) {
+    LOG("Loss summary file: %s\n", r->lossfile);
+  }
+
+  // the bitmaps of the other endpoints, as large as the one of the page
+  lock_streams(r);
+  for (i = 0; i < r->nstreams; i++) {
+    free(r->streams[i].received);
+    r->streams[i].received = calloc(r->loss.nwords, sizeof(uint64_t));
+    if (!r->streams[i].received) {
+      unlock_streams(r);
+      LOG_ERR("ERROR. Cannot allocate packet bitmaps of the endpoints\n");
+      return -1;
+    }
+  }
+  unlock_streams(r);
+
+  // overload policy, the pages are kept while the page size does not change
+  if (r->have_writer && r->writer.size != required_size) {
+    pagewriter_close(&r->writer);
+    r->have_writer = 0;
+  }
+  if (!r->have_writer) {
+    warmup_t pool_warmup;
+
+    warmup_clear(&pool_warmup);
+    if (pagewriter_init(&r->writer, r->rb, r->overload, r->spill_pages, required_size, r->warm ? &pool_warmup : NULL)) {
+      LOG_ERR("ERROR. Cannot allocate pages for the overload policy\n");
+      return -1;
+    }
+    r->have_writer = 1;
+    if (r->metafile && pagewriter_meta(&r->writer, &r->meta)) {
+      LOG_ERR("ERROR. Cannot allocate page metadata\n");
+      return -1;
+    }
+    if (r->overload == OVERLOAD_SKIP) {
+      LOG("Overload policy: skip pages when the ring buffer is full\n");
+    } else if (r->overload == OVERLOAD_SPILL) {
+      LOG("Overload policy: spill pages to a pool of %i pages when the ring buffer is full\n", r->spill_pages);
+    }
+    if (r->warm && r->overload != OVERLOAD_BLOCK) {
+      status = warmup_describe(&pool_warmup, r->overload == OVERLOAD_SPILL ? "spill pool" : "scratch page", message, sizeof(message));
+      log_printf(status ? LOG_WARNING : LOG_INFO, "%s", message);
+    }
+  }
+
+  // the Stokes ring buffers have the same overload policy, without metadata or flag masks
+  for (i = 1; r->split && i < ASSEMBLE_STOKES; i++) {
+    if (r->have_stokes_writer[i] && r->stokes_writer[i].size != required_size) {
+      pagewriter_close(&r->stokes_writer[i]);
+      r->have_stokes_writer[i] = 0;
+    }
+    if (r->stokes_rb[i] && !r->have_stokes_writer[i]) {
+      if (pagewriter_init(&r->stokes_writer[i], r->stokes_rb[i], r->overload, r->spill_pages, required_size, NULL)) {
+        LOG_ERR("ERROR. Cannot allocate pages for the overload policy\n");
+        return -1;
+      }
+      r->have_stokes_writer[i] = 1;
+    }
+  }
+
+  // flag masks, with room for all pages of the ring buffer; the sidecar is replaced when the page layout changes
+  if (r->flagsfile) {
+    if (!flagmask_matches(&r->flags, 2 * r->rb->nbufs[RING_DATA], &r->assembler)) {
+      // spilled pages of the previous observation still publish their masks in the current sidecar
+      pagewriter_wait(&r->writer);
+      r->writer.flags = NULL;
+      flagmask_close(&r->flags);
+      if (flagmask_create(&r->flags, r->flagsfile, 2 * r->rb->nbufs[RING_DATA], &r->assembler)) {
+        LOG_ERR("ERROR. Cannot create flag mask file %s\n", r->flagsfile);
+        return -1;
+      }
+      LOG("Flag mask file: %s (%lu bytes per page)\n", r->flagsfile, r->flags.mask_size);
+    }
+    if (r->writer.flags != &r->flags || r->writer.mask_size != r->flags.mask_size) {
+      if (pagewriter_flags(&r->writer, &r->flags)) {
+        LOG_ERR("ERROR. Cannot allocate flag masks\n");
+        return -1;
+      }
+    }
+  }
+
+  // hand over the header page, the readers can prepare while we wait for the start
+  buf = ringbuffer_next_write (r->rb, RING_HEADER);
+  if (! buf) {
+    LOG_ERR("ERROR. Get next header block error\n");
+    return -1;
+  }
+  memcpy(buf, r->header, bufsz);
+  if (ringbuffer_mark_filled (r->rb, RING_HEADER, bufsz) < 0) {
+    LOG_ERR("ERROR. Could not mark filled header block\n");
+    return -1;
+  }
+
+  // and the same header to the other Stokes parameters
+  for (i = 1; r->split && i < ASSEMBLE_STOKES; i++) {
+    uint64_t size;
+
+    if (!r->stokes_rb[i]) {
+      continue;
+    }
+    size = r->stokes_rb[i]->bufsz[RING_HEADER];
+    buf = ringbuffer_next_write (r->stokes_rb[i], RING_HEADER);
+    if (! buf) {
+      LOG_ERR("ERROR. Get next header block error\n");
+      return -1;
+    }
+    snprintf(buf, size, "%s", r->header);
+    if (ringbuffer_header_set(buf, size, "STOKES", "%c", stokes_names[i]) || ringbuffer_mark_filled (r->stokes_rb[i], RING_HEADER, size) < 0) {
+      LOG_ERR("ERROR. Could not mark filled header block of Stokes %c\n", stokes_names[i]);
+      return -1;
+    }
+  }
+  r->in_transfer = 1;
+
+  return 0;
+}
+
+/**
+ * Nanoseconds between two points in time
+ */
+static inline long elapsed_ns(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * Time the data in a packet ends, in nanoseconds since the unix epoch
+ * The packet timestamp is the start of its page, the sequence number gives the part of the page it holds.
+ */
+static inline uint64_t packet_end_ns(const assembler_t *assembler, const packet_t *packet) {
+  uint64_t end = bswap_64(packet->timestamp) + (packet->sequence_number + 1UL) * FRAMETIME / assembler->sequence_length;
+  return end * NS_PER_PACKET;
+}
+
+/**
+ * Copy a validated packet to the page, or to the pages of the Stokes parameters when split
+ */
+static inline void copy_packet(receiver_t *r, const packet_t *packet, char *page) {
+  if (r->assembler.split) {
+    assemble_copy_stokes(&r->assembler, packet, r->pages);
+  } else {
+    assemble_copy(&r->assembler, packet, page);
+  }
+}
+
+/**
+ * Receive a batch of packets, and count them
+ *
+ * @param {int} sockfd Socket to read from
+ * @param {struct mmsghdr *} msgs Message headers
+ * @param {int} vlen Number of packets to read
+ * @param {size_t} controllen Size of the control buffer of each message
+ * @param {metrics_counters_t *} counters Packets, bytes, calls, and kernel drops are added here
+ * @param {uint32_t *} drops Kernel drop counter of the socket, updated
+ * @param {uint64_t *} arrival Kernel receive time of every packet in ns since the unix epoch, 0 if unknown
+ * @returns {int} Number of packets received, less than vlen only when the socket has a receive timeout; 0 on timeout or a signal, -1 on error
+ */
+int receive(int sockfd, struct mmsghdr *msgs, int vlen, size_t controllen, metrics_counters_t *counters, uint32_t *drops, uint64_t *arrival) {
+  struct cmsghdr *cmsg;
+  struct timespec stamp;
+  int i, n;
+
+  // the kernel overwrites the lengths of the control buffers
+  for (i = 0; i < vlen; i++) {
+    msgs[i].msg_hdr.msg_controllen = controllen;
+  }
+
+  n = recvmmsg(sockfd, msgs, vlen, 0, NULL);
+  if (n <= 0) {
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+  }
+
+  counters->recv_calls++;
+  counters->packets += n;
+  for (i = 0; i < n; i++) {
+    counters->bytes += msgs[i].msg_len;
+  }
+
+  for (i = 0; i < n; i++) {
+    arrival[i] = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET) {
+        continue;
+      }
+      if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+        memcpy(&stamp, CMSG_DATA(cmsg), sizeof(struct timespec));
+        arrival[i] = stamp.tv_sec * 1000000000UL + stamp.tv_nsec;
+      } else if (cmsg->cmsg_type == SO_RXQ_OVFL && i == n - 1) {
+        // the drop counter is cumulative, so the last message has the latest value
+        uint32_t value;
+        memcpy(&value, CMSG_DATA(cmsg), sizeof(uint32_t));
+        counters->kernel_drops += value - *drops;
+        *drops = value;
+      }
+    }
+  }
+
+  return n;
+}
+
+/**
+ * Stop the threads of the other endpoints, and close their sockets
+ */
+void stop_streams(receiver_t *r) {
+  int i;
+
+  __atomic_store_n(&r->stop_streams, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < r->nstreams; i++) {
+    pthread_join(r->streams[i].thread, NULL);
+    close(r->streams[i].sockfd);
+    free(r->streams[i].received);
+    r->streams[i].received = NULL;
+  }
+  r->nstreams = 0;
+}
+
+/**
+ * Try to cleanly shut down after a fatal error, and signal end-of-data on the ring buffer, if possible
+ */
+void clean_exit(void) {
+  receiver_t *r = signal_receiver;
+  int i;
+
+  if (signal_control) {
+    control_close(signal_control);
+  }
+
+  if (r) {
+    // nobody copies to the page anymore
+    stop_streams(r);
+    metrics_stop(&r->metrics);
+
+    end_transfer(r);
+    if (r->have_writer) {
+      pagewriter_close(&r->writer);
+    }
+    for (i = 1; i < ASSEMBLE_STOKES; i++) {
+      if (r->have_stokes_writer[i]) {
+        pagewriter_close(&r->stokes_writer[i]);
+      }
+    }
+
+    close(r->sockfd);
+  }
+
+  // clean up and exit
+  log_close();
+  fflush(stdout);
+  fflush(stderr);
+
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * SIGTERM: only ask for a shutdown, the receive loop ends the observation and exits
+ */
+void request_shutdown(int signum) {
+  (void) signum;
+  shutdown_requested = 1;
+}
+
+/**
+ * Next command for the current observation: from the control socket, or quit after SIGTERM
+ *
+ * @param {control_t *} control Control socket, or NULL
+ * @returns {int} CONTROL_CONTINUE, CONTROL_STOP, or CONTROL_QUIT
+ */
+static int next_request(control_t *control) {
+  if (shutdown_requested) {
+    return CONTROL_QUIT;
+  }
+  return control ? control_request(control) : CONTROL_CONTINUE;
+}
+
+/**
+ * Next packet from the packet buffer, reading a new batch from the network when all are processed
+ * The time spent in recvmmsg is counted separately from the busy time.
+ *
+ * @returns {packet_t *} The packet, the index of its arrival time is packet_idx - 1; NULL when the receive timeout expired, with more endpoints
+ */
+static inline packet_t *next_packet(receiver_t *r) {
+  struct timespec now;
+
+  // did we reach the end of the packet buffer?
+  if (r->packet_idx == r->npackets) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    r->counters.busy_ns += elapsed_ns(&r->busy_start, &now);
+    profile_stage(&r->profile, PROFILE_VALIDATE);
+
+    // read new packets from the network into the buffer
+    r->npackets = receive(r->sockfd, r->msgs, r->vlen, sizeof(r->control[0]), &r->counters, &r->kernel_drops, r->arrival);
+    if (r->npackets < 0 && shutdown_requested) {
+      // recvmmsg interrupted by SIGTERM after some packets leaves the error for the next call
+      r->npackets = 0;
+    } else if (r->npackets < 0) {
+      LOG_ERR("ERROR Could not read packets\n");
+      clean_exit();
+    }
+    profile_stage(&r->profile, PROFILE_RECV);
+    profile_batch(&r->profile, r->npackets);
+    // go to start of buffer
+    r->packet_idx = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &r->busy_start);
+    r->counters.recv_ns += elapsed_ns(&now, &r->busy_start);
+
+    // receive timeout, with more endpoints
+    if (r->npackets == 0) {
+      return NULL;
+    }
+  }
+
+  return &r->packet_buffer[r->packet_idx++];
+}
+
+/**
+ * Add what the streams copied to the current page, call while holding the page lock for writing
+ * Packets that arrived on more than one endpoint are counted as duplicates.
+ *
+ * @param {receiver_t *} r Receiver
+ * @param {unsigned long *} packets Packets in the page, increased
+ * @param {int *} invalid Invalid packets dropped, increased
+ * @param {uint64_t *} last_arrival Arrival time of the last packet in the page, updated
+ */
+void collect_streams(receiver_t *r, unsigned long *packets, int *invalid, uint64_t *last_arrival) {
+  stream_t *s;
+  uint32_t added;
+  int i;
+
+  for (i = 0; i < r->nstreams; i++) {
+    s = &r->streams[i];
+
+    added = loss_merge(&r->loss, s->received);
+    *packets += added;
+    r->counters.duplicates += s->packets - added;
+    *invalid += s->invalid;
+    if (s->last_arrival > *last_arrival) {
+      *last_arrival = s->last_arrival;
+    }
+    histogram_merge(&r->latency, &s->latency);
+    histogram_merge(&r->jitter, &s->jitter);
+
+    s->packets = 0;
+    s->invalid = 0;
+    s->last_arrival = 0;
+    histogram_clear(&s->latency);
+    histogram_clear(&s->jitter);
+  }
+}
 
-    // check timestamps
+/**
+ * Earliest timestamp of the packets the streams hold for a later page
+ *
+ * @returns {unsigned long} The timestamp, ULONG_MAX when none
+ */
+unsigned long streams_ahead(const receiver_t *r) {
+  unsigned long ahead = ULONG_MAX, timestamp;
+  int i;
+
+  for (i = 0; i < r->nstreams; i++) {
+    timestamp = __atomic_load_n(&r->streams[i].ahead, __ATOMIC_ACQUIRE);
+    if (timestamp < ahead) {
+      ahead = timestamp;
+    }
+  }
+
+  return ahead;
+}
+
+/**
+ * Copy the packets in the packet buffer of a stream to the current page, call while holding the page lock for reading
+ * Stops at a packet of a later page, it is kept in the buffer till the page switches.
+ *
+ * @returns {int} 1 when a packet is held for a later page, 0 otherwise
+ */
+static int stream_copy(stream_t *s) {
+  receiver_t *r = s->r;
+  const assembler_t *assembler = &r->assembler;
+  packet_t *packet;
+  unsigned long timestamp = ULONG_MAX;
+  uint64_t arrival, data_end;
+  int status;
+  int copied = 0;
+
+  while (s->packet_idx < s->npackets) {
+    packet = &s->packet_buffer[s->packet_idx];
+    arrival = s->arrival[s->packet_idx];
+    timestamp = bswap_64(packet->timestamp);
+
+    // not observing: drop the packets before the next start, keep the others
+    if (!r->page) {
+      if (timestamp >= r->keep_from) {
+        break;
+      }
+      s->packet_idx++;
+      continue;
+    }
+
+    status = assemble_validate(assembler, packet);
+    if (status == ASSEMBLE_UNSELECTED) {
+      s->counters.unselected++;
+      s->packet_idx++;
+      continue;
+    }
+    if (status > ASSEMBLE_SKIP) {
+      s->invalid++;
+      s->counters.invalid++;
+      s->packet_idx++;
+      continue;
+    }
+
+    // as in run_observation: a later page waits for the main thread, timestamps far from the page are dropped
+    if (timestamp + FRAMETIME < r->page_time || timestamp >= r->page_time + MAX_GAP_FRAMES * FRAMETIME) {
+      s->counters.outliers++;
+      s->packet_idx++;
+      continue;
+    }
+    if (timestamp >= r->page_time + FRAMETIME) {
+      break;
+    }
+    if (timestamp < r->page_time) {
+      s->counters.late++;
+      s->packet_idx++;
+      continue;
+    }
+
+    if (loss_mark_bitmap(s->received, assemble_slot(assembler, packet))) {
+      s->counters.duplicates++;
+      s->packet_idx++;
+      continue;
+    }
+    if (status == ASSEMBLE_OK) {
+      copy_packet(r, packet, r->page);
+      if (r->page_mask) {
+        assemble_flags(assembler, packet, r->page_mask);
+      }
+      s->counters.copied_bytes += assembler->expected_payload;
+      copied = 1;
+    }
+    if (arrival) {
+      data_end = packet_end_ns(assembler, packet);
+      histogram_add(&s->latency, arrival > data_end ? arrival - data_end : 0);
+      s->last_arrival = arrival;
+    }
+    s->packets++;
+    s->packet_idx++;
+  }
+
+  if (copied) {
+    assemble_flush(assembler);
+  }
+
+  __atomic_store_n(&s->ahead, s->packet_idx < s->npackets ? timestamp : ULONG_MAX, __ATOMIC_RELEASE);
+  return s->packet_idx < s->npackets;
+}
+
+/**
+ * Receive on one of the other endpoints, and copy to the page of the main thread
+ */
+static void *stream_thread(void *arg) {
+  stream_t *s = arg;
+  receiver_t *r = s->r;
+  struct timespec deadline;
+  uint64_t generation;
+  int fresh = 0;           // the packets in the buffer were just received
+  int held, i;
+  sigset_t all;
+
+  // leave signals to the main thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  if (s->endpoint.numa_node >= 0 && endpoint_pin(s->endpoint.numa_node)) {
+    LOG_WARN("WARNING: Cannot pin the thread of port %i to NUMA node %i\n", s->endpoint.port, s->endpoint.numa_node);
+  }
+
+  while (!__atomic_load_n(&r->stop_streams, __ATOMIC_ACQUIRE)) {
+    if (s->packet_idx == s->npackets) {
+      s->npackets = receive(s->sockfd, s->msgs, r->vlen, sizeof(s->control[0]), &s->counters, &s->kernel_drops, s->arrival);
+      s->packet_idx = 0;
+      if (s->npackets < 0) {
+        LOG_ERR("ERROR Could not read packets from port %i\n", s->endpoint.port);
+        s->npackets = 0;
+        break;
+      }
+      fresh = 1;
+    }
+
+    pthread_rwlock_rdlock(&r->page_lock);
+    generation = r->page_generation;
+
+    // arrival jitter, over all packets of this endpoint
+    if (fresh && r->page) {
+      for (i = 0; i < s->npackets; i++) {
+        if (s->arrival[i] && s->previous_arrival && s->arrival[i] >= s->previous_arrival) {
+          histogram_add(&s->jitter, s->arrival[i] - s->previous_arrival);
+        }
+        s->previous_arrival = s->arrival[i] ? s->arrival[i] : s->previous_arrival;
+      }
+    }
+    fresh = 0;
+
+    held = stream_copy(s);
+    pthread_rwlock_unlock(&r->page_lock);
+
+    metrics_add(&r->metrics, &s->counters);
+
+    // wait for the main thread to switch to the page of the held packet
+    if (held) {
+      pthread_mutex_lock(&r->page_mutex);
+      while (r->page_generation == generation && !__atomic_load_n(&r->stop_streams, __ATOMIC_ACQUIRE)) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += STREAM_TIMEOUT_US * 1000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+          deadline.tv_sec++;
+          deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&r->page_changed, &r->page_mutex, &deadline);
+      }
+      pthread_mutex_unlock(&r->page_mutex);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Open the other endpoints, and start their threads
+ *
+ * @param {receiver_t *} r Receiver
+ * @param {endpoint_t *} endpoints The other endpoints
+ * @param {int} nendpoints Number of other endpoints
+ * @param {int} sockbufsize Socket receive buffer size in bytes
+ * @returns {int} 0 on success, -1 on error
+ */
+int start_streams(receiver_t *r, const endpoint_t *endpoints, int nendpoints, int sockbufsize) {
+  stream_t *s;
+  warmup_t slab_warmup;
+  pthread_rwlockattr_t lock_attr;
+  int i, j;
+
+  r->streams = calloc(nendpoints, sizeof(stream_t));
+  if (!r->streams) {
+    return -1;
+  }
+  // the streams hold read locks nearly all the time, the page switch should not wait for all of them to let go at once
+  pthread_rwlockattr_init(&lock_attr);
+  pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&r->page_lock, &lock_attr);
+  pthread_rwlockattr_destroy(&lock_attr);
+  pthread_mutex_init(&r->page_mutex, NULL);
+  pthread_cond_init(&r->page_changed, NULL);
+  r->keep_from = ULONG_MAX;
+
+  for (i = 0; i < nendpoints; i++) {
+    s = &r->streams[i];
+    s->r = r;
+    s->endpoint = endpoints[i];
+    s->ahead = ULONG_MAX;
+    histogram_clear(&s->latency);
+    histogram_clear(&s->jitter);
+
+    s->sockfd = init_network(&s->endpoint, sockbufsize, STREAM_TIMEOUT_US);
+
+    // packets of any size fit, the packet layout is only known per observation
+    warmup_clear(&slab_warmup);
+    s->packet_buffer = r->warm ? warmup_alloc(&slab_warmup, MMSG_VLEN * sizeof(packet_t) + PACKHEADER) : malloc(MMSG_VLEN * sizeof(packet_t) + PACKHEADER);
+    if (!s->packet_buffer) {
+      return -1;
+    }
+    for (j = 0; j < MMSG_VLEN; j++) {
+      s->iov[j].iov_base = (char *) &s->packet_buffer[j];
+      s->iov[j].iov_len = PAYLOADSIZE_MAX + PACKHEADER;
+      s->msgs[j].msg_hdr.msg_iov = &s->iov[j];
+      s->msgs[j].msg_hdr.msg_iovlen = 1;
+      s->msgs[j].msg_hdr.msg_control = s->control[j];
+      s->msgs[j].msg_hdr.msg_controllen = sizeof(s->control[j]);
+    }
+
+    if (pthread_create(&s->thread, NULL, stream_thread, s)) {
+      return -1;
+    }
+    r->nstreams++;
+  }
+
+  return 0;
+}
+
+/**
+ * Hand over pages for frames without any packets, so that page N of the observation stays at startpacket + N * FRAMETIME
+ * The pages are not written to: their metadata is flagged PAGEMETA_PLACEHOLDER, and the loss summary has all packets missing.
+ * Without the metadata file, a reader sees stale data, as for missing packets.
+ *
+ * @param {receiver_t *} r Receiver
+ * @param {unsigned long} timestamp Packet number of the first page
+ * @param {unsigned long} count Number of pages
+ * @param {int} eod Set End-Of-Data on the last page
+ */
+void placeholder_pages(receiver_t *r, unsigned long timestamp, unsigned long count, int eod) {
+  assembler_t *assembler = &r->assembler;
+  pagemeta_record_t *record;
+  metrics_page_t page_stats;
+  struct timespec now;
+  unsigned long p;
+
+  LOG_WARN("WARNING: No packets for %lu pages from %lu, inserting placeholder pages\n", count, timestamp);
+
+  memset(&page_stats, 0, sizeof(metrics_page_t));
+  for (p = 0; p < count; p++) {
+    // the time spent waiting for a page is not busy time
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    r->counters.busy_ns += elapsed_ns(&r->busy_start, &now);
+    next_page(r);
+    clock_gettime(CLOCK_MONOTONIC, &r->busy_start);
+    r->counters.blocked_ns += elapsed_ns(&now, &r->busy_start);
+
+    record = pagewriter_record(&r->writer);
+    if (record) {
+      pagemeta_fill(record, assembler, &r->loss, timestamp, 0, 0);
+      record->flags |= PAGEMETA_PLACEHOLDER;
+    }
+    if (filled_page(r, eod && p == count - 1) < 0) {
+      LOG_ERR("ERROR: cannot mark buffer as filled\n");
+      clean_exit();
+    }
+    loss_page(&r->loss, timestamp);
+    r->counters.placeholders++;
+
+    page_stats.timestamp = timestamp;
+    page_stats.expected = assembler->packets_per_sample;
+    page_stats.missing = assembler->packets_per_sample;
+    page_stats.ring_full = ringbuffer_nfull(r->rb, RING_DATA);
+    page_stats.ring_nbufs = r->rb->nbufs[RING_DATA];
+    page_stats.skipped = r->writer.skipped;
+    page_stats.spilled = r->writer.spilled;
+    page_stats.spill_pending = pagewriter_pending(&r->writer);
+    metrics_add(&r->metrics, &r->counters);
+    metrics_page(&r->metrics, &page_stats);
+
+    timestamp += FRAMETIME;
+  }
+
+  if (eod) {
+    r->in_transfer = 0;
+  }
+}
+
+/**
+ * Idle till the start packet, but keep track of which bands there are
+ * Packets left in the packet buffer by a previous observation that ended at, or just before, our start are kept.
+ *
+ * @param {receiver_t *} r Receiver
+ * @param {control_t *} control Control socket to check for commands, or NULL
+ * @returns {int} CONTROL_CONTINUE at the start packet, CONTROL_STOP or CONTROL_QUIT when stopped before it
+ */
+int wait_for_start(receiver_t *r, control_t *control) {
+  packet_t *packet;
+  unsigned long curr_packet, sequence_time = 0;
+  unsigned long drained = 0;          // packets drained before the start
+  long wake_ns, next_ns;
+  int request = CONTROL_CONTINUE;
+  int reached = 0;
+  int held = 0;                       // another endpoint holds the start packet
+  int i;
+
+  if (r->packet_idx < r->npackets && bswap_64(r->packet_buffer[r->packet_idx].timestamp) + FRAMETIME < r->startpacket) {
+    r->packet_idx = r->npackets;
+  }
+
+  // sleep until shortly before the start, only draining the socket, and look for commands every now and then
+  if (r->packet_idx == r->npackets) {
+    wake_ns = r->startpacket * NS_PER_PACKET - START_MARGIN_NS;
+    while (!reached && realtime_ns() < wake_ns) {
+      next_ns = control ? realtime_ns() + CONTROL_INTERVAL_NS : wake_ns;
+      reached = drain_until(r->sockfd, r->packet_buffer, r->vlen, next_ns < wake_ns ? next_ns : wake_ns, r->startpacket, &r->cb_index, &drained);
+      if ((request = next_request(control)) != CONTROL_CONTINUE) {
+        break;
+      }
+    }
+    if (drained) {
+      LOG("Drained %lu packets while waiting for the start\n", drained);
+    }
+    if (request != CONTROL_CONTINUE) {
+      return request;
+    }
+  }
+
+  // then look at every packet, to start exactly at the start packet
+  while (1) {
+    if (shutdown_requested) {
+      return CONTROL_QUIT;
+    }
+    packet = next_packet(r);
+    if (!packet) {
+      // nothing on the first endpoint, start when another one holds the start packet, and take the compound beam from it
+      for (i = 0; i < r->nstreams; i++) {
+        stream_t *s = &r->streams[i];
+        if (__atomic_load_n(&s->ahead, __ATOMIC_ACQUIRE) != ULONG_MAX) {
+          r->cb_index = s->packet_buffer[s->packet_idx].cb_index;
+          held = 1;
+        }
+      }
+      if (held) {
+        break;
+      }
+      continue;
+    }
+
+    // keep track of compound beams
+    r->cb_index = packet->cb_index;
+
+    // keep track of timestamps
     curr_packet = bswap_64(packet->timestamp);
-    if (curr_packet > sequence_time) {
+    if (curr_packet >= r->startpacket) {
+      // process this packet first in the main loop
+      r->packet_idx--;
+      break;
+    }
+
+    if (curr_packet != sequence_time) {
+      log_printf(LOG_DEBUG, "Current packet is %li\n", curr_packet);
+      sequence_time = curr_packet;
+    }
+  }
+
+  // the warm-up should be done by now; if not, the first page will be slow
+  clock_gettime(CLOCK_MONOTONIC, &r->idle_end);
+  join_warmup(r);
+
+  return CONTROL_CONTINUE;
+}
+
+/**
+ * Run from the start packet till the end packet, a stop command, or the end of the data
+ * The packet of the next page after the end is left in the packet buffer, for a following observation.
+ *
+ * @param {receiver_t *} r Receiver
+ * @param {control_t *} control Control socket to check for commands and report status, or NULL
+ * @returns {int} CONTROL_CONTINUE at the end packet, CONTROL_STOP or CONTROL_QUIT when stopped before it
+ */
+int run_observation(receiver_t *r, control_t *control) {
+  assembler_t *assembler = &r->assembler;
+  ringbuffer_t *rb = r->rb;
+  char *buf;                        // pointer to current buffer
+  uint8_t *mask;                    // flag mask of the current buffer, or NULL
+  packet_t *packet;                 // Pointer to current packet
+  uint64_t arrival;                 // of the current packet
+  int status;                       // result of packet validation
+  char message[256];
+  char report[1024];                // profile of a page
+  float missing_pct;                // Number of packets missed in percentage of expected number
+  int missing;                      // Number of packets missed
+  float done_pct;
+  int target;                       // where the last page went
+  int end;                          // the last page
+  int request = CONTROL_CONTINUE;
+  uint64_t pages = 0;
+  int invalid_in_page = 0;          // invalid packets in the current page
+  uint64_t last_arrival = 0;        // of the last packet added to the page
+  uint64_t data_end;                // time the data of a packet ends, ns since the unix epoch
+  struct timespec published;        // time a page was handed to the ring buffer
+  uint64_t publication_ns;
+  struct timespec now;
+  metrics_page_t page_stats;
+  pagemeta_record_t *record;        // metadata of the page
+  uint32_t page_flags = 0;          // extra pagemeta_flags for the current page
+  unsigned long gap;                // frames without packets before the current packet
+  unsigned long remaining;          // time left in the observation at a timestamp reset
+  unsigned long outliers = 0;       // consecutive packets far from the current page
+  int replayed;                     // the current packet was held back before a timestamp reset
+  int reset = 0;
+  int i;
+
+  unsigned long curr_packet;        // Current packet number (is number of packets after unix epoch)
+  unsigned long sequence_time;      // Timestamp for current sequnce
+  unsigned long packets_in_buffer;  // number of records processed per time segment
+
+  // only count from the batch with the start packet on; when it was received by the previous observation, it is counted there
+  if (r->counters.recv_calls) {
+    memset(&r->counters, 0, sizeof(metrics_counters_t));
+    r->counters.recv_calls = 1;
+    r->counters.packets = r->npackets;
+  }
+  histogram_clear(&r->latency);
+  histogram_clear(&r->jitter);
+  histogram_clear(&r->publication);
+  r->previous_arrival = 0;
+  r->nheld = 0;
+  r->held_idx = 0;
+
+  LOG("STARTING WITH CB_INDEX=%i\n", r->cb_index);
+  assembler->cb_index = r->cb_index;
+  if (r->kernel_filter) {
+    status = attach_filter(r->sockfd, assembler, r->cb_index);
+    for (i = 0; i < r->nstreams; i++) {
+      status |= attach_filter(r->streams[i].sockfd, assembler, r->cb_index);
+    }
+    if (status) {
+      LOG_WARN("WARNING: Cannot attach socket filter for compound beam %i\n", r->cb_index);
+    }
+  }
+
+  // the first packet, on the first endpoint or held by another one
+  if (r->packet_idx < r->npackets) {
+    sequence_time = bswap_64(r->packet_buffer[r->packet_idx].timestamp);
+  } else {
+    sequence_time = streams_ahead(r);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &r->busy_start);
+  profile_start(&r->profile);
+
+  // no packets for the first frames: keep the phase of the stream, and stop early when there is nothing in the observation
+  gap = (sequence_time - r->startpacket) / FRAMETIME;
+  if (gap && sequence_time - gap * FRAMETIME < r->endpacket) {
+    remaining = (r->endpacket - (sequence_time - gap * FRAMETIME) - 1) / FRAMETIME + 1;
+    end = sequence_time >= r->endpacket;
+    placeholder_pages(r, sequence_time - gap * FRAMETIME, gap < remaining ? gap : remaining, end);
+    pages += gap < remaining ? gap : remaining;
+    if (end) {
+      return request;
+    }
+  }
+
+  //  get a new buffer, and share it with the other endpoints
+  buf = next_page(r);
+  mask = pagewriter_mask(&r->writer);
+  packets_in_buffer = 0;
+  lock_streams(r);
+  share_page(r, buf, mask, sequence_time, ULONG_MAX);
+  unlock_streams(r);
+
+  // ============================================================
+  // run till end time
+  // ============================================================
+
+  while (1) { // loop is terminated by return statement below
+    replayed = r->held_idx < r->nheld;
+    if (replayed) {
+      // the packets held back before a timestamp reset, their arrival was counted already
+      packet = &r->held[r->held_idx++];
+      arrival = 0;
+    } else {
+      packet = next_packet(r);
+      arrival = packet ? r->arrival[r->packet_idx - 1] : 0;
+    }
+    if (packet) {
+      // arrival jitter, over all packets
+      if (arrival) {
+        if (r->previous_arrival && arrival >= r->previous_arrival) {
+          histogram_add(&r->jitter, arrival - r->previous_arrival);
+        }
+        r->previous_arrival = arrival;
+      }
+
+      // check the packet header; drop invalid packets, and describe the first one of every page
+      status = assemble_validate(assembler, packet);
+      if (status == ASSEMBLE_UNSELECTED) {
+        r->counters.unselected++;
+        continue;
+      }
+      if (status > ASSEMBLE_SKIP) {
+        if (invalid_in_page++ == 0) {
+          assemble_describe(assembler, packet, status, message, sizeof(message));
+          LOG_WARN("%s", message);
+        }
+        r->counters.invalid++;
+        continue;
+      }
+
+      // check timestamps
+      curr_packet = bswap_64(packet->timestamp);
+
+      // a packet far from the current page is held back, and dropped unless it is followed by enough others:
+      // then the timestamps were reset, and the held packets are replayed on the new timeline
+      if (curr_packet + FRAMETIME < sequence_time || curr_packet >= sequence_time + MAX_GAP_FRAMES * FRAMETIME) {
+        if (replayed) {
+          // still far from the page after the reset
+          r->counters.outliers++;
+          continue;
+        }
+        if (++outliers < RESET_PACKETS) {
+          memcpy(&r->held[outliers - 1], packet, offsetof(packet_t, record) + assembler->expected_payload);
+          continue;
+        }
+        reset = 1;
+      } else if (outliers) {
+        r->counters.outliers += outliers;
+        outliers = 0;
+      }
+    } else if (shutdown_requested) {
+      // no packets, and SIGTERM: end with the current page
+      curr_packet = sequence_time + FRAMETIME;
+    } else {
+      // nothing on the first endpoint for a while: switch pages when another endpoint holds a packet of a later page
+      curr_packet = streams_ahead(r);
+      if (curr_packet == ULONG_MAX || curr_packet <= sequence_time) {
+        continue;
+      }
+    }
+    profile_stage(&r->profile, PROFILE_VALIDATE);
+
+    if (reset || curr_packet > sequence_time) {
       // start of a new time segment:
-      // - check if this is the last data to process, 
-      if (curr_packet >= endpacket) {
-        // set End-Of-Data on the ringbuffer to have a clean shutdown of the pipeline
-        ipcbuf_enable_eod((ipcbuf_t *)hdu->data_block);
+      //  - mark the ringbuffer as filled (or spill or skip the page, see pagewriter.h),
+      //    for the last data to process, set End-Of-Data on the ringbuffer to have a clean shutdown of the pipeline
+      //  - frames without packets between this page and the next get a placeholder page, up to the end packet
+      //  - after a timestamp reset, continue with the time that was left from the new timestamp on
+      if (request == CONTROL_CONTINUE) {
+        request = next_request(control);
+      }
+      gap = 0;
+      remaining = 0;
+      if (reset) {
+        remaining = r->endpacket > sequence_time + FRAMETIME ? r->endpacket - sequence_time - FRAMETIME : 0;
+        end = remaining == 0 || request != CONTROL_CONTINUE;
+      } else {
+        if ((curr_packet - sequence_time) % FRAMETIME) {
+          LOG_WARN("WARNING: Timestamp phase changed, page %lu followed by %lu\n", sequence_time, curr_packet);
+        }
+        if (request == CONTROL_CONTINUE && curr_packet - sequence_time >= 2 * FRAMETIME && sequence_time + FRAMETIME < r->endpacket) {
+          gap = (curr_packet - sequence_time) / FRAMETIME - 1;
+          if (gap > (r->endpacket - sequence_time - 1) / FRAMETIME) {
+            gap = (r->endpacket - sequence_time - 1) / FRAMETIME;
+          }
+        }
+        end = (curr_packet >= r->endpacket && gap == 0) || request != CONTROL_CONTINUE;
       }
 
-      //  - mark the ringbuffer as filled
-      if (ipcbuf_mark_filled ((ipcbuf_t *)hdu->data_block, required_size) < 0) {
-        LOG("ERROR: cannot mark buffer as filled\n");
-        clean_exit(0);
+      lock_streams(r);
+      assemble_finish(assembler);
+      assemble_flush(assembler);
+      profile_stage(&r->profile, PROFILE_COPY);
+      collect_streams(r, &packets_in_buffer, &invalid_in_page, &last_arrival);
+
+      // the streams hold the packets of the next page meanwhile, handing over the page can wait for the ring buffer
+      share_page(r, NULL, NULL, 0, curr_packet);
+      unlock_streams(r);
+      record = pagewriter_record(&r->writer);
+      if (record) {
+        pagemeta_fill(record, assembler, &r->loss, sequence_time, packets_in_buffer, invalid_in_page);
+        record->flags |= page_flags;
+      }
+      profile_stage(&r->profile, PROFILE_PAGE);
+      target = r->writer.target;
+      if (filled_page(r, end) < 0) {
+        LOG_ERR("ERROR: cannot mark buffer as filled\n");
+        clean_exit();
       }
+      profile_stage(&r->profile, PROFILE_RING);
+      if (end) {
+        r->in_transfer = 0;
+      }
+      clock_gettime(CLOCK_REALTIME, &published);
+      publication_ns = 0;
+      if (last_arrival) {
+        publication_ns = published.tv_sec * 1000000000UL + published.tv_nsec - last_arrival;
+        histogram_add(&r->publication, publication_ns);
+      }
+      pages++;
 
       // - print diagnostics
-      missing = packets_per_sample - packets_in_buffer;
-      missing_pct = (100.0 * missing) / (1.0 * packets_per_sample);
-      done_pct = 100.0 * (1.0 * curr_packet - startpacket) / (endpacket - startpacket);
-      LOG("Compound beam %4i: time %li (%6.2f%%), missing: %6.3f%% (%i)\n", cb_index, curr_packet, done_pct, missing_pct, missing);
+      missing = assembler->packets_per_sample - packets_in_buffer;
+      missing_pct = (100.0 * missing) / (1.0 * assembler->packets_per_sample);
+      done_pct = 100.0 * (1.0 * curr_packet - r->startpacket) / (r->endpacket - r->startpacket);
+      LOG("Compound beam %4i: time %li (%6.2f%%), missing: %6.3f%% (%i), ring: %lu/%lu full\n", r->cb_index, curr_packet, done_pct, missing_pct, missing,
+          ringbuffer_nfull(rb, RING_DATA), rb->nbufs[RING_DATA]);
+      if (target == PAGE_SKIP) {
+        LOG_WARN("WARNING: Ring buffer full, skipped page %lu\n", sequence_time);
+      } else if (target == PAGE_SPILL) {
+        LOG_WARN("WARNING: Spilled page %lu, %i spilled pages pending\n", sequence_time, pagewriter_pending(&r->writer));
+      }
+      if (invalid_in_page > 1) {
+        LOG("Dropped %i invalid packets\n", invalid_in_page);
+      }
+      loss_page(&r->loss, sequence_time);
+      if (missing > 0) {
+        loss_describe(&r->loss, message, sizeof(message));
+        LOG("%s", message);
+      }
+      histogram_summary(&r->latency, message, sizeof(message), "Network latency");
+      LOG("%s", message);
+      histogram_summary(&r->jitter, message, sizeof(message), "Arrival jitter");
+      LOG("%s", message);
+      histogram_summary(&r->publication, message, sizeof(message), "Publication latency");
+      LOG("%s", message);
+
+      // - update the metrics, and the status
+      if (end && outliers) {
+        // the held packets are dropped at the end of the observation, the one of the reset is left for the next
+        r->counters.outliers += reset ? outliers - 1 : outliers;
+      }
+      page_stats.timestamp = sequence_time;
+      page_stats.expected = assembler->packets_per_sample;
+      page_stats.missing = missing;
+      page_stats.ring_full = ringbuffer_nfull(rb, RING_DATA);
+      page_stats.ring_nbufs = rb->nbufs[RING_DATA];
+      page_stats.latency_p50_ns = histogram_percentile(&r->latency, 50);
+      page_stats.latency_p99_ns = histogram_percentile(&r->latency, 99);
+      page_stats.jitter_p99_ns = histogram_percentile(&r->jitter, 99);
+      page_stats.publication_ns = publication_ns;
+      page_stats.skipped = r->writer.skipped;
+      page_stats.spilled = r->writer.spilled;
+      page_stats.spill_pending = pagewriter_pending(&r->writer);
+      metrics_add(&r->metrics, &r->counters);
+      metrics_page(&r->metrics, &page_stats);
+      if (control) {
+        control_status(control, CONTROL_OBSERVING, NULL, sequence_time, pages);
+      }
+
+      // - the profile of the page, up to here: the next page is charged with getting a new buffer
+      profile_stage(&r->profile, PROFILE_PAGE);
+      if (profile_page(&r->profile, report, sizeof(report))) {
+        LOG("%s", report);
+      }
+
+      //  - keep page N at startpacket + N * FRAMETIME
+      if (gap) {
+        placeholder_pages(r, sequence_time + FRAMETIME, gap, curr_packet >= r->endpacket);
+        pages += gap;
+        end = curr_packet >= r->endpacket;
+      }
+      page_flags = 0;
+      if (reset) {
+        LOG_WARN("WARNING: Timestamps reset from page %lu to %lu, continuing for %lu more packet numbers\n", sequence_time, curr_packet, remaining);
+        r->startpacket += curr_packet - (sequence_time + FRAMETIME);
+        r->endpacket = curr_packet + remaining;
+        r->counters.resets++;
+        page_flags = PAGEMETA_RESET;
+        r->nheld = outliers - 1;
+        r->held_idx = 0;
+        outliers = 0;
+        reset = 0;
+      }
 
       //  - reset the packets counter and sequence time
       packets_in_buffer = 0;
+      invalid_in_page = 0;
+      histogram_clear(&r->latency);
+      histogram_clear(&r->jitter);
+      last_arrival = 0;
       sequence_time = curr_packet;
 
-      // - stop when we have reached (or passed..) end packet
-      if (curr_packet >= endpacket) {
-        clean_exit(0);
+      // - stop when we have reached (or passed..) end packet, the packet is for the next observation
+      if (end) {
+        if (request != CONTROL_CONTINUE) {
+          LOG("Observation stopped at packet %lu\n", curr_packet);
+        }
+        lock_streams(r);
+        share_page(r, NULL, NULL, 0, r->endpacket);
+        unlock_streams(r);
+        if (packet) {
+          r->packet_idx--;
+        }
+        return request;
       } else {
-        //  - get a new buffer
-        buf = ipcbuf_get_next_write ((ipcbuf_t *)hdu->data_block);
+        //  - get a new buffer, the time spent waiting for it is not busy time
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        r->counters.busy_ns += elapsed_ns(&r->busy_start, &now);
+        buf = next_page(r);
+        mask = pagewriter_mask(&r->writer);
+        clock_gettime(CLOCK_MONOTONIC, &r->busy_start);
+        r->counters.blocked_ns += elapsed_ns(&now, &r->busy_start);
+        profile_stage(&r->profile, PROFILE_RING);
+        lock_streams(r);
+        share_page(r, buf, mask, sequence_time, ULONG_MAX);
+        unlock_streams(r);
+        profile_stage(&r->profile, PROFILE_PAGE);
       }
     } else if (curr_packet < sequence_time) {
       // packet belongs to previous sequence, but we have already released that dada ringbuffer page
+      r->counters.late++;
+      continue;
+    }
+    if (!packet) {
       continue;
     }
 
+    // drop duplicates
+    if (loss_mark(&r->loss, assemble_slot(assembler, packet))) {
+      r->counters.duplicates++;
+      profile_stage(&r->profile, PROFILE_PLACE);
+      continue;
+    }
+    profile_stage(&r->profile, PROFILE_PLACE);
+
     // copy to ringbuffer
-    if ((science_mode & 1) == 0) {
-      // stokes I
-      // packets contains: timeseries of PAYLOADSIZE_STOKESI elements [t0 .. tn]
-      //
-      // ring buffer contains matrix:
-      // [ntabs][NCHANNELS][PAYLOADSIZE_STOKESI]
-
-      if (freqissue_workaround) {
-        // Work around the FREQISSUE described above
-        curr_channel = remap_frequency_sc4[curr_channel];
-
-        if (curr_channel != 9999) {
-          memcpy(
-            &buf[((packet->tab_index * NCHANNELS) + curr_channel) * padded_size + packet->sequence_number * PAYLOADSIZE_STOKESI],
-            packet->record, PAYLOADSIZE_STOKESI);
-        }
-      } else {
-        memcpy(
-          &buf[((packet->tab_index * NCHANNELS) + curr_channel) * padded_size + packet->sequence_number * PAYLOADSIZE_STOKESI],
-          packet->record, PAYLOADSIZE_STOKESI);
+    if (status == ASSEMBLE_OK) {
+      copy_packet(r, packet, buf);
+      if (mask) {
+        assemble_flags(assembler, packet, mask);
       }
-    } else {
-      // stokes IQUV
-      // packets contains matrix: [t0 .. t499][c0 .. c3][the 4 components IQUV] total of 500*4*4=8000 bytes
-      // t0, .., t499 = sequence_number * 500 + tx
-      // c0, c1, c2, c3 = curr_channel + 0, 1, 2, 3
-      //
-      // ring buffer contains matrix:
-      // tab             := packet->tab_index       : ranges from 0 to NTABS
-      // channel_offset  := curr_channel/4          : ranges from 0 to NCHANNELS/4
-      // sequence_number := packet->sequence_number : ranges from 0 to sequence_length
-      //
-      // [tab][channel_offset][sequence_number][PAYLOADSIZE_STOKESIQUV]
-      memcpy(
-        &buf[(((packet->tab_index * NCHANNELS/4) + curr_channel / 4) * sequence_length) * PAYLOADSIZE_STOKESIQUV],
-        packet->record, PAYLOADSIZE_STOKESIQUV);
+      r->counters.copied_bytes += assembler->expected_payload;
+    }
+    profile_stage(&r->profile, PROFILE_COPY);
+
+    // network latency: from the end of the data in the packet to its arrival
+    if (arrival) {
+      data_end = packet_end_ns(assembler, packet);
+      histogram_add(&r->latency, arrival > data_end ? arrival - data_end : 0);
+      last_arrival = arrival;
     }
 
     // book keeping
     packets_in_buffer++;
+    profile_stage(&r->profile, PROFILE_ACCOUNT);
+  }
+}
+
+/**
+ * Set up an observation, wait for its start, and run it
+ *
+ * @param {receiver_t *} r Receiver
+ * @param {control_t *} control Control socket, or NULL
+ * @param {observation_t *} obs The observation
+ * @returns {int} 0 on success, -1 when the observation could not be set up
+ */
+int observe(receiver_t *r, control_t *control, const observation_t *obs) {
+  int request;
+
+  if (setup_observation(r, obs)) {
+    return -1;
+  }
+
+  if (control) {
+    control_status(control, CONTROL_WAITING, obs, 0, 0);
+  }
+  request = wait_for_start(r, control);
+  if (request == CONTROL_CONTINUE) {
+    if (control) {
+      control_status(control, CONTROL_OBSERVING, NULL, r->startpacket, 0);
+    }
+    request = run_observation(r, control);
+  } else {
+    LOG("Observation stopped before the start packet\n");
+  }
+
+  end_transfer(r);
+  if (control) {
+    control_status(control, CONTROL_IDLE, NULL, 0, 0);
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  receiver_t *r;            // state kept over observations
+  control_t control;        // control socket, in daemon mode
+  observation_t obs;        // observation given on the commandline
+  int have_obs;
+  struct sigaction action;  // SIGTERM handler
+
+  // run parameters
+  char *endpointlist = NULL;       // [address:]port[,...]
+  endpoint_t endpoints[ENDPOINT_MAX];
+  int nendpoints;
+  float duration = 0;       // run time in seconds
+  unsigned long startpacket = 0;
+  char *header = NULL;
+  char *key = NULL;
+
+  // local vars
+  char *logfile;
+  int loglevel = LOG_INFO;
+  int logformat = LOG_PLAIN;
+  char message[256];
+  int status, i;
+  int sockbufsize = SOCKBUFSIZE;   // socket receive buffer size
+  warmup_t slab_warmup;
+  char *metricsfile = NULL;        // Prometheus text file
+  char *metricssocket = NULL;      // UNIX socket to serve the metrics on
+  char *controlsocket = NULL;      // control socket, daemon mode
+  unsigned long drained = 0;
+
+  r = calloc(1, sizeof(receiver_t));
+  if (! r) {
+    fprintf(stderr, "ERROR. Cannot allocate receiver\n");
+    exit(EXIT_FAILURE);
+  }
+  r->vlen = MMSG_VLEN;
+  r->warm = 1;
+  r->kernel_filter = 1;
+  r->overload = OVERLOAD_BLOCK;
+  r->cb_index = 255;
+
+  // parse commandline
+  if (argc == 1) {
+    printOptions();
+    exit(EXIT_FAILURE);
+  }
+  parseOptions(argc, argv, &header, &key, &startpacket, &duration, &endpointlist, &logfile, &r->freqissue_workaround, &r->time_major, &r->split_stokes, r->stokes_keys, &r->tabs, &r->channels, &r->vlen, &sockbufsize, &r->warm, &r->kernel_filter, &r->overload, &r->spill_pages, &metricsfile, &metricssocket, &r->lossfile, &r->metafile, &r->flagsfile, &loglevel, &logformat, &controlsocket, &r->profiling);
+
+  // set up logging
+  if (log_init(logfile, loglevel, logformat)) {
+    fprintf(stderr, "ERROR opening logfile: %s\n", logfile);
+    exit(EXIT_FAILURE);
+  }
+  LOG("Logging to logfile: %s\n", logfile);
+  free (logfile);
+  LOG("fill ringbuffer version: " VERSION "\n");
+
+  // observation from the commandline
+  have_obs = header != NULL;
+  if (have_obs) {
+    memset(&obs, 0, sizeof(observation_t));
+    snprintf(obs.header, sizeof(obs.header), "%s", header);
+    snprintf(obs.key, sizeof(obs.key), "%s", key);
+    obs.startpacket = startpacket;
+    obs.duration = duration;
+    free(header); header = NULL;
+    free(key); key = NULL;
+  }
+
+  // sockets, the first endpoint is received on by this thread
+  nendpoints = endpoint_parse(endpointlist, endpoints, ENDPOINT_MAX);
+  if (nendpoints < 1) {
+    LOG_ERR("ERROR. Cannot parse the endpoints %s\n", endpointlist);
+    exit(EXIT_FAILURE);
+  }
+  free(endpointlist);
+  for (i = 0; i < nendpoints; i++) {
+    LOG("Opening network port %s%s%i (NUMA node %i)\n", endpoints[i].address, endpoints[i].address[0] ? ":" : "", endpoints[i].port, endpoints[i].numa_node);
+  }
+  if (endpoints[0].numa_node >= 0 && endpoint_pin(endpoints[0].numa_node)) {
+    LOG_WARN("WARNING: Cannot pin to NUMA node %i\n", endpoints[0].numa_node);
+  }
+  r->sockfd = init_network(&endpoints[0], sockbufsize, nendpoints > 1 ? STREAM_TIMEOUT_US : 0);
+  LOG("Packets per recvmmsg call = %i\n", r->vlen);
+  LOG("Socket buffer size = %i B\n", sockbufsize);
+
+  // profiling, of this thread
+  status = profile_init(&r->profile, r->profiling);
+  if (status < 0) {
+    LOG_WARN("WARNING: Profiling is not built in, rebuild with ENABLE_PROFILE\n");
+  } else if (r->profiling) {
+    LOG("Profiling the receive loop, %i of %i hardware counters available\n", status, PROFILE_COUNTERS);
+  }
+
+  // packet buffer, on the heap to be able to lock it and use huge pages
+  // packets on the wire have a PACKHEADER byte header, larger than the header of packet_t,
+  // so the last packet of the buffer can run PACKHEADER bytes past it
+  warmup_clear(&slab_warmup);
+  if (r->warm) {
+    r->packet_buffer = warmup_alloc(&slab_warmup, MMSG_VLEN * sizeof(packet_t) + PACKHEADER);
+  } else {
+    r->packet_buffer = malloc(MMSG_VLEN * sizeof(packet_t) + PACKHEADER);
+  }
+  if (! r->packet_buffer) {
+    LOG_ERR("ERROR. Cannot allocate packet buffer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // the packets that may start a new timeline, only touched at a timestamp reset
+  r->held = malloc((RESET_PACKETS - 1) * sizeof(packet_t));
+  if (! r->held) {
+    LOG_ERR("ERROR. Cannot allocate packet buffer\n");
+    exit(EXIT_FAILURE);
+  }
+  if (r->warm) {
+    status = warmup_describe(&slab_warmup, "packet buffer", message, sizeof(message));
+    log_printf(status ? LOG_WARNING : LOG_INFO, "%s", message);
+  }
+
+  // multi message setup, the packet size is set per observation
+  memset(r->msgs, 0, sizeof(r->msgs));
+  for(i=0; i < MMSG_VLEN; i++) {
+    r->iov[i].iov_base = (char *) &r->packet_buffer[i];
+
+    r->msgs[i].msg_hdr.msg_name    = NULL; // we don't need to know who sent the data
+    r->msgs[i].msg_hdr.msg_iov     = &r->iov[i];
+    r->msgs[i].msg_hdr.msg_iovlen  = 1;
+    r->msgs[i].msg_hdr.msg_control = r->control[i]; // only for the kernel drop counter and arrival time
+    r->msgs[i].msg_hdr.msg_controllen = sizeof(r->control[i]);
+  }
+  r->packet_idx = r->npackets = 0;
+
+  // metrics
+  if (metrics_init(&r->metrics, metricsfile, metricssocket)) {
+    LOG_ERR("ERROR. Cannot set up metrics export\n");
+    exit(EXIT_FAILURE);
+  }
+  if (metricsfile) {
+    LOG("Metrics file: %s\n", metricsfile);
+  }
+  if (metricssocket) {
+    LOG("Metrics socket: %s\n", metricssocket);
+  }
+
+  // the other endpoints, each with its own thread
+  if (nendpoints > 1 && start_streams(r, &endpoints[1], nendpoints - 1, sockbufsize)) {
+    LOG_ERR("ERROR. Cannot start receiving on the other endpoints\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Try to do a clean exit on SIGTERM: the handler only sets a flag; without SA_RESTART, it interrupts recvmmsg
+  signal_receiver = r;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_shutdown;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, NULL);
+
+  if (!controlsocket) {
+    if (observe(r, NULL, &obs)) {
+      clean_exit();
+    }
+    if (shutdown_requested) {
+      LOG("Received SIGTERM, shutting down\n");
+    }
+  } else {
+    if (control_init(&control, controlsocket)) {
+      LOG_ERR("ERROR. Cannot set up control socket %s\n", controlsocket);
+      clean_exit();
+    }
+    signal_control = &control;
+    LOG("Daemon mode, control socket: %s\n", controlsocket);
+
+    while (next_request(&control) != CONTROL_QUIT) {
+      if (have_obs) {
+        have_obs = 0;
+      } else if (!control_next(&control, &obs)) {
+        // idle, keep the sockets empty so old packets are not mistaken for the next observation
+        if (r->keep_from != ULONG_MAX) {
+          lock_streams(r);
+          share_page(r, NULL, NULL, 0, ULONG_MAX);
+          unlock_streams(r);
+        }
+        r->packet_idx = r->npackets;
+        drain_until(r->sockfd, r->packet_buffer, r->vlen, realtime_ns() + CONTROL_INTERVAL_NS, ULONG_MAX, &r->cb_index, &drained);
+        continue;
+      }
+
+      if (observe(r, &control, &obs)) {
+        LOG_ERR("ERROR. Cannot set up the observation starting at %lu, skipped\n", obs.startpacket);
+        end_transfer(r);
+      }
+    }
+    LOG("Received %s, shutting down\n", shutdown_requested ? "SIGTERM" : "quit command");
   }
 
   // clean up and exit
+  if (signal_control) {
+    control_close(signal_control);
+    signal_control = NULL;
+  }
+  stop_streams(r);
+  metrics_stop(&r->metrics);
+  profile_close(&r->profile);
+  if (r->rb) {
+    close_ringbuffer(r);
+  }
+  log_close();
   fflush(stdout);
   fflush(stderr);
-  fflush(runlog);
 
-  close(sockfd);
-  fclose(runlog);
+  close(r->sockfd);
   exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,183 @@
+/**
+ * Flag masks of the beamformer, published in a sidecar file next to the ring buffer
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flagmask.h"
+
+/**
+ * Bytes per mask for a page layout
+ */
+static size_t mask_size(const assembler_t *assembler) {
+  return (size_t) assembler->packets_per_sample * ASSEMBLE_FLAG_WORDS * sizeof(uint64_t);
+}
+
+static flagmask_slot_t *get_slot(const flagmask_t *f, uint64_t page) {
+  return (flagmask_slot_t *) (f->masks + (page % f->header->nmasks) * f->header->stride);
+}
+
+/**
+ * Create (or replace) the sidecar file, for the writer
+ *
+ * @param {flagmask_t *} f To initialize
+ * @param {char *} path File, e.g. in /dev/shm
+ * @param {uint32_t} nmasks Number of masks, at least the number of pages in the ring buffer
+ * @param {assembler_t *} assembler Layout of the pages
+ * @returns {int} 0 on success, -1 on error
+ */
+int flagmask_create(flagmask_t *f, const char *path, uint32_t nmasks, const assembler_t *assembler) {
+  uint64_t stride;
+  void *base;
+  int fd;
+
+  f->mask_size = mask_size(assembler);
+  stride = sizeof(flagmask_slot_t) + ((f->mask_size + 63) & ~63UL);
+  f->size = sizeof(flagmask_header_t) + nmasks * stride;
+
+  // a new file, readers of the previous one keep their mapping
+  unlink(path);
+  fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+    perror("ERROR. Cannot create flag mask file");
+    return -1;
+  }
+  if (ftruncate(fd, 0) || ftruncate(fd, f->size)) {
+    perror("ERROR. Cannot size flag mask file");
+    close(fd);
+    return -1;
+  }
+  base = mmap(NULL, f->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("ERROR. Cannot map flag mask file");
+    return -1;
+  }
+
+  f->header = base;
+  f->masks = (char *) base + sizeof(flagmask_header_t);
+  f->header->version = FLAGMASK_VERSION;
+  f->header->nmasks = nmasks;
+  f->header->bits = ASSEMBLE_FLAG_BITS;
+  f->header->mask_size = f->mask_size;
+  f->header->stride = stride;
+  f->header->ntabs = assembler->ntabs;
+  f->header->channels = assembler->channel_slots;
+  f->header->sequence_length = assembler->sequence_length;
+  f->header->science_case = assembler->science_case;
+  f->header->science_mode = assembler->science_mode;
+  __atomic_store_n(&f->header->magic, FLAGMASK_MAGIC, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/**
+ * Open an existing sidecar file, for a reader
+ *
+ * @returns {int} 0 on success, -1 on error
+ */
+int flagmask_open(flagmask_t *f, const char *path) {
+  struct stat st;
+  void *base;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) || st.st_size < (off_t) sizeof(flagmask_header_t)) {
+    fprintf(stderr, "ERROR. Cannot open flag mask file %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  f->size = st.st_size;
+  base = mmap(NULL, f->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("ERROR. Cannot map flag mask file");
+    return -1;
+  }
+
+  f->header = base;
+  f->masks = (char *) base + sizeof(flagmask_header_t);
+  f->mask_size = f->header->mask_size;
+  if (f->header->magic != FLAGMASK_MAGIC || f->header->version != FLAGMASK_VERSION ||
+      f->header->stride < sizeof(flagmask_slot_t) + f->mask_size ||
+      f->size < sizeof(flagmask_header_t) + f->header->nmasks * f->header->stride) {
+    fprintf(stderr, "ERROR. Not a flag mask file, or a different version: %s\n", path);
+    munmap(base, f->size);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Check if the sidecar can be kept for the next observation
+ *
+ * @returns {int} 1 when it has the number of masks and the page layout, 0 otherwise
+ */
+int flagmask_matches(const flagmask_t *f, uint32_t nmasks, const assembler_t *assembler) {
+  return f->header && f->header->nmasks == nmasks && f->mask_size == mask_size(assembler) &&
+    f->header->ntabs == assembler->ntabs && f->header->channels == assembler->channel_slots &&
+    f->header->sequence_length == assembler->sequence_length &&
+    f->header->science_case == assembler->science_case && f->header->science_mode == assembler->science_mode;
+}
+
+/**
+ * The mask of a ring buffer page, to fill in place by the writer; it is unpublished until flagmask_publish
+ *
+ * @param {uint64_t} page Ring buffer page number, see ringbuffer_count
+ * @returns {uint8_t *} The mask
+ */
+uint8_t *flagmask_slot(flagmask_t *f, uint64_t page) {
+  flagmask_slot_t *slot = get_slot(f, page);
+
+  __atomic_store_n(&slot->page, 0, __ATOMIC_RELEASE);
+  return (uint8_t *) (slot + 1);
+}
+
+/**
+ * Publish the mask of a ring buffer page, call before handing over the page
+ *
+ * @param {uint64_t} page Ring buffer page number, see ringbuffer_count
+ * @param {uint8_t *} mask Mask to copy, or NULL when it was filled in place, see flagmask_slot
+ */
+void flagmask_publish(flagmask_t *f, uint64_t page, const uint8_t *mask) {
+  flagmask_slot_t *slot = get_slot(f, page);
+
+  if (mask) {
+    __atomic_store_n(&slot->page, 0, __ATOMIC_RELEASE);
+    memcpy(slot + 1, mask, f->mask_size);
+  }
+  __atomic_store_n(&slot->page, page + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Find the mask of a ring buffer page
+ *
+ * @param {uint64_t} page Ring buffer page number, see ringbuffer_count
+ * @returns {uint8_t *} The mask, or NULL when it was not published (yet)
+ */
+const uint8_t *flagmask_find(const flagmask_t *f, uint64_t page) {
+  const flagmask_slot_t *slot = get_slot(f, page);
+
+  if (__atomic_load_n(&slot->page, __ATOMIC_ACQUIRE) != page + 1) {
+    return NULL;
+  }
+  return (const uint8_t *) (slot + 1);
+}
+
+void flagmask_close(flagmask_t *f) {
+  if (f->header) {
+    munmap(f->header, f->size);
+    f->header = NULL;
+    f->masks = NULL;
+  }
+}
@@ -0,0 +1,72 @@
+/**
+ * Flag masks of the beamformer, published in a sidecar file next to the ring buffer
+ * Author: Jisk Attema
+ *
+ * Every packet carries 192 flag bits from the beamformer (packet_t.flags, three 64 bit words in network byte order),
+ * each flagging a block of consecutive samples of the packet: about 33 samples for Stokes I, about 3 for Stokes IQUV.
+ * fill_ringbuffer copies them bit-packed, as three 64 bit words in host byte order, to a mask per page
+ * with the layout of the page at reduced time resolution:
+ *
+ *   Stokes I     [tab][channel][sequence_length][3 words]
+ *   Stokes IQUV  [tab][channel / 4][sequence_length][3 words]
+ *
+ * so the flags of a packet are at word slot * 3, see assemble_slot; flag k is bit k % 64 of word k / 64, 1 for flagged.
+ * As with the data, missing packets leave stale flags from an earlier page; see the bitmap of the page metadata.
+ *
+ *   flagmask_header_t                        64 bytes
+ *   nmasks times:
+ *     flagmask_slot_t                        64 bytes
+ *     mask                                   mask_size bytes, rounded up to 64
+ *
+ * The mask of ring buffer page p is at index p % nmasks, like the records of pagemeta.h:
+ *
+ *   page = ringbuffer_next_read(rb, RING_DATA, &size);
+ *   mask = flagmask_find(&flags, ringbuffer_count(rb, RING_DATA));
+ */
+#ifndef FLAGMASK_H
+#define FLAGMASK_H
+
+#include <stdint.h>
+
+#include "assemble.h"
+
+#define FLAGMASK_MAGIC 0x47414c46          // 'FLAG'
+#define FLAGMASK_VERSION 2
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t nmasks;
+  uint32_t bits;                           // flags per packet, ASSEMBLE_FLAG_BITS, bit-packed
+  uint64_t mask_size;                      // bytes per mask
+  uint64_t stride;                         // bytes from one mask slot to the next
+  uint16_t ntabs;
+  uint16_t channels;                       // channel slots: 1536 for Stokes I, 384 for Stokes IQUV, fewer with a channel selection
+  uint16_t sequence_length;
+  uint16_t science_case;
+  uint16_t science_mode;
+  uint8_t padding[22];
+} flagmask_header_t;
+
+typedef struct {
+  uint64_t page;                           // ring buffer page number plus one, written last; 0 while unused or being written
+  uint8_t padding[56];
+} flagmask_slot_t;
+
+typedef struct {
+  flagmask_header_t *header;
+  char *masks;
+  size_t size;                             // of the mapping
+  size_t mask_size;
+} flagmask_t;
+
+int flagmask_create(flagmask_t *f, const char *path, uint32_t nmasks, const assembler_t *assembler);
+int flagmask_open(flagmask_t *f, const char *path);
+int flagmask_matches(const flagmask_t *f, uint32_t nmasks, const assembler_t *assembler);
+uint8_t *flagmask_slot(flagmask_t *f, uint64_t page);
+void flagmask_publish(flagmask_t *f, uint64_t page, const uint8_t *mask);
+const uint8_t *flagmask_find(const flagmask_t *f, uint64_t page);
+void flagmask_close(flagmask_t *f);
+
+#endif
@@ -0,0 +1,127 @@
+/**
+ * Histograms with power of two bins, for timing measurements
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+
+/**
+ * Reset all counts
+ */
+void histogram_clear(histogram_t *histogram) {
+  memset(histogram, 0, sizeof(histogram_t));
+  histogram->min = ~0UL;
+}
+
+/**
+ * Add a value, typically a duration in nanoseconds
+ */
+void histogram_add(histogram_t *histogram, unsigned long value) {
+  int bin = value ? 64 - __builtin_clzl(value) : 0;
+
+  if (bin >= HISTOGRAM_BINS) {
+    bin = HISTOGRAM_BINS - 1;
+  }
+  histogram->count[bin]++;
+  histogram->n++;
+  histogram->sum += value;
+  if (value < histogram->min) {
+    histogram->min = value;
+  }
+  if (value > histogram->max) {
+    histogram->max = value;
+  }
+}
+
+/**
+ * Add the counts of another histogram
+ */
+void histogram_merge(histogram_t *histogram, const histogram_t *other) {
+  int bin;
+
+  for (bin = 0; bin < HISTOGRAM_BINS; bin++) {
+    histogram->count[bin] += other->count[bin];
+  }
+  histogram->n += other->n;
+  histogram->sum += other->sum;
+  if (other->min < histogram->min) {
+    histogram->min = other->min;
+  }
+  if (other->max > histogram->max) {
+    histogram->max = other->max;
+  }
+}
+
+/**
+ * Estimate a percentile as the upper edge of the bin containing it (clipped to the maximum)
+ *
+ * @param {double} percentile In the range [0, 100]
+ */
+unsigned long histogram_percentile(const histogram_t *histogram, double percentile) {
+  unsigned long target = (unsigned long) (percentile / 100.0 * histogram->n + 0.5);
+  unsigned long seen = 0;
+  int bin;
+
+  if (histogram->n == 0) {
+    return 0;
+  }
+  if (target == 0) {
+    target = 1;
+  }
+
+  for (bin = 0; bin < HISTOGRAM_BINS - 1; bin++) {
+    seen += histogram->count[bin];
+    if (seen >= target) {
+      unsigned long edge = bin ? (1UL << bin) - 1 : 0;
+      return edge < histogram->max ? edge : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+/**
+ * Print a single summary line, values in nanoseconds
+ *
+ * @returns {int} Number of characters written, as snprintf
+ */
+int histogram_summary(const histogram_t *histogram, char *buf, size_t size, const char *label) {
+  if (histogram->n == 0) {
+    return snprintf(buf, size, "%s: no samples\n", label);
+  }
+
+  return snprintf(buf, size,
+      "%s: n=%lu min=%.3fus mean=%.3fus p50<%.3fus p99<%.3fus max=%.3fus\n", label,
+      histogram->n, 1e-3 * histogram->min, 1e-3 * histogram->sum / histogram->n,
+      1e-3 * histogram_percentile(histogram, 50), 1e-3 * histogram_percentile(histogram, 99),
+      1e-3 * histogram->max);
+}
+
+/**
+ * Print a summary line followed by one line per non-empty bin, values in nanoseconds
+ *
+ * @returns {int} Number of characters written, as snprintf
+ */
+int histogram_format(const histogram_t *histogram, char *buf, size_t size, const char *label) {
+  int len = 0;
+  int bin;
+
+  len += histogram_summary(histogram, buf, size, label);
+  if (histogram->n == 0) {
+    return len;
+  }
+
+  for (bin = 0; bin < HISTOGRAM_BINS; bin++) {
+    if (histogram->count[bin] == 0) {
+      continue;
+    }
+    len += snprintf(buf + len, len < size ? size - len : 0,
+        "  %12.3fus - %12.3fus: %10lu (%6.2f%%)\n",
+        bin ? 1e-3 * (1UL << (bin - 1)) : 0.0, 1e-3 * (1UL << bin),
+        histogram->count[bin], 100.0 * histogram->count[bin] / histogram->n);
+  }
+
+  return len;
+}
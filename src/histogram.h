@@ -0,0 +1,28 @@
+/**
+ * Histograms with power of two bins, for timing measurements
+ * Author: Jisk Attema
+ *
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+
+#define HISTOGRAM_BINS 48          // bin b counts values in [2^(b-1), 2^b), bin 0 counts zeros
+
+typedef struct {
+  unsigned long count[HISTOGRAM_BINS];
+  unsigned long n;                 // number of values
+  unsigned long min;
+  unsigned long max;
+  double sum;
+} histogram_t;
+
+void histogram_clear(histogram_t *histogram);
+void histogram_add(histogram_t *histogram, unsigned long value);
+void histogram_merge(histogram_t *histogram, const histogram_t *other);
+unsigned long histogram_percentile(const histogram_t *histogram, double percentile);
+int histogram_summary(const histogram_t *histogram, char *buf, size_t size, const char *label);
+int histogram_format(const histogram_t *histogram, char *buf, size_t size, const char *label);
+
+#endif
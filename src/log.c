@@ -0,0 +1,296 @@
+/**
+ * Asynchronous logging
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "log.h"
+
+/*
+ * A slot of the ring, a bounded multi-producer queue:
+ * the slot is free for position p when its sequence is p, and holds the record of position p when its sequence is p + 1
+ */
+typedef struct {
+  uint64_t sequence;
+  int level;
+  struct timespec time;
+  char text[LOG_MESSAGE_SIZE];
+} log_record_t;
+
+static struct {
+  log_record_t records[LOG_RECORDS];
+  uint64_t head;             // next position to claim, by the logging threads
+  uint64_t tail;             // next position to write, by the writer only
+  uint64_t dropped;          // records dropped because the ring was full
+  uint64_t suppressed;       // records dropped by the rate limit
+  int64_t window;            // second of the rate limit window
+  uint64_t window_count;     // records in the window
+
+  int level;                 // minimum level to log
+  int format;
+  FILE *file;
+  int running;
+  int stop;
+  pthread_t writer;
+} logger;
+
+static const char *level_names[] = {"debug", "info", "notice", "warning", "error"};
+
+/**
+ * Write a record as key=value pairs: time, level, and the message quoted
+ */
+static void write_keyvalue(FILE *out, int level, const struct timespec *time, const char *text) {
+  char stamp[32];
+  struct tm tm;
+  const char *c;
+
+  gmtime_r(&time->tv_sec, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+  fprintf(out, "time=%s.%06liZ level=%s msg=\"", stamp, time->tv_nsec / 1000, level_names[level]);
+
+  for (c = text; *c; c++) {
+    switch (*c) {
+      case '"': fputs("\\\"", out); break;
+      case '\\': fputs("\\\\", out); break;
+      case '\n': if (c[1]) fputs("\\n", out); break;  // drop the trailing newline
+      default: fputc(*c, out); break;
+    }
+  }
+  fputs("\"\n", out);
+}
+
+static void write_record(int level, const struct timespec *time, const char *text) {
+  if (logger.format == LOG_KEYVALUE) {
+    write_keyvalue(stdout, level, time, text);
+    if (logger.file) {
+      write_keyvalue(logger.file, level, time, text);
+    }
+  } else {
+    fputs(text, stdout);
+    if (logger.file) {
+      fputs(text, logger.file);
+    }
+  }
+}
+
+/**
+ * Write all records in the ring, and report the records that were dropped
+ *
+ * @returns {int} Number of records written
+ */
+static int drain(void) {
+  log_record_t *record;
+  uint64_t dropped, suppressed;
+  struct timespec now;
+  char text[128];
+  int n = 0;
+
+  while (1) {
+    record = &logger.records[logger.tail & (LOG_RECORDS - 1)];
+    if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != logger.tail + 1) {
+      break;
+    }
+    write_record(record->level, &record->time, record->text);
+
+    // free the slot for the next round
+    __atomic_store_n(&record->sequence, logger.tail + LOG_RECORDS, __ATOMIC_RELEASE);
+    logger.tail++;
+    n++;
+  }
+
+  dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_ACQ_REL);
+  suppressed = __atomic_exchange_n(&logger.suppressed, 0, __ATOMIC_ACQ_REL);
+  if (dropped || suppressed) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    snprintf(text, sizeof(text), "WARNING: log records dropped: %lu (log full), %lu (rate limit)\n", dropped, suppressed);
+    write_record(LOG_WARNING, &now, text);
+    n++;
+  }
+
+  if (n) {
+    fflush(stdout);
+    if (logger.file) {
+      fflush(logger.file);
+    }
+  }
+  return n;
+}
+
+/**
+ * Writer thread: write the records, until stopped and the ring is empty
+ */
+static void *writer_thread(void *arg) {
+  sigset_t all;
+  int stop;
+
+  // leave signals to the other threads, so a signal handler can stop and join us
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  while (1) {
+    stop = __atomic_load_n(&logger.stop, __ATOMIC_ACQUIRE);
+    if (drain() == 0) {
+      if (stop) {
+        break;
+      }
+      usleep(LOG_POLL_MS * 1000);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Open the log file and start the writer; the log is closed (and flushed) at exit
+ *
+ * @param {char *} filename Log file, or NULL to only log to stdout
+ * @param {int} level Minimum level to log
+ * @param {int} format LOG_PLAIN or LOG_KEYVALUE
+ * @returns {int} 0 on success, -1 on error
+ */
+int log_init(const char *filename, int level, int format) {
+  uint64_t i;
+
+  logger.level = level;
+  logger.format = format;
+  logger.head = 0;
+  logger.tail = 0;
+  for (i = 0; i < LOG_RECORDS; i++) {
+    logger.records[i].sequence = i;
+  }
+
+  if (filename) {
+    logger.file = fopen(filename, "w");
+    if (!logger.file) {
+      return -1;
+    }
+  }
+
+  if (pthread_create(&logger.writer, NULL, writer_thread, NULL)) {
+    return -1;
+  }
+  logger.running = 1;
+  atexit(log_close);
+
+  return 0;
+}
+
+/**
+ * Log a message, without blocking: it is formatted into the ring and written by the writer thread
+ * Before log_init, or after log_close, the message is written to stdout directly.
+ *
+ * @param {int} level One of the log_level
+ */
+void log_printf(int level, const char *format, ...) {
+  log_record_t *record;
+  struct timespec now;
+  uint64_t pos, sequence;
+  int64_t window;
+  va_list args;
+
+  if (level < logger.level) {
+    return;
+  }
+
+  if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+    va_start(args, format);
+    vfprintf(stdout, format, args);
+    va_end(args);
+    fflush(stdout);
+    return;
+  }
+
+  // rate limit: at most LOG_RATE records per second, except notices, warnings and errors
+  if (level < LOG_NOTICE) {
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    window = __atomic_load_n(&logger.window, __ATOMIC_ACQUIRE);
+    if (now.tv_sec != window &&
+        __atomic_compare_exchange_n(&logger.window, &window, now.tv_sec, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&logger.window_count, 0, __ATOMIC_RELEASE);
+    }
+    if (__atomic_add_fetch(&logger.window_count, 1, __ATOMIC_ACQ_REL) > LOG_RATE) {
+      __atomic_add_fetch(&logger.suppressed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  // claim a slot
+  pos = __atomic_load_n(&logger.head, __ATOMIC_ACQUIRE);
+  while (1) {
+    record = &logger.records[pos & (LOG_RECORDS - 1)];
+    sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+    if (sequence == pos) {
+      if (__atomic_compare_exchange_n(&logger.head, &pos, pos + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      // pos is updated to the current head, try again
+    } else if (sequence < pos) {
+      // the writer did not free this slot yet: the ring is full
+      __atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&logger.head, __ATOMIC_ACQUIRE);
+    }
+  }
+
+  record->level = level;
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  va_start(args, format);
+  vsnprintf(record->text, LOG_MESSAGE_SIZE, format, args);
+  va_end(args);
+
+  // publish
+  __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Stop the writer after writing all records, and close the log file
+ */
+void log_close(void) {
+  if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  __atomic_store_n(&logger.stop, 1, __ATOMIC_RELEASE);
+  pthread_join(logger.writer, NULL);
+  __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+
+  if (logger.file) {
+    fclose(logger.file);
+    logger.file = NULL;
+  }
+}
+
+/**
+ * @returns {int} The log_level with this name, or -1
+ */
+int log_parse_level(const char *name) {
+  int level;
+
+  for (level = LOG_DEBUG; level <= LOG_ERROR; level++) {
+    if (strcmp(name, level_names[level]) == 0) {
+      return level;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @returns {int} LOG_PLAIN for 'plain', LOG_KEYVALUE for 'kv', or -1
+ */
+int log_parse_format(const char *name) {
+  if (strcmp(name, "plain") == 0) {
+    return LOG_PLAIN;
+  }
+  if (strcmp(name, "kv") == 0) {
+    return LOG_KEYVALUE;
+  }
+  return -1;
+}
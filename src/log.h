@@ -0,0 +1,48 @@
+/**
+ * Asynchronous logging
+ * Author: Jisk Attema
+ *
+ * Log records are formatted by the calling thread into a fixed size, lock-free ring of records,
+ * and written to stdout and the log file by a background thread. Logging never blocks:
+ * when the ring is full the record is dropped, and the number of dropped records is logged later.
+ * Records below LOG_NOTICE are rate limited to LOG_RATE per second; use LOG_NOTICE for run summaries.
+ *
+ * Records are written as is (plain), or as key=value pairs:
+ *   time=2024-01-01T12:00:00.000000Z level=info msg="Compound beam ..."
+ */
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define LOG_RECORDS 256            // Records in the ring, a power of two
+#define LOG_MESSAGE_SIZE 4096      // Maximum length of a single record, longer messages are truncated
+#define LOG_RATE 100               // Records per second below LOG_NOTICE, the rest is suppressed
+#define LOG_POLL_MS 10             // How often the writer checks for new records
+
+enum log_level {
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_NOTICE,
+  LOG_WARNING,
+  LOG_ERROR
+};
+
+enum log_format {
+  LOG_PLAIN,
+  LOG_KEYVALUE
+};
+
+int log_init(const char *filename, int level, int format);
+void log_printf(int level, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+void log_close(void);
+
+int log_parse_level(const char *name);
+int log_parse_format(const char *name);
+
+#define LOG(...) log_printf(LOG_INFO, __VA_ARGS__)
+#define LOG_WARN(...) log_printf(LOG_WARNING, __VA_ARGS__)
+#define LOG_ERR(...) log_printf(LOG_ERROR, __VA_ARGS__)
+
+#endif
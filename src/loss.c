@@ -0,0 +1,247 @@
+/**
+ * Packet loss per TAB, channel group, and sequence number
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loss.h"
+
+/**
+ * Number of bits set in the range [from, to) of a bitmap
+ */
+static uint64_t count_range(const uint64_t *bits, size_t from, size_t to) {
+  size_t first = from / 64;
+  size_t last = to / 64;
+  uint64_t head = ~0UL << (from % 64);
+  uint64_t tail = (to % 64) ? ~0UL >> (64 - to % 64) : 0;
+  uint64_t count = 0;
+  size_t w;
+
+  if (first == last) {
+    return __builtin_popcountl(bits[first] & head & tail);
+  }
+
+  count = __builtin_popcountl(bits[first] & head);
+  for (w = first + 1; w < last; w++) {
+    count += __builtin_popcountl(bits[w]);
+  }
+  if (tail) {
+    count += __builtin_popcountl(bits[last] & tail);
+  }
+  return count;
+}
+
+/**
+ * Set up the bitmaps for the page geometry of the assembler
+ *
+ * @param {loss_t *} loss To initialize
+ * @param {assembler_t *} assembler Initialized assembler
+ * @param {char *} summaryfile Binary summary file to append to, or NULL
+ * @returns {int} 0 on success, -1 on error
+ */
+int loss_init(loss_t *loss, const assembler_t *assembler, const char *summaryfile) {
+  size_t slot;
+  int s;
+
+  memset(loss, 0, sizeof(loss_t));
+  loss->ntabs = assembler->ntabs;
+  loss->nchannels = assembler->nchannels;
+  loss->channel_slots = assembler->channel_slots;
+  loss->sequence_length = assembler->sequence_length;
+  loss->slots_per_group = LOSS_GROUP_CHANNELS * assembler->channel_slots / assembler->nchannels;
+  // with a channel selection the last group can be smaller
+  loss->ngroups = (loss->channel_slots + loss->slots_per_group - 1) / loss->slots_per_group;
+  loss->nslots = assembler->packets_per_sample;
+  loss->nwords = (loss->nslots + 63) / 64;
+
+  loss->received = calloc(loss->nwords, sizeof(uint64_t));
+  loss->sequence_mask = calloc(loss->nwords * loss->sequence_length, sizeof(uint64_t));
+  loss->missing = calloc(loss->ntabs * loss->ngroups, sizeof(uint32_t));
+  loss->missing_sequence = calloc(loss->sequence_length, sizeof(uint32_t));
+  if (!loss->received || !loss->sequence_mask || !loss->missing || !loss->missing_sequence) {
+    return -1;
+  }
+
+  // a selection of tabs or channels is compacted in the page, keep the indices to describe the loss
+  for (s = 0; s < ASSEMBLE_MAX_TABS; s++) {
+    if (assembler->tab_slot[s] >= 0) {
+      loss->tab_index[(int) assembler->tab_slot[s]] = s;
+    }
+  }
+  for (s = 0; s < NCHANNELS; s++) {
+    if (assembler->channel_slot[s] >= 0) {
+      loss->channel_index[assembler->channel_slot[s]] = s;
+    }
+  }
+
+  // the sequence number is the fastest running index of a slot
+  for (slot = 0; slot < loss->nslots; slot++) {
+    s = slot % loss->sequence_length;
+    loss->sequence_mask[s * loss->nwords + slot / 64] |= 1UL << (slot % 64);
+  }
+
+  loss->record.magic = LOSS_MAGIC;
+  loss->record.version = LOSS_VERSION;
+  loss->record.ntabs = loss->ntabs;
+  loss->record.ngroups = loss->ngroups;
+  loss->record.channels_per_group = LOSS_GROUP_CHANNELS;
+  loss->record.sequence_length = loss->sequence_length;
+  loss->record.expected = loss->nslots;
+
+  if (summaryfile) {
+    loss->summary = fopen(summaryfile, "ab");
+    if (!loss->summary) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Count the missing packets of the page, write the summary, and clear the bitmap for the next page
+ *
+ * @param {uint64_t} timestamp Packet number of the start of the page
+ */
+void loss_page(loss_t *loss, uint64_t timestamp) {
+  size_t start, end;
+  uint32_t missing = 0;
+  size_t w;
+  int t, g, s, last;
+
+  // slots of a (tab, channel group) are contiguous
+  for (t = 0; t < loss->ntabs; t++) {
+    for (g = 0; g < loss->ngroups; g++) {
+      last = (g + 1) * loss->slots_per_group < loss->channel_slots ? (g + 1) * loss->slots_per_group : loss->channel_slots;
+      start = ((size_t) t * loss->channel_slots + g * loss->slots_per_group) * loss->sequence_length;
+      end = ((size_t) t * loss->channel_slots + last) * loss->sequence_length;
+      loss->missing[t * loss->ngroups + g] = end - start - count_range(loss->received, start, end);
+      missing += loss->missing[t * loss->ngroups + g];
+    }
+  }
+
+  for (s = 0; s < loss->sequence_length; s++) {
+    const uint64_t *mask = &loss->sequence_mask[s * loss->nwords];
+    uint32_t received = 0;
+    for (w = 0; w < loss->nwords; w++) {
+      received += __builtin_popcountl(loss->received[w] & mask[w]);
+    }
+    loss->missing_sequence[s] = loss->nslots / loss->sequence_length - received;
+  }
+
+  loss->record.timestamp = timestamp;
+  loss->record.missing = missing;
+
+  if (loss->summary) {
+    fwrite(&loss->record, sizeof(loss_record_t), 1, loss->summary);
+    fwrite(loss->missing, sizeof(uint32_t), loss->ntabs * loss->ngroups, loss->summary);
+    fwrite(loss->missing_sequence, sizeof(uint32_t), loss->sequence_length, loss->summary);
+    fflush(loss->summary);
+  }
+
+  memset(loss->received, 0, loss->nwords * sizeof(uint64_t));
+}
+
+/**
+ * Describe the channel indices of a channel group, as ranges: "0-63", or "60-63,128-187" with a channel selection
+ *
+ * @returns {int} Number of characters written, as snprintf
+ */
+static int describe_channels(const loss_t *loss, int group, char *buf, size_t size) {
+  int first = group * LOSS_GROUP_CHANNELS;
+  int last = first + LOSS_GROUP_CHANNELS < loss->nchannels ? first + LOSS_GROUP_CHANNELS : loss->nchannels;
+  int c, start, n = 0;
+
+  for (c = first; c < last; c = start) {
+    // a run of consecutive channel indices
+    start = c + 1;
+    while (start < last && loss->channel_index[start] == loss->channel_index[start - 1] + 1) {
+      start++;
+    }
+    if (start - 1 == c) {
+      n += snprintf(buf + n, n < (int) size ? size - n : 0, "%s%i", c == first ? "" : ",", loss->channel_index[c]);
+    } else {
+      n += snprintf(buf + n, n < (int) size ? size - n : 0, "%s%i-%i", c == first ? "" : ",",
+          loss->channel_index[c], loss->channel_index[start - 1]);
+    }
+  }
+  return n;
+}
+
+/**
+ * Describe where the packets of the last page went missing: the worst tab, channel group and sequence number
+ *
+ * @returns {int} Number of characters written, as snprintf
+ */
+int loss_describe(const loss_t *loss, char *buf, size_t size) {
+  uint32_t tab_missing, worst_tab_missing = 0, worst_group_missing = 0, worst_sequence_missing = 0;
+  int worst_tab = 0, worst_group = 0, worst_sequence = 0;
+  char channels[128];
+  int t, g, s;
+
+  for (t = 0; t < loss->ntabs; t++) {
+    tab_missing = 0;
+    for (g = 0; g < loss->ngroups; g++) {
+      tab_missing += loss->missing[t * loss->ngroups + g];
+    }
+    if (tab_missing > worst_tab_missing) {
+      worst_tab_missing = tab_missing;
+      worst_tab = t;
+    }
+  }
+
+  for (g = 0; g < loss->ngroups; g++) {
+    uint32_t group_missing = 0;
+    for (t = 0; t < loss->ntabs; t++) {
+      group_missing += loss->missing[t * loss->ngroups + g];
+    }
+    if (group_missing > worst_group_missing) {
+      worst_group_missing = group_missing;
+      worst_group = g;
+    }
+  }
+
+  for (s = 0; s < loss->sequence_length; s++) {
+    if (loss->missing_sequence[s] > worst_sequence_missing) {
+      worst_sequence_missing = loss->missing_sequence[s];
+      worst_sequence = s;
+    }
+  }
+
+  describe_channels(loss, worst_group, channels, sizeof(channels));
+  return snprintf(buf, size, "Loss: worst tab %i (%u), worst channels %s (%u), worst sequence number %i (%u)\n",
+      loss->tab_index[worst_tab], worst_tab_missing, channels, worst_group_missing,
+      worst_sequence, worst_sequence_missing);
+}
+
+/**
+ * Add the packets received by another thread to the current page, and clear its bitmap
+ *
+ * @param {uint64_t *} received Bitmap of the other thread, see loss_mark_bitmap
+ * @returns {uint32_t} Number of packets that were not received already, the others are duplicates
+ */
+uint32_t loss_merge(loss_t *loss, uint64_t *received) {
+  uint32_t added = 0;
+  size_t w;
+
+  for (w = 0; w < loss->nwords; w++) {
+    added += __builtin_popcountl(received[w] & ~loss->received[w]);
+    loss->received[w] |= received[w];
+    received[w] = 0;
+  }
+
+  return added;
+}
+
+void loss_close(loss_t *loss) {
+  if (loss->summary) {
+    fclose(loss->summary);
+  }
+  free(loss->received);
+  free(loss->sequence_mask);
+  free(loss->missing);
+  free(loss->missing_sequence);
+}
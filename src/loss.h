@@ -0,0 +1,93 @@
+/**
+ * Packet loss per TAB, channel group, and sequence number
+ * Author: Jisk Attema
+ *
+ * Every page has one bit per packet slot (see assemble_slot), set when the packet arrives.
+ * At the end of the page the missing packets are counted per (tab, channel group) and per sequence number
+ * with popcounts, and optionally appended to a binary summary file, one record per page:
+ *
+ *   loss_record_t                             header, 32 bytes
+ *   uint32_t missing[ntabs][ngroups]          missing packets per tab and channel group (of the selected channels)
+ *   uint32_t missing_sequence[sequence_length] missing packets per sequence number
+ *
+ * All in native (little) endian byte order.
+ */
+#ifndef LOSS_H
+#define LOSS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "assemble.h"
+
+#define LOSS_MAGIC 0x53534f4c         // 'LOSS'
+#define LOSS_VERSION 1
+#define LOSS_GROUP_CHANNELS 64        // Channels per channel group
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t ntabs;
+  uint16_t ngroups;
+  uint16_t channels_per_group;       // in channels
+  uint16_t sequence_length;
+  uint16_t reserved;
+  uint64_t timestamp;                // packet number of the start of the page
+  uint32_t expected;                 // packets expected in the page
+  uint32_t missing;                  // packets missing from the page
+} loss_record_t;
+
+typedef struct {
+  int ntabs;
+  int ngroups;
+  int channel_slots;                 // per tab, see assembler_t
+  int slots_per_group;               // channel slots per group: channels, or channels / 4 for IQUV
+  int nchannels;                     // channels in the page
+  unsigned char tab_index[ASSEMBLE_MAX_TABS];  // tab index per tab in the page, as selected
+  short channel_index[NCHANNELS];    // channel index per channel in the page, as selected
+  int sequence_length;
+  size_t nslots;
+  size_t nwords;
+  uint64_t *received;                // bitmap of the packets received for the current page
+  uint64_t *sequence_mask;           // [sequence_length][nwords] bitmaps selecting the slots per sequence number
+
+  // last page
+  uint32_t *missing;                 // [ntabs][ngroups]
+  uint32_t *missing_sequence;        // [sequence_length]
+  loss_record_t record;
+
+  FILE *summary;
+} loss_t;
+
+int loss_init(loss_t *loss, const assembler_t *assembler, const char *summaryfile);
+void loss_page(loss_t *loss, uint64_t timestamp);
+int loss_describe(const loss_t *loss, char *buf, size_t size);
+uint32_t loss_merge(loss_t *loss, uint64_t *received);
+void loss_close(loss_t *loss);
+
+/**
+ * Mark a packet slot as received in a bitmap, for threads that keep their own, see loss_merge
+ *
+ * @returns {int} 1 when it was already received (a duplicate), 0 otherwise
+ */
+static inline int loss_mark_bitmap(uint64_t *received, size_t slot) {
+  uint64_t bit = 1UL << (slot % 64);
+  uint64_t *word = &received[slot / 64];
+
+  if (*word & bit) {
+    return 1;
+  }
+  *word |= bit;
+  return 0;
+}
+
+/**
+ * Mark a packet slot as received
+ *
+ * @returns {int} 1 when it was already received (a duplicate), 0 otherwise
+ */
+static inline int loss_mark(loss_t *loss, size_t slot) {
+  return loss_mark_bitmap(loss->received, slot);
+}
+
+#endif
@@ -0,0 +1,261 @@
+/**
+ * Ingest metrics, exported in the Prometheus text format
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+#define METRICS_POLL_MS 100       // How often the exporter checks for new data and stop requests
+#define METRICS_TEXTSIZE 8192     // Maximum size of the exported text
+
+/**
+ * Write the metrics to the text file, atomically by renaming a temporary file
+ */
+static void write_textfile(metrics_t *m) {
+  char text[METRICS_TEXTSIZE];
+  char tmpname[4096];
+  FILE *file;
+  int len;
+
+  len = metrics_format(m, text, sizeof(text));
+
+  snprintf(tmpname, sizeof(tmpname), "%s.tmp", m->textfile);
+  file = fopen(tmpname, "w");
+  if (!file) {
+    return;
+  }
+  fwrite(text, 1, len, file);
+  fclose(file);
+  rename(tmpname, m->textfile);
+}
+
+/**
+ * Exporter thread: update the text file after every page, and answer clients on the UNIX socket
+ */
+static void *exporter_thread(void *arg) {
+  metrics_t *m = arg;
+  uint64_t written = 0;
+  char text[METRICS_TEXTSIZE];
+  struct pollfd pfd;
+  sigset_t all;
+  int client, len;
+
+  // leave signals to the receiving thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  pfd.fd = m->sockfd;
+  pfd.events = POLLIN;
+
+  while (!__atomic_load_n(&m->stop, __ATOMIC_ACQUIRE)) {
+    if (m->sockfd >= 0) {
+      if (poll(&pfd, 1, METRICS_POLL_MS) > 0) {
+        client = accept(m->sockfd, NULL, NULL);
+        if (client >= 0) {
+          len = metrics_format(m, text, sizeof(text));
+          if (write(client, text, len) < 0) {
+            // client went away, nothing to do
+          }
+          close(client);
+        }
+      }
+    } else {
+      usleep(METRICS_POLL_MS * 1000);
+    }
+
+    if (m->textfile && __atomic_load_n(&m->generation, __ATOMIC_ACQUIRE) != written) {
+      written = __atomic_load_n(&m->generation, __ATOMIC_ACQUIRE);
+      write_textfile(m);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Initialize the metrics, and start the exporter when a text file or socket is given
+ *
+ * @param {metrics_t *} m To initialize
+ * @param {char *} textfile Path of the Prometheus text file, or NULL
+ * @param {char *} socketpath Path of the UNIX socket, or NULL
+ * @returns {int} 0 on success, -1 on error
+ */
+int metrics_init(metrics_t *m, const char *textfile, const char *socketpath) {
+  struct sockaddr_un addr;
+
+  memset(m, 0, sizeof(metrics_t));
+  pthread_mutex_init(&m->lock, NULL);
+  m->sockfd = -1;
+
+  if (!textfile && !socketpath) {
+    return 0;
+  }
+
+  if (textfile) {
+    m->textfile = strdup(textfile);
+  }
+
+  if (socketpath) {
+    if (strlen(socketpath) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "ERROR. Socket path too long: %s\n", socketpath);
+      return -1;
+    }
+    m->socketpath = strdup(socketpath);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketpath);
+
+    m->sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketpath);
+    if (m->sockfd < 0 || bind(m->sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(m->sockfd, 4) < 0) {
+      perror("ERROR. Cannot open metrics socket");
+      return -1;
+    }
+  }
+
+  if (pthread_create(&m->exporter, NULL, exporter_thread, m)) {
+    perror("ERROR. Cannot start metrics exporter");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Add the counters of a thread to the totals, and clear them
+ */
+void metrics_add(metrics_t *m, metrics_counters_t *local) {
+  pthread_mutex_lock(&m->lock);
+  m->total.packets += local->packets;
+  m->total.bytes += local->bytes;
+  m->total.recv_calls += local->recv_calls;
+  m->total.invalid += local->invalid;
+  m->total.unselected += local->unselected;
+  m->total.late += local->late;
+  m->total.duplicates += local->duplicates;
+  m->total.kernel_drops += local->kernel_drops;
+  m->total.copied_bytes += local->copied_bytes;
+  m->total.recv_ns += local->recv_ns;
+  m->total.busy_ns += local->busy_ns;
+  m->total.blocked_ns += local->blocked_ns;
+  m->total.placeholders += local->placeholders;
+  m->total.outliers += local->outliers;
+  m->total.resets += local->resets;
+  pthread_mutex_unlock(&m->lock);
+
+  memset(local, 0, sizeof(metrics_counters_t));
+}
+
+/**
+ * Record the statistics of a finished page, call after metrics_add
+ */
+void metrics_page(metrics_t *m, const metrics_page_t *page) {
+  uint64_t busy;
+
+  pthread_mutex_lock(&m->lock);
+  m->page = *page;
+  m->pages++;
+  m->missing += page->missing;
+
+  busy = m->total.busy_ns - m->previous.busy_ns;
+  m->copy_bandwidth = busy ? 1e9 * (m->total.copied_bytes - m->previous.copied_bytes) / busy : 0;
+  m->previous = m->total;
+  pthread_mutex_unlock(&m->lock);
+
+  __atomic_add_fetch(&m->generation, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Format the metrics in the Prometheus text exposition format
+ *
+ * @returns {int} Number of characters written
+ */
+int metrics_format(metrics_t *m, char *buf, size_t size) {
+  metrics_counters_t t;
+  metrics_page_t p;
+  uint64_t pages, missing;
+  double bandwidth;
+  size_t len = 0;
+
+  pthread_mutex_lock(&m->lock);
+  t = m->total;
+  p = m->page;
+  pages = m->pages;
+  missing = m->missing;
+  bandwidth = m->copy_bandwidth;
+  pthread_mutex_unlock(&m->lock);
+
+#define METRIC(name, type, help, format, value) \
+  if (len < size) { \
+    len += snprintf(&buf[len], size - len, "# HELP fill_ringbuffer_" name " " help "\n# TYPE fill_ringbuffer_" name " " type "\nfill_ringbuffer_" name " " format "\n", value); \
+  }
+
+  METRIC("packets_total", "counter", "Packets received.", "%lu", t.packets);
+  METRIC("bytes_total", "counter", "Bytes received.", "%lu", t.bytes);
+  METRIC("recv_calls_total", "counter", "recvmmsg calls.", "%lu", t.recv_calls);
+  METRIC("packets_per_recv", "gauge", "Average number of packets per recvmmsg call.", "%.2f", t.recv_calls ? (double) t.packets / t.recv_calls : 0.0);
+  METRIC("invalid_packets_total", "counter", "Packets dropped because of an invalid header.", "%lu", t.invalid);
+  METRIC("unselected_packets_total", "counter", "Packets dropped because they are not in the selected tabs and channels.", "%lu", t.unselected);
+  METRIC("late_packets_total", "counter", "Packets dropped because their page was already handed over.", "%lu", t.late);
+  METRIC("duplicate_packets_total", "counter", "Packets dropped because their slot was already filled.", "%lu", t.duplicates);
+  METRIC("kernel_drops_total", "counter", "Packets dropped by the kernel, socket buffer full.", "%lu", t.kernel_drops);
+  METRIC("missing_packets_total", "counter", "Packets missing from pages.", "%lu", missing);
+  METRIC("pages_total", "counter", "Pages handed to the ring buffer.", "%lu", pages);
+  METRIC("placeholder_pages_total", "counter", "Pages handed to the ring buffer without data, for frames without any packets.", "%lu", t.placeholders);
+  METRIC("outlier_packets_total", "counter", "Packets dropped because their timestamp is far from the current page.", "%lu", t.outliers);
+  METRIC("timestamp_resets_total", "counter", "Timestamp jumps after which the observation continued from the new timestamp.", "%lu", t.resets);
+  METRIC("copied_bytes_total", "counter", "Payload bytes copied to pages.", "%lu", t.copied_bytes);
+  METRIC("recv_seconds_total", "counter", "Time spent waiting for packets.", "%.6f", 1e-9 * t.recv_ns);
+  METRIC("busy_seconds_total", "counter", "Time spent validating and copying packets.", "%.6f", 1e-9 * t.busy_ns);
+  METRIC("blocked_seconds_total", "counter", "Time spent waiting for a free ring buffer page.", "%.6f", 1e-9 * t.blocked_ns);
+  METRIC("copy_bandwidth_bytes_per_second", "gauge", "Payload copied per second of busy time, over the last page.", "%.0f", bandwidth);
+  METRIC("page_timestamp", "gauge", "Packet number of the start of the last page.", "%lu", p.timestamp);
+  METRIC("page_missing_ratio", "gauge", "Fraction of packets missing from the last page.", "%.6f", p.expected ? (double) p.missing / p.expected : 0.0);
+  METRIC("ring_pages_full", "gauge", "Ring buffer pages in use after the last page.", "%lu", p.ring_full);
+  METRIC("ring_pages", "gauge", "Ring buffer pages.", "%lu", p.ring_nbufs);
+  METRIC("skipped_pages_total", "counter", "Pages thrown away because the ring buffer was full.", "%lu", p.skipped);
+  METRIC("spilled_pages_total", "counter", "Pages spilled to the spill pool because the ring buffer was full.", "%lu", p.spilled);
+  METRIC("spill_pages_pending", "gauge", "Spilled pages waiting for a free ring buffer page.", "%lu", p.spill_pending);
+  METRIC("page_latency_p50_seconds", "gauge", "Median network latency, packet arrival after the end of its data, over the last page.", "%.6f", 1e-9 * p.latency_p50_ns);
+  METRIC("page_latency_p99_seconds", "gauge", "99th percentile network latency over the last page.", "%.6f", 1e-9 * p.latency_p99_ns);
+  METRIC("page_jitter_p99_seconds", "gauge", "99th percentile time between packet arrivals over the last page.", "%.6f", 1e-9 * p.jitter_p99_ns);
+  METRIC("page_publication_seconds", "gauge", "Time from the last packet of the last page to handing the page to the ring buffer.", "%.6f", 1e-9 * p.publication_ns);
+
+#undef METRIC
+
+  return len < size ? len : size - 1;
+}
+
+/**
+ * Stop the exporter, write the final metrics, and remove the socket
+ */
+void metrics_stop(metrics_t *m) {
+  if (!m->textfile && !m->socketpath) {
+    return;
+  }
+
+  __atomic_store_n(&m->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(m->exporter, NULL);
+
+  if (m->textfile) {
+    write_textfile(m);
+    free(m->textfile);
+    m->textfile = NULL;
+  }
+  if (m->socketpath) {
+    close(m->sockfd);
+    unlink(m->socketpath);
+    free(m->socketpath);
+    m->socketpath = NULL;
+  }
+}
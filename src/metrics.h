@@ -0,0 +1,79 @@
+/**
+ * Ingest metrics, exported in the Prometheus text format
+ * Author: Jisk Attema
+ *
+ * Every receiving thread counts in its own metrics_counters_t, without locking or atomics.
+ * Once per page the counters are added to the shared totals, and the page statistics are updated.
+ * A background thread writes the totals to a text file (for node_exporter's textfile collector),
+ * and/or serves them on a UNIX socket: connect and read till EOF.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Counters kept by a single thread
+ */
+typedef struct {
+  uint64_t packets;          // received
+  uint64_t bytes;            // received
+  uint64_t recv_calls;       // recvmmsg calls
+  uint64_t invalid;          // failed validation, dropped
+  uint64_t unselected;       // not in the selected tabs and channels, dropped
+  uint64_t late;             // for a page that was already handed over, dropped
+  uint64_t duplicates;       // for a slot that was already filled, dropped
+  uint64_t kernel_drops;     // dropped by the kernel because the socket buffer was full
+  uint64_t copied_bytes;     // payload copied to pages
+  uint64_t recv_ns;          // time waiting in recvmmsg
+  uint64_t busy_ns;          // time validating and copying
+  uint64_t blocked_ns;       // time waiting for a free ring buffer page
+  uint64_t placeholders;     // pages handed over without data, for frames without any packets
+  uint64_t outliers;         // timestamp far from the current page, dropped
+  uint64_t resets;           // timestamp jumps, the observation continued from the new timestamp
+} metrics_counters_t;
+
+/*
+ * Statistics of the last page
+ */
+typedef struct {
+  uint64_t timestamp;        // packet number of the start of the page
+  uint64_t expected;         // packets expected
+  uint64_t missing;          // packets missing
+  uint64_t ring_full;        // ring buffer pages in use
+  uint64_t ring_nbufs;       // ring buffer pages
+  uint64_t latency_p50_ns;   // network latency: packet arrival - end of its data
+  uint64_t latency_p99_ns;
+  uint64_t jitter_p99_ns;    // time between packet arrivals
+  uint64_t publication_ns;   // last packet of the page to handing it to the ring buffer
+  uint64_t skipped;          // pages skipped because the ring buffer was full, total
+  uint64_t spilled;          // pages spilled because the ring buffer was full, total
+  uint64_t spill_pending;    // spilled pages waiting for a free ring buffer page
+} metrics_page_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  metrics_counters_t total;
+  metrics_page_t page;
+  uint64_t pages;
+  uint64_t missing;          // total over all pages
+  double copy_bandwidth;     // bytes per second of busy time, over the last page
+  uint64_t generation;       // bumped on every page
+  metrics_counters_t previous;  // totals at the previous page
+
+  // export
+  char *textfile;
+  char *socketpath;
+  int sockfd;
+  int stop;
+  pthread_t exporter;
+} metrics_t;
+
+int metrics_init(metrics_t *m, const char *textfile, const char *socketpath);
+void metrics_add(metrics_t *m, metrics_counters_t *local);
+void metrics_page(metrics_t *m, const metrics_page_t *page);
+int metrics_format(metrics_t *m, char *buf, size_t size);
+void metrics_stop(metrics_t *m);
+
+#endif
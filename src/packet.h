@@ -0,0 +1,44 @@
+/**
+ * Network packet layout, shared by the programs reading and writing packets
+ * Author: Jisk Attema, based on code by Roy Smits
+ *
+ */
+#ifndef PACKET_H
+#define PACKET_H
+
+#define PACKHEADER 114                   // Size of the packet header = PACKETSIZE-PAYLOADSIZE in bytes
+
+#define PACKETSIZE_STOKESI  6364         // Size of the packet, including the header in bytes
+#define PAYLOADSIZE_STOKESI 6250         // Size of the record = packet - header in bytes
+
+#define PACKETSIZE_STOKESIQUV  8114      // Size of the packet, including the header in bytes
+#define PAYLOADSIZE_STOKESIQUV 8000      // Size of the record = packet - header in bytes
+#define PAYLOADSIZE_MAX        8000      // Maximum of payload size of I, IQUV
+
+#define TIMEUNIT 781250           // Conversion factor of timestamp from seconds to (1.28 us) packets
+#define FRAMETIME 800000          // 1.024 seconds per frame (ringbuffer page), in units of 1.28 microseconds
+
+#define NCHANNELS 1536
+
+/*
+ * Header description based on:
+ * ARTS Interface Specification from BF to SC3+4
+ * ASTRON_SP_066_InterfaceSpecificationSC34.pdf
+ * revision 2.0
+ */
+typedef struct {
+  unsigned char marker_byte;         // See table 3 in PDF, page 6
+  unsigned char format_version;      // Version: 1
+  unsigned char cb_index;            // [0,39] one compound beam per fill_ringbuffer instance:: ignore
+  unsigned char tab_index;           // [0,ntabs-1] all tabs per fill_ringbuffer instance
+  unsigned short channel_index;      // [0,1535] all channels per fill_ringbuffer instance
+  unsigned short payload_size;       // Stokes I: 6250, IQUV: 8000
+  unsigned long timestamp;           // units of 1.28 us, since 1970-01-01 00:00.000 
+  unsigned char sequence_number;     // SC3: Stokes I: 0-1, Stokes IQUV: 0-24
+                                     // SC4: Stokes I: 0-3, Stokes IQUV: 0-49
+  unsigned char reserved[7];
+  unsigned long flags[3];
+  unsigned char record[PAYLOADSIZE_MAX];
+} packet_t;
+
+#endif
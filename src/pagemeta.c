@@ -0,0 +1,157 @@
+/**
+ * Per-page metadata, published in a sidecar file next to the ring buffer
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pagemeta.h"
+
+/**
+ * Create (or replace) the sidecar file, for the writer
+ *
+ * @param {pagemeta_t *} m To initialize
+ * @param {char *} path File, e.g. in /dev/shm
+ * @param {uint32_t} nrecords Number of records, at least the number of pages in the ring buffer
+ * @returns {int} 0 on success, -1 on error
+ */
+int pagemeta_create(pagemeta_t *m, const char *path, uint32_t nrecords) {
+  void *base;
+  int fd;
+
+  m->size = sizeof(pagemeta_header_t) + (size_t) nrecords * sizeof(pagemeta_record_t);
+
+  fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+    perror("ERROR. Cannot create page metadata file");
+    return -1;
+  }
+  if (ftruncate(fd, 0) || ftruncate(fd, m->size)) {
+    perror("ERROR. Cannot size page metadata file");
+    close(fd);
+    return -1;
+  }
+  base = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("ERROR. Cannot map page metadata file");
+    return -1;
+  }
+
+  m->header = base;
+  m->records = (pagemeta_record_t *) ((char *) base + sizeof(pagemeta_header_t));
+  m->header->version = PAGEMETA_VERSION;
+  m->header->nrecords = nrecords;
+  m->header->record_size = sizeof(pagemeta_record_t);
+  __atomic_store_n(&m->header->magic, PAGEMETA_MAGIC, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/**
+ * Open an existing sidecar file, for a reader
+ *
+ * @returns {int} 0 on success, -1 on error
+ */
+int pagemeta_open(pagemeta_t *m, const char *path) {
+  struct stat st;
+  void *base;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) || st.st_size < (off_t) sizeof(pagemeta_header_t)) {
+    fprintf(stderr, "ERROR. Cannot open page metadata file %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  m->size = st.st_size;
+  base = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("ERROR. Cannot map page metadata file");
+    return -1;
+  }
+
+  m->header = base;
+  m->records = (pagemeta_record_t *) ((char *) base + sizeof(pagemeta_header_t));
+  if (m->header->magic != PAGEMETA_MAGIC || m->header->version != PAGEMETA_VERSION ||
+      m->header->record_size != sizeof(pagemeta_record_t) ||
+      m->size < sizeof(pagemeta_header_t) + (size_t) m->header->nrecords * sizeof(pagemeta_record_t)) {
+    fprintf(stderr, "ERROR. Not a page metadata file, or a different version: %s\n", path);
+    munmap(base, m->size);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Fill a record for a finished page, with the packets received according to the loss bitmap
+ *
+ * @param {pagemeta_record_t *} record To fill, the page number is set on publication
+ * @param {assembler_t *} assembler Layout of the page
+ * @param {loss_t *} loss Bitmap of the packets received for the page
+ * @param {uint64_t} timestamp Packet number of the start of the page
+ * @param {uint32_t} received Packets received for the page
+ * @param {uint32_t} invalid Invalid packets dropped
+ */
+void pagemeta_fill(pagemeta_record_t *record, const assembler_t *assembler, const loss_t *loss, uint64_t timestamp, uint32_t received, uint32_t invalid) {
+  record->timestamp = timestamp;
+  record->flags = received < (uint32_t) assembler->packets_per_sample ? PAGEMETA_INCOMPLETE : 0;
+  record->expected = assembler->packets_per_sample;
+  record->received = received;
+  record->invalid = invalid;
+  record->ntabs = assembler->ntabs;
+  record->sequence_length = assembler->sequence_length;
+  record->science_case = assembler->science_case;
+  record->science_mode = assembler->science_mode;
+  record->nslots = loss->nslots;
+  memcpy(record->received_slots, loss->received, loss->nwords * sizeof(uint64_t));
+}
+
+/**
+ * Publish the record of a ring buffer page, call before handing over the page
+ *
+ * @param {uint64_t} page Ring buffer page number, see ringbuffer_count
+ */
+void pagemeta_publish(pagemeta_t *m, uint64_t page, const pagemeta_record_t *record) {
+  pagemeta_record_t *slot = &m->records[page % m->header->nrecords];
+  size_t words = (record->nslots + 63) / 64;
+
+  __atomic_store_n(&slot->page, 0, __ATOMIC_RELEASE);
+  memcpy((char *) slot + sizeof(uint64_t), (const char *) record + sizeof(uint64_t),
+      offsetof(pagemeta_record_t, received_slots) - sizeof(uint64_t) + words * sizeof(uint64_t));
+  __atomic_store_n(&slot->page, page + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Find the record of a ring buffer page
+ *
+ * @param {uint64_t} page Ring buffer page number, see ringbuffer_count
+ * @returns {pagemeta_record_t *} The record, or NULL when it was not published (yet)
+ */
+const pagemeta_record_t *pagemeta_find(const pagemeta_t *m, uint64_t page) {
+  const pagemeta_record_t *slot = &m->records[page % m->header->nrecords];
+
+  if (__atomic_load_n(&slot->page, __ATOMIC_ACQUIRE) != page + 1) {
+    return NULL;
+  }
+  return slot;
+}
+
+void pagemeta_close(pagemeta_t *m) {
+  if (m->header) {
+    munmap(m->header, m->size);
+    m->header = NULL;
+    m->records = NULL;
+  }
+}
@@ -0,0 +1,86 @@
+/**
+ * Per-page metadata, published in a sidecar file next to the ring buffer
+ * Author: Jisk Attema
+ *
+ * The ring buffer pages only hold data, and the header page is written once per observation.
+ * Before handing over a data page, fill_ringbuffer publishes a record for it in a small shared memory file:
+ * the timestamp of the page, the packets expected and received, flags, and a bitmap of the packets received.
+ * Missing packets leave stale data from an earlier page in their part of the page; the bitmap tells which parts.
+ *
+ *   pagemeta_header_t                        64 bytes
+ *   pagemeta_record_t[nrecords]              the record of ring buffer page p is at index p % nrecords
+ *
+ * The page number p counts all data pages of the ring buffer since it was created, see ringbuffer_count.
+ * A reader gets the record of the page it is about to read with:
+ *
+ *   page = ringbuffer_next_read(rb, RING_DATA, &size);
+ *   record = pagemeta_find(&meta, ringbuffer_count(rb, RING_DATA));
+ *
+ * and should be done with it before clearing the page, as the writer can then reuse the record.
+ *
+ * A bit of the bitmap is set when the packet of that slot arrived, see assemble_slot:
+ *   slot = (tab * channel_slots + channel_slot) * sequence_length + sequence_number
+ * with 1536 channel slots of one channel for Stokes I, and 384 channel slots of 4 channels for Stokes IQUV
+ * (fewer with a channel selection, see assemble_select).
+ * A packet holds the samples of part sequence_number of sequence_length parts of the page, in time.
+ */
+#ifndef PAGEMETA_H
+#define PAGEMETA_H
+
+#include <stdint.h>
+
+#include "assemble.h"
+#include "loss.h"
+
+#define PAGEMETA_MAGIC 0x4154454d          // 'META'
+#define PAGEMETA_VERSION 2
+#define PAGEMETA_SLOTS 230400              // Maximum packets per page: science case 4, IQUV, 12 tabs, 384 channel slots, 50 sequence numbers
+#define PAGEMETA_WORDS (PAGEMETA_SLOTS / 64)
+
+enum pagemeta_flags {
+  PAGEMETA_EOD = 1,                        // last page of the transfer
+  PAGEMETA_INCOMPLETE = 2,                 // packets are missing, see the bitmap
+  PAGEMETA_EMPTY = 4,                      // no data, for instance the end of data of an observation stopped before its start
+  PAGEMETA_PLACEHOLDER = 8,                // no packets arrived for this frame, the page was not written to
+  PAGEMETA_RESET = 16                      // first page after a timestamp reset, the timestamps before it are not continuous
+};
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t nrecords;
+  uint32_t record_size;                    // bytes per record
+  uint8_t padding[48];
+} pagemeta_header_t;
+
+typedef struct {
+  uint64_t page;                           // ring buffer page number plus one, written last; 0 while unused or being written
+  uint64_t timestamp;                      // packet number of the start of the page
+  uint32_t flags;                          // pagemeta_flags
+  uint32_t expected;                       // packets expected in the page
+  uint32_t received;                       // packets received
+  uint32_t invalid;                        // invalid packets dropped
+  uint16_t ntabs;
+  uint16_t sequence_length;
+  uint16_t science_case;
+  uint16_t science_mode;
+  uint32_t nslots;                         // bits used in the bitmap
+  uint32_t reserved;
+  uint64_t received_slots[PAGEMETA_WORDS]; // bitmap of the packets received
+} pagemeta_record_t;
+
+typedef struct {
+  pagemeta_header_t *header;
+  pagemeta_record_t *records;
+  size_t size;                             // of the mapping
+} pagemeta_t;
+
+int pagemeta_create(pagemeta_t *m, const char *path, uint32_t nrecords);
+int pagemeta_open(pagemeta_t *m, const char *path);
+void pagemeta_fill(pagemeta_record_t *record, const assembler_t *assembler, const loss_t *loss, uint64_t timestamp, uint32_t received, uint32_t invalid);
+void pagemeta_publish(pagemeta_t *m, uint64_t page, const pagemeta_record_t *record);
+const pagemeta_record_t *pagemeta_find(const pagemeta_t *m, uint64_t page);
+void pagemeta_close(pagemeta_t *m);
+
+#endif
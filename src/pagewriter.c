@@ -0,0 +1,411 @@
+/**
+ * Hand pages to the ring buffer, with a policy for when it is full
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "pagewriter.h"
+
+/**
+ * Allocate a page: prefaulted and locked when warming up, otherwise faulted in on first use
+ */
+static char *alloc_page(uint64_t size, warmup_t *warm) {
+  void *page;
+
+  if (warm) {
+    return warmup_alloc(warm, size);
+  }
+  page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return page == MAP_FAILED ? NULL : page;
+}
+
+/**
+ * Publish the record of a page, if any, with eod and the page number of the next ring buffer page
+ */
+static void publish_record(pagewriter_t *w, pagemeta_record_t *record, int eod) {
+  if (!w->meta) {
+    return;
+  }
+  if (eod) {
+    record->flags |= PAGEMETA_EOD;
+  }
+  pagemeta_publish(w->meta, ringbuffer_count(w->rb, RING_DATA), record);
+}
+
+/**
+ * Publish the mask of a page, if any, with the page number of the next ring buffer page
+ *
+ * @param {uint8_t *} mask Private mask to copy, or NULL for a ring buffer page filled in place
+ */
+static void publish_mask(pagewriter_t *w, const uint8_t *mask) {
+  if (!w->flags) {
+    return;
+  }
+  flagmask_publish(w->flags, ringbuffer_count(w->rb, RING_DATA), mask);
+}
+
+/**
+ * Drain thread: copy spilled pages to the ring buffer, in order, when pages are free
+ */
+static void *drain_thread(void *arg) {
+  pagewriter_t *w = arg;
+  char *page;
+  sigset_t all;
+  int index, eod;
+
+  // leave signals to the receiving thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while (w->head == w->tail && !w->stop) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (w->head == w->tail) {
+      break;
+    }
+    index = w->queue[w->head % w->npool];
+    eod = w->queue_eod[w->head % w->npool];
+    pthread_mutex_unlock(&w->lock);
+
+    // blocks till the readers free a page
+    page = ringbuffer_next_write(w->rb, RING_DATA);
+    if (page) {
+      memcpy(page, w->pool[index], w->size);
+      publish_record(w, &w->records[index], eod);
+      publish_mask(w, w->flags ? &w->masks[index * w->mask_size] : NULL);
+      if (eod) {
+        ringbuffer_enable_eod(w->rb, RING_DATA);
+      }
+      ringbuffer_mark_filled(w->rb, RING_DATA, w->size);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->head++;
+    w->free[w->nfree++] = index;
+    w->pending--;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+/**
+ * Set up the page writer, and allocate the scratch page and the spill pool
+ *
+ * @param {pagewriter_t *} w To initialize
+ * @param {ringbuffer_t *} rb Ring buffer, opened for writing
+ * @param {int} policy One of overload_policy
+ * @param {int} npool Number of spill pages, for OVERLOAD_SPILL
+ * @param {uint64_t} size Bytes per page
+ * @param {warmup_t *} warm Prefault and lock the pages, and add the results here; or NULL
+ * @returns {int} 0 on success, -1 on error
+ */
+int pagewriter_init(pagewriter_t *w, ringbuffer_t *rb, int policy, int npool, uint64_t size, warmup_t *warm) {
+  int i;
+
+  memset(w, 0, sizeof(pagewriter_t));
+  w->policy = policy;
+  w->rb = rb;
+  w->size = size;
+  w->target = PAGE_NONE;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+
+  if (policy == OVERLOAD_BLOCK) {
+    return 0;
+  }
+
+  w->scratch = alloc_page(size, warm);
+  if (!w->scratch) {
+    return -1;
+  }
+
+  if (policy == OVERLOAD_SPILL) {
+    w->npool = npool;
+    w->pool = calloc(npool, sizeof(char *));
+    w->free = calloc(npool, sizeof(int));
+    w->queue = calloc(npool, sizeof(int));
+    w->queue_eod = calloc(npool, sizeof(int));
+    if (!w->pool || !w->free || !w->queue || !w->queue_eod) {
+      return -1;
+    }
+    for (i = 0; i < npool; i++) {
+      w->pool[i] = alloc_page(size, warm);
+      if (!w->pool[i]) {
+        return -1;
+      }
+      w->free[w->nfree++] = i;
+    }
+
+    if (pthread_create(&w->drainer, NULL, drain_thread, w)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Publish page metadata for every page handed to the ring buffer
+ *
+ * @param {pagemeta_t *} meta Sidecar, created for the ring buffer
+ * @returns {int} 0 on success, -1 on error
+ */
+int pagewriter_meta(pagewriter_t *w, pagemeta_t *meta) {
+  w->records = calloc(w->npool + 1, sizeof(pagemeta_record_t));
+  if (!w->records) {
+    return -1;
+  }
+  w->meta = meta;
+  return 0;
+}
+
+/**
+ * Publish a flag mask for every page handed to the ring buffer
+ * Call again when the layout of the masks changes.
+ *
+ * @param {flagmask_t *} flags Sidecar, created for the ring buffer
+ * @returns {int} 0 on success, -1 on error
+ */
+int pagewriter_flags(pagewriter_t *w, flagmask_t *flags) {
+  free(w->masks);
+  w->mask_size = flags->mask_size;
+  w->masks = calloc(w->npool + 1, w->mask_size);
+  if (!w->masks) {
+    w->flags = NULL;
+    return -1;
+  }
+  w->flags = flags;
+  return 0;
+}
+
+/**
+ * Record of the current page, to fill before handing it over
+ *
+ * @returns {pagemeta_record_t *} The record, or NULL without page metadata
+ */
+pagemeta_record_t *pagewriter_record(pagewriter_t *w) {
+  if (!w->meta) {
+    return NULL;
+  }
+  return &w->records[w->target == PAGE_SPILL ? w->current : w->npool];
+}
+
+/**
+ * Flag mask of the current page, to fill before handing it over
+ *
+ * @returns {uint8_t *} The mask, or NULL without flag masks
+ */
+uint8_t *pagewriter_mask(pagewriter_t *w) {
+  if (!w->flags) {
+    return NULL;
+  }
+  if (w->target == PAGE_RING) {
+    return flagmask_slot(w->flags, ringbuffer_count(w->rb, RING_DATA));
+  }
+  return &w->masks[(w->target == PAGE_SPILL ? w->current : w->npool) * w->mask_size];
+}
+
+/**
+ * Get the page to fill next: a ring buffer page, a spill page, or the scratch page when the page is skipped
+ * Only blocks with OVERLOAD_BLOCK.
+ *
+ * @returns {char *} The page, or NULL on error
+ */
+char *pagewriter_next(pagewriter_t *w) {
+  int pending;
+
+  if (w->policy == OVERLOAD_BLOCK) {
+    w->page = ringbuffer_next_write(w->rb, RING_DATA);
+    w->target = PAGE_RING;
+    return w->page;
+  }
+
+  pthread_mutex_lock(&w->lock);
+  pending = w->pending;
+  pthread_mutex_unlock(&w->lock);
+
+  // nothing pending, so the drain thread does not use the ring buffer
+  if (pending == 0 && ringbuffer_nfull(w->rb, RING_DATA) < w->rb->nbufs[RING_DATA]) {
+    w->page = ringbuffer_next_write(w->rb, RING_DATA);
+    w->target = PAGE_RING;
+    return w->page;
+  }
+
+  if (w->policy == OVERLOAD_SPILL) {
+    pthread_mutex_lock(&w->lock);
+    if (w->nfree > 0) {
+      w->current = w->free[--w->nfree];
+      pthread_mutex_unlock(&w->lock);
+
+      w->page = w->pool[w->current];
+      w->target = PAGE_SPILL;
+      w->spilled++;
+      return w->page;
+    }
+    pthread_mutex_unlock(&w->lock);
+  }
+
+  w->page = w->scratch;
+  w->target = PAGE_SKIP;
+  w->skipped++;
+  return w->page;
+}
+
+/**
+ * Hand over the current page
+ *
+ * @param {int} eod Set end of data after this page
+ * @returns {int} 0 on success, -1 on error
+ */
+int pagewriter_filled(pagewriter_t *w, int eod) {
+  int target = w->target;
+
+  w->target = PAGE_NONE;
+  w->page = NULL;
+
+  switch (target) {
+    case PAGE_RING:
+      publish_record(w, &w->records[w->npool], eod);
+      publish_mask(w, NULL);
+      if (eod) {
+        ringbuffer_enable_eod(w->rb, RING_DATA);
+      }
+      return ringbuffer_mark_filled(w->rb, RING_DATA, w->size) < 0 ? -1 : 0;
+
+    case PAGE_SPILL:
+      pthread_mutex_lock(&w->lock);
+      w->queue[w->tail % w->npool] = w->current;
+      w->queue_eod[w->tail % w->npool] = eod;
+      w->tail++;
+      w->pending++;
+      pthread_cond_broadcast(&w->cond);
+      pthread_mutex_unlock(&w->lock);
+      return 0;
+
+    case PAGE_SKIP:
+      if (eod) {
+        // the readers still need the end of data
+        return pagewriter_empty(w);
+      }
+      return 0;
+  }
+
+  return 0;
+}
+
+/**
+ * Hand over an empty page with end of data, after the spilled pages, to end a transfer without data
+ *
+ * @returns {int} 0 on success, -1 on error
+ */
+int pagewriter_empty(pagewriter_t *w) {
+  pagewriter_wait(w);
+
+  if (!ringbuffer_next_write(w->rb, RING_DATA)) {
+    return -1;
+  }
+  if (w->meta) {
+    pagemeta_record_t *record = &w->records[w->npool];
+
+    memset(record, 0, offsetof(pagemeta_record_t, received_slots));
+    record->flags = PAGEMETA_EMPTY;
+    publish_record(w, record, 1);
+  }
+  ringbuffer_enable_eod(w->rb, RING_DATA);
+  return ringbuffer_mark_filled(w->rb, RING_DATA, 0) < 0 ? -1 : 0;
+}
+
+/**
+ * Wait till the spilled pages are in the ring buffer
+ */
+void pagewriter_wait(pagewriter_t *w) {
+  pthread_mutex_lock(&w->lock);
+  while (w->pending > 0) {
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * @returns {int} Number of spilled pages waiting for a free ring buffer page
+ */
+int pagewriter_pending(pagewriter_t *w) {
+  int pending;
+
+  pthread_mutex_lock(&w->lock);
+  pending = w->pending;
+  pthread_mutex_unlock(&w->lock);
+  return pending;
+}
+
+/**
+ * Hand over the current page with end of data, if any, wait till the spilled pages are in the ring buffer,
+ * and free the pages
+ */
+void pagewriter_close(pagewriter_t *w) {
+  int i;
+
+  if (w->target != PAGE_NONE) {
+    pagewriter_filled(w, 1);
+  }
+
+  if (w->policy == OVERLOAD_SPILL) {
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->drainer, NULL);
+    w->policy = OVERLOAD_SKIP;  // closing twice does not join twice
+
+    for (i = 0; i < w->npool; i++) {
+      munmap(w->pool[i], w->size);
+    }
+    free(w->pool);
+    free(w->free);
+    free(w->queue);
+    free(w->queue_eod);
+    w->pool = NULL;
+    w->npool = 0;
+  }
+
+  if (w->scratch) {
+    munmap(w->scratch, w->size);
+    w->scratch = NULL;
+  }
+
+  free(w->records);
+  w->records = NULL;
+  w->meta = NULL;
+
+  free(w->masks);
+  w->masks = NULL;
+  w->flags = NULL;
+}
+
+/**
+ * Parse an overload policy: block, skip, or spill:<pages>
+ *
+ * @returns {int} The overload_policy, or -1
+ */
+int pagewriter_parse(const char *policy, int *npool) {
+  if (strcmp(policy, "block") == 0) {
+    return OVERLOAD_BLOCK;
+  }
+  if (strcmp(policy, "skip") == 0) {
+    return OVERLOAD_SKIP;
+  }
+  if (sscanf(policy, "spill:%i", npool) == 1 && *npool > 0) {
+    return OVERLOAD_SPILL;
+  }
+  return -1;
+}
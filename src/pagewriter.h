@@ -0,0 +1,97 @@
+/**
+ * Hand pages to the ring buffer, with a policy for when it is full
+ * Author: Jisk Attema
+ *
+ * When the readers are slow and the ring buffer is full, the receiving thread can:
+ *  - block till a page is free; meanwhile the socket overflows and random packets are lost over several seconds,
+ *  - skip the page: its data is thrown away, and the whole page is reported as lost,
+ *  - spill the page into a bounded pool of pre-allocated pages. A drain thread copies the spilled pages,
+ *    in order, to the ring buffer as soon as pages are free. When the pool is full as well, the page is skipped.
+ *
+ * While spilled pages are pending, later pages are spilled too to keep the pages in order;
+ * pages go to the ring buffer directly again once the drain thread has emptied the pool, for instance at a gap in the data.
+ * Only one thread at a time uses the ring buffer: the receiving thread when nothing is pending, the drain thread otherwise.
+ *
+ * With page metadata (see pagemeta.h), every page has a record that is published just before the page is handed to the ring buffer,
+ * so the record gets the page number the page actually has in the ring buffer.
+ * Flag masks (see flagmask.h) are handled the same way: filled in place for ring buffer pages, and privately for the other pages.
+ */
+#ifndef PAGEWRITER_H
+#define PAGEWRITER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ringbuffer.h"
+#include "warmup.h"
+#include "pagemeta.h"
+#include "flagmask.h"
+
+enum overload_policy {
+  OVERLOAD_BLOCK,
+  OVERLOAD_SKIP,
+  OVERLOAD_SPILL
+};
+
+enum page_target {
+  PAGE_NONE,                 // no page, or the end of data was handed over
+  PAGE_RING,                 // a ring buffer page
+  PAGE_SPILL,                // a page of the spill pool
+  PAGE_SKIP                  // the scratch page, thrown away
+};
+
+typedef struct {
+  int policy;
+  ringbuffer_t *rb;
+  uint64_t size;             // bytes to mark filled per page
+
+  // current page
+  char *page;
+  int target;
+
+  char *scratch;             // target for skipped pages
+
+  // spill pool
+  int npool;
+  char **pool;
+  int current;               // pool page being filled
+  int *free;                 // stack of free pool pages
+  int nfree;
+  int *queue;                // fifo of spilled pages
+  int *queue_eod;            // end of data after this page
+  int head;                  // next page to drain
+  int tail;                  // next free queue position
+  int pending;               // pages queued or being copied, changed under the lock
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t drainer;
+
+  // page metadata, published when the page goes to the ring buffer
+  pagemeta_t *meta;
+  pagemeta_record_t *records;  // per spill pool page, and one for the other pages
+
+  // flag masks, published when the page goes to the ring buffer
+  flagmask_t *flags;
+  uint8_t *masks;            // per spill pool page, and one for skipped pages
+  size_t mask_size;
+
+  // statistics
+  uint64_t skipped;          // pages skipped
+  uint64_t spilled;          // pages spilled
+} pagewriter_t;
+
+int pagewriter_init(pagewriter_t *w, ringbuffer_t *rb, int policy, int npool, uint64_t size, warmup_t *warm);
+int pagewriter_meta(pagewriter_t *w, pagemeta_t *meta);
+int pagewriter_flags(pagewriter_t *w, flagmask_t *flags);
+char *pagewriter_next(pagewriter_t *w);
+pagemeta_record_t *pagewriter_record(pagewriter_t *w);
+uint8_t *pagewriter_mask(pagewriter_t *w);
+int pagewriter_filled(pagewriter_t *w, int eod);
+int pagewriter_empty(pagewriter_t *w);
+int pagewriter_pending(pagewriter_t *w);
+void pagewriter_wait(pagewriter_t *w);
+void pagewriter_close(pagewriter_t *w);
+int pagewriter_parse(const char *policy, int *npool);
+
+#endif
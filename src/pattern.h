@@ -0,0 +1,51 @@
+/**
+ * Test pattern for packet payloads and ring buffer pages, checked by verify
+ * Author: Jisk Attema
+ *
+ * Every byte of the pattern is a deterministic function of where it belongs: tab, channel, sample (and Stokes parameter)
+ * and the timestamp of the page, so a reader can tell whether each part of a page ended up in the right place,
+ * and whether it is from the right page.
+ *
+ * A packet is identified by its tab index, channel index (the first of its 4 channels for Stokes IQUV), sequence number
+ * and timestamp; they are hashed to a first value and an odd step. Byte i of the payload is first + i * step (mod 256):
+ *   Stokes I:    i = sample in the packet
+ *   Stokes IQUV: i = 16 * sample in the packet + 4 * (channel & 3) + Stokes parameter
+ * Within a packet the bytes only repeat after 256 bytes, and the first value and step tell 32768 packets apart.
+ */
+#ifndef PATTERN_H
+#define PATTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * First value and step of the pattern of a packet
+ *
+ * @param {int} tab Tab index
+ * @param {int} channel Channel index, the first channel of the packet for Stokes IQUV
+ * @param {int} sequence Sequence number
+ * @param {uint64_t} timestamp Timestamp of the page, in packets (see FRAMETIME)
+ */
+static inline void pattern_key(int tab, int channel, int sequence, uint64_t timestamp, uint8_t *first, uint8_t *step) {
+  // splitmix64 finalizer
+  uint64_t z = timestamp * 0x9E3779B97F4A7C15UL + (((uint64_t) tab << 24) | ((uint64_t) sequence << 16) | (uint64_t) channel);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+  z ^= z >> 31;
+
+  *first = z & 0xff;
+  *step = ((z >> 8) & 0xff) | 1;
+}
+
+/**
+ * Write the pattern: dest[i] = first + i * step
+ */
+static inline void pattern_fill(uint8_t *dest, size_t n, uint8_t first, uint8_t step) {
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    dest[i] = first + i * step;
+  }
+}
+
+#endif
@@ -0,0 +1,184 @@
+/**
+ * Cycle accounting of the receive loop of fill_ringbuffer
+ * Author: Jisk Attema
+ *
+ * The hardware counters count the calling thread only, so profile_init has to be called by the receiving thread.
+ * They include the kernel (recvmmsg) when perf_event_paranoid allows it, and user space only otherwise.
+ */
+// needed for syscall
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "profile.h"
+
+static const char *stage_names[] = {"recv", "validate", "place", "copy", "account", "ring", "page"};
+
+/**
+ * Open a hardware counter of the calling thread, counting from now on
+ *
+ * @returns {int} File descriptor, -1 when not available
+ */
+static int open_counter(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_hv = 1;
+
+  fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0) {
+    attr.exclude_kernel = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  return fd;
+}
+
+/**
+ * Read the hardware counters, scaled up for the time they were not running when the PMU is multiplexed
+ *
+ * @param {uint64_t *} delta Increase since the previous read, per counter
+ */
+static void read_counters(profile_t *p, uint64_t *delta) {
+  uint64_t data[3];          // value, time enabled, time running
+  double scale;
+  int c;
+
+  for (c = 0; c < PROFILE_COUNTERS; c++) {
+    delta[c] = 0;
+    if (p->fd[c] < 0 || read(p->fd[c], data, sizeof(data)) != sizeof(data)) {
+      continue;
+    }
+    scale = data[2] > p->running_ns[c] ? (double) (data[1] - p->enabled_ns[c]) / (data[2] - p->running_ns[c]) : 1;
+    delta[c] = (data[0] - p->value[c]) * scale;
+    p->value[c] = data[0];
+    p->enabled_ns[c] = data[1];
+    p->running_ns[c] = data[2];
+  }
+}
+
+/**
+ * Set up profiling, call from the thread that runs the receive loop
+ *
+ * @param {profile_t *} p To initialize
+ * @param {int} enabled 1 to profile, 0 to leave it off
+ * @returns {int} Number of hardware counters available, -1 when enabled but not built in
+ */
+int profile_init(profile_t *p, int enabled) {
+  int count = 0;
+  int c;
+
+  memset(p, 0, sizeof(profile_t));
+  for (c = 0; c < PROFILE_COUNTERS; c++) {
+    p->fd[c] = -1;
+  }
+  if (!enabled) {
+    return 0;
+  }
+#ifndef HAVE_PROFILE
+  return -1;
+#endif
+
+  p->enabled = 1;
+  p->fd[PROFILE_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  p->fd[PROFILE_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  p->fd[PROFILE_LLC_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  p->fd[PROFILE_DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+  for (c = 0; c < PROFILE_COUNTERS; c++) {
+    count += p->fd[c] >= 0;
+  }
+  return count;
+}
+
+/**
+ * Start counting, at the start of the receive loop
+ */
+void profile_start(profile_t *p) {
+  uint64_t delta[PROFILE_COUNTERS];
+
+  if (!p->enabled) {
+    return;
+  }
+  memset(p->cycles, 0, sizeof(p->cycles));
+  p->batches = 0;
+  p->packets = 0;
+  read_counters(p, delta);
+  p->last = profile_clock();
+}
+
+/**
+ * Summary of the page, per packet, and start counting the next page
+ *
+ * @returns {int} Number of characters written, as snprintf; 0 when not enabled
+ */
+int profile_page(profile_t *p, char *buf, size_t size) {
+  uint64_t delta[PROFILE_COUNTERS];
+  uint64_t total = 0;
+  double packets;
+  int n, s;
+
+  buf[0] = '\0';
+  if (!p->enabled) {
+    return 0;
+  }
+  read_counters(p, delta);
+
+  packets = p->packets ? p->packets : 1;
+  for (s = 0; s < PROFILE_STAGES; s++) {
+    total += p->cycles[s];
+  }
+  n = snprintf(buf, size, "Profile: %lu packets in %lu batches, %.0f TSC cycles per packet:", p->packets, p->batches, total / packets);
+  for (s = 0; s < PROFILE_STAGES; s++) {
+    n += snprintf(&buf[n], n < (int) size ? size - n : 0, "%s %s %.0f (%.1f%%)", s ? "," : "", stage_names[s],
+        p->cycles[s] / packets, total ? 100.0 * p->cycles[s] / total : 0);
+  }
+
+  if (p->fd[PROFILE_CYCLES] >= 0 || p->fd[PROFILE_INSTRUCTIONS] >= 0 || p->fd[PROFILE_LLC_MISSES] >= 0 || p->fd[PROFILE_DTLB_MISSES] >= 0) {
+    n += snprintf(&buf[n], n < (int) size ? size - n : 0, "; hardware counters per packet:");
+    if (p->fd[PROFILE_CYCLES] >= 0) {
+      n += snprintf(&buf[n], n < (int) size ? size - n : 0, " %.0f cycles", delta[PROFILE_CYCLES] / packets);
+    }
+    if (p->fd[PROFILE_INSTRUCTIONS] >= 0) {
+      n += snprintf(&buf[n], n < (int) size ? size - n : 0, " %.0f instructions", delta[PROFILE_INSTRUCTIONS] / packets);
+      if (p->fd[PROFILE_CYCLES] >= 0 && delta[PROFILE_CYCLES]) {
+        n += snprintf(&buf[n], n < (int) size ? size - n : 0, " (%.2f IPC)", (double) delta[PROFILE_INSTRUCTIONS] / delta[PROFILE_CYCLES]);
+      }
+    }
+    if (p->fd[PROFILE_LLC_MISSES] >= 0) {
+      n += snprintf(&buf[n], n < (int) size ? size - n : 0, " %.2f LLC misses", delta[PROFILE_LLC_MISSES] / packets);
+    }
+    if (p->fd[PROFILE_DTLB_MISSES] >= 0) {
+      n += snprintf(&buf[n], n < (int) size ? size - n : 0, " %.2f dTLB misses", delta[PROFILE_DTLB_MISSES] / packets);
+    }
+  }
+  n += snprintf(&buf[n], n < (int) size ? size - n : 0, "\n");
+
+  memset(p->cycles, 0, sizeof(p->cycles));
+  p->batches = 0;
+  p->packets = 0;
+  return n;
+}
+
+void profile_close(profile_t *p) {
+  int c;
+
+  for (c = 0; c < PROFILE_COUNTERS; c++) {
+    if (p->fd[c] >= 0) {
+      close(p->fd[c]);
+      p->fd[c] = -1;
+    }
+  }
+  p->enabled = 0;
+}
@@ -0,0 +1,112 @@
+/**
+ * Cycle accounting of the receive loop of fill_ringbuffer
+ * Author: Jisk Attema
+ *
+ * The receive loop marks the end of every stage of its work; the time stamp counter (rdtsc) cycles since the previous mark
+ * are added to that stage. A page summary gives the cycles per packet of every stage, and the hardware counters
+ * of the thread over the page (perf_event_open): cycles, instructions, last level cache misses and dTLB misses.
+ *
+ * Built in with HAVE_PROFILE (the CMake option ENABLE_PROFILE), and enabled at run time with profile_init.
+ * Without HAVE_PROFILE profile_stage is empty, and the loop has no extra instructions at all.
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(HAVE_PROFILE) && defined(__x86_64__)
+#include <x86intrin.h>
+#elif defined(HAVE_PROFILE)
+#include <time.h>
+#endif
+
+// Stages of the receive loop
+enum profile_stage {
+  PROFILE_RECV,              // recvmmsg, and the control messages
+  PROFILE_VALIDATE,          // packet header and timestamp checks
+  PROFILE_PLACE,             // packet slot and duplicate detection
+  PROFILE_COPY,              // payload and flags to the page
+  PROFILE_ACCOUNT,           // latency and jitter histograms, counters
+  PROFILE_RING,              // handing over a page, and getting the next one: includes waiting for a free page
+  PROFILE_PAGE,              // the rest of a page switch: page metadata, diagnostics, metrics
+  PROFILE_STAGES
+};
+
+// Hardware counters
+enum profile_counter {
+  PROFILE_CYCLES,
+  PROFILE_INSTRUCTIONS,
+  PROFILE_LLC_MISSES,
+  PROFILE_DTLB_MISSES,
+  PROFILE_COUNTERS
+};
+
+typedef struct {
+  int enabled;
+  uint64_t last;                         // time stamp counter at the previous mark
+  uint64_t cycles[PROFILE_STAGES];       // time stamp counter cycles per stage, in this page
+  uint64_t batches;                      // recvmmsg calls, in this page
+  uint64_t packets;                      // packets received, in this page
+
+  int fd[PROFILE_COUNTERS];              // perf events, -1 when not available
+  uint64_t value[PROFILE_COUNTERS];      // at the previous page, scaled for multiplexing
+  uint64_t enabled_ns[PROFILE_COUNTERS];
+  uint64_t running_ns[PROFILE_COUNTERS];
+} profile_t;
+
+int profile_init(profile_t *p, int enabled);
+void profile_start(profile_t *p);
+int profile_page(profile_t *p, char *buf, size_t size);
+void profile_close(profile_t *p);
+
+/**
+ * Time stamp counter, or nanoseconds on other architectures
+ */
+static inline uint64_t profile_clock(void) {
+#if defined(HAVE_PROFILE) && defined(__x86_64__)
+  return __rdtsc();
+#elif defined(HAVE_PROFILE)
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000UL + now.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * End of a stage: the cycles since the previous mark are added to it
+ */
+static inline void profile_stage(profile_t *p, int stage) {
+#ifdef HAVE_PROFILE
+  uint64_t now;
+
+  if (p->enabled) {
+    now = profile_clock();
+    p->cycles[stage] += now - p->last;
+    p->last = now;
+  }
+#else
+  (void) p;
+  (void) stage;
+#endif
+}
+
+/**
+ * A batch of packets was received
+ */
+static inline void profile_batch(profile_t *p, int npackets) {
+#ifdef HAVE_PROFILE
+  if (p->enabled) {
+    p->batches++;
+    p->packets += npackets;
+  }
+#else
+  (void) p;
+  (void) npackets;
+#endif
+}
+
+#endif
@@ -0,0 +1,126 @@
+/**
+ * psrdada ring buffer backend
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dada_hdu.h"
+#include "ringbuffer.h"
+
+static ipcbuf_t *dada_block(ringbuffer_t *rb, int block) {
+  dada_hdu_t *hdu = rb->state;
+
+  return block == RING_HEADER ? hdu->header_block : (ipcbuf_t *) hdu->data_block;
+}
+
+static int dada_open(ringbuffer_t *rb, const char *key, int role) {
+  dada_hdu_t *hdu;
+  key_t shmkey;
+  multilog_t* multilog = NULL; // TODO: See if this is used in anyway by dada
+  char writemode='W';     // needs to be a capital
+
+  if (sscanf(key, "%x", &shmkey) != 1) {
+    fprintf(stderr, "ERROR. Illegal psrdada key: %s\n", key);
+    return -1;
+  }
+
+  // create hdu
+  hdu = dada_hdu_create (multilog);
+  dada_hdu_set_key(hdu, shmkey);
+
+  // connect
+  if (dada_hdu_connect (hdu) < 0) {
+    fprintf(stderr, "ERROR in dada_hdu_connect\n");
+    dada_hdu_destroy(hdu);
+    return -1;
+  }
+
+  if (role == RING_WRITER) {
+    if (dada_hdu_lock_write_spec (hdu, writemode) < 0) {
+      fprintf(stderr, "ERROR in dada_hdu_lock_write_spec\n");
+      dada_hdu_destroy(hdu);
+      return -1;
+    }
+  } else {
+    if (dada_hdu_lock_read (hdu) < 0) {
+      fprintf(stderr, "ERROR in dada_hdu_lock_read\n");
+      dada_hdu_destroy(hdu);
+      return -1;
+    }
+  }
+
+  rb->state = hdu;
+  rb->nbufs[RING_HEADER] = ipcbuf_get_nbufs(hdu->header_block);
+  rb->bufsz[RING_HEADER] = ipcbuf_get_bufsz(hdu->header_block);
+  rb->nbufs[RING_DATA] = ipcbuf_get_nbufs((ipcbuf_t *) hdu->data_block);
+  rb->bufsz[RING_DATA] = ipcbuf_get_bufsz((ipcbuf_t *) hdu->data_block);
+  return 0;
+}
+
+static void dada_close(ringbuffer_t *rb) {
+  dada_hdu_t *hdu = rb->state;
+
+  if (rb->role == RING_WRITER) {
+    dada_hdu_unlock_write(hdu);
+  } else {
+    dada_hdu_unlock_read(hdu);
+  }
+  dada_hdu_disconnect(hdu);
+  dada_hdu_destroy(hdu);
+}
+
+static char *dada_next_write(ringbuffer_t *rb, int block) {
+  return ipcbuf_get_next_write(dada_block(rb, block));
+}
+
+static int dada_mark_filled(ringbuffer_t *rb, int block, uint64_t size) {
+  return ipcbuf_mark_filled(dada_block(rb, block), size) < 0 ? -1 : 0;
+}
+
+static int dada_enable_eod(ringbuffer_t *rb, int block) {
+  return ipcbuf_enable_eod(dada_block(rb, block)) < 0 ? -1 : 0;
+}
+
+static char *dada_next_read(ringbuffer_t *rb, int block, uint64_t *size) {
+  return ipcbuf_get_next_read(dada_block(rb, block), size);
+}
+
+static int dada_mark_cleared(ringbuffer_t *rb, int block) {
+  return ipcbuf_mark_cleared(dada_block(rb, block)) < 0 ? -1 : 0;
+}
+
+static int dada_eod(ringbuffer_t *rb, int block) {
+  return ipcbuf_eod(dada_block(rb, block));
+}
+
+static uint64_t dada_nfull(ringbuffer_t *rb, int block) {
+  return ipcbuf_get_nfull(dada_block(rb, block));
+}
+
+static uint64_t dada_count(ringbuffer_t *rb, int block) {
+  if (rb->role == RING_WRITER) {
+    return ipcbuf_get_write_count(dada_block(rb, block));
+  }
+  return ipcbuf_get_read_count(dada_block(rb, block));
+}
+
+static char *dada_page(ringbuffer_t *rb, int block, uint64_t index) {
+  return dada_block(rb, block)->buffer[index];
+}
+
+const ringbuffer_backend_t ring_dada_backend = {
+  .name = "psrdada",
+  .open = dada_open,
+  .close = dada_close,
+  .next_write = dada_next_write,
+  .mark_filled = dada_mark_filled,
+  .enable_eod = dada_enable_eod,
+  .next_read = dada_next_read,
+  .mark_cleared = dada_mark_cleared,
+  .eod = dada_eod,
+  .nfull = dada_nfull,
+  .count = dada_count,
+  .page = dada_page
+};
@@ -0,0 +1,208 @@
+/**
+ * Create, destroy, or drain a ring buffer
+ * Author: Jisk Attema
+ *
+ * The native counterpart of dada_db and dada_dbnull:
+ *   ring_db -k shm:<name> -b <page size> -n <pages> [-r <readers>]   create
+ *   ring_db -k shm:<name> -d                                          destroy
+ *   ring_db -k <key> -z [-m <page metadata file>] [-g <flag masks>]  read and discard pages until End-Of-Data
+ * Draining works for psrdada keys as well, when built with psrdada.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "ringbuffer.h"
+#include "pagemeta.h"
+#include "flagmask.h"
+
+#define DEFAULT_NBUFS 4
+#define DEFAULT_BUFSZ 524288
+#define DEFAULT_HDR_NBUFS 8
+#define DEFAULT_HDR_BUFSZ 4096
+
+/**
+ * Print commandline optinos
+ */
+void printOptions() {
+  printf("usage: ring_db -k <key> [-b <page size> -n <pages> -r <readers>] [-d] [-z [-m <page metadata file>] [-g <flag mask file>]]\n");
+  printf("Create (default), with -d destroy, or with -z drain the ring buffer.\n");
+  printf("When draining, -m prints the page metadata published by fill_ringbuffer -P for every page.\n");
+  printf("When draining, -g prints the number of flags set in the flag mask published by fill_ringbuffer -G for every page.\n");
+  printf("Native ring buffers have a key 'shm:<name>' in /dev/shm, or 'shm:/path/to/file' e.g. on a hugetlbfs mount.\n");
+  return;
+}
+
+/**
+ * Read and discard all pages of a single transfer
+ *
+ * @param {pagemeta_t *} meta Page metadata to print, or NULL
+ * @param {char *} flagsfile Flag mask file, or NULL
+ */
+int drain(ringbuffer_t *rb, const pagemeta_t *meta, const char *flagsfile) {
+  const pagemeta_record_t *record;
+  const uint8_t *mask;
+  flagmask_t flags;
+  size_t i, flagged;
+  uint64_t size;
+  uint64_t bytes = 0;
+  long pages = 0;
+
+  // the header
+  if (!ringbuffer_next_read(rb, RING_HEADER, &size)) {
+    fprintf(stderr, "ERROR. Cannot read header\n");
+    return -1;
+  }
+  ringbuffer_mark_cleared(rb, RING_HEADER);
+
+  // the flag mask file is replaced when the layout changes, open it for every transfer
+  if (flagsfile && flagmask_open(&flags, flagsfile)) {
+    return -1;
+  }
+
+  // the data, till End-Of-Data
+  while (1) {
+    if (!ringbuffer_next_read(rb, RING_DATA, &size)) {
+      break;
+    }
+    bytes += size;
+    pages++;
+
+    if (meta) {
+      record = pagemeta_find(meta, ringbuffer_count(rb, RING_DATA));
+      if (record) {
+        printf("Page %lu: time %lu, received %u/%u, invalid %u, flags%s%s%s%s%s\n", ringbuffer_count(rb, RING_DATA),
+            record->timestamp, record->received, record->expected, record->invalid,
+            record->flags & PAGEMETA_INCOMPLETE ? " incomplete" : "",
+            record->flags & PAGEMETA_EMPTY ? " empty" : "",
+            record->flags & PAGEMETA_PLACEHOLDER ? " placeholder" : "",
+            record->flags & PAGEMETA_RESET ? " reset" : "",
+            record->flags & PAGEMETA_EOD ? " eod" : "");
+      } else {
+        printf("Page %lu: no metadata\n", ringbuffer_count(rb, RING_DATA));
+      }
+    }
+    if (flagsfile) {
+      mask = flagmask_find(&flags, ringbuffer_count(rb, RING_DATA));
+      if (mask) {
+        flagged = 0;
+        for (i = 0; i < flags.mask_size / sizeof(uint64_t); i++) {
+          flagged += __builtin_popcountl(((const uint64_t *) mask)[i]);
+        }
+        printf("Page %lu: %lu/%lu flags set\n", ringbuffer_count(rb, RING_DATA), flagged, flags.mask_size * 8);
+      } else {
+        printf("Page %lu: no flag mask\n", ringbuffer_count(rb, RING_DATA));
+      }
+    }
+    ringbuffer_mark_cleared(rb, RING_DATA);
+
+    if (ringbuffer_eod(rb, RING_DATA)) {
+      break;
+    }
+  }
+
+  if (flagsfile) {
+    flagmask_close(&flags);
+  }
+  printf("Drained %li pages, %lu bytes\n", pages, bytes);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  char *key = NULL;
+  uint64_t bufsz = DEFAULT_BUFSZ;
+  uint64_t nbufs = DEFAULT_NBUFS;
+  int nreaders = 1;
+  int destroy = 0;
+  int drainer = 0;
+  char *metafile = NULL;
+  char *flagsfile = NULL;
+  pagemeta_t meta;
+  ringbuffer_t *rb;
+  int c;
+
+  while((c=getopt(argc,argv,"k:b:n:r:dzm:g:"))!=-1) {
+    switch(c) {
+      // -k key
+      case('k'):
+        key = strdup(optarg);
+        break;
+
+      // -b page size in bytes
+      case('b'):
+        bufsz = atol(optarg);
+        break;
+
+      // -n number of pages
+      case('n'):
+        nbufs = atol(optarg);
+        break;
+
+      // -r number of readers
+      case('r'):
+        nreaders = atoi(optarg);
+        break;
+
+      // -d destroy
+      case('d'):
+        destroy = 1;
+        break;
+
+      // -z drain
+      case('z'):
+        drainer = 1;
+        break;
+
+      // -m page metadata file
+      case('m'):
+        metafile = strdup(optarg);
+        break;
+
+      // -g flag mask file
+      case('g'):
+        flagsfile = strdup(optarg);
+        break;
+
+      default:
+        printOptions();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  if (!key) {
+    printOptions();
+    exit(EXIT_FAILURE);
+  }
+
+  if (drainer) {
+    rb = ringbuffer_open(key, RING_READER);
+    if (!rb) {
+      exit(EXIT_FAILURE);
+    }
+    if (metafile && pagemeta_open(&meta, metafile)) {
+      exit(EXIT_FAILURE);
+    }
+    c = drain(rb, metafile ? &meta : NULL, flagsfile);
+    ringbuffer_close(rb);
+    exit(c ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  if (strncmp(key, "shm:", 4) != 0) {
+    fprintf(stderr, "ERROR. Only native ring buffers (shm:<name>) can be created or destroyed, use dada_db for psrdada\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (destroy) {
+    exit(ring_shm_destroy(&key[4]) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  if (ring_shm_create(&key[4], nbufs, bufsz, DEFAULT_HDR_NBUFS, DEFAULT_HDR_BUFSZ, nreaders)) {
+    exit(EXIT_FAILURE);
+  }
+  printf("Created ring buffer %s: %lu pages of %lu bytes, %i readers\n", key, nbufs, bufsz, nreaders);
+
+  free(key);
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,425 @@
+/**
+ * Native ring buffer backend: a shared memory file with futex signalling
+ * Author: Jisk Attema
+ *
+ * The file lives in /dev/shm, or on a hugetlbfs mount when given as an absolute path,
+ * and is mapped by the writer and all readers. Layout:
+ *   [control][header pages][data pages]
+ * Data pages start at a 2 MB boundary, and are 2 MB aligned, so they can be backed by huge pages.
+ *
+ * Every block has a write count, and a read count per reader; a page is free when all
+ * readers have cleared it. The writer and readers sleep on a futex that is bumped on every fill, resp. clear.
+ * A reader or writer that died is detected by its pid, and its slot can be taken over.
+ */
+// needed for MADV_HUGEPAGE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ringbuffer.h"
+
+#define SHM_MAGIC 0x474e4952          // 'RING'
+#define SHM_VERSION 1
+#define SHM_DIR "/dev/shm/"           // location of files given by name only
+#define SHM_MAXREADERS 8              // Maximum number of readers
+#define SHM_MAXBUFS 1024              // Maximum number of pages per block
+#define SHM_ALIGN 2097152             // Data pages start at a huge page boundary
+#define SHM_PAGE 4096                 // Alignment of the control structure and header pages
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+#define ROUNDUP(x, a) ((((x) + (a) - 1) / (a)) * (a))
+
+/*
+ * Shared state of a block of pages
+ */
+typedef struct {
+  uint64_t nbufs;
+  uint64_t bufsz;
+  uint64_t stride;                        // distance between pages in bytes
+  uint64_t offset;                        // of the first page from the start of the file
+  uint64_t write_count;                   // pages filled by the writer
+  uint64_t read_count[SHM_MAXREADERS];    // pages cleared by each reader
+  uint32_t write_seq;                     // futex, bumped when a page is filled
+  uint32_t read_seq;                      // futex, bumped when a page is cleared
+  uint32_t eod_pending;                   // the next filled page ends the transfer
+  uint64_t size[SHM_MAXBUFS];             // bytes written per page
+  uint8_t eod[SHM_MAXBUFS];               // page is the last of a transfer
+} shm_block_t;
+
+/*
+ * Shared control structure at the start of the file
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nreaders;                      // a page is free when this many readers have cleared it
+  int32_t writer_pid;
+  int32_t reader_pid[SHM_MAXREADERS];
+  uint64_t total_size;
+  shm_block_t block[RING_BLOCKS];
+} shm_control_t;
+
+/*
+ * Process local state
+ */
+typedef struct {
+  int fd;
+  char *base;
+  size_t size;
+  shm_control_t *control;
+  int reader;                             // our reader slot
+  int last_eod[RING_BLOCKS];              // eod flag of the page last read
+} shm_state_t;
+
+static void shm_path(const char *key, char *path, size_t size) {
+  if (key[0] == '/') {
+    snprintf(path, size, "%s", key);
+  } else {
+    snprintf(path, size, SHM_DIR "%s", key);
+  }
+}
+
+static inline void futex_wait(uint32_t *addr, uint32_t value) {
+  // returns immediately with EAGAIN when the value changed in the mean time; the caller rechecks anyway
+  syscall(SYS_futex, addr, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static inline void futex_wake(uint32_t *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Take a writer or reader slot: it is free when unused, or when the process holding it is gone
+ *
+ * @returns {int} 0 on success, -1 when in use
+ */
+static int claim_slot(int32_t *slot) {
+  int32_t pid = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+  if (pid != 0 && pid != getpid() && (kill(pid, 0) == 0 || errno != ESRCH)) {
+    return -1;
+  }
+  return __atomic_compare_exchange_n(slot, &pid, getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? 0 : -1;
+}
+
+/**
+ * Number of pages the slowest reader has cleared
+ */
+static uint64_t min_read(shm_control_t *control, shm_block_t *b) {
+  uint64_t min = UINT64_MAX;
+  uint32_t r;
+
+  for (r = 0; r < control->nreaders; r++) {
+    uint64_t count = __atomic_load_n(&b->read_count[r], __ATOMIC_ACQUIRE);
+    if (count < min) {
+      min = count;
+    }
+  }
+  return min;
+}
+
+/**
+ * Create the shared memory file for a ring buffer
+ *
+ * @param {char *} key Name in /dev/shm, or absolute path (e.g. on a hugetlbfs mount)
+ * @param {uint64_t} nbufs Number of data pages
+ * @param {uint64_t} bufsz Size of a data page in bytes
+ * @param {uint64_t} hdr_nbufs Number of header pages
+ * @param {uint64_t} hdr_bufsz Size of a header page in bytes
+ * @param {int} nreaders Number of readers
+ * @returns {int} 0 on success, -1 on error
+ */
+int ring_shm_create(const char *key, uint64_t nbufs, uint64_t bufsz, uint64_t hdr_nbufs, uint64_t hdr_bufsz, int nreaders) {
+  char path[PATH_MAX];
+  shm_control_t *control;
+  uint64_t hdr_offset, data_offset, total_size;
+  int fd;
+
+  if (nbufs < 1 || nbufs > SHM_MAXBUFS || hdr_nbufs < 1 || hdr_nbufs > SHM_MAXBUFS || nreaders < 1 || nreaders > SHM_MAXREADERS) {
+    fprintf(stderr, "ERROR. Between 1 and %i pages per block, and 1 and %i readers supported\n", SHM_MAXBUFS, SHM_MAXREADERS);
+    return -1;
+  }
+
+  hdr_offset = ROUNDUP(sizeof(shm_control_t), SHM_PAGE);
+  data_offset = ROUNDUP(hdr_offset + hdr_nbufs * ROUNDUP(hdr_bufsz, SHM_PAGE), SHM_ALIGN);
+  total_size = data_offset + nbufs * ROUNDUP(bufsz, SHM_ALIGN);
+
+  shm_path(key, path, sizeof(path));
+  fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+
+  if (ftruncate(fd, total_size) < 0) {
+    perror("ERROR. Cannot size ring buffer");
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+
+  control = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (control == MAP_FAILED) {
+    perror("ERROR. Cannot map ring buffer");
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+
+  memset(control, 0, sizeof(shm_control_t));
+  control->version = SHM_VERSION;
+  control->nreaders = nreaders;
+  control->total_size = total_size;
+
+  control->block[RING_HEADER].nbufs = hdr_nbufs;
+  control->block[RING_HEADER].bufsz = hdr_bufsz;
+  control->block[RING_HEADER].stride = ROUNDUP(hdr_bufsz, SHM_PAGE);
+  control->block[RING_HEADER].offset = hdr_offset;
+
+  control->block[RING_DATA].nbufs = nbufs;
+  control->block[RING_DATA].bufsz = bufsz;
+  control->block[RING_DATA].stride = ROUNDUP(bufsz, SHM_ALIGN);
+  control->block[RING_DATA].offset = data_offset;
+
+  // publish
+  __atomic_store_n(&control->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+  munmap(control, total_size);
+  close(fd);
+  return 0;
+}
+
+/**
+ * Remove the shared memory file of a ring buffer
+ */
+int ring_shm_destroy(const char *key) {
+  char path[PATH_MAX];
+
+  shm_path(key, path, sizeof(path));
+  if (unlink(path) < 0) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+static int shm_open_ring(ringbuffer_t *rb, const char *key, int role) {
+  char path[PATH_MAX];
+  shm_state_t *state;
+  shm_control_t *control;
+  struct stat st;
+  struct statfs sfs;
+  int b, r;
+
+  shm_path(key, path, sizeof(path));
+
+  state = calloc(1, sizeof(shm_state_t));
+  state->fd = open(path, O_RDWR);
+  if (state->fd < 0 || fstat(state->fd, &st) < 0 || st.st_size < (off_t) sizeof(shm_control_t)) {
+    fprintf(stderr, "ERROR. Cannot open ring buffer %s, create it with ring_db\n", path);
+    goto fail;
+  }
+
+  state->size = st.st_size;
+  state->base = mmap(NULL, state->size, PROT_READ | PROT_WRITE, MAP_SHARED, state->fd, 0);
+  if (state->base == MAP_FAILED) {
+    perror("ERROR. Cannot map ring buffer");
+    goto fail;
+  }
+  control = state->control = (shm_control_t *) state->base;
+
+  if (__atomic_load_n(&control->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC || control->version != SHM_VERSION || control->total_size != state->size) {
+    fprintf(stderr, "ERROR. %s is not a ring buffer, or of an incompatible version\n", path);
+    goto fail;
+  }
+
+  // huge pages: implicit on hugetlbfs, on tmpfs ask for transparent huge pages
+  if (fstatfs(state->fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC) {
+    rb->hugepages = 1;
+  } else {
+    madvise(state->base + control->block[RING_DATA].offset, state->size - control->block[RING_DATA].offset, MADV_HUGEPAGE);
+  }
+
+  if (role == RING_WRITER) {
+    if (claim_slot(&control->writer_pid) < 0) {
+      fprintf(stderr, "ERROR. Ring buffer %s already has a writer (pid %i)\n", path, control->writer_pid);
+      goto fail;
+    }
+  } else {
+    for (r = 0; r < (int) control->nreaders; r++) {
+      if (claim_slot(&control->reader_pid[r]) == 0) {
+        break;
+      }
+    }
+    if (r == (int) control->nreaders) {
+      fprintf(stderr, "ERROR. Ring buffer %s already has %i readers\n", path, control->nreaders);
+      goto fail;
+    }
+    state->reader = r;
+  }
+
+  for (b = 0; b < RING_BLOCKS; b++) {
+    rb->nbufs[b] = control->block[b].nbufs;
+    rb->bufsz[b] = control->block[b].bufsz;
+  }
+  rb->state = state;
+  return 0;
+
+fail:
+  if (state->base && state->base != MAP_FAILED) {
+    munmap(state->base, state->size);
+  }
+  if (state->fd >= 0) {
+    close(state->fd);
+  }
+  free(state);
+  return -1;
+}
+
+static void shm_close(ringbuffer_t *rb) {
+  shm_state_t *state = rb->state;
+  int32_t pid = getpid();
+
+  if (rb->role == RING_WRITER) {
+    __atomic_compare_exchange_n(&state->control->writer_pid, &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  } else {
+    __atomic_compare_exchange_n(&state->control->reader_pid[state->reader], &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  }
+
+  munmap(state->base, state->size);
+  close(state->fd);
+  free(state);
+}
+
+static char *shm_next_write(ringbuffer_t *rb, int block) {
+  shm_state_t *state = rb->state;
+  shm_block_t *b = &state->control->block[block];
+  uint64_t count = b->write_count;  // only the writer changes it
+  uint32_t seq;
+
+  while (1) {
+    seq = __atomic_load_n(&b->read_seq, __ATOMIC_ACQUIRE);
+    if (count - min_read(state->control, b) < b->nbufs) {
+      break;
+    }
+    futex_wait(&b->read_seq, seq);
+  }
+
+  return state->base + b->offset + (count % b->nbufs) * b->stride;
+}
+
+static int shm_mark_filled(ringbuffer_t *rb, int block, uint64_t size) {
+  shm_state_t *state = rb->state;
+  shm_block_t *b = &state->control->block[block];
+  uint64_t count = b->write_count;
+  uint64_t slot = count % b->nbufs;
+
+  if (size > b->bufsz) {
+    return -1;
+  }
+
+  b->size[slot] = size;
+  b->eod[slot] = b->eod_pending;
+  b->eod_pending = 0;
+
+  __atomic_store_n(&b->write_count, count + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&b->write_seq, 1, __ATOMIC_RELEASE);
+  futex_wake(&b->write_seq);
+  return 0;
+}
+
+static int shm_enable_eod(ringbuffer_t *rb, int block) {
+  shm_state_t *state = rb->state;
+
+  state->control->block[block].eod_pending = 1;
+  return 0;
+}
+
+static char *shm_next_read(ringbuffer_t *rb, int block, uint64_t *size) {
+  shm_state_t *state = rb->state;
+  shm_block_t *b = &state->control->block[block];
+  uint64_t count = b->read_count[state->reader];  // only we change it
+  uint64_t slot = count % b->nbufs;
+  uint32_t seq;
+
+  while (1) {
+    seq = __atomic_load_n(&b->write_seq, __ATOMIC_ACQUIRE);
+    if (count < __atomic_load_n(&b->write_count, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    futex_wait(&b->write_seq, seq);
+  }
+
+  *size = b->size[slot];
+  state->last_eod[block] = b->eod[slot];
+  return state->base + b->offset + slot * b->stride;
+}
+
+static int shm_mark_cleared(ringbuffer_t *rb, int block) {
+  shm_state_t *state = rb->state;
+  shm_block_t *b = &state->control->block[block];
+
+  __atomic_add_fetch(&b->read_count[state->reader], 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&b->read_seq, 1, __ATOMIC_RELEASE);
+  futex_wake(&b->read_seq);
+  return 0;
+}
+
+static int shm_eod(ringbuffer_t *rb, int block) {
+  shm_state_t *state = rb->state;
+
+  return state->last_eod[block];
+}
+
+static uint64_t shm_nfull(ringbuffer_t *rb, int block) {
+  shm_state_t *state = rb->state;
+  shm_block_t *b = &state->control->block[block];
+
+  return __atomic_load_n(&b->write_count, __ATOMIC_ACQUIRE) - min_read(state->control, b);
+}
+
+static uint64_t shm_count(ringbuffer_t *rb, int block) {
+  shm_state_t *state = rb->state;
+  shm_block_t *b = &state->control->block[block];
+
+  if (rb->role == RING_WRITER) {
+    return b->write_count;
+  }
+  return __atomic_load_n(&b->read_count[state->reader], __ATOMIC_ACQUIRE);
+}
+
+static char *shm_page(ringbuffer_t *rb, int block, uint64_t index) {
+  shm_state_t *state = rb->state;
+  shm_block_t *b = &state->control->block[block];
+
+  return state->base + b->offset + index * b->stride;
+}
+
+const ringbuffer_backend_t ring_shm_backend = {
+  .name = "shm",
+  .open = shm_open_ring,
+  .close = shm_close,
+  .next_write = shm_next_write,
+  .mark_filled = shm_mark_filled,
+  .enable_eod = shm_enable_eod,
+  .next_read = shm_next_read,
+  .mark_cleared = shm_mark_cleared,
+  .eod = shm_eod,
+  .nfull = shm_nfull,
+  .count = shm_count,
+  .page = shm_page
+};
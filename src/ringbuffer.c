@@ -0,0 +1,225 @@
+/**
+ * Ring buffer interface: backend selection and ASCII header helpers
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "ringbuffer.h"
+
+#define SHM_PREFIX "shm:"
+
+/**
+ * Connect to a ring buffer as writer or reader
+ * The backend is selected by the key, see ringbuffer.h
+ *
+ * @param {char *} key Ring buffer key
+ * @param {int} role RING_WRITER or RING_READER
+ * @returns {ringbuffer_t *} A connected ring buffer, or NULL on error
+ */
+ringbuffer_t *ringbuffer_open(const char *key, int role) {
+  ringbuffer_t *rb;
+
+  rb = calloc(1, sizeof(ringbuffer_t));
+  rb->role = role;
+
+  if (strncmp(key, SHM_PREFIX, strlen(SHM_PREFIX)) == 0) {
+    rb->backend = &ring_shm_backend;
+    key += strlen(SHM_PREFIX);
+  } else {
+#ifdef HAVE_PSRDADA
+    rb->backend = &ring_dada_backend;
+#else
+    fprintf(stderr, "ERROR. Not built with psrdada, use a 'shm:' key instead of %s\n", key);
+    free(rb);
+    return NULL;
+#endif
+  }
+
+  if (rb->backend->open(rb, key, role) < 0) {
+    free(rb);
+    return NULL;
+  }
+
+  return rb;
+}
+
+/**
+ * Disconnect from the ring buffer, and free it
+ */
+void ringbuffer_close(ringbuffer_t *rb) {
+  rb->backend->close(rb);
+  free(rb);
+}
+
+/**
+ * Get the next page to write to, blocks until all readers have released it
+ *
+ * @returns {char *} Pointer to the page, or NULL on error
+ */
+char *ringbuffer_next_write(ringbuffer_t *rb, int block) {
+  return rb->backend->next_write(rb, block);
+}
+
+/**
+ * Hand the current page over to the readers
+ *
+ * @param {uint64_t} size Number of bytes written to the page
+ * @returns {int} 0 on success, -1 on error
+ */
+int ringbuffer_mark_filled(ringbuffer_t *rb, int block, uint64_t size) {
+  return rb->backend->mark_filled(rb, block, size);
+}
+
+/**
+ * Mark the next filled page as the last of the transfer (End-Of-Data)
+ */
+int ringbuffer_enable_eod(ringbuffer_t *rb, int block) {
+  return rb->backend->enable_eod(rb, block);
+}
+
+/**
+ * Get the next page to read, blocks until the writer has filled it
+ *
+ * @param {uint64_t *} size Number of bytes in the page, stored here
+ * @returns {char *} Pointer to the page, or NULL on error
+ */
+char *ringbuffer_next_read(ringbuffer_t *rb, int block, uint64_t *size) {
+  return rb->backend->next_read(rb, block, size);
+}
+
+/**
+ * Release the current page back to the writer
+ */
+int ringbuffer_mark_cleared(ringbuffer_t *rb, int block) {
+  return rb->backend->mark_cleared(rb, block);
+}
+
+/**
+ * Is the page last read the end of the transfer?
+ */
+int ringbuffer_eod(ringbuffer_t *rb, int block) {
+  return rb->backend->eod(rb, block);
+}
+
+/**
+ * Number of pages filled, but not yet cleared by (the slowest) reader
+ */
+uint64_t ringbuffer_nfull(ringbuffer_t *rb, int block) {
+  return rb->backend->nfull(rb, block);
+}
+
+/**
+ * Number of pages handed over since the ring buffer was created: filled by the writer, or cleared by this reader
+ * This is the sequence number of the next page to fill, resp. to read.
+ */
+uint64_t ringbuffer_count(ringbuffer_t *rb, int block) {
+  return rb->backend->count(rb, block);
+}
+
+/**
+ * Address of a page, in the order of the ring, for instance to prefault it
+ * Do not use it to read or write data, that goes through next_write/next_read
+ *
+ * @param {uint64_t} index Page number, between 0 and nbufs
+ */
+char *ringbuffer_page(ringbuffer_t *rb, int block, uint64_t index) {
+  return rb->backend->page(rb, block, index);
+}
+
+/**
+ * Read an ASCII header from file into a header page, the remainder of the page is cleared
+ *
+ * @returns {int} Number of bytes read, or -1 on error
+ */
+int ringbuffer_header_read(const char *filename, char *buf, uint64_t size) {
+  FILE *file;
+  size_t bytes;
+
+  file = fopen(filename, "r");
+  if (!file) {
+    return -1;
+  }
+  bytes = fread(buf, 1, size - 1, file);
+  fclose(file);
+
+  memset(&buf[bytes], 0, size - bytes);
+  return bytes;
+}
+
+/**
+ * Parse a value from an ASCII header of 'KEYWORD value' lines
+ *
+ * @param {char *} header The header
+ * @param {char *} keyword Keyword to look for, at the start of a line
+ * @param {char *} format scanf format of the value
+ * @returns {int} Number of values parsed, or -1 when the keyword is not present
+ */
+int ringbuffer_header_get(const char *header, const char *keyword, const char *format, ...) {
+  size_t len = strlen(keyword);
+  const char *line = header;
+  va_list args;
+  int ret;
+
+  while (line && *line) {
+    if (strncmp(line, keyword, len) == 0 && (line[len] == ' ' || line[len] == '\t')) {
+      va_start(args, format);
+      ret = vsscanf(&line[len], format, args);
+      va_end(args);
+      return ret;
+    }
+
+    line = strchr(line, '\n');
+    if (line) {
+      line++;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Set a value in an ASCII header: the line of the keyword is replaced, or a line is added at the end
+ *
+ * @param {char *} header The header, a zero terminated string
+ * @param {uint64_t} size Size of the header page
+ * @param {char *} keyword Keyword to set
+ * @param {char *} format printf format of the value
+ * @returns {int} 0 on success, -1 when the header page is too small
+ */
+int ringbuffer_header_set(char *header, uint64_t size, const char *keyword, const char *format, ...) {
+  size_t len = strlen(keyword);
+  char value[256];
+  char *line = header;
+  char *next;
+  size_t used;
+  int newline;
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(value, sizeof(value), format, args);
+  va_end(args);
+
+  // remove the current line, if any
+  while (line && *line) {
+    next = strchr(line, '\n');
+    next = next ? next + 1 : line + strlen(line);
+    if (strncmp(line, keyword, len) == 0 && (line[len] == ' ' || line[len] == '\t')) {
+      memmove(line, next, strlen(next) + 1);
+      break;
+    }
+    line = next;
+  }
+
+  // the line, after a newline when the header does not end with one
+  used = strlen(header);
+  newline = used && header[used - 1] != '\n';
+  if (used + newline + len + strlen(value) + 3 > size) {
+    return -1;
+  }
+  sprintf(&header[used], "%s%s %s\n", newline ? "\n" : "", keyword, value);
+  return 0;
+}
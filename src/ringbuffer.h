@@ -0,0 +1,89 @@
+/**
+ * Ring buffer interface, with pluggable backends
+ * Author: Jisk Attema
+ *
+ * A ring buffer has two blocks of pages: a small header block with the ASCII metadata of a transfer,
+ * and a data block with the pages themselves. This mirrors psrdada's HDU.
+ *
+ * The backend is selected by the key:
+ *  - 'shm:<name>' or 'shm:/path/to/file' is the native backend: a file in /dev/shm (or on a hugetlbfs mount)
+ *    mapped by the writer and readers, with futex signalling and a cursor per reader. Create it with ring_db.
+ *  - a hexadecimal number is a psrdada key (only when built with psrdada). Create it with dada_db.
+ */
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stdint.h>
+
+// blocks of a ring buffer
+enum {
+  RING_HEADER = 0,
+  RING_DATA,
+  RING_BLOCKS
+};
+
+// role when connecting
+enum {
+  RING_WRITER = 0,
+  RING_READER
+};
+
+typedef struct ringbuffer ringbuffer_t;
+
+/*
+ * Operations a backend implements; see the ringbuffer_* functions below
+ */
+typedef struct {
+  char *name;
+  int (*open)(ringbuffer_t *rb, const char *key, int role);
+  void (*close)(ringbuffer_t *rb);
+  char *(*next_write)(ringbuffer_t *rb, int block);
+  int (*mark_filled)(ringbuffer_t *rb, int block, uint64_t size);
+  int (*enable_eod)(ringbuffer_t *rb, int block);
+  char *(*next_read)(ringbuffer_t *rb, int block, uint64_t *size);
+  int (*mark_cleared)(ringbuffer_t *rb, int block);
+  int (*eod)(ringbuffer_t *rb, int block);
+  uint64_t (*nfull)(ringbuffer_t *rb, int block);
+  uint64_t (*count)(ringbuffer_t *rb, int block);
+  char *(*page)(ringbuffer_t *rb, int block, uint64_t index);
+} ringbuffer_backend_t;
+
+struct ringbuffer {
+  const ringbuffer_backend_t *backend;
+  int role;                         // RING_WRITER or RING_READER
+  uint64_t nbufs[RING_BLOCKS];      // number of pages per block
+  uint64_t bufsz[RING_BLOCKS];      // size of a page in bytes per block
+  int hugepages;                    // data pages are backed by huge pages
+  void *state;                      // backend private
+};
+
+extern const ringbuffer_backend_t ring_shm_backend;
+#ifdef HAVE_PSRDADA
+extern const ringbuffer_backend_t ring_dada_backend;
+#endif
+
+ringbuffer_t *ringbuffer_open(const char *key, int role);
+void ringbuffer_close(ringbuffer_t *rb);
+
+char *ringbuffer_next_write(ringbuffer_t *rb, int block);
+int ringbuffer_mark_filled(ringbuffer_t *rb, int block, uint64_t size);
+int ringbuffer_enable_eod(ringbuffer_t *rb, int block);
+
+char *ringbuffer_next_read(ringbuffer_t *rb, int block, uint64_t *size);
+int ringbuffer_mark_cleared(ringbuffer_t *rb, int block);
+int ringbuffer_eod(ringbuffer_t *rb, int block);
+
+uint64_t ringbuffer_nfull(ringbuffer_t *rb, int block);
+uint64_t ringbuffer_count(ringbuffer_t *rb, int block);
+char *ringbuffer_page(ringbuffer_t *rb, int block, uint64_t index);
+
+// ASCII header helpers, compatible with psrdada's header format
+int ringbuffer_header_read(const char *filename, char *buf, uint64_t size);
+int ringbuffer_header_get(const char *header, const char *keyword, const char *format, ...);
+int ringbuffer_header_set(char *header, uint64_t size, const char *keyword, const char *format, ...);
+
+// native backend management, used by ring_db
+int ring_shm_create(const char *key, uint64_t nbufs, uint64_t bufsz, uint64_t hdr_nbufs, uint64_t hdr_bufsz, int nreaders);
+int ring_shm_destroy(const char *key);
+
+#endif
@@ -8,87 +8,210 @@
 #include <unistd.h>
 #include <string.h>
 #include <byteswap.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103           // linux/udp.h, kernel 4.18 and up
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60            // asm-generic/socket.h, kernel 4.14 and up
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
-#define PACKHEADER 114                   // Size of the packet header = PACKETSIZE-PAYLOADSIZE in bytes
+#include "packet.h"
+#include "pattern.h"
 
-#define PACKETSIZE_STOKESI  6364         // Size of the packet, including the header in bytes
-#define PAYLOADSIZE_STOKESI 6250         // Size of the record = packet - header in bytes
+#define MMSG_VLEN  256            // Batch message into single syscal using recvmmsg()
 
-#define PACKETSIZE_STOKESIQUV  8114      // Size of the packet, including the header in bytes
-#define PAYLOADSIZE_STOKESIQUV 8000      // Size of the record = packet - header in bytes
+#define MAXTHREADS 64             // Maximum number of sender threads
+#define SOCKBUFSIZE 67108864      // Send buffer size of each socket
 
-#define PAYLOADSIZE_MAX        8000      // Maximum of payload size of I, IQUV
+#define SPIN_NS 50000             // Busy wait instead of sleeping when the pacing deficit is shorter than this
 
-#define MMSG_VLEN  256            // Batch message into single syscal using recvmmsg()
+#define GSO_MAXBYTES 65507        // Maximum UDP payload of a single (to be segmented) IPv4 datagram
+#define GSO_MAXSEGMENTS 64        // Maximum number of segments per datagram (UDP_MAX_SEGMENTS)
+#define ZC_BUFFERS 16             // Batch buffers in flight when waiting for zero copy completions
+
+// Payload patterns
+enum {
+  PATTERN_ZERO,       // all zeros
+  PATTERN_CONSTANT,   // a constant value (8) everywhere, like fake without noise
+  PATTERN_RAMP,       // byte i of the record is (i + tab + channel + sequence) & 0xff
+  PATTERN_NOISE,      // uniform random bytes
+  PATTERN_VERIFY      // a function of tab, channel, sample and timestamp, see pattern.h; checked by verify
+};
+char *pattern_names[] = {"zero", "constant", "ramp", "noise", "verify"};
+
+/*
+ * Run parameters, shared read-only by all sender threads
+ */
+typedef struct {
+  // commandline
+  char *host;                  // destination host
+  int port;                    // first destination port
+  int nports;                  // number of destination ports per compound beam
+  int nbeams;                  // number of compound beams
+  int first_beam;              // cb_index of the first compound beam
+  int nthreads;                // number of sender threads
+  int vlen;                    // number of packets per sendmmsg call
+  int gso;                     // send back-to-back packets as segmentation offloaded datagrams
+  int zerocopy;                // send with MSG_ZEROCOPY and reap the completions
+  int science_case;            // 3 or 4
+  int science_mode;            // 0: I+TAB, 1: IQUV+TAB, 2: I+IAB, 3: IQUV+IAB
+  unsigned long startpacket;   // timestamp of the first frame
+  long nframes;                // number of frames to send, 0 for no limit
+  double rate;                 // target rate in Gb/s, 0 for unpaced, negative for real time
+  int pattern;                 // payload pattern
+  double loss;                 // fraction of packets to drop
+  double reorder;              // fraction of packets to swap with another packet in the same batch
+  double duplicate;            // fraction of packets to send twice
+  double corrupt;              // fraction of packets with a corrupted header
+
+  // derived from science case and mode
+  int payload_size;
+  int packet_size;
+  int sequence_length;
+  int ntabs;
+  int channel_delta;
+  unsigned char marker_field;
+} options_t;
 
-#define TIMEUNIT 781250           // Conversion factor of timestamp from seconds to (1.28 us) packets
-#define UMSPPACKET (1000.0)       // sleep time in microseconds between sending two packets
+/*
+ * Token bucket rate limiter
+ */
+typedef struct {
+  double rate;                 // bytes per nanosecond, 0 for no limit
+  double capacity;             // maximum burst size in bytes
+  double tokens;               // currently available bytes
+  struct timespec last;        // time of last refill
+} bucket_t;
 
 /*
- * Header description based on:
- * ARTS Interface Specification from BF to SC3+4
- * ASTRON_SP_066_InterfaceSpecificationSC34.pdf
- * revision 2.0
+ * Per thread state
  */
 typedef struct {
-  unsigned char marker_byte;         // See table 3 in PDF, page 6
-  unsigned char format_version;      // Version: 1
-  unsigned char cb_index;            // [0,36] one compound beam per fill_ringbuffer instance:: ignore
-  unsigned char tab_index;           // [0,11] all tabs per fill_ringbuffer instance
-  unsigned short channel_index;      // [0,1535] all channels per fill_ringbuffer instance
-  unsigned short payload_size;       // Stokes I: 6250, IQUV: 8000
-  unsigned long timestamp;           // units of 1.28 us, since 1970-01-01 00:00.000 
-  unsigned char sequence_number;     // SC3: Stokes I: 0-1, Stokes IQUV: 0-24
-                                     // SC4: Stokes I: 0-3, Stokes IQUV: 0-49
-  unsigned char reserved[7];
-  unsigned long flags[3];
-  unsigned char record[PAYLOADSIZE_MAX];
-} packet_t;
+  int id;
+  pthread_t thread;
+  options_t *options;
+
+  int *sockfd;                 // one connected socket per compound beam
+
+  unsigned char *batch;        // packets for a single sendmmsg call, one of buffers[]
+  int stride;                  // distance between two packets in the batch, a packet slot or packet size for GSO
+  struct iovec *iov;
+  struct mmsghdr *msgs;
+  packet_t *scratch;           // temporary packet for reordering
+
+  // zero copy bookkeeping: a batch buffer can only be rewritten after the kernel released it
+  unsigned char **buffers;     // batch buffers
+  int nbuffers;
+  int curr_buffer;
+  int *buffer_beam;            // socket the buffer was last sent on, or -1
+  unsigned long *buffer_id;    // last zero copy send id that used the buffer
+  unsigned long *zc_sent;      // per socket: number of zero copy sends so far
+  unsigned long *zc_done;      // per socket: all send ids below this have completed
+
+  bucket_t bucket;
+  unsigned long rng;           // xorshift64 state
+
+  // counters
+  unsigned long packets;
+  unsigned long bytes;
+  unsigned long lost;
+  unsigned long reordered;
+  unsigned long duplicated;
+  unsigned long corrupted;
+  unsigned long refused;
+  unsigned long syscalls;
+  unsigned long zc_copied;     // zero copy sends the kernel copied anyway (always on loopback)
+} sender_t;
 
+pthread_barrier_t frame_barrier;     // keeps the sender threads in the same frame
+volatile sig_atomic_t stop_sending = 0;
+int stop_frame = 0;                  // stop_sending as seen by all threads at the end of a frame
 
 /**
  * Print commandline optinos
  */
 void printOptions() {
-  printf("usage: send -c <science case> -m <science mode> -s <start packet number> -p <port>\n");
+  printf("usage: send -c <science case> -m <science mode> -p <port> [options]\n");
+  printf("  -s <start packet number>   timestamp of the first frame (default 0)\n");
+  printf("  -H <host>                  destination host (default 127.0.0.1)\n");
+  printf("  -P <ports per beam>        spread each compound beam over this many consecutive ports (default 1)\n");
+  printf("  -B <compound beams>        number of compound beams, beam b is sent to port + b * ports per beam (default 1)\n");
+  printf("  -b <first beam>            cb_index of the first compound beam (default 1)\n");
+  printf("  -t <threads>               number of sender threads (default 1)\n");
+  printf("  -v <packets>               packets per sendmmsg call (default %i)\n", MMSG_VLEN);
+  printf("  -g                         send back-to-back packets as UDP_SEGMENT (GSO) datagrams\n");
+  printf("  -z                         send with MSG_ZEROCOPY, implies -g\n");
+  printf("  -r <Gb/s>                  target rate over all threads; 0 sends unpaced (default: real time)\n");
+  printf("  -n <frames>                stop after this many 1.024s frames (default: run forever)\n");
+  printf("  -x <pattern>               payload: zero, constant, ramp, noise, verify (default zero)\n");
+  printf("  -L <%%> -R <%%> -D <%%> -C <%%>  lose, reorder, duplicate, corrupt this percentage of packets\n");
+  printf("e.g. send -c 4 -m 0 -p 4000 -t 4 -r 20 -x ramp -L 0.1\n");
   return;
 }
 
 /**
  * Parse commandline
  */
-void parseOptions(int argc, char*argv[], int *science_case, int *science_mode, unsigned long *startpacket, int *port) {
-  int sets=0, setp=0, setc=0, setm=0;
+void parseOptions(int argc, char*argv[], options_t *options) {
+  int setp=0, setc=0, setm=0;
 
-  // TODO
-  *startpacket = 0;
-  sets = 1;
+  // defaults
+  options->host = "127.0.0.1";
+  options->startpacket = 0;
+  options->nports = 1;
+  options->nbeams = 1;
+  options->first_beam = 1;
+  options->nthreads = 1;
+  options->vlen = MMSG_VLEN;
+  options->gso = 0;
+  options->zerocopy = 0;
+  options->nframes = 0;
+  options->rate = -1;
+  options->pattern = PATTERN_ZERO;
+  options->loss = 0;
+  options->reorder = 0;
+  options->duplicate = 0;
+  options->corrupt = 0;
 
-  int c;
-  while((c=getopt(argc,argv,"s:p:c:m:"))!=-1) {
+  int c, i;
+  while((c=getopt(argc,argv,"s:p:c:m:H:P:B:b:t:v:gzr:n:x:L:R:D:C:"))!=-1) {
     switch(c) {
       // -s start packet number
       case('s'):
-        *startpacket = atol(optarg);
-        sets=1;
+        options->startpacket = atol(optarg);
         break;
 
       // -p port number
       case('p'):
-        *port=atoi(optarg);
+        options->port=atoi(optarg);
         setp=1;
         break;
 
       // -c case
       case('c'):
-        *science_case = atoi(optarg);
+        options->science_case = atoi(optarg);
         setc=1;
-        if (*science_case < 3 || *science_case > 4) {
+        if (options->science_case < 3 || options->science_case > 4) {
           printOptions();
           exit(0);
         }
@@ -96,14 +219,93 @@ void parseOptions(int argc, char*argv[], int *science_case, int *science_mode, u
 
       // -m mode
       case('m'):
-        *science_mode = atoi(optarg);
+        options->science_mode = atoi(optarg);
         setm=1;
-        if (*science_mode < 0 || *science_mode > 4) {
+        if (options->science_mode < 0 || options->science_mode > 3) {
           printOptions();
           exit(0);
         }
         break;
 
+      // -H destination host
+      case('H'):
+        options->host = optarg;
+        break;
+
+      // -P ports per compound beam
+      case('P'):
+        options->nports = atoi(optarg);
+        break;
+
+      // -B number of compound beams
+      case('B'):
+        options->nbeams = atoi(optarg);
+        break;
+
+      // -b first compound beam index
+      case('b'):
+        options->first_beam = atoi(optarg);
+        break;
+
+      // -t number of threads
+      case('t'):
+        options->nthreads = atoi(optarg);
+        break;
+
+      // -v packets per sendmmsg call
+      case('v'):
+        options->vlen = atoi(optarg);
+        break;
+
+      // -g generic segmentation offload
+      case('g'):
+        options->gso = 1;
+        break;
+
+      // -z zero copy, only in combination with GSO
+      case('z'):
+        options->gso = 1;
+        options->zerocopy = 1;
+        break;
+
+      // -r rate in Gb/s
+      case('r'):
+        options->rate = atof(optarg);
+        break;
+
+      // -n number of frames
+      case('n'):
+        options->nframes = atol(optarg);
+        break;
+
+      // -x payload pattern
+      case('x'):
+        options->pattern = -1;
+        for (i=0; i < sizeof(pattern_names) / sizeof(pattern_names[0]); i++) {
+          if (strcmp(optarg, pattern_names[i]) == 0) {
+            options->pattern = i;
+          }
+        }
+        if (options->pattern < 0) {
+          fprintf(stderr, "Unknown payload pattern '%s'\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // impairments, in percent
+      case('L'):
+        options->loss = atof(optarg) / 100.0;
+        break;
+      case('R'):
+        options->reorder = atof(optarg) / 100.0;
+        break;
+      case('D'):
+        options->duplicate = atof(optarg) / 100.0;
+        break;
+      case('C'):
+        options->corrupt = atof(optarg) / 100.0;
+        break;
+
       default:
         fprintf(stderr, "Illegal option '%c'\n",  c);
         printOptions();
@@ -112,34 +314,525 @@ void parseOptions(int argc, char*argv[], int *science_case, int *science_mode, u
   }
 
   // All arguments are required
-  if (!sets || !setp || !setc || !setm) {
-    printf( "sets %i setp %i setc %i setm %i\n", sets, setp, setc, setm);
+  if (!setp || !setc || !setm) {
+    printf( "setp %i setc %i setm %i\n", setp, setc, setm);
     printOptions();
     exit(EXIT_FAILURE);
   }
+
+  if (options->nthreads < 1 || options->nthreads > MAXTHREADS) {
+    fprintf(stderr, "Number of threads should be between 1 and %i\n", MAXTHREADS);
+    exit(EXIT_FAILURE);
+  }
+  if (options->vlen < 1 || options->vlen > MMSG_VLEN) {
+    fprintf(stderr, "Packets per call should be between 1 and %i\n", MMSG_VLEN);
+    exit(EXIT_FAILURE);
+  }
+  if (options->nports < 1 || options->nbeams < 1) {
+    fprintf(stderr, "Need at least one port and one compound beam\n");
+    exit(EXIT_FAILURE);
+  }
+  if (options->first_beam < 0 || options->first_beam + options->nbeams > 256) {
+    fprintf(stderr, "Compound beam index out of range\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Open a socket connected to a host and port
+ *
+ * @param {char *} host Destination host name or address
+ * @param {int} port Destination port
+ * @param {int} gso_size Enable UDP segmentation offload with this segment size, 0 to disable
+ * @param {int} zerocopy Enable MSG_ZEROCOPY on the socket
+ * @returns {int} socket file descriptor
+ */
+int init_network(char *host, int port, int gso_size, int zerocopy) {
+  int sockfd = -1;
+  struct addrinfo hints, *servinfo, *p;
+  char service[256];
+
+  // connect to port
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  snprintf(service, 255, "%i", port);
+
+  // find possible connections
+  if(getaddrinfo(host, service, &hints, &servinfo) != 0) {
+    perror(NULL);
+    exit(EXIT_FAILURE);
+  }
+
+  // loop through all the results and make a socket
+  for(p = servinfo; p != NULL; p = p->ai_next) {
+    sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (sockfd == -1) {
+      perror("talker: socket");
+      continue;
+    }
+
+    if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+      close(sockfd);
+      continue;
+    }
+
+    break;
+  }
+
+  if (p==NULL) {
+    fprintf(stderr, "Cannot open connection to %s:%i\n", host, port);
+    exit(EXIT_FAILURE);
+  }
+
+  // set socket buffer size
+  int sockbufsize = SOCKBUFSIZE;
+  setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sockbufsize, (socklen_t)sizeof(int));
+
+  // every datagram larger than gso_size is split in segments of gso_size by the kernel (or NIC)
+  if (gso_size && setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &gso_size, (socklen_t)sizeof(int)) == -1) {
+    perror("ERROR Could not enable UDP_SEGMENT");
+    exit(EXIT_FAILURE);
+  }
+
+  if (zerocopy) {
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, (socklen_t)sizeof(int)) == -1) {
+      perror("ERROR Could not enable SO_ZEROCOPY");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  freeaddrinfo(servinfo);
+
+  return sockfd;
+}
+
+/**
+ * Nanoseconds between two points in time
+ */
+static inline double elapsed_ns(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e9 + (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * Wait until the bucket holds enough tokens to send size bytes, then take them
+ *
+ * Longer waits sleep until an absolute deadline so that sleep overshoot is paid back
+ * by the next refill, short waits spin.
+ */
+void bucket_take(bucket_t *bucket, double size) {
+  struct timespec now, deadline;
+  double wait;
+
+  if (bucket->rate == 0) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  bucket->tokens += elapsed_ns(&bucket->last, &now) * bucket->rate;
+  if (bucket->tokens > bucket->capacity) {
+    bucket->tokens = bucket->capacity;
+  }
+  bucket->last = now;
+
+  if (bucket->tokens < size) {
+    wait = (size - bucket->tokens) / bucket->rate;
+
+    deadline.tv_sec = now.tv_sec + (long) (wait / 1e9);
+    deadline.tv_nsec = now.tv_nsec + (long) (wait - 1e9 * (long) (wait / 1e9));
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    if (wait > SPIN_NS) {
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+    do {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_ns(&deadline, &now) < 0);
+
+    bucket->tokens += elapsed_ns(&bucket->last, &now) * bucket->rate;
+    bucket->last = now;
+  }
+
+  bucket->tokens -= size;
+}
+
+/**
+ * xorshift64 pseudo random number generator
+ */
+static inline unsigned long xorshift64(unsigned long *state) {
+  unsigned long x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+/**
+ * Uniform random number in [0, 1)
+ */
+static inline double uniform(unsigned long *state) {
+  return (xorshift64(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Write the header fields that are the same for all packets
+ * They are written once per batch buffer, so nothing may write across the end of a packet into the next one:
+ * copies in the batch are packet_size bytes, within a stride of at least packet_size.
+ */
+static inline void set_constant_fields(packet_t *packet, const options_t *options) {
+  packet->marker_byte = options->marker_field;
+  packet->format_version = 1;
+  packet->payload_size = bswap_16(options->payload_size);
+}
+
+/**
+ * Fill the record of a packet with the payload pattern
+ */
+void fill_payload(sender_t *sender, packet_t *packet, unsigned char tab, unsigned short channel, unsigned char sequence, unsigned long timestamp) {
+  options_t *options = sender->options;
+  unsigned long word;
+  uint8_t first, step;
+  int i;
+
+  switch (options->pattern) {
+    case PATTERN_ZERO:
+      memset(packet->record, 0, options->payload_size);
+      break;
+
+    case PATTERN_CONSTANT:
+      memset(packet->record, 8, options->payload_size);
+      break;
+
+    case PATTERN_RAMP:
+      for (i=0; i < options->payload_size; i++) {
+        packet->record[i] = (i + tab + channel + sequence) & 0xff;
+      }
+      break;
+
+    case PATTERN_NOISE:
+      // packets in a GSO batch are not 8 byte aligned
+      for (i=0; i < options->payload_size; i += 8) {
+        word = xorshift64(&sender->rng);
+        memcpy(&packet->record[i], &word, options->payload_size - i < 8 ? options->payload_size - i : 8);
+      }
+      break;
+
+    case PATTERN_VERIFY:
+      pattern_key(tab, channel, sequence, timestamp, &first, &step);
+      pattern_fill(packet->record, options->payload_size, first, step);
+      break;
+  }
+}
+
+/**
+ * Corrupt one of the header fields fill_ringbuffer checks
+ */
+void corrupt_header(sender_t *sender, packet_t *packet) {
+  switch (xorshift64(&sender->rng) % 6) {
+    case 0: packet->marker_byte ^= 0xFF; break;
+    case 1: packet->format_version++; break;
+    case 2: packet->cb_index++; break;
+    case 3: packet->tab_index = 0xFF; break;
+    case 4: packet->channel_index = bswap_16(NCHANNELS + 1); break;
+    case 5: packet->payload_size ^= 0xFFFF; break;
+  }
+}
+
+/**
+ * Process zero copy completion notifications from the error queue of a socket
+ */
+void reap_completions(sender_t *sender, int beam) {
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct sock_extended_err *serr;
+  char control[128];
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sender->sockfd[beam], &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      // EAGAIN: no more notifications
+      return;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+
+      // [ee_info, ee_data] is a range of completed send ids,
+      // for a single UDP socket they are reported in order
+      if (serr->ee_data + 1UL > sender->zc_done[beam]) {
+        sender->zc_done[beam] = serr->ee_data + 1UL;
+      }
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        sender->zc_copied += serr->ee_data - serr->ee_info + 1;
+      }
+    }
+  }
+}
+
+/**
+ * Make the next batch buffer current; with zero copy, wait till the kernel is done with it
+ */
+void next_buffer(sender_t *sender) {
+  int beam;
+  struct pollfd pfd;
+
+  sender->curr_buffer = (sender->curr_buffer + 1) % sender->nbuffers;
+  sender->batch = sender->buffers[sender->curr_buffer];
+
+  beam = sender->buffer_beam[sender->curr_buffer];
+  if (!sender->options->zerocopy || beam < 0) {
+    return;
+  }
+
+  reap_completions(sender, beam);
+  while (sender->zc_done[beam] <= sender->buffer_id[sender->curr_buffer]) {
+    // error queue events are always reported, no need to ask for them
+    pfd.fd = sender->sockfd[beam];
+    pfd.events = 0;
+    poll(&pfd, 1, 100);
+    reap_completions(sender, beam);
+  }
+}
+
+/**
+ * Swap two packets in the batch
+ */
+void swap_packets(sender_t *sender, int i, int j) {
+  int size = sender->options->packet_size;
+  unsigned char *a = &sender->batch[i * sender->stride];
+  unsigned char *b = &sender->batch[j * sender->stride];
+
+  memcpy(sender->scratch, a, size);
+  memcpy(a, b, size);
+  memcpy(b, sender->scratch, size);
+}
+
+/**
+ * Send the first count packets of the current batch on a socket
+ *
+ * Without GSO every packet is a message of its own.
+ * With GSO, consecutive packets are grouped in large datagrams that the kernel splits in
+ * packet_size segments, so one pass through the network stack is paid per datagram instead of per packet.
+ */
+int send_batch(sender_t *sender, int beam, int count) {
+  options_t *options = sender->options;
+  int sockfd = sender->sockfd[beam];
+  int flags = options->zerocopy ? MSG_ZEROCOPY : 0;
+  int segments = options->gso ? GSO_MAXBYTES / options->packet_size : 1;
+  int nmsgs = 0;
+  int sent = 0;
+  int i, n, r;
+
+  if (segments > GSO_MAXSEGMENTS) {
+    segments = GSO_MAXSEGMENTS;
+  }
+
+  // shuffle some packets within the batch
+  if (options->reorder > 0) {
+    for (i=0; i < count; i++) {
+      if (uniform(&sender->rng) < options->reorder) {
+        swap_packets(sender, i, xorshift64(&sender->rng) % count);
+        sender->reordered++;
+      }
+    }
+  }
+
+  for (i=0; i < count; i += segments) {
+    n = count - i < segments ? count - i : segments;
+    sender->iov[nmsgs].iov_base = &sender->batch[i * sender->stride];
+    sender->iov[nmsgs].iov_len = n * options->packet_size;
+    nmsgs++;
+  }
+
+  bucket_take(&sender->bucket, (double) count * options->packet_size);
+
+  while (sent < nmsgs) {
+    r = sendmmsg(sockfd, &sender->msgs[sent], nmsgs - sent, flags);
+    sender->syscalls++;
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == ENOBUFS && options->zerocopy) {
+        // out of option memory for pending notifications, release some
+        reap_completions(sender, beam);
+        continue;
+      }
+      if (errno == ECONNREFUSED) {
+        // nobody listening (yet), the rest of the batch is lost
+        for (i=sent; i < nmsgs; i++) {
+          sender->refused += sender->iov[i].iov_len / options->packet_size;
+        }
+        break;
+      }
+      perror("ERROR Could not send packets");
+      return -1;
+    }
+
+    for (i=sent; i < sent + r; i++) {
+      sender->packets += sender->iov[i].iov_len / options->packet_size;
+      sender->bytes += sender->iov[i].iov_len;
+    }
+    if (options->zerocopy) {
+      sender->zc_sent[beam] += r;
+    }
+    sent += r;
+  }
+
+  // remember which send released this buffer, and move on to the next one
+  sender->buffer_beam[sender->curr_buffer] = sent ? beam : -1;
+  sender->buffer_id[sender->curr_buffer] = sender->zc_sent[beam] - 1;
+  next_buffer(sender);
+
+  return 0;
+}
+
+/**
+ * Sender thread
+ *
+ * Every frame the threads split the channels between them.
+ * Per compound beam, a thread sends to port + beam * nports + (thread % nports).
+ * Loop over:
+ *  * compound beam [0 .. nbeams]
+ *  * tab           [0 .. ntabs]
+ *  * sequence      [0 .. sequence_length]
+ *  * channel       [thread .. 1536], in steps of channel_delta * nthreads
+ */
+void *sender_thread(void *arg) {
+  sender_t *sender = (sender_t *) arg;
+  options_t *options = sender->options;
+
+  unsigned long curr_time = options->startpacket;
+  long frame;
+  int beam;
+  unsigned char curr_tab;
+  unsigned char curr_sequence;
+  unsigned short curr_channel;
+  int count = 0;
+  packet_t *packet;
+
+  for (frame = 0; options->nframes == 0 || frame < options->nframes; frame++) {
+    for (beam = 0; beam < options->nbeams && !stop_sending; beam++) {
+      for (curr_tab = 0; curr_tab < options->ntabs; curr_tab++) {
+        for (curr_sequence = 0; curr_sequence < options->sequence_length; curr_sequence++) {
+          for (curr_channel = sender->id * options->channel_delta;
+               curr_channel < NCHANNELS;
+               curr_channel += options->channel_delta * options->nthreads) {
+
+            if (options->loss > 0 && uniform(&sender->rng) < options->loss) {
+              sender->lost++;
+              continue;
+            }
+
+            packet = (packet_t *) &sender->batch[count * sender->stride];
+
+            // the constant values are in the buffer since its setup, unless an earlier batch corrupted them
+            if (options->corrupt > 0) {
+              set_constant_fields(packet, options);
+            }
+
+            // update non-constant values
+            packet->cb_index = options->first_beam + beam;
+            packet->sequence_number = curr_sequence;
+            packet->tab_index = curr_tab;
+            packet->channel_index = bswap_16(curr_channel);
+            packet->timestamp = bswap_64(curr_time);
+
+            if (options->pattern >= PATTERN_RAMP) {
+              fill_payload(sender, packet, curr_tab, curr_channel, curr_sequence, curr_time);
+            }
+
+            if (options->corrupt > 0 && uniform(&sender->rng) < options->corrupt) {
+              corrupt_header(sender, packet);
+              sender->corrupted++;
+            }
+            count++;
+
+            if (options->duplicate > 0 && count < options->vlen && uniform(&sender->rng) < options->duplicate) {
+              memcpy(&sender->batch[count * sender->stride], packet, options->packet_size);
+              sender->duplicated++;
+              count++;
+            }
+
+            // Send next batch of packets
+            if (count == options->vlen) {
+              if (send_batch(sender, beam, count)) {
+                stop_sending = 1;
+              }
+              count = 0;
+            }
+          }
+        }
+      }
+
+      // flush the remainder, a batch never spans two compound beams
+      if (count) {
+        if (send_batch(sender, beam, count)) {
+          stop_sending = 1;
+        }
+        count = 0;
+      }
+    }
+
+    // wait for the other threads before starting the next frame,
+    // and make sure they all agree on stopping
+    if (pthread_barrier_wait(&frame_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+      stop_frame = stop_sending;
+    }
+    pthread_barrier_wait(&frame_barrier);
+    if (stop_frame) {
+      break;
+    }
+
+    curr_time += FRAMETIME;
+  }
+
+  return NULL;
+}
+
+/**
+ * Stop all threads at the end of their current frame
+ */
+void stop_handler(int signum) {
+  stop_sending = 1;
 }
 
 int main(int argc , char *argv[]) {
   // commandline args
-  int port;
-  int science_mode;        // 0: I+TAB, 1: IQUV+TAB, 2: I+IAB, 3: IQUV+IAB
-  int science_case;        // 3 or 4
-  unsigned long startpacket;
-  parseOptions(argc, argv, &science_case, &science_mode, &startpacket, &port);
+  options_t options;
+  parseOptions(argc, argv, &options);
 
   // local variables
-  int sockfd;
-  struct addrinfo hints, *servinfo, *p;
-  int payload_size;
-  int packet_size;
+  sender_t senders[MAXTHREADS];
+  struct timespec start, end;
+  int payload_size = 0;
+  int packet_size = 0;
+  size_t slot_size;
   int sequence_length = 1;
   int ntabs = 1;
   int channel_delta = 1;
   unsigned char marker_field = 0;
+  int t, beam, packet_idx, b;
 
-  switch (science_case) {
+  switch (options.science_case) {
     case 3:
-      switch (science_mode) {
+      switch (options.science_mode) {
         case 0:
           // Science case 3, Stokes I + TAB
           payload_size = PAYLOADSIZE_STOKESI;
@@ -180,7 +873,7 @@ int main(int argc , char *argv[]) {
       break;
 
     case 4:
-      switch (science_mode) {
+      switch (options.science_mode) {
         case 0:
           // Science case 4, Stokes I + TAB
           payload_size = PAYLOADSIZE_STOKESI;
@@ -220,119 +913,148 @@ int main(int argc , char *argv[]) {
       }
       break;
   }
+  options.payload_size = payload_size;
+  options.packet_size = packet_size;
+  options.sequence_length = sequence_length;
+  options.ntabs = ntabs;
+  options.channel_delta = channel_delta;
+  options.marker_field = marker_field;
+
+  // real time rate: a frame of packets every 1.024 seconds
+  if (options.rate < 0) {
+    options.rate = 8e-9 * options.nbeams * ntabs * sequence_length * (NCHANNELS / channel_delta) * packet_size
+                   / (1.0 * FRAMETIME / TIMEUNIT);
+  }
+
   printf("Sending sequence_length=%i packet_size=%i payload_size=%i marker_field=%i channel_delta=%i ntabs=%i\n",
       sequence_length, packet_size, payload_size, marker_field, channel_delta, ntabs);
+  printf("Sending beams=%i ports per beam=%i threads=%i packets per call=%i rate=%.3f Gb/s pattern=%s gso=%i zerocopy=%i\n",
+      options.nbeams, options.nports, options.nthreads, options.vlen, options.rate, pattern_names[options.pattern],
+      options.gso, options.zerocopy);
+  printf("Impairments loss=%.3f%% reorder=%.3f%% duplicate=%.3f%% corrupt=%.3f%%\n",
+      100.0 * options.loss, 100.0 * options.reorder, 100.0 * options.duplicate, 100.0 * options.corrupt);
 
-  // connect to port
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_DGRAM;
+  pthread_barrier_init(&frame_barrier, NULL, options.nthreads);
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
 
-  char service[256];
-  snprintf(service, 255, "%i", port);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (t=0; t < options.nthreads; t++) {
+    sender_t *sender = &senders[t];
+    memset(sender, 0, sizeof(sender_t));
+    sender->id = t;
+    sender->options = &options;
+    sender->rng = 0x9E3779B97F4A7C15UL * (t + 1);
 
-  // find possible connections
-  if(getaddrinfo("127.0.0.1", service, &hints, &servinfo) != 0) {
-    perror(NULL);
-    exit(EXIT_FAILURE);
-  }
+    // connect to port
+    sender->sockfd = malloc(options.nbeams * sizeof(int));
+    for (beam=0; beam < options.nbeams; beam++) {
+      sender->sockfd[beam] = init_network(options.host, options.port + beam * options.nports + t % options.nports,
+                                          options.gso ? packet_size : 0, options.zerocopy);
+    }
+    sender->zc_sent = calloc(options.nbeams, sizeof(unsigned long));
+    sender->zc_done = calloc(options.nbeams, sizeof(unsigned long));
 
-  // loop through all the results and make a socket
-  for(p = servinfo; p != NULL; p = p->ai_next) {
-    sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-    if (sockfd == -1) {
-      perror("talker: socket");
-      continue;
+    // batch buffers: with GSO the packets are back-to-back, and with zero copy
+    // several buffers are needed to keep sending while the kernel holds on to earlier ones
+    // a slot holds both a packet_t and a packet on the wire, which is larger for Stokes IQUV
+    slot_size = ((sizeof(packet_t) > (size_t) packet_size ? sizeof(packet_t) : (size_t) packet_size) + 63) & ~63UL;
+    sender->stride = options.gso ? packet_size : slot_size;
+    sender->nbuffers = options.zerocopy ? ZC_BUFFERS : 1;
+    sender->buffers = malloc(sender->nbuffers * sizeof(unsigned char *));
+    sender->buffer_beam = malloc(sender->nbuffers * sizeof(int));
+    sender->buffer_id = calloc(sender->nbuffers, sizeof(unsigned long));
+    for (b=0; b < sender->nbuffers; b++) {
+      // a full slot for the last packet, also with GSO where the stride is only packet_size
+      sender->buffers[b] = calloc(1, (options.vlen - 1) * sender->stride + slot_size);
+      sender->buffer_beam[b] = -1;
+
+      // header templates: constant fields are written once, the rest is updated in place
+      for(packet_idx=0; packet_idx < options.vlen; packet_idx++) {
+        packet_t *packet = (packet_t *) &sender->buffers[b][packet_idx * sender->stride];
+        set_constant_fields(packet, &options);
+        if (options.pattern == PATTERN_CONSTANT) {
+          fill_payload(sender, packet, 0, 0, 0, 0);
+        }
+      }
     }
+    sender->curr_buffer = 0;
+    sender->batch = sender->buffers[0];
+    sender->scratch = malloc(slot_size);
 
-    if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-      close(sockfd);
-      continue;
+    // multi message setup
+    sender->iov = malloc(options.vlen * sizeof(struct iovec));
+    sender->msgs = calloc(options.vlen, sizeof(struct mmsghdr));
+    for(packet_idx=0; packet_idx < options.vlen; packet_idx++) {
+      sender->msgs[packet_idx].msg_hdr.msg_name    = NULL; // sockets are connected
+      sender->msgs[packet_idx].msg_hdr.msg_iov     = &sender->iov[packet_idx];
+      sender->msgs[packet_idx].msg_hdr.msg_iovlen  = 1;
+      sender->msgs[packet_idx].msg_hdr.msg_control = NULL; // segment size is set on the socket
     }
 
-    break;
-  }
+    // each thread paces its share of the total rate
+    sender->bucket.rate = options.rate / 8.0 / options.nthreads;
+    sender->bucket.capacity = 2.0 * options.vlen * packet_size;
+    sender->bucket.tokens = sender->bucket.capacity;
+    sender->bucket.last = start;
 
-  if (p==NULL) {
-    fprintf(stderr, "Cannot open connection\n");
-    exit(EXIT_FAILURE);
+    if (pthread_create(&sender->thread, NULL, sender_thread, sender)) {
+      perror("ERROR Could not start sender thread");
+      exit(EXIT_FAILURE);
+    }
   }
 
-  // multi message setup
-  packet_t packet_buffer[MMSG_VLEN];   // Buffer for batch requesting packets via recvmmsg
-  unsigned int packet_idx;             // Current packet index in MMSG buffer
-  struct iovec iov[MMSG_VLEN];         // IO vec structure for recvmmsg
-  struct mmsghdr msgs[MMSG_VLEN];      // multimessage hearders for recvmmsg
-
-  memset(msgs, 0, sizeof(msgs));
-  for(packet_idx=0; packet_idx < MMSG_VLEN; packet_idx++) {
-    iov[packet_idx].iov_base = (char *) &packet_buffer[packet_idx];
-    iov[packet_idx].iov_len = packet_size;
-
-    msgs[packet_idx].msg_hdr.msg_name    = NULL; // we don't need to know who sent the data
-    msgs[packet_idx].msg_hdr.msg_iov     = &iov[packet_idx];
-    msgs[packet_idx].msg_hdr.msg_iovlen  = 1;
-    msgs[packet_idx].msg_hdr.msg_control = NULL; // we're not interested in OoB data
-  }
+  // done, collect statistics and clean up
+  unsigned long packets = 0, bytes = 0, lost = 0, reordered = 0, duplicated = 0, corrupted = 0, refused = 0;
+  unsigned long syscalls = 0, zc_copied = 0;
+  for (t=0; t < options.nthreads; t++) {
+    sender_t *sender = &senders[t];
+    pthread_join(sender->thread, NULL);
 
-  // local counters
-  unsigned short curr_channel = 0;
-  unsigned char curr_sequence = 0;
-  unsigned char curr_tab = 0;
-  unsigned long curr_time = startpacket;
-
-  packet_t *packet;                // Pointer to current packet
-  while(1) {
-
-    // Create the next MMSB_VLEN packets
-    //
-    // Loop over:
-    //  * tab           [0 .. 12]
-    //  * sequence      [0 .. sequence_length]
-    //  * channel       [0 .. 1536], in steps of channel_delta
-    for(packet_idx=0; packet_idx < MMSG_VLEN; packet_idx++) {
-      packet = &packet_buffer[packet_idx];
-
-      // set constant values
-      packet->marker_byte = marker_field;
-      packet->format_version = 1;
-      packet->cb_index = 1;
-      packet->payload_size = bswap_16(payload_size);
-
-      // update non-constant values
-      packet->sequence_number = curr_sequence;
-      packet->tab_index = curr_tab;
-      packet->channel_index = bswap_16(curr_channel);
-      packet->timestamp = bswap_64(curr_time);
-
-      // go to next packet
-      curr_channel += channel_delta;
-      if (curr_channel >= 1536) {
-        curr_channel = 0;
-        curr_sequence++;
-      }
-      if (curr_sequence >= sequence_length) {
-        curr_sequence = 0;
-        curr_tab++;
-      }
-      if (curr_tab >= ntabs) {
-        curr_tab = 0;
-        curr_time += 800000; // 1.024 seconds per frame, in units of 1.28 microseconds
-      }
+    packets += sender->packets;
+    bytes += sender->bytes;
+    lost += sender->lost;
+    reordered += sender->reordered;
+    duplicated += sender->duplicated;
+    corrupted += sender->corrupted;
+    refused += sender->refused;
+    syscalls += sender->syscalls;
+
+    // wait for outstanding zero copy sends before releasing the buffers
+    for (b=0; options.zerocopy && b < sender->nbuffers; b++) {
+      next_buffer(sender);
     }
+    zc_copied += sender->zc_copied;
 
-    // Send next batch of packets
-    if (sendmmsg(sockfd, msgs, MMSG_VLEN, 0) == -1) {
-      perror("ERROR Could not send packets");
-      goto exit;
+    for (beam=0; beam < options.nbeams; beam++) {
+      close(sender->sockfd[beam]);
     }
+    free(sender->sockfd);
+    for (b=0; b < sender->nbuffers; b++) {
+      free(sender->buffers[b]);
+    }
+    free(sender->buffers);
+    free(sender->buffer_beam);
+    free(sender->buffer_id);
+    free(sender->zc_sent);
+    free(sender->zc_done);
+    free(sender->scratch);
+    free(sender->iov);
+    free(sender->msgs);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
 
-    // slow down sending a bit
-    usleep(UMSPPACKET);
+  double seconds = elapsed_ns(&start, &end) * 1e-9;
+  printf("Sent %lu packets, %lu bytes in %.3f s: %.0f packets/s, %.3f Gb/s\n",
+      packets, bytes, seconds, packets / seconds, 8e-9 * bytes / seconds);
+  printf("Lost %lu reordered %lu duplicated %lu corrupted %lu refused %lu\n",
+      lost, reordered, duplicated, corrupted, refused);
+  printf("System calls %lu (%.1f packets per call)", syscalls, syscalls ? 1.0 * packets / syscalls : 0.0);
+  if (options.zerocopy) {
+    printf(", zero copy sends copied by the kernel %lu", zc_copied);
   }
+  printf("\n");
 
-exit:
-  // done, clean up
-  free(servinfo); 
-  close(sockfd);
+  pthread_barrier_destroy(&frame_barrier);
+  return 0;
 }
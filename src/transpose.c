@@ -0,0 +1,445 @@
+/**
+ * Time-major Stokes I pages: cache-blocked transpose of the packets to [tab][time][channel]
+ * Author: Jisk Attema
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "packet.h"
+#include "transpose.h"
+
+/**
+ * Set up the tile pool for a page layout
+ * Packets are accepted in any order till the page is handed over, so the pool has a tile for every tab, sequence number
+ * and channel group of the page. The tiles are only faulted in when used: packets in order keep reusing a few.
+ *
+ * @param {transposer_t *} t To initialize
+ * @param {int} ntabs Tabs in the page
+ * @param {int} nchannels Channels in the page
+ * @param {int} sequence_length Packets per channel per page
+ * @param {int} padded_size Samples per tab in the page
+ * @returns {int} 0 on success, -1 on error
+ */
+int transpose_init(transposer_t *t, int ntabs, int nchannels, int sequence_length, int padded_size) {
+  size_t nkeys;
+  size_t i;
+
+  memset(t, 0, sizeof(transposer_t));
+  t->ntabs = ntabs;
+  t->nchannels = nchannels;
+  t->groups = (nchannels + TRANSPOSE_CHANNELS - 1) / TRANSPOSE_CHANNELS;
+  t->sequence_length = sequence_length;
+  t->padded_size = padded_size;
+  nkeys = (size_t) ntabs * sequence_length * t->groups;
+  t->ntiles = nkeys;
+
+  t->map = malloc(nkeys * sizeof(int));
+  t->written = calloc(nkeys, sizeof(uint64_t));
+  t->tiles = calloc(t->ntiles, sizeof(transpose_tile_t));
+  t->free = malloc(t->ntiles * sizeof(int));
+  t->pool = mmap(NULL, (size_t) t->ntiles * TRANSPOSE_CHANNELS * TRANSPOSE_STRIDE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (!t->map || !t->written || !t->tiles || !t->free || t->pool == MAP_FAILED) {
+    if (t->pool != MAP_FAILED) {
+      munmap(t->pool, (size_t) t->ntiles * TRANSPOSE_CHANNELS * TRANSPOSE_STRIDE);
+    }
+    free(t->map);
+    free(t->written);
+    free(t->tiles);
+    free(t->free);
+    t->map = NULL;
+    t->written = NULL;
+    t->tiles = NULL;
+    t->free = NULL;
+    t->pool = NULL;
+    return -1;
+  }
+  for (i = 0; i < nkeys; i++) {
+    t->map[i] = -1;
+  }
+  for (i = 0; i < (size_t) t->ntiles; i++) {
+    t->tiles[i].data = &t->pool[i * TRANSPOSE_CHANNELS * TRANSPOSE_STRIDE];
+    t->tiles[i].key = -1;
+    t->free[t->nfree++] = t->ntiles - 1 - i;
+  }
+  pthread_mutex_init(&t->lock, NULL);
+  pthread_cond_init(&t->flushed, NULL);
+
+  return 0;
+}
+
+#ifdef __SSE2__
+/**
+ * Transpose 16x16 bytes in registers
+ * Interleaving the bytes of rows i and i+8 moves element (row, column) to the position rotated left by one bit:
+ * after four rounds row and column are swapped.
+ */
+static inline void transpose_16x16(__m128i *r) {
+  __m128i t[16];
+  int round, i;
+
+  for (round = 0; round < 4; round++) {
+    for (i = 0; i < 8; i++) {
+      t[2*i    ] = _mm_unpacklo_epi8(r[i], r[i + 8]);
+      t[2*i + 1] = _mm_unpackhi_epi8(r[i], r[i + 8]);
+    }
+    for (i = 0; i < 16; i++) {
+      r[i] = t[i];
+    }
+  }
+}
+#endif
+
+/**
+ * Channels in the tile of a key: TRANSPOSE_CHANNELS, except for the last group of a channel selection
+ */
+static int tile_width(const transposer_t *t, int key) {
+  int first = (key % t->groups) * TRANSPOSE_CHANNELS;
+
+  return t->nchannels - first < TRANSPOSE_CHANNELS ? t->nchannels - first : TRANSPOSE_CHANNELS;
+}
+
+/**
+ * Bitmap of all channels of a tile
+ */
+static uint64_t tile_full(const transpose_tile_t *tile) {
+  return tile->width == TRANSPOSE_CHANNELS ? ~0UL : (1UL << tile->width) - 1;
+}
+
+/**
+ * Write out a complete tile: 16 samples of 64 channels at a time, as 16 full cache lines in the page
+ */
+static void write_tile(const transposer_t *t, const transpose_tile_t *tile) {
+  const uint8_t *data = tile->data;
+  char *dest = tile->dest;
+  size_t stride = t->nchannels;
+  int time = 0;
+  int channel;
+
+#ifdef __SSE2__
+  __m128i r[TRANSPOSE_CHANNELS / 16][16];
+  __m128i *out;
+  int blocks = tile->width / 16;
+  int block, i;
+
+  // the page rows are 1536 bytes, or the selected channels, so this is aligned when the page is and the rows are
+  int aligned = ((uintptr_t) dest & 15) == 0 && (stride & 15) == 0;
+
+  for (time = 0; time + 16 <= PAYLOADSIZE_STOKESI; time += 16) {
+    for (block = 0; block < blocks; block++) {
+      for (i = 0; i < 16; i++) {
+        r[block][i] = _mm_loadu_si128((const __m128i *) &data[(block * 16 + i) * TRANSPOSE_STRIDE + time]);
+      }
+      transpose_16x16(r[block]);
+    }
+
+    // write whole cache lines, so the write combining buffers do not flush partial lines
+    for (i = 0; i < 16; i++) {
+      out = (__m128i *) &dest[(time + i) * stride];
+      for (block = 0; block < blocks; block++) {
+        if (aligned) {
+          _mm_stream_si128(&out[block], r[block][i]);
+        } else {
+          _mm_storeu_si128(&out[block], r[block][i]);
+        }
+      }
+      // the channels of a partial block
+      for (channel = blocks * 16; channel < tile->width; channel++) {
+        dest[(time + i) * stride + channel] = data[channel * TRANSPOSE_STRIDE + time + i];
+      }
+    }
+  }
+#endif
+
+  // the remaining samples
+  for (; time < PAYLOADSIZE_STOKESI; time++) {
+    for (channel = 0; channel < tile->width; channel++) {
+      dest[time * stride + channel] = data[channel * TRANSPOSE_STRIDE + time];
+    }
+  }
+}
+
+/**
+ * Read channels of a tile back from the page, the inverse of write_tile
+ *
+ * @param {uint64_t} rows Bitmap of the channels to read
+ */
+static void read_back(const transposer_t *t, transpose_tile_t *tile, uint64_t rows) {
+  const char *src = tile->dest;
+  uint8_t *data = tile->data;
+  size_t stride = t->nchannels;
+  int time = 0;
+  int simd_rows = 0;                   // channels read back with SIMD transposes, up to time
+  int row, sample;
+
+#ifdef __SSE2__
+  __m128i r[16];
+  int blocks = tile->width / 16;
+  int block, i;
+
+  for (time = 0; time + 16 <= PAYLOADSIZE_STOKESI; time += 16) {
+    for (block = 0; block < blocks; block++) {
+      if (((rows >> (block * 16)) & 0xffff) == 0) {
+        continue;
+      }
+      for (i = 0; i < 16; i++) {
+        r[i] = _mm_loadu_si128((const __m128i *) &src[(time + i) * stride + block * 16]);
+      }
+      transpose_16x16(r);
+      for (i = 0; i < 16; i++) {
+        if (rows & (1UL << (block * 16 + i))) {
+          _mm_storeu_si128((__m128i *) &data[(block * 16 + i) * TRANSPOSE_STRIDE + time], r[i]);
+        }
+      }
+    }
+  }
+  simd_rows = blocks * 16;
+#endif
+
+  // the remaining samples, and the channels of a partial block
+  for (row = 0; row < tile->width; row++) {
+    if (rows & (1UL << row)) {
+      for (sample = row < simd_rows ? time : 0; sample < PAYLOADSIZE_STOKESI; sample++) {
+        data[row * TRANSPOSE_STRIDE + sample] = src[sample * stride + row];
+      }
+    }
+  }
+}
+
+/**
+ * Write out a tile that may be incomplete, without holding the lock: the tile is flushing, so its key gets no packets meanwhile
+ * The whole tile is written a cache line at a time. Channels written to the page by an earlier tile of the same key are
+ * read back first, so they keep their samples; channels of missing packets get stale data, as in the frequency-major layout.
+ *
+ * @param {uint64_t} keep Channels of the tile already in the page
+ */
+static void flush_tile(const transposer_t *t, transpose_tile_t *tile, uint64_t keep) {
+  if (keep) {
+    read_back(t, tile, keep);
+  }
+  write_tile(t, tile);
+}
+
+/**
+ * Release a tile that was written out, and wake the threads waiting for it, call with the lock held
+ */
+static void release_tile(transposer_t *t, int index) {
+  transpose_tile_t *tile = &t->tiles[index];
+
+  t->map[tile->key] = -1;
+  tile->key = -1;
+  tile->channels = 0;
+  tile->users = 0;
+  tile->flushing = 0;
+  t->free[t->nfree++] = index;
+  pthread_cond_broadcast(&t->flushed);
+}
+
+/**
+ * Packets added to the transposer between two packets of a tile, on average
+ * Until the tile has a few packets, assume they arrive in random order: a tile gets one in every ntiles packets.
+ */
+static uint64_t tile_gap(const transposer_t *t, const transpose_tile_t *tile) {
+  int received = __builtin_popcountl(tile->channels);
+
+  if (received < TRANSPOSE_GAPS) {
+    return t->ntiles;
+  }
+  return (tile->touched - tile->opened) / (received - 1) + 1;
+}
+
+/**
+ * Take a tile for writing it out, call with the lock held
+ * It stays in the map till it is released, so packets for its key wait for it.
+ *
+ * @returns {uint64_t} Channels of the tile already in the page, see flush_tile
+ */
+static uint64_t take_tile(transposer_t *t, transpose_tile_t *tile) {
+  uint64_t keep = t->written[tile->key] & ~tile->channels;
+
+  t->written[tile->key] |= tile->channels;
+  tile->flushing = 1;
+  tile->users = 1;
+  if (tile->channels != tile_full(tile)) {
+    t->partial++;
+  }
+  return keep;
+}
+
+/**
+ * Add the payload of a Stokes I packet to its tile, and write out the tile when it is complete
+ * Safe to call from several threads copying to the same page. Tiles are written out without holding the lock.
+ *
+ * @param {int} tab Tab in the page
+ * @param {int} channel Channel in the page, after the FREQISSUE workaround and the channel selection
+ * @param {unsigned char *} payload The samples of the packet
+ * @param {char *} page Time-major page: [tab][padded_size][nchannels]
+ */
+void transpose_add(transposer_t *t, int tab, int channel, int sequence_number, const unsigned char *payload, char *page) {
+  int key = (tab * t->sequence_length + sequence_number) * t->groups + channel / TRANSPOSE_CHANNELS;
+  int row = channel % TRANSPOSE_CHANNELS;
+  char *dest = &page[((size_t) tab * t->padded_size + (size_t) sequence_number * PAYLOADSIZE_STOKESI) * t->nchannels + channel - row];
+  transpose_tile_t *tile;
+  uint64_t keep = 0;
+  int index, complete;
+
+  pthread_mutex_lock(&t->lock);
+
+  // every now and then, write out the tiles that got no packets for a while: they miss packets, and would otherwise
+  // all be written out at the end of the page
+  if (++t->added % TRANSPOSE_SCAN == 0) {
+    for (index = 0; index < t->ntiles; index++) {
+      tile = &t->tiles[index];
+      if (tile->key < 0 || tile->users || t->added - tile->touched < TRANSPOSE_IDLE * tile_gap(t, tile)) {
+        continue;
+      }
+      keep = take_tile(t, tile);
+      pthread_mutex_unlock(&t->lock);
+
+      flush_tile(t, tile, keep);
+
+      pthread_mutex_lock(&t->lock);
+      release_tile(t, index);
+    }
+  }
+
+  // a tile being written out is released first; there is a tile for every key, so a free one is always left
+  while ((index = t->map[key]) >= 0 && t->tiles[index].flushing) {
+    pthread_cond_wait(&t->flushed, &t->lock);
+  }
+  if (index < 0) {
+    index = t->free[--t->nfree];
+    t->map[key] = index;
+    t->tiles[index].key = key;
+    t->tiles[index].dest = dest;
+    t->tiles[index].width = tile_width(t, key);
+    t->tiles[index].opened = t->added;
+  }
+  tile = &t->tiles[index];
+  tile->users++;
+  tile->touched = t->added;
+  pthread_mutex_unlock(&t->lock);
+
+  memcpy(&tile->data[row * TRANSPOSE_STRIDE], payload, PAYLOADSIZE_STOKESI);
+
+  // complete when all channels are in and nobody else is copying (a duplicate)
+  pthread_mutex_lock(&t->lock);
+  tile->channels |= 1UL << row;
+  tile->users--;
+  complete = tile->channels == tile_full(tile) && tile->users == 0;
+  if (complete) {
+    // ours now, so it is not written out by another thread meanwhile
+    keep = take_tile(t, tile);
+  }
+  pthread_mutex_unlock(&t->lock);
+
+  if (complete) {
+    flush_tile(t, tile, keep);
+
+    pthread_mutex_lock(&t->lock);
+    release_tile(t, index);
+    pthread_mutex_unlock(&t->lock);
+  }
+}
+
+/**
+ * Write out the open tiles, call when all packets of the page are added and no thread is adding any more
+ */
+void transpose_finish(transposer_t *t) {
+  transpose_tile_t *tile;
+  uint64_t keep;
+  int index;
+
+  for (index = 0; index < t->ntiles; index++) {
+    tile = &t->tiles[index];
+    if (tile->key < 0) {
+      continue;
+    }
+    keep = take_tile(t, tile);
+    flush_tile(t, tile, keep);
+    release_tile(t, index);
+  }
+  memset(t->written, 0, (size_t) t->ntabs * t->sequence_length * t->groups * sizeof(uint64_t));
+  t->added = 0;
+
+#ifdef __SSE2__
+  _mm_sfence();
+#endif
+}
+
+/**
+ * Transpose a matrix of bytes, for instance the channels of a frequency-major tab to time-major
+ * The columns are done in bands of TRANSPOSE_CHANNELS, so the source rows and the destination rows of a band stay in cache.
+ *
+ * @param {uint8_t *} src Source matrix
+ * @param {size_t} src_stride Bytes from one source row to the next
+ * @param {char *} dest Destination matrix, a source column per row
+ * @param {size_t} dest_stride Bytes from one destination row to the next
+ * @param {int} rows Rows of the source
+ * @param {int} columns Columns of the source
+ */
+void transpose_matrix(const uint8_t *src, size_t src_stride, char *dest, size_t dest_stride, int rows, int columns) {
+  int band, column, row, end;
+
+  for (band = 0; band < columns; band += TRANSPOSE_CHANNELS) {
+    end = band + TRANSPOSE_CHANNELS < columns ? band + TRANSPOSE_CHANNELS : columns;
+    row = 0;
+
+#ifdef __SSE2__
+    __m128i r[16];
+    int i;
+
+    for (; row + 16 <= rows; row += 16) {
+      for (column = band; column + 16 <= end; column += 16) {
+        for (i = 0; i < 16; i++) {
+          r[i] = _mm_loadu_si128((const __m128i *) &src[(row + i) * src_stride + column]);
+        }
+        transpose_16x16(r);
+        for (i = 0; i < 16; i++) {
+          _mm_storeu_si128((__m128i *) &dest[(column + i) * dest_stride + row], r[i]);
+        }
+      }
+      // the columns of a partial block
+      for (; column < end; column++) {
+        for (i = 0; i < 16; i++) {
+          dest[column * dest_stride + row + i] = src[(row + i) * src_stride + column];
+        }
+      }
+    }
+#endif
+
+    // the remaining rows
+    for (; row < rows; row++) {
+      for (column = band; column < end; column++) {
+        dest[column * dest_stride + row] = src[row * src_stride + column];
+      }
+    }
+  }
+}
+
+void transpose_close(transposer_t *t) {
+  if (!t->map) {
+    return;
+  }
+  if (t->pool) {
+    munmap(t->pool, (size_t) t->ntiles * TRANSPOSE_CHANNELS * TRANSPOSE_STRIDE);
+    t->pool = NULL;
+  }
+  free(t->map);
+  free(t->written);
+  free(t->tiles);
+  free(t->free);
+  t->map = NULL;
+  t->written = NULL;
+  t->tiles = NULL;
+  t->free = NULL;
+  pthread_mutex_destroy(&t->lock);
+  pthread_cond_destroy(&t->flushed);
+}
@@ -0,0 +1,73 @@
+/**
+ * Time-major Stokes I pages: cache-blocked transpose of the packets to [tab][time][channel]
+ * Author: Jisk Attema
+ *
+ * A Stokes I packet holds 6250 samples of a single channel, so in a time-major page its bytes are 1536 bytes apart
+ * (or the number of selected channels, see assemble_select).
+ * Instead of scattering them, the packets of a group of 64 channels (same tab and sequence number) are collected
+ * in a tile of 64 x 6250 bytes that stays in cache. When all channels are in, the tile is transposed with SIMD
+ * 16x16 byte transposes and streamed to the page a full cache line (64 channels of one sample) at a time.
+ *
+ * The beamformer sends the channels of a tab and sequence number together, so only a few tiles are open at a time.
+ * The pool still has a tile for every tab, sequence number and channel group of the page, so packets that arrive out
+ * of order end up in complete tiles too. A tile that gets no packets for much longer than it used to probably misses
+ * packets: it is written out the same way, with stale data for the missing channels, as in the frequency-major layout;
+ * the page metadata tells which. So are the tiles still open at the end of the page. When a tile of the same key is
+ * opened again later in the page, the channels it does not have are first read back from the page with the same SIMD
+ * transposes, so they keep their samples. Tiles are written out without holding the lock.
+ *
+ * The tiles are shared by all threads copying to the page.
+ */
+#ifndef TRANSPOSE_H
+#define TRANSPOSE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define TRANSPOSE_CHANNELS 64          // channels per tile, a cache line per sample in the page
+#define TRANSPOSE_STRIDE 6256          // bytes per channel in a tile: the samples of a packet, rounded up to 16
+#define TRANSPOSE_IDLE 8               // tiles without packets for this many times their average gap are written out
+#define TRANSPOSE_GAPS 16              // packets in a tile before its own gap is used, see tile_gap
+#define TRANSPOSE_SCAN 256             // packets between looking for such tiles
+
+typedef struct {
+  uint8_t *data;                       // [TRANSPOSE_CHANNELS][TRANSPOSE_STRIDE]
+  char *dest;                          // first sample of the first channel of the tile in the page
+  uint64_t channels;                   // bitmap of the channels copied to the tile
+  int width;                           // channels of the tile: TRANSPOSE_CHANNELS, or less at the end of a selection
+  int users;                           // threads copying to or writing out the tile
+  int flushing;                        // being written out, packets for its key wait for it
+  int key;                             // tab, sequence number and channel group, -1 when free
+  uint64_t opened;                     // packets added to the transposer at its first packet
+  uint64_t touched;                    // and at its last packet
+} transpose_tile_t;
+
+typedef struct transposer {
+  int ntabs;
+  int nchannels;                       // channels in the page, the row length
+  int groups;                          // tiles per tab and sequence number
+  int sequence_length;
+  int padded_size;                     // samples per tab in the page
+  int *map;                            // open tile per key, or -1
+  uint64_t *written;                   // channels per key written to the page, reset every page
+  int ntiles;
+  transpose_tile_t *tiles;             // [ntiles]
+  int *free;                           // stack of free tiles
+  int nfree;
+  uint64_t added;                      // packets added in this page
+  uint8_t *pool;                       // memory of the tiles
+  pthread_mutex_t lock;
+  pthread_cond_t flushed;              // a tile was written out
+
+  // statistics
+  uint64_t partial;                    // tiles written out incomplete
+} transposer_t;
+
+int transpose_init(transposer_t *t, int ntabs, int nchannels, int sequence_length, int padded_size);
+void transpose_add(transposer_t *t, int tab, int channel, int sequence_number, const unsigned char *payload, char *page);
+void transpose_finish(transposer_t *t);
+void transpose_close(transposer_t *t);
+
+void transpose_matrix(const uint8_t *src, size_t src_stride, char *dest, size_t dest_stride, int rows, int columns);
+
+#endif
@@ -0,0 +1,580 @@
+/**
+ * Check the pages of a ring buffer against the test pattern of send -x verify and fake -p
+ * Author: Jisk Attema
+ *
+ * A page is checked per region: the bytes of a single packet in the page, at the place assemble_copy puts them.
+ * Regions are compared with the expected pattern (see pattern.h) using SIMD, so checking keeps up with the ring buffer.
+ * A region that does not match is classified:
+ *  - missing:   the packet did not arrive: its bit in the page metadata is not set (-m), or the region was never written
+ *  - stale:     the region holds the pattern of the same packet of an earlier page (up to VERIFY_STALE_PAGES back),
+ *               while the packet did arrive; without page metadata lost packets also show up as stale
+ *  - misplaced: anything else, for instance the data of another packet, or a packet that arrived but was not copied
+ *
+ * The timestamp of a page comes from the page metadata, or else it is start packet + page number * FRAMETIME.
+ * The channel remapping of fill_ringbuffer -f is not supported.
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "config.h"
+#include "ringbuffer.h"
+#include "assemble.h"
+#include "pagemeta.h"
+#include "pattern.h"
+#include "log.h"
+
+#define VERIFY_STALE_PAGES 64            // How many pages back to look for the pattern of a stale region
+#define VERIFY_REPORT 8                  // Bad regions per page to describe in the log
+
+enum region {
+  REGION_OK,
+  REGION_MISSING,
+  REGION_STALE,
+  REGION_MISPLACED,
+  REGIONS
+};
+
+char *science_modes[] = {"I+TAB", "IQUV+TAB", "I+IAB", "IQUV+IAB"};
+
+typedef struct {
+  // page layout of the transfer
+  assembler_t assembler;
+  int time_major;                        // Stokes I pages with ORDER TF
+  int stokes;                            // Stokes parameter of a split page, see STOKES; -1 for interleaved pages
+  size_t region_size;                    // bytes of a packet in the page
+  int tab_index[ASSEMBLE_MAX_TABS];      // tab index per tab in the page
+  int channel_index[NCHANNELS];          // channel index per channel in the page
+
+  // time-major pages are checked a row at a time, with the expected value per channel
+  uint8_t expected[NCHANNELS];
+  uint8_t step[NCHANNELS];
+  uint8_t diff[NCHANNELS];               // non-zero for the channels that did not match
+  uint8_t column[PAYLOADSIZE_STOKESI];   // a region of a time-major page, to classify it
+
+  // the current page
+  uint64_t page;                         // page number in the transfer
+  uint64_t timestamp;
+  const pagemeta_record_t *record;       // or NULL
+  uint64_t counts[REGIONS];
+  int reported;
+
+  // statistics of the transfer
+  uint64_t totals[REGIONS];
+  uint64_t pages;
+  uint64_t bytes;
+  uint64_t busy_ns;
+} verifier_t;
+
+/**
+ * Nanoseconds between two points in time
+ */
+static inline long elapsed_ns(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * Compare a region with the pattern: src[i] == first + i * step
+ *
+ * @returns {int} 1 when the region matches, 0 otherwise
+ */
+static inline int check_region(const uint8_t *src, size_t n, uint8_t first, uint8_t step) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // the differences of all bytes are or-ed together, and tested once at the end
+  uint8_t ramp[16];
+  __m128i expected, increment, diff = _mm_setzero_si128();
+  int k;
+
+  for (k = 0; k < 16; k++) {
+    ramp[k] = first + k * step;
+  }
+  expected = _mm_loadu_si128((const __m128i *) ramp);
+  increment = _mm_set1_epi8((char) (16 * step));
+  for (; i + 16 <= n; i += 16) {
+    diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128((const __m128i *) &src[i]), expected));
+    expected = _mm_add_epi8(expected, increment);
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff) {
+    return 0;
+  }
+#endif
+  for (; i < n; i++) {
+    if (src[i] != (uint8_t) (first + i * step)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * First value and step of the pattern of a region in the page, see pattern.h
+ * A split page holds Stokes parameter k of an IQUV packet: bytes k, k + 4, k + 8, ...
+ */
+static inline void region_key(const verifier_t *v, int tab, int channel, int sequence, uint64_t timestamp, uint8_t *first, uint8_t *step) {
+  pattern_key(v->tab_index[tab], v->channel_index[channel], sequence, timestamp, first, step);
+  if (v->stokes >= 0) {
+    *first += v->stokes * *step;
+    *step *= ASSEMBLE_STOKES;
+  }
+}
+
+/**
+ * Classify a region that does not hold the pattern of this page
+ *
+ * @param {uint8_t *} src The region, contiguous
+ * @param {int} tab Tab in the page
+ * @param {int} channel Channel in the page, the first of the packet for Stokes IQUV
+ * @param {size_t} slot Packet slot in the page, see assemble_slot
+ * @returns {int} One of region
+ */
+static int classify(verifier_t *v, const uint8_t *src, int tab, int channel, int sequence, size_t slot) {
+  const size_t n = v->region_size;
+  uint8_t first, step;
+  int received = 1;
+  int age;
+  size_t i;
+
+  if (v->record) {
+    received = (v->record->received_slots[slot / 64] >> (slot % 64)) & 1;
+  }
+  if (!received) {
+    return REGION_MISSING;
+  }
+
+  // the same packet of an earlier page; check the first bytes before the whole region
+  for (age = 1; age <= VERIFY_STALE_PAGES && (uint64_t) age * FRAMETIME <= v->timestamp; age++) {
+    region_key(v, tab, channel, sequence, v->timestamp - (uint64_t) age * FRAMETIME, &first, &step);
+    if (src[0] == first && src[1] == (uint8_t) (first + step) && check_region(src, n, first, step)) {
+      break;
+    }
+  }
+
+  if (age <= VERIFY_STALE_PAGES && (uint64_t) age * FRAMETIME <= v->timestamp) {
+    if (v->reported < VERIFY_REPORT) {
+      LOG_WARN("Page %lu: tab %i channel %i sequence %i: stale, the data of %i pages back\n",
+          v->page, v->tab_index[tab], v->channel_index[channel], sequence, age);
+    }
+    return REGION_STALE;
+  }
+
+  // never written: the pattern has an odd step, so it is never all zeros
+  if (!v->record) {
+    for (i = 0; i < n && src[i] == 0; i++);
+    if (i == n) {
+      return REGION_MISSING;
+    }
+  }
+
+  if (v->reported < VERIFY_REPORT) {
+    region_key(v, tab, channel, sequence, v->timestamp, &first, &step);
+    LOG_WARN("Page %lu: tab %i channel %i sequence %i: misplaced, starts with %u %u instead of %u %u\n",
+        v->page, v->tab_index[tab], v->channel_index[channel], sequence, src[0], src[1], first, (uint8_t) (first + step));
+  }
+  return REGION_MISPLACED;
+}
+
+/**
+ * Count a region, and classify it when it does not match
+ */
+static inline void count_region(verifier_t *v, int match, const uint8_t *src, int tab, int channel, int sequence, size_t slot) {
+  int region = match ? REGION_OK : classify(v, src, tab, channel, sequence, slot);
+
+  v->counts[region]++;
+  if (region == REGION_STALE || region == REGION_MISPLACED) {
+    v->reported++;
+  }
+}
+
+/**
+ * Check a frequency-major page: Stokes I [tab][channel][padded_size], or Stokes IQUV [tab][channel / 4][sequence][region]
+ */
+static void check_page(verifier_t *v, const uint8_t *page) {
+  const assembler_t *a = &v->assembler;
+  const int channels_per_slot = a->science_mode & 1 ? 4 : 1;
+  const uint8_t *src;
+  uint8_t first, step;
+  int tab, slot, sequence;
+  size_t index;
+
+  for (tab = 0; tab < a->ntabs; tab++) {
+    for (slot = 0; slot < a->channel_slots; slot++) {
+      for (sequence = 0; sequence < a->sequence_length; sequence++) {
+        index = ((size_t) tab * a->channel_slots + slot) * a->sequence_length + sequence;
+        if (channels_per_slot == 1) {
+          src = &page[((size_t) tab * a->nchannels + slot) * a->padded_size + sequence * PAYLOADSIZE_STOKESI];
+        } else {
+          src = &page[index * v->region_size];
+        }
+
+        region_key(v, tab, slot * channels_per_slot, sequence, v->timestamp, &first, &step);
+        count_region(v, check_region(src, v->region_size, first, step), src, tab, slot * channels_per_slot, sequence, index);
+      }
+    }
+  }
+}
+
+/**
+ * Check a time-major Stokes I page: [tab][padded_size][channel]
+ * A row of a sequence holds a sample of every channel; the expected values of the row are kept per channel,
+ * and advance by the step of the channel every row.
+ */
+static void check_page_time_major(verifier_t *v, const uint8_t *page) {
+  const assembler_t *a = &v->assembler;
+  const int nchannels = a->nchannels;
+  const uint8_t *row;
+  int tab, channel, sequence, sample;
+  size_t index;
+
+  for (tab = 0; tab < a->ntabs; tab++) {
+    for (sequence = 0; sequence < a->sequence_length; sequence++) {
+      for (channel = 0; channel < nchannels; channel++) {
+        region_key(v, tab, channel, sequence, v->timestamp, &v->expected[channel], &v->step[channel]);
+      }
+      memset(v->diff, 0, nchannels);
+
+      for (sample = 0; sample < PAYLOADSIZE_STOKESI; sample++) {
+        row = &page[((size_t) tab * a->padded_size + sequence * PAYLOADSIZE_STOKESI + sample) * nchannels];
+        channel = 0;
+#ifdef __SSE2__
+        for (; channel + 16 <= nchannels; channel += 16) {
+          __m128i expected = _mm_loadu_si128((const __m128i *) &v->expected[channel]);
+          __m128i diff = _mm_loadu_si128((const __m128i *) &v->diff[channel]);
+
+          diff = _mm_or_si128(diff, _mm_xor_si128(_mm_loadu_si128((const __m128i *) &row[channel]), expected));
+          _mm_storeu_si128((__m128i *) &v->diff[channel], diff);
+          _mm_storeu_si128((__m128i *) &v->expected[channel], _mm_add_epi8(expected, _mm_loadu_si128((const __m128i *) &v->step[channel])));
+        }
+#endif
+        for (; channel < nchannels; channel++) {
+          v->diff[channel] |= row[channel] ^ v->expected[channel];
+          v->expected[channel] += v->step[channel];
+        }
+      }
+
+      for (channel = 0; channel < nchannels; channel++) {
+        index = ((size_t) tab * a->channel_slots + channel) * a->sequence_length + sequence;
+        if (v->diff[channel]) {
+          // gather the column of the region to classify it
+          for (sample = 0; sample < PAYLOADSIZE_STOKESI; sample++) {
+            v->column[sample] = page[((size_t) tab * a->padded_size + sequence * PAYLOADSIZE_STOKESI + sample) * nchannels + channel];
+          }
+        }
+        count_region(v, !v->diff[channel], v->column, tab, channel, sequence, index);
+      }
+    }
+  }
+}
+
+/**
+ * Set up the page layout of a transfer from its header
+ *
+ * @returns {int} 0 on success, -1 on error
+ */
+int parse_layout(verifier_t *v, const char *header) {
+  assembler_t *a = &v->assembler;
+  int science_case, science_mode, padded_size;
+  char order[8] = "FT";
+  char stokes[8] = "";
+  char tabs[64] = "";
+  char channels[8192] = "";
+  int header_incomplete = 0;
+  int i;
+
+  if (ringbuffer_header_get(header, "SCIENCE_CASE", "%i", &science_case) == -1) {
+    LOG_ERR("ERROR. SCIENCE_CASE not set in header\n");
+    header_incomplete = 1;
+  }
+  if (ringbuffer_header_get(header, "SCIENCE_MODE", "%i", &science_mode) == -1) {
+    LOG_ERR("ERROR. SCIENCE_MODE not set in header\n");
+    header_incomplete = 1;
+  }
+  if (ringbuffer_header_get(header, "PADDED_SIZE", "%i", &padded_size) == -1) {
+    LOG_ERR("ERROR. PADDED_SIZE not set in header\n");
+    header_incomplete = 1;
+  }
+  if (header_incomplete) {
+    return -1;
+  }
+
+  if (assemble_init(a, science_case, science_mode, padded_size)) {
+    LOG_ERR("ERROR: science case %i mode %i not supported\n", science_case, science_mode);
+    return -1;
+  }
+
+  // a selection, see fill_ringbuffer -t and -C
+  ringbuffer_header_get(header, "TABS", "%63s", tabs);
+  ringbuffer_header_get(header, "CHANNELS", "%8191s", channels);
+  if (assemble_select(a, tabs[0] ? tabs : NULL, channels[0] ? channels : NULL)) {
+    LOG_ERR("ERROR: invalid selection of tabs '%s' and channels '%s'\n", tabs, channels);
+    return -1;
+  }
+  for (i = 0; i < ASSEMBLE_MAX_TABS; i++) {
+    if (a->tab_slot[i] >= 0) {
+      v->tab_index[a->tab_slot[i]] = i;
+    }
+  }
+  for (i = 0; i < NCHANNELS; i++) {
+    if (a->channel_slot[i] >= 0) {
+      v->channel_index[a->channel_slot[i]] = i;
+    }
+  }
+
+  ringbuffer_header_get(header, "ORDER", "%7s", order);
+  ringbuffer_header_get(header, "STOKES", "%7s", stokes);
+
+  v->stokes = -1;
+  v->time_major = 0;
+  if (science_mode & 1) {
+    if (stokes[0] != '\0') {
+      if (!strchr("IQUV", stokes[0])) {
+        LOG_ERR("ERROR: unknown Stokes parameter %s\n", stokes);
+        return -1;
+      }
+      v->stokes = strchr("IQUV", stokes[0]) - "IQUV";
+      assemble_split_stokes(a, 1);
+    }
+    v->region_size = PAYLOADSIZE_STOKESIQUV / (v->stokes >= 0 ? ASSEMBLE_STOKES : 1);
+  } else {
+    v->time_major = !strcmp(order, "TF");
+    v->region_size = PAYLOADSIZE_STOKESI;
+    if (padded_size < a->ntimes) {
+      LOG_ERR("ERROR: padded size %i smaller than the number of samples %i\n", padded_size, a->ntimes);
+      return -1;
+    }
+  }
+
+  LOG("Science case = %i\n", science_case);
+  LOG("Science mode = %i [ %s ]\n", science_mode, science_modes[science_mode]);
+  LOG("Page layout: %i tabs, %i channels, %i samples%s%s%s, %i regions of %lu bytes\n", a->ntabs, a->nchannels, a->ntimes,
+      v->time_major ? ", time-major" : "", v->stokes >= 0 ? ", Stokes " : "", v->stokes >= 0 ? stokes : "",
+      a->packets_per_sample, v->region_size);
+  return 0;
+}
+
+/**
+ * Print commandline options
+ */
+void printOptions() {
+  printf("usage: verify -k <key>\n");
+  printf("e.g. verify -k shm:dada -m /dev/shm/dada.meta\n");
+  printf("Optional: -m <page metadata file, see fill_ringbuffer -P> -s <start packet, for pages without metadata, default 0>\n");
+  printf("          -n <stop after this many transfers> -l <logfile>\n");
+  printf("          -v <minimum log level: debug, info, notice, warning, error> -F <log format: plain, kv>\n");
+  printf("Checks the test pattern of send -x verify and fake -p; exits with failure when stale or misplaced data was found.\n");
+  return;
+}
+
+/**
+ * Parse commandline
+ */
+void parseOptions(int argc, char*argv[], char **key, char **metafile, unsigned long *startpacket, int *transfers, char **logfile, int *loglevel, int *logformat) {
+  int c;
+
+  int setk=0;
+  while((c=getopt(argc,argv,"k:m:s:n:l:v:F:"))!=-1) {
+    switch(c) {
+      // -v minimum log level
+      case('v'):
+        *loglevel = log_parse_level(optarg);
+        if (*loglevel < 0) {
+          fprintf(stderr, "Log level should be one of debug, info, notice, warning, error\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -F log format
+      case('F'):
+        *logformat = log_parse_format(optarg);
+        if (*logformat < 0) {
+          fprintf(stderr, "Log format should be plain or kv\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // -k <key>
+      case('k'):
+        *key = strdup(optarg);
+        setk=1;
+        break;
+
+      // -m page metadata file
+      case('m'):
+        *metafile = strdup(optarg);
+        break;
+
+      // -s start packet number
+      case('s'):
+        *startpacket = strtoul(optarg, NULL, 10);
+        break;
+
+      // -n number of transfers
+      case('n'):
+        *transfers = atoi(optarg);
+        break;
+
+      // -l log file
+      case('l'):
+        *logfile = strdup(optarg);
+        break;
+
+      default:
+        printOptions();
+        exit(0);
+    }
+  }
+
+  if (!setk) {
+    fprintf(stderr, "Ringbuffer key not set\n");
+    printOptions();
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char** argv) {
+  verifier_t *v;
+  ringbuffer_t *rb;
+  pagemeta_t meta;
+  char *key = NULL;
+  char *metafile = NULL;
+  int have_meta = 0;
+  char *logfile = NULL;
+  char *header;
+  char *page;
+  uint64_t size;
+  unsigned long startpacket = 0;
+  int loglevel = LOG_INFO;
+  int logformat = LOG_PLAIN;
+  int transfers = 0;        // stop after this many, 0 to keep going
+  int transfer;
+  int usable;
+  int failed = 0;
+  int i;
+  struct timespec before, after;
+  long ns;
+
+  parseOptions(argc, argv, &key, &metafile, &startpacket, &transfers, &logfile, &loglevel, &logformat);
+
+  // set up logging
+  if (log_init(logfile, loglevel, logformat)) {
+    fprintf(stderr, "ERROR opening logfile: %s\n", logfile);
+    exit(EXIT_FAILURE);
+  }
+  if (logfile) {
+    LOG("Logging to logfile: %s\n", logfile);
+    free(logfile);
+  }
+  LOG("verify version: " VERSION "\n");
+
+  v = calloc(1, sizeof(verifier_t));
+  if (!v) {
+    LOG_ERR("ERROR: cannot allocate the verifier\n");
+    exit(EXIT_FAILURE);
+  }
+
+  rb = ringbuffer_open(key, RING_READER);
+  if (!rb) {
+    LOG_ERR("ERROR. Cannot connect to ringbuffer %s\n", key);
+    exit(EXIT_FAILURE);
+  }
+  LOG("Ringbuffer KEY: %s (%s backend%s)\n", key, rb->backend->name, rb->hugepages ? ", huge pages" : "");
+  free(key);
+
+  if (metafile) {
+    if (pagemeta_open(&meta, metafile)) {
+      LOG_ERR("ERROR. Cannot open page metadata %s\n", metafile);
+      exit(EXIT_FAILURE);
+    }
+    LOG("Page metadata: %s\n", metafile);
+    free(metafile);
+    have_meta = 1;
+  }
+
+  for (transfer = 0; transfers == 0 || transfer < transfers; transfer++) {
+    // the header of the next transfer
+    header = ringbuffer_next_read(rb, RING_HEADER, &size);
+    if (!header) {
+      break;
+    }
+    usable = parse_layout(v, header) == 0;
+    ringbuffer_mark_cleared(rb, RING_HEADER);
+    if (!usable) {
+      LOG_ERR("ERROR: cannot verify transfer %i, skipping its pages\n", transfer);
+    }
+
+    memset(v->totals, 0, sizeof(v->totals));
+    v->pages = 0;
+    v->bytes = 0;
+    v->busy_ns = 0;
+    v->page = 0;
+    while ((page = ringbuffer_next_read(rb, RING_DATA, &size))) {
+      v->timestamp = startpacket + v->page * FRAMETIME;
+      v->record = have_meta ? pagemeta_find(&meta, ringbuffer_count(rb, RING_DATA)) : NULL;
+      if (v->record) {
+        v->timestamp = v->record->timestamp;
+      } else if (have_meta) {
+        LOG_WARN("WARNING: page %lu has no metadata\n", v->page);
+      }
+
+      if (!usable || size == 0) {
+        // nothing to check
+      } else if (size < v->assembler.required_size) {
+        LOG_WARN("WARNING: page of %lu bytes too small for the layout, skipped\n", size);
+      } else if (v->record && (v->record->flags & (PAGEMETA_EMPTY | PAGEMETA_PLACEHOLDER))) {
+        LOG("Page %lu: timestamp %lu, no data\n", v->page, v->timestamp);
+      } else {
+        memset(v->counts, 0, sizeof(v->counts));
+        v->reported = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        if (v->time_major) {
+          check_page_time_major(v, (const uint8_t *) page);
+        } else {
+          check_page(v, (const uint8_t *) page);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        ns = elapsed_ns(&before, &after);
+
+        LOG("Page %lu: timestamp %lu, %lu ok, %lu missing, %lu stale, %lu misplaced, checked at %.3f GB/s\n",
+            v->page, v->timestamp, v->counts[REGION_OK], v->counts[REGION_MISSING], v->counts[REGION_STALE],
+            v->counts[REGION_MISPLACED], ns > 0 ? (double) v->assembler.required_size / ns : 0);
+        for (i = 0; i < REGIONS; i++) {
+          v->totals[i] += v->counts[i];
+        }
+        v->pages++;
+        v->bytes += v->assembler.required_size;
+        v->busy_ns += ns;
+      }
+      v->page++;
+
+      ringbuffer_mark_cleared(rb, RING_DATA);
+      if (ringbuffer_eod(rb, RING_DATA)) {
+        break;
+      }
+    }
+
+    log_printf(LOG_NOTICE, "Transfer %i: %lu pages, regions %lu ok, %lu missing, %lu stale, %lu misplaced; checked %.3f GB at %.3f GB/s\n",
+        transfer, v->pages, v->totals[REGION_OK], v->totals[REGION_MISSING], v->totals[REGION_STALE],
+        v->totals[REGION_MISPLACED], 1e-9 * v->bytes, v->busy_ns > 0 ? (double) v->bytes / v->busy_ns : 0);
+    if (v->totals[REGION_STALE] || v->totals[REGION_MISPLACED]) {
+      failed = 1;
+    }
+  }
+
+  if (have_meta) {
+    pagemeta_close(&meta);
+  }
+  ringbuffer_close(rb);
+  free(v);
+  log_close();
+  exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
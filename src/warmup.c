@@ -0,0 +1,106 @@
+/**
+ * Warm-up of memory regions: prefault, lock, and ask for huge pages, before the data arrives
+ * Author: Jisk Attema
+ *
+ * Page faults on a freshly attached ring buffer cost a few microseconds per 4 KB page,
+ * which is enough to lose packets during the first page of an observation.
+ */
+// needed for MADV_HUGEPAGE, MADV_POPULATE_WRITE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "warmup.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23    // Linux 5.14
+#endif
+
+void warmup_clear(warmup_t *w) {
+  memset(w, 0, sizeof(warmup_t));
+}
+
+/**
+ * Prefault and lock a region, and ask for huge pages
+ * The contents of the region are not changed, so it is safe for pages readers may still be reading.
+ *
+ * @param {warmup_t *} w Results are accumulated here
+ * @param {void *} addr Start of the region
+ * @param {size_t} size Size of the region in bytes
+ */
+void warmup_region(warmup_t *w, void *addr, size_t size) {
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t) addr & ~(pagesize - 1);
+  size_t length = (((uintptr_t) addr + size - start) + pagesize - 1) & ~(pagesize - 1);
+  unsigned char *vec;
+  size_t i, npages = length / pagesize;
+
+  w->bytes += size;
+
+  // before faulting the pages in, so they can be allocated as huge pages
+  if (madvise((void *) start, length, MADV_HUGEPAGE) == 0) {
+    w->hugepage += size;
+  }
+
+  if (madvise((void *) start, length, MADV_POPULATE_WRITE) != 0) {
+    // older kernel: write every page, keeping its contents
+    volatile char *p = (volatile char *) start;
+    for (i = 0; i < length; i += pagesize) {
+      p[i] = p[i];
+    }
+    w->touched++;
+  }
+
+  if (mlock((void *) start, length) == 0) {
+    w->locked += size;
+  }
+
+  // verify
+  vec = malloc(npages);
+  if (mincore((void *) start, length, vec) == 0) {
+    size_t resident = 0;
+    for (i = 0; i < npages; i++) {
+      resident += vec[i] & 1;
+    }
+    w->resident += resident == npages ? size : resident * pagesize;
+  }
+  free(vec);
+}
+
+/**
+ * Allocate a prefaulted, locked region of anonymous memory
+ *
+ * @returns {void *} The region, or NULL on error
+ */
+void *warmup_alloc(warmup_t *w, size_t size) {
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+  warmup_region(w, addr, size);
+  return addr;
+}
+
+/**
+ * One line summary for the log, with a warning when something did not work out
+ *
+ * @returns {int} 0 when fully resident and locked, -1 otherwise
+ */
+int warmup_describe(const warmup_t *w, const char *label, char *buf, size_t size) {
+  int ok = w->resident == w->bytes && w->locked == w->bytes;
+
+  snprintf(buf, size, "%sWarm-up %s: %.1f MB, resident %.1f%%, locked %.1f%%, huge pages advised %.1f%%%s\n",
+      ok ? "" : "WARNING: ", label, 1e-6 * w->bytes,
+      w->bytes ? 100.0 * w->resident / w->bytes : 100.0,
+      w->bytes ? 100.0 * w->locked / w->bytes : 100.0,
+      w->bytes ? 100.0 * w->hugepage / w->bytes : 100.0,
+      w->touched ? ", prefaulted by touching" : "");
+
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,27 @@
+/**
+ * Warm-up of memory regions: prefault, lock, and ask for huge pages, before the data arrives
+ * Author: Jisk Attema
+ *
+ */
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <stddef.h>
+
+/*
+ * What was achieved for one or more regions, to verify and log
+ */
+typedef struct {
+  size_t bytes;             // total size of the regions
+  size_t resident;          // bytes resident after prefaulting (from mincore)
+  size_t locked;            // bytes locked with mlock
+  size_t hugepage;          // bytes for which madvise(MADV_HUGEPAGE) was accepted
+  int touched;              // regions prefaulted by touching, MADV_POPULATE_WRITE not available
+} warmup_t;
+
+void warmup_clear(warmup_t *w);
+void warmup_region(warmup_t *w, void *addr, size_t size);
+void *warmup_alloc(warmup_t *w, size_t size);
+int warmup_describe(const warmup_t *w, const char *label, char *buf, size_t size);
+
+#endif